@@ -846,6 +846,28 @@ local function get_stat_tokens(task, cf)
   return res
 end
 
+-- Returns next cursor and a flat list of {token_id, spam, ham} triples
+-- Keys with the same prefix that are not tokens (e.g. native expiry buckets
+-- and locks) are skipped
+-- KEYS[1]: prefix
+-- KEYS[2]: cursor
+-- KEYS[3]: batch size
+exports.snapshot_scan_script = [[
+local res = redis.call('SCAN', KEYS[2], 'MATCH', KEYS[1] .. '_*', 'COUNT', KEYS[3])
+local out = {}
+local plen = #KEYS[1] + 2
+for _,k in ipairs(res[2]) do
+  local tok = string.sub(k, plen)
+  if string.match(tok, '^%d+$') and redis.call('TYPE', k)['ok'] == 'hash' then
+    local vals = redis.call('HMGET', k, 'S', 'H')
+    table.insert(out, tok)
+    table.insert(out, vals[1] or '0')
+    table.insert(out, vals[2] or '0')
+  end
+end
+return {res[1], out}
+]]
+
 exports.gen_stat_tokens = function(cfg)
   local stat_config = process_stat_config(cfg)
 
@@ -0,0 +1,149 @@
+--[[
+Copyright (c) 2020, Vsevolod Stakhov <vsevolod@highsecure.ru>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+local argparse = require "argparse"
+local rspamd_logger = require "rspamd_logger"
+local rspamd_util = require "rspamd_util"
+local lua_redis = require "lua_redis"
+local lua_stat = require "lua_stat"
+
+local parser = argparse()
+    :name "rspamadm statsnapshot"
+    :description "Builds read-only snapshots of Redis bayes statistics for 'snapshot' backend"
+    :help_description_margin(30)
+
+parser:option "-c --config"
+      :description "Path to config file"
+      :argname("<cfg>")
+      :default(rspamd_paths["CONFDIR"] .. "/" .. "rspamd.conf")
+parser:option "-p --prefix"
+      :description "Statistics prefix in Redis (new schema is required)"
+      :argname("<prefix>")
+      :default("RS")
+parser:option "-b --batch"
+      :description "Number of keys to process in a single Redis request"
+      :argname("<num>")
+      :convert(tonumber)
+      :default(1000)
+parser:option "--spam"
+      :description "Output spam snapshot"
+      :argname("<file>")
+      :args(1)
+parser:option "--ham"
+      :description "Output ham snapshot"
+      :argname("<file>")
+      :args(1)
+
+local function find_classifier_redis(cfg)
+  local classifier = cfg.classifier
+
+  if not classifier then return nil end
+  if classifier.bayes then classifier = classifier.bayes end
+  if classifier[1] then classifier = classifier[1] end
+
+  return lua_redis.try_load_redis_servers(classifier, nil) or
+      lua_redis.try_load_redis_servers(cfg.redis or {}, nil)
+end
+
+local function handler(args)
+  local opts = parser:parse(args)
+
+  if not opts.spam or not opts.ham then
+    parser:error('both --spam and --ham outputs are required')
+  end
+
+  local _r,err = rspamd_config:load_ucl(opts['config'])
+
+  if not _r then
+    rspamd_logger.errx('cannot parse %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+
+  local redis_params = find_classifier_redis(rspamd_config:get_ucl())
+
+  if not redis_params then
+    rspamd_logger.errx('cannot find redis servers for bayes classifier')
+    os.exit(1)
+  end
+
+  local res,conn = lua_redis.redis_connect_sync(redis_params, false)
+
+  if not res then
+    rspamd_logger.errx('cannot connect to redis server')
+    os.exit(1)
+  end
+
+  conn:add_cmd('HMGET', {opts.prefix, 'learns_spam', 'learns_ham'})
+  local ret,learns = conn:exec()
+
+  if not ret then
+    rspamd_logger.errx('cannot get learns: %s', learns)
+    os.exit(1)
+  end
+
+  local spam, ham = {}, {}
+  local nspam, nham = 0, 0
+  local cursor = '0'
+
+  repeat
+    conn:add_cmd('EVAL', {lua_stat.snapshot_scan_script, '3', opts.prefix, cursor,
+                          tostring(opts.batch)})
+    local r,reply = conn:exec()
+
+    if not r then
+      rspamd_logger.errx('cannot scan tokens: %s', reply)
+      os.exit(1)
+    end
+
+    cursor = reply[1]
+    local elts = reply[2]
+
+    for i = 1,#elts,3 do
+      local s,h = tonumber(elts[i + 1]) or 0, tonumber(elts[i + 2]) or 0
+
+      if s > 0 then
+        spam[elts[i]] = s
+        nspam = nspam + 1
+      end
+      if h > 0 then
+        ham[elts[i]] = h
+        nham = nham + 1
+      end
+    end
+  until cursor == '0'
+
+  local function write(path, tokens, ntokens, nlearns)
+    local ok,write_err = rspamd_util.write_stat_snapshot(path, tokens,
+        tonumber(nlearns) or 0)
+
+    if not ok then
+      rspamd_logger.errx('cannot write snapshot %s: %s', path, write_err)
+      os.exit(1)
+    end
+
+    rspamd_logger.messagex('written %s tokens to %s', ntokens, path)
+  end
+
+  write(opts.spam, spam, nspam, learns[1])
+  write(opts.ham, ham, nham, learns[2])
+end
+
+return {
+  name = 'statsnapshot',
+  aliases = {'stat_snapshot'},
+  handler = handler,
+  description = parser._description
+}
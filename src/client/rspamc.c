@@ -64,6 +64,7 @@ static gboolean compressed = FALSE;
 static gboolean profile = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
+static gboolean binary = FALSE;
 static gchar *key = NULL;
 static gchar *user_agent = "rspamc";
 static GList *children;
@@ -166,6 +167,8 @@ static GOptionEntry entries[] =
 	   "Skip attachments when learning/unlearning fuzzy", NULL },
 	{ "user-agent", 'U', 0, G_OPTION_ARG_STRING, &user_agent,
 	   "Use specific User-Agent instead of \"rspamc\"", NULL },
+	{ "binary", '\0', 0, G_OPTION_ARG_NONE, &binary,
+	   "Use binary protocol for scanning (worker must have binary_protocol enabled)", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -1707,7 +1710,14 @@ rspamc_process_input (struct ev_loop *ev_base, struct rspamc_command *cmd,
 			cbdata->filename = g_strdup (name);
 		}
 
-		if (cmd->need_input) {
+		if (binary && cmd->cmd == RSPAMC_COMMAND_SYMBOLS) {
+			if (!rspamd_client_command_v3 (conn, attrs, in, rspamc_client_cb,
+					cbdata, &err)) {
+				rspamd_fprintf (stderr, "cannot send binary request: %e\n", err);
+				exit (EXIT_FAILURE);
+			}
+		}
+		else if (cmd->need_input) {
 			rspamd_client_command (conn, cmd->path, attrs, in, rspamc_client_cb,
 				cbdata, compressed, dictionary, cbdata->filename, &err);
 		}
@@ -18,7 +18,11 @@
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "libserver/protocol_internal.h"
+#include "libserver/cfg_file.h"
+#include "libutil/libev_helper.h"
 #include "unix-std.h"
+
+#define ZSTD_STATIC_LINKING_ONLY
 #include "contrib/zstd/zstd.h"
 #include "contrib/zstd/zdict.h"
 
@@ -46,6 +50,11 @@ struct rspamd_client_connection {
 	gdouble send_time;
 	struct rspamd_client_request *req;
 	struct rspamd_keypair_cache *keys_cache;
+	/* Binary (v3) protocol state */
+	struct rspamd_io_ev ev;
+	GString *v3_buf;
+	gsize v3_pos;
+	gboolean v3_reading;
 };
 
 struct rspamd_client_request {
@@ -54,6 +63,10 @@ struct rspamd_client_request {
 	GString *input;
 	rspamd_client_callback cb;
 	gpointer ud;
+	/* Compression dictionary, replies might be compressed with it as well */
+	void *dict;
+	gsize dict_len;
+	guint dict_id;
 };
 
 #define RCLIENT_ERROR rspamd_client_error_quark ()
@@ -73,6 +86,9 @@ rspamd_client_request_free (struct rspamd_client_request *req)
 		if (req->input) {
 			g_string_free (req->input, TRUE);
 		}
+		if (req->dict) {
+			munmap (req->dict, req->dict_len);
+		}
 
 		g_free (req);
 	}
@@ -152,14 +168,44 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				ZSTD_inBuffer zin;
 				ZSTD_outBuffer zout;
 				gsize outlen, r;
-
-				zstream = ZSTD_createDStream ();
-				ZSTD_initDStream (zstream);
+				gulong dict_id = 0;
 
 				zin.pos = 0;
 				zin.src = msg->body_buf.begin;
 				zin.size = msg->body_buf.len;
 
+				tok = rspamd_http_message_find_header (msg, "Dictionary");
+
+				if (tok) {
+					if (!rspamd_strtoul (tok->begin, tok->len, &dict_id)) {
+						dict_id = 0;
+					}
+				}
+				else {
+					dict_id = ZSTD_getDictID_fromFrame (zin.src, zin.size);
+				}
+
+				if (dict_id != 0 && dict_id != req->dict_id) {
+					err = g_error_new (RCLIENT_ERROR, 500,
+							"Reply is compressed with unknown dictionary: %lu",
+							dict_id);
+					req->cb (c, msg, c->server_name->str, NULL,
+							req->input, req->ud, c->start_time,
+							c->send_time, body, bodylen, err);
+					g_error_free (err);
+
+					return 0;
+				}
+
+				zstream = ZSTD_createDStream ();
+
+				if (dict_id != 0) {
+					ZSTD_initDStream_usingDict (zstream, req->dict, req->dict_len);
+				}
+				else {
+					ZSTD_initDStream (zstream);
+				}
+
 				if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
 					outlen = ZSTD_DStreamOutSize ();
 				}
@@ -304,6 +350,40 @@ rspamd_client_init (struct rspamd_http_context *http_ctx,
 	return conn;
 }
 
+static GString *
+rspamd_client_read_input (FILE *in, GError **err)
+{
+	GString *input;
+	gchar *p;
+	gsize remain, old_len;
+
+	input = g_string_sized_new (BUFSIZ);
+
+	while (!feof (in)) {
+		p = input->str + input->len;
+		remain = input->allocated_len - input->len - 1;
+		if (remain == 0) {
+			old_len = input->len;
+			g_string_set_size (input, old_len * 2);
+			input->len = old_len;
+			continue;
+		}
+		remain = fread (p, 1, remain, in);
+		if (remain > 0) {
+			input->len += remain;
+			input->str[input->len] = '\0';
+		}
+	}
+	if (ferror (in) != 0) {
+		g_set_error (err, RCLIENT_ERROR, ferror (
+				in), "input IO error: %s", strerror (ferror (in)));
+		g_string_free (input, TRUE);
+		return NULL;
+	}
+
+	return input;
+}
+
 gboolean
 rspamd_client_command (struct rspamd_client_connection *conn,
 		const gchar *command, GQueue *attrs,
@@ -315,8 +395,6 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 {
 	struct rspamd_client_request *req;
 	struct rspamd_http_client_header *nh;
-	gchar *p;
-	gsize remain, old_len;
 	GList *cur;
 	GString *input = NULL;
 	rspamd_fstring_t *body;
@@ -338,28 +416,10 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 
 	if (in != NULL) {
 		/* Read input stream */
-		input = g_string_sized_new (BUFSIZ);
-
-		while (!feof (in)) {
-			p = input->str + input->len;
-			remain = input->allocated_len - input->len - 1;
-			if (remain == 0) {
-				old_len = input->len;
-				g_string_set_size (input, old_len * 2);
-				input->len = old_len;
-				continue;
-			}
-			remain = fread (p, 1, remain, in);
-			if (remain > 0) {
-				input->len += remain;
-				input->str[input->len] = '\0';
-			}
-		}
-		if (ferror (in) != 0) {
-			g_set_error (err, RCLIENT_ERROR, ferror (
-					in), "input IO error: %s", strerror (ferror (in)));
+		input = rspamd_client_read_input (in, err);
+
+		if (input == NULL) {
 			g_free (req);
-			g_string_free (input, TRUE);
 			return FALSE;
 		}
 
@@ -382,7 +442,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					return FALSE;
 				}
 
-				dict_id = ZDICT_getDictID (comp_dictionary, dict_len);
+				dict_id = ZDICT_getDictID (dict, dict_len);
 
 				if (dict_id == 0) {
 					g_set_error (err, RCLIENT_ERROR, errno,
@@ -404,8 +464,6 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					dict, dict_len,
 					1);
 
-			munmap (dict, dict_len);
-
 			if (ZSTD_isError (body->len)) {
 				g_set_error (err, RCLIENT_ERROR, ferror (
 						in), "compression error");
@@ -414,9 +472,18 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 				rspamd_fstring_free (body);
 				ZSTD_freeCCtx (zctx);
 
+				if (dict) {
+					munmap (dict, dict_len);
+				}
+
 				return FALSE;
 			}
 
+			/* Keep dictionary to decompress reply */
+			req->dict = dict;
+			req->dict_len = dict_len;
+			req->dict_id = dict_id;
+
 			ZSTD_freeCCtx (zctx);
 		}
 
@@ -470,10 +537,405 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	return ret;
 }
 
+static const struct {
+	const gchar *name;
+	enum rspamd_protocol_v3_field_type type;
+} rspamd_client_v3_fields[] = {
+	{IP_ADDR_HEADER, RSPAMD_PROTOCOL_V3_FIELD_IP},
+	{HELO_HEADER, RSPAMD_PROTOCOL_V3_FIELD_HELO},
+	{FROM_HEADER, RSPAMD_PROTOCOL_V3_FIELD_FROM},
+	{RCPT_HEADER, RSPAMD_PROTOCOL_V3_FIELD_RCPT},
+	{HOSTNAME_HEADER, RSPAMD_PROTOCOL_V3_FIELD_HOSTNAME},
+	{USER_HEADER, RSPAMD_PROTOCOL_V3_FIELD_USER},
+	{DELIVER_TO_HEADER, RSPAMD_PROTOCOL_V3_FIELD_DELIVER_TO},
+	{QUEUE_ID_HEADER, RSPAMD_PROTOCOL_V3_FIELD_QUEUE_ID},
+	{SETTINGS_ID_HEADER, RSPAMD_PROTOCOL_V3_FIELD_SETTINGS_ID},
+	{FLAGS_HEADER, RSPAMD_PROTOCOL_V3_FIELD_FLAGS},
+	{MTA_NAME_HEADER, RSPAMD_PROTOCOL_V3_FIELD_MTA_NAME},
+	{MTA_TAG_HEADER, RSPAMD_PROTOCOL_V3_FIELD_MTA_TAG},
+};
+
+static void
+rspamd_client_v3_add_field (GString *out, guint16 type,
+		const gchar *value, gsize len)
+{
+	struct rspamd_protocol_v3_field fh;
+
+	len = MIN (len, G_MAXUINT16);
+	fh.type = GUINT16_TO_LE (type);
+	fh.len = GUINT16_TO_LE ((guint16)len);
+	g_string_append_len (out, (const gchar *)&fh, sizeof (fh));
+	g_string_append_len (out, value, len);
+}
+
+static guint16
+rspamd_client_v3_add_attr (GString *out, struct rspamd_http_client_header *nh)
+{
+	guint i;
+	gchar *hdr;
+
+	if (g_ascii_strcasecmp (nh->name, PASS_HEADER) == 0) {
+		return g_ascii_strcasecmp (nh->value, "all") == 0 ?
+				RSPAMD_PROTOCOL_V3_REQUEST_PASS_ALL : 0;
+	}
+	if (g_ascii_strcasecmp (nh->name, NO_LOG_HEADER) == 0) {
+		return g_ascii_strcasecmp (nh->value, "no") == 0 ?
+				RSPAMD_PROTOCOL_V3_REQUEST_NO_LOG : 0;
+	}
+	if (g_ascii_strcasecmp (nh->name, RAW_DATA_HEADER) == 0) {
+		return g_ascii_strcasecmp (nh->value, "yes") == 0 ?
+				RSPAMD_PROTOCOL_V3_REQUEST_RAW : 0;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_client_v3_fields); i ++) {
+		if (g_ascii_strcasecmp (nh->name, rspamd_client_v3_fields[i].name) == 0) {
+			rspamd_client_v3_add_field (out, rspamd_client_v3_fields[i].type,
+					nh->value, strlen (nh->value));
+
+			return 0;
+		}
+	}
+
+	hdr = g_strdup_printf ("%s: %s", nh->name, nh->value);
+	rspamd_client_v3_add_field (out, RSPAMD_PROTOCOL_V3_FIELD_HEADER,
+			hdr, strlen (hdr));
+	g_free (hdr);
+
+	return 0;
+}
+
+/*
+ * Returns full length of reply or 0 if more data is needed
+ */
+static gsize
+rspamd_client_v3_reply_len (const guchar *data, gsize len)
+{
+	const struct rspamd_protocol_v3_reply *hdr;
+	gsize need;
+	guint32 i, nsym;
+	guint16 nlen;
+
+	if (len < sizeof (*hdr)) {
+		return 0;
+	}
+
+	hdr = (const struct rspamd_protocol_v3_reply *)data;
+	nsym = GUINT32_FROM_LE (hdr->nsymbols);
+	need = sizeof (*hdr) + (gsize)nsym * sizeof (struct rspamd_protocol_v3_symbol);
+
+	if (hdr->flags & RSPAMD_PROTOCOL_V3_REPLY_NAMES) {
+		for (i = 0; i < nsym; i ++) {
+			if (need + sizeof (nlen) > len) {
+				return 0;
+			}
+
+			memcpy (&nlen, data + need, sizeof (nlen));
+			need += sizeof (nlen) + GUINT16_FROM_LE (nlen);
+		}
+	}
+
+	need += GUINT32_FROM_LE (hdr->extra_len);
+
+	return need <= len ? need : 0;
+}
+
+static gdouble
+rspamd_client_v3_double (gdouble val)
+{
+	union {
+		gdouble d;
+		guint64 u;
+	} cv;
+
+	cv.d = val;
+	cv.u = GUINT64_FROM_LE (cv.u);
+
+	return cv.d;
+}
+
+/*
+ * Converts binary reply to the same object as `checkv2` returns
+ */
+static ucl_object_t *
+rspamd_client_v3_reply_to_ucl (const guchar *data, gsize len, GError **err)
+{
+	struct rspamd_protocol_v3_reply hdr;
+	struct rspamd_protocol_v3_symbol sr;
+	const guchar *syms, *names, *extra;
+	ucl_object_t *top, *symbols, *sobj;
+	guint32 i, nsym, extra_len;
+	guint16 nlen;
+	gchar idbuf[32];
+	union {
+		gfloat f;
+		guint32 u;
+	} cv;
+
+	memcpy (&hdr, data, sizeof (hdr));
+
+	if (memcmp (hdr.magic, RSPAMD_PROTOCOL_V3_MAGIC, sizeof (hdr.magic)) != 0) {
+		g_set_error (err, RCLIENT_ERROR, 500, "invalid binary reply magic");
+		return NULL;
+	}
+
+	nsym = GUINT32_FROM_LE (hdr.nsymbols);
+	extra_len = GUINT32_FROM_LE (hdr.extra_len);
+	syms = data + sizeof (hdr);
+	names = syms + (gsize)nsym * sizeof (sr);
+	extra = data + len - extra_len;
+
+	if (hdr.flags & RSPAMD_PROTOCOL_V3_REPLY_ERROR) {
+		g_set_error (err, RCLIENT_ERROR, 500, "%.*s",
+				(gint)extra_len, (const gchar *)extra);
+		return NULL;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top,
+			ucl_object_frombool (hdr.flags & RSPAMD_PROTOCOL_V3_REPLY_SKIPPED),
+			"is_skipped", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (rspamd_client_v3_double (hdr.score)),
+			"score", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (rspamd_client_v3_double (hdr.required_score)),
+			"required_score", 0, false);
+
+	if (GUINT16_FROM_LE (hdr.action) == METRIC_ACTION_CUSTOM && extra_len > 0) {
+		ucl_object_insert_key (top,
+				ucl_object_fromstring_common (extra, extra_len, 0),
+				"action", 0, false);
+	}
+	else {
+		ucl_object_insert_key (top,
+				ucl_object_fromstring (
+						rspamd_action_to_str (GUINT16_FROM_LE (hdr.action))),
+				"action", 0, false);
+	}
+
+	symbols = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < nsym; i ++) {
+		memcpy (&sr, syms + i * sizeof (sr), sizeof (sr));
+		cv.f = sr.score;
+		cv.u = GUINT32_FROM_LE (cv.u);
+		sobj = ucl_object_typed_new (UCL_OBJECT);
+
+		if (hdr.flags & RSPAMD_PROTOCOL_V3_REPLY_NAMES) {
+			memcpy (&nlen, names, sizeof (nlen));
+			nlen = GUINT16_FROM_LE (nlen);
+			names += sizeof (nlen);
+			ucl_object_insert_key (sobj,
+					ucl_object_fromstring_common (names, nlen, 0),
+					"name", 0, false);
+			ucl_object_insert_key (sobj, ucl_object_fromdouble (cv.f),
+					"score", 0, false);
+			ucl_object_insert_key (symbols, sobj, names, nlen, true);
+			names += nlen;
+		}
+		else {
+			rspamd_snprintf (idbuf, sizeof (idbuf), "%ud",
+					GUINT32_FROM_LE (sr.id));
+			ucl_object_insert_key (sobj, ucl_object_fromstring (idbuf),
+					"name", 0, false);
+			ucl_object_insert_key (sobj, ucl_object_fromdouble (cv.f),
+					"score", 0, false);
+			ucl_object_insert_key (symbols, sobj, idbuf, 0, true);
+		}
+	}
+
+	ucl_object_insert_key (top, symbols, "symbols", 0, false);
+
+	return top;
+}
+
+static void
+rspamd_client_v3_finish (struct rspamd_client_connection *c,
+		ucl_object_t *result, GError *err)
+{
+	struct rspamd_client_request *req = c->req;
+
+	rspamd_ev_watcher_stop (c->event_loop, &c->ev);
+	/* Callback can destroy connection */
+	req->cb (c, NULL, c->server_name->str, result, req->input, req->ud,
+			c->start_time, c->send_time, NULL, 0, err);
+}
+
+static void
+rspamd_client_v3_io (gint fd, short what, gpointer ud)
+{
+	struct rspamd_client_connection *c = (struct rspamd_client_connection *)ud;
+	ucl_object_t *result;
+	GError *err = NULL;
+	gssize r;
+	gsize need;
+
+	if (what == EV_TIMER) {
+		err = g_error_new (RCLIENT_ERROR, ETIMEDOUT, "IO timeout");
+		rspamd_client_v3_finish (c, NULL, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	if (!c->v3_reading) {
+		r = write (fd, c->v3_buf->str + c->v3_pos, c->v3_buf->len - c->v3_pos);
+
+		if (r == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return;
+			}
+
+			err = g_error_new (RCLIENT_ERROR, errno, "write error: %s",
+					strerror (errno));
+			rspamd_client_v3_finish (c, NULL, err);
+			g_error_free (err);
+
+			return;
+		}
+
+		c->v3_pos += r;
+
+		if (c->v3_pos == c->v3_buf->len) {
+			c->v3_reading = TRUE;
+			c->req_sent = TRUE;
+			c->send_time = rspamd_get_ticks (FALSE);
+			g_string_set_size (c->v3_buf, 0);
+			rspamd_ev_watcher_reschedule (c->event_loop, &c->ev, EV_READ);
+		}
+
+		return;
+	}
+
+	for (;;) {
+		if (c->v3_buf->allocated_len - c->v3_buf->len < BUFSIZ) {
+			need = c->v3_buf->len;
+			g_string_set_size (c->v3_buf, need + BUFSIZ * 2);
+			c->v3_buf->len = need;
+		}
+
+		r = read (fd, c->v3_buf->str + c->v3_buf->len,
+				c->v3_buf->allocated_len - c->v3_buf->len - 1);
+
+		if (r == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return;
+			}
+
+			err = g_error_new (RCLIENT_ERROR, errno, "read error: %s",
+					strerror (errno));
+			rspamd_client_v3_finish (c, NULL, err);
+			g_error_free (err);
+
+			return;
+		}
+		else if (r == 0) {
+			err = g_error_new (RCLIENT_ERROR, 500, "connection closed");
+			rspamd_client_v3_finish (c, NULL, err);
+			g_error_free (err);
+
+			return;
+		}
+
+		c->v3_buf->len += r;
+		need = rspamd_client_v3_reply_len ((const guchar *)c->v3_buf->str,
+				c->v3_buf->len);
+
+		if (need > 0) {
+			result = rspamd_client_v3_reply_to_ucl (
+					(const guchar *)c->v3_buf->str, need, &err);
+			rspamd_client_v3_finish (c, result, err);
+
+			if (err) {
+				g_error_free (err);
+			}
+
+			return;
+		}
+	}
+}
+
+gboolean
+rspamd_client_command_v3 (struct rspamd_client_connection *conn,
+		GQueue *attrs,
+		FILE *in,
+		rspamd_client_callback cb,
+		gpointer ud,
+		GError **err)
+{
+	struct rspamd_client_request *req;
+	struct rspamd_protocol_v3_request hdr;
+	GString *input = NULL, *fields;
+	guint16 flags = RSPAMD_PROTOCOL_V3_REQUEST_NAMES;
+	GList *cur;
+
+	if (conn->key) {
+		g_set_error (err, RCLIENT_ERROR, EINVAL,
+				"binary protocol does not support encryption");
+		return FALSE;
+	}
+
+	if (in != NULL) {
+		input = rspamd_client_read_input (in, err);
+
+		if (input == NULL) {
+			return FALSE;
+		}
+	}
+
+	req = g_malloc0 (sizeof (struct rspamd_client_request));
+	req->conn = conn;
+	req->cb = cb;
+	req->ud = ud;
+	req->input = input;
+
+	fields = g_string_sized_new (256);
+
+	for (cur = attrs->head; cur != NULL; cur = g_list_next (cur)) {
+		flags |= rspamd_client_v3_add_attr (fields, cur->data);
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_PROTOCOL_V3_MAGIC, sizeof (hdr.magic));
+	hdr.version = RSPAMD_PROTOCOL_V3_VERSION;
+	hdr.cmd = input ? RSPAMD_PROTOCOL_V3_CMD_CHECK : RSPAMD_PROTOCOL_V3_CMD_PING;
+	hdr.flags = GUINT16_TO_LE (flags);
+	hdr.fields_len = GUINT32_TO_LE (fields->len);
+	hdr.body_len = GUINT32_TO_LE (input ? input->len : 0);
+
+	conn->v3_buf = g_string_sized_new (sizeof (hdr) + fields->len +
+			(input ? input->len : 0));
+	g_string_append_len (conn->v3_buf, (const gchar *)&hdr, sizeof (hdr));
+	g_string_append_len (conn->v3_buf, fields->str, fields->len);
+
+	if (input) {
+		g_string_append_len (conn->v3_buf, input->str, input->len);
+	}
+
+	g_string_free (fields, TRUE);
+
+	conn->req = req;
+	conn->v3_pos = 0;
+	conn->v3_reading = FALSE;
+	conn->start_time = rspamd_get_ticks (FALSE);
+
+	rspamd_ev_watcher_init (&conn->ev, conn->fd, EV_WRITE,
+			rspamd_client_v3_io, conn);
+	rspamd_ev_watcher_start (conn->event_loop, &conn->ev, conn->timeout);
+
+	return TRUE;
+}
+
 void
 rspamd_client_destroy (struct rspamd_client_connection *conn)
 {
 	if (conn != NULL) {
+		rspamd_ev_watcher_stop (conn->event_loop, &conn->ev);
+
+		if (conn->v3_buf) {
+			g_string_free (conn->v3_buf, TRUE);
+		}
+
 		rspamd_http_connection_unref (conn->http_conn);
 		if (conn->req != NULL) {
 			rspamd_client_request_free (conn->req);
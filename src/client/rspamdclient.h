@@ -93,6 +93,25 @@ gboolean rspamd_client_command (
 		const gchar *filename,
 		GError **err);
 
+/**
+ * Scan message using binary (v3) protocol, attributes are converted to the
+ * envelope fields. Reply is converted to the same object as `checkv2` returns
+ * and callback is called with NULL HTTP message.
+ * @param conn connection object
+ * @param attrs additional attributes
+ * @param in input file or NULL to ping server
+ * @param cb callback to be called on command completion
+ * @param ud opaque user data
+ * @return
+ */
+gboolean rspamd_client_command_v3 (
+		struct rspamd_client_connection *conn,
+		GQueue *attrs,
+		FILE *in,
+		rspamd_client_callback cb,
+		gpointer ud,
+		GError **err);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
@@ -23,6 +23,7 @@
 #include "libstemmer.h"
 
 #include <glob.h>
+#include <sys/mman.h>
 #include <unicode/utf8.h>
 #include <unicode/utf16.h>
 #include <unicode/ucnv.h>
@@ -34,6 +35,12 @@ static const gsize default_short_text_limit = 10;
 static const gsize default_words = 80;
 static const gdouble update_prob = 0.6;
 static const gchar *default_languages_path = RSPAMD_SHAREDIR "/languages";
+/*
+ * `lang_detection.model_cache`: compiled model of the languages files, it is
+ * rebuilt when the set of files or their sizes and mtimes are changed;
+ * `false` disables it
+ */
+static const gchar *default_model_cache = RSPAMD_DBDIR "/languages.model";
 
 #undef EXTRA_LANGDET_DEBUG
 
@@ -87,6 +94,7 @@ struct rspamd_language_elt {
 	gdouble mean;
 	gdouble std;
 	guint occurencies; /* total number of parts with this language */
+	guint idx; /* index in languages array and in the compiled model */
 };
 
 struct rspamd_ngramm_elt {
@@ -98,7 +106,6 @@ struct rspamd_ngramm_chain {
 	GPtrArray *languages;
 	gdouble mean;
 	gdouble std;
-	gchar *utf;
 };
 
 struct rspamd_stop_word_range {
@@ -173,9 +180,58 @@ KHASH_INIT (rspamd_stopwords_hash, rspamd_ftok_t *,
 		char, false,
 		rspamd_ftok_hash, rspamd_ftok_equal);
 
+/*
+ * Compiled language model, it is a single memory chunk (that could be mapped
+ * from a cache file) consisting of header, languages, ngramms probabilities
+ * and per category open addressing hash tables of ngramms
+ */
+#define RSPAMD_LANG_MODEL_MAGIC "rslmdl01"
+#define RSPAMD_LANG_MODEL_SEED 0xa1c3f26b9e5d4087ULL
+
+struct rspamd_lang_model_header {
+	gchar magic[8];
+	guint64 source_hash; /* hash of source files and model format */
+	guint32 nlangs;
+	guint32 endian_check;
+	guint64 nelts;
+	guint64 tables_size[RSPAMD_LANGUAGE_MAX]; /* number of slots, power of 2 */
+	guint64 tables_offset[RSPAMD_LANGUAGE_MAX];
+	guint64 langs_offset;
+	guint64 elts_offset;
+	guint64 total_len;
+};
+
+struct rspamd_lang_model_lang {
+	gchar name[32];
+	gint32 flags;
+	guint32 category;
+	guint32 trigramms_words;
+	guint32 reserved;
+	gdouble mean;
+	gdouble std;
+};
+
+struct rspamd_lang_model_elt {
+	gdouble prob;
+	guint32 lang;
+	guint32 reserved;
+};
+
+struct rspamd_lang_model_slot {
+	UChar32 s[3];
+	guint32 nelts; /* 0 for empty slots */
+	guint32 elts_idx;
+};
+
 struct rspamd_lang_detector {
 	GPtrArray *languages;
-	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* trigramms frequencies */
+	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* trigramms frequencies, used to build model */
+	const guchar *model;
+	gsize model_len;
+	gboolean model_mapped;
+	const struct rspamd_lang_model_slot *model_tables[RSPAMD_LANGUAGE_MAX];
+	guint64 model_masks[RSPAMD_LANGUAGE_MAX];
+	const struct rspamd_lang_model_elt *model_elts;
 	struct rspamd_stop_word_elt stop_words[RSPAMD_LANGUAGE_MAX];
 	khash_t(rspamd_stopwords_hash) *stop_words_norm;
 	UConverter *uchar_converter;
@@ -228,6 +284,7 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 {
 	struct rspamd_ngramm_chain *chain = NULL, st_chain;
 	struct rspamd_ngramm_elt *elt;
+	UChar32 *key;
 	khiter_t k;
 	guint i;
 	gboolean found;
@@ -252,16 +309,16 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 		/* New element */
 		chain = &st_chain;
 		memset (chain, 0, sizeof (st_chain));
-		chain->languages = g_ptr_array_sized_new (32);
-		rspamd_mempool_add_destructor (cfg->cfg_pool, rspamd_ptr_array_free_hard,
-				chain->languages);
-		chain->utf = rspamd_mempool_strdup (cfg->cfg_pool, ucs->utf);
-		elt = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*elt));
+		/* These are freed when model is compiled */
+		chain->languages = g_ptr_array_new_full (32, g_free);
+		elt = g_malloc (sizeof (*elt));
 		elt->elt = lelt;
 		elt->prob = ((gdouble)freq) / ((gdouble)total);
 		g_ptr_array_add (chain->languages, elt);
 
-		k = kh_put (rspamd_trigram_hash, htb, ucs->s, &i);
+		key = g_malloc (sizeof (UChar32) * 3);
+		memcpy (key, ucs->s, sizeof (UChar32) * 3);
+		k = kh_put (rspamd_trigram_hash, htb, key, &i);
 		kh_value (htb, k) = *chain;
 	}
 	else {
@@ -277,7 +334,7 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 		}
 
 		if (!found) {
-			elt = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*elt));
+			elt = g_malloc (sizeof (*elt));
 			elt->elt = lelt;
 			elt->prob = ((gdouble)freq) / ((gdouble)total);
 			g_ptr_array_add (chain->languages, elt);
@@ -338,6 +395,96 @@ rspamd_language_detector_cmp_ngramm (gconstpointer a, gconstpointer b)
 	return (gint)e2->freq - (gint)e1->freq;
 }
 
+static void
+rspamd_language_detector_read_stop_words (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		struct rspamd_language_elt *nelt,
+		const ucl_object_t *stop_words)
+{
+	enum rspamd_language_category cat = nelt->category;
+
+	if (stop_words) {
+		const ucl_object_t *specific_stop_words;
+
+		specific_stop_words = ucl_object_lookup (stop_words, nelt->name);
+
+		if (specific_stop_words) {
+			struct sb_stemmer *stem = NULL;
+			ucl_object_iter_t it = NULL;
+			const ucl_object_t *w;
+			guint start, stop;
+
+			stem = sb_stemmer_new (nelt->name, "UTF_8");
+			start = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
+
+			while ((w = ucl_object_iterate (specific_stop_words, &it, true)) != NULL) {
+				gsize wlen;
+				const char *word = ucl_object_tolstring (w, &wlen);
+				const char *saved;
+
+#ifdef WITH_HYPERSCAN
+				rspamd_multipattern_add_pattern_len (d->stop_words[cat].mp,
+						word, wlen,
+						RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8
+						|RSPAMD_MULTIPATTERN_RE);
+#else
+				rspamd_multipattern_add_pattern_len (d->stop_words[cat].mp,
+						word, wlen,
+						RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8);
+#endif
+				nelt->stop_words ++;
+
+				/* Also lemmatise and store normalised */
+				if (stem) {
+					const char *nw = sb_stemmer_stem (stem, word, wlen);
+
+
+					if (nw) {
+						saved = nw;
+						wlen = strlen (nw);
+					}
+					else {
+						saved = word;
+					}
+				}
+				else {
+					saved = word;
+				}
+
+				if (saved) {
+					gint rc;
+					rspamd_ftok_t *tok;
+					gchar *dst;
+
+					tok = rspamd_mempool_alloc (cfg->cfg_pool,
+							sizeof (*tok) + wlen + 1);
+					dst = ((gchar *)tok) + sizeof (*tok);
+					rspamd_strlcpy (dst, saved, wlen + 1);
+					tok->begin = dst;
+					tok->len = wlen;
+
+					kh_put (rspamd_stopwords_hash, d->stop_words_norm,
+							tok, &rc);
+				}
+			}
+
+			if (stem) {
+				sb_stemmer_delete (stem);
+			}
+
+			stop = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
+
+			struct rspamd_stop_word_range r;
+
+			r.start = start;
+			r.stop = stop;
+			r.elt = nelt;
+
+			g_array_append_val (d->stop_words[cat].ranges, r);
+		}
+	}
+}
+
 static void
 rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		struct rspamd_lang_detector *d,
@@ -354,7 +501,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	khash_t (rspamd_trigram_hash) *htb = NULL;
 	gchar *pos;
 	guint total = 0, total_latin = 0, total_ngramms = 0, i, skipped,
-			loaded, nstop = 0;
+			loaded;
 	gdouble mean = 0, std = 0, delta = 0, delta2 = 0, m2 = 0;
 	enum rspamd_language_category cat = RSPAMD_LANGUAGE_MAX;
 
@@ -459,90 +606,8 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		}
 	}
 
-	if (stop_words) {
-		const ucl_object_t *specific_stop_words;
-
-		specific_stop_words = ucl_object_lookup (stop_words, nelt->name);
-
-		if (specific_stop_words) {
-			struct sb_stemmer *stem = NULL;
-			it = NULL;
-			const ucl_object_t *w;
-			guint start, stop;
-
-			stem = sb_stemmer_new (nelt->name, "UTF_8");
-			start = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
-
-			while ((w = ucl_object_iterate (specific_stop_words, &it, true)) != NULL) {
-				gsize wlen;
-				const char *word = ucl_object_tolstring (w, &wlen);
-				const char *saved;
-
-#ifdef WITH_HYPERSCAN
-				rspamd_multipattern_add_pattern_len (d->stop_words[cat].mp,
-						word, wlen,
-						RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8
-						|RSPAMD_MULTIPATTERN_RE);
-#else
-				rspamd_multipattern_add_pattern_len (d->stop_words[cat].mp,
-						word, wlen,
-						RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8);
-#endif
-				nelt->stop_words ++;
-				nstop ++;
-
-				/* Also lemmatise and store normalised */
-				if (stem) {
-					const char *nw = sb_stemmer_stem (stem, word, wlen);
-
-
-					if (nw) {
-						saved = nw;
-						wlen = strlen (nw);
-					}
-					else {
-						saved = word;
-					}
-				}
-				else {
-					saved = word;
-				}
-
-				if (saved) {
-					gint rc;
-					rspamd_ftok_t *tok;
-					gchar *dst;
-
-					tok = rspamd_mempool_alloc (cfg->cfg_pool,
-							sizeof (*tok) + wlen + 1);
-					dst = ((gchar *)tok) + sizeof (*tok);
-					rspamd_strlcpy (dst, saved, wlen + 1);
-					tok->begin = dst;
-					tok->len = wlen;
-
-					kh_put (rspamd_stopwords_hash, d->stop_words_norm,
-							tok, &rc);
-				}
-			}
-
-			if (stem) {
-				sb_stemmer_delete (stem);
-			}
-
-			stop = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
-
-			struct rspamd_stop_word_range r;
-
-			r.start = start;
-			r.stop = stop;
-			r.elt = nelt;
-
-			g_array_append_val (d->stop_words[cat].ranges, r);
-			it = NULL;
-		}
-	}
-
 	nelt->category = cat;
+	rspamd_language_detector_read_stop_words (cfg, d, nelt, stop_words);
 	htb = d->trigramms[cat];
 
 	GPtrArray *ngramms;
@@ -559,7 +624,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	}
 
 	it = NULL;
-	ngramms = g_ptr_array_sized_new (freqs->len);
+	ngramms = g_ptr_array_new_full (freqs->len, g_free);
 	i = 0;
 	skipped = 0;
 	loaded = 0;
@@ -582,8 +647,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 			UChar32 *cur_ucs;
 			const char *end = key + keylen, *cur_utf = key;
 
-			ucs_elt = rspamd_mempool_alloc (cfg->cfg_pool,
-					sizeof (*ucs_elt) + (keylen + 1) * sizeof (UChar32));
+			ucs_elt = g_malloc (sizeof (*ucs_elt) + (keylen + 1) * sizeof (UChar32));
 
 			cur_ucs = ucs_elt->s;
 			nsym = 0;
@@ -602,6 +666,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 			if (!U_SUCCESS (uc_err)) {
 				msg_warn_config ("cannot convert key %*s to unicode: %s",
 						(gint)keylen, key, u_errorName (uc_err));
+				g_free (ucs_elt);
 
 				continue;
 			}
@@ -613,6 +678,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 				g_ptr_array_add (ngramms, ucs_elt);
 			}
 			else {
+				g_free (ucs_elt);
 				continue;
 			}
 
@@ -686,6 +752,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 			skipped, loaded, nelt->stop_words,
 			rspamd_language_detector_print_flags (nelt));
 
+	nelt->idx = d->languages->len;
 	g_ptr_array_add (d->languages, nelt);
 	ucl_object_unref (top);
 }
@@ -735,8 +802,8 @@ rspamd_language_detector_process_chain (struct rspamd_config *cfg,
 			if (elt->prob < mean) {
 				g_ptr_array_remove_index_fast (chain->languages, i);
 #ifdef EXTRA_LANGDET_DEBUG
-				msg_debug_lang_det_cfg ("remove %s from %s; prob: %.4f; mean: %.4f, std: %.4f",
-						elt->elt->name, chain->utf, elt->prob, mean, std);
+				msg_debug_lang_det_cfg ("remove %s from ngramm; prob: %.4f; mean: %.4f, std: %.4f",
+						elt->elt->name, elt->prob, mean, std);
 #endif
 			}
 		}
@@ -746,23 +813,437 @@ rspamd_language_detector_process_chain (struct rspamd_config *cfg,
 		PTR_ARRAY_FOREACH (chain->languages, i, elt) {
 			elt->prob *= 4.0;
 #ifdef EXTRA_LANGDET_DEBUG
-			msg_debug_lang_det_cfg ("increase weight of %s in %s; prob: %.4f",
-					elt->elt->name, chain->utf, elt->prob);
+			msg_debug_lang_det_cfg ("increase weight of %s in ngramm; prob: %.4f",
+					elt->elt->name, elt->prob);
 #endif
 		}
 	}
 }
 
+static inline guint64
+rspamd_language_model_hash (const UChar32 *s)
+{
+	/* Must be stable as it is used in cached models */
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			s, sizeof (UChar32) * 3, RSPAMD_LANG_MODEL_SEED);
+}
+
+static void
+rspamd_language_detector_free_trigramms (struct rspamd_lang_detector *d)
+{
+	struct rspamd_ngramm_chain chain;
+	const UChar32 *key;
+	guint i;
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		if (d->trigramms[i]) {
+			kh_foreach (d->trigramms[i], key, chain, {
+				g_free ((gpointer)key);
+				g_ptr_array_free (chain.languages, TRUE);
+			});
+
+			kh_destroy (rspamd_trigram_hash, d->trigramms[i]);
+			d->trigramms[i] = NULL;
+		}
+	}
+}
+
+static void
+rspamd_language_detector_set_model (struct rspamd_lang_detector *d,
+		const guchar *model, gsize len, gboolean mapped)
+{
+	const struct rspamd_lang_model_header *hdr =
+			(const struct rspamd_lang_model_header *)model;
+	guint i;
+
+	d->model = model;
+	d->model_len = len;
+	d->model_mapped = mapped;
+	d->model_elts = (const struct rspamd_lang_model_elt *)
+			(model + hdr->elts_offset);
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		if (hdr->tables_size[i] > 0) {
+			d->model_tables[i] = (const struct rspamd_lang_model_slot *)
+					(model + hdr->tables_offset[i]);
+			d->model_masks[i] = hdr->tables_size[i] - 1;
+		}
+		else {
+			d->model_tables[i] = NULL;
+			d->model_masks[i] = 0;
+		}
+	}
+}
+
+static guint64
+rspamd_language_model_insert (struct rspamd_lang_model_slot *tbl, guint64 mask,
+		struct rspamd_lang_model_elt *melts, guint64 cur_elt,
+		const UChar32 *key, struct rspamd_ngramm_chain *chain)
+{
+	struct rspamd_lang_model_slot *slot;
+	struct rspamd_ngramm_elt *elt;
+	guint64 pos;
+	guint i, nelts = 0;
+
+	PTR_ARRAY_FOREACH (chain->languages, i, elt) {
+		if (elt->prob >= chain->mean) {
+			melts[cur_elt + nelts].prob = elt->prob;
+			melts[cur_elt + nelts].lang = elt->elt->idx;
+			nelts ++;
+		}
+	}
+
+	if (nelts == 0) {
+		return cur_elt;
+	}
+
+	pos = rspamd_language_model_hash (key) & mask;
+
+	while (tbl[pos].nelts != 0) {
+		pos = (pos + 1) & mask;
+	}
+
+	slot = &tbl[pos];
+	memcpy (slot->s, key, sizeof (slot->s));
+	slot->nelts = nelts;
+	slot->elts_idx = cur_elt;
+
+	return cur_elt + nelts;
+}
+
+/*
+ * Converts trigramms hashes built from the languages files to the compiled
+ * model and frees them
+ */
+static void
+rspamd_language_detector_compile_model (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d, guint64 source_hash)
+{
+	struct rspamd_lang_model_header *hdr;
+	struct rspamd_lang_model_lang *mlang;
+	struct rspamd_lang_model_elt *melts;
+	struct rspamd_lang_model_slot *tbl;
+	struct rspamd_language_elt *lelt;
+	struct rspamd_ngramm_chain chain;
+	struct rspamd_ngramm_elt *elt;
+	const UChar32 *key;
+	guchar *model;
+	guint64 nelts = 0, nslots, cur_elt = 0, mask;
+	gsize total_len;
+	guint i, j;
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		kh_foreach_value (d->trigramms[i], chain, {
+			PTR_ARRAY_FOREACH (chain.languages, j, elt) {
+				if (elt->prob >= chain.mean) {
+					nelts ++;
+				}
+			}
+		});
+	}
+
+	total_len = sizeof (*hdr) + sizeof (*mlang) * d->languages->len +
+			sizeof (*melts) * nelts;
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		nslots = 0;
+
+		if (kh_size (d->trigramms[i]) > 0) {
+			/* Keep load factor below 0.5 */
+			nslots = 2;
+
+			while (nslots < kh_size (d->trigramms[i]) * 2) {
+				nslots <<= 1;
+			}
+		}
+
+		total_len += sizeof (*tbl) * nslots;
+	}
+
+	model = g_malloc0 (total_len);
+	hdr = (struct rspamd_lang_model_header *)model;
+	memcpy (hdr->magic, RSPAMD_LANG_MODEL_MAGIC, sizeof (hdr->magic));
+	hdr->source_hash = source_hash;
+	hdr->nlangs = d->languages->len;
+	hdr->endian_check = 0x01020304;
+	hdr->nelts = nelts;
+	hdr->langs_offset = sizeof (*hdr);
+	hdr->elts_offset = hdr->langs_offset + sizeof (*mlang) * d->languages->len;
+	hdr->total_len = total_len;
+
+	mlang = (struct rspamd_lang_model_lang *)(model + hdr->langs_offset);
+
+	PTR_ARRAY_FOREACH (d->languages, i, lelt) {
+		rspamd_strlcpy (mlang[i].name, lelt->name, sizeof (mlang[i].name));
+		mlang[i].flags = lelt->flags;
+		mlang[i].category = lelt->category;
+		mlang[i].trigramms_words = lelt->trigramms_words;
+		mlang[i].mean = lelt->mean;
+		mlang[i].std = lelt->std;
+	}
+
+	melts = (struct rspamd_lang_model_elt *)(model + hdr->elts_offset);
+	total_len = hdr->elts_offset + sizeof (*melts) * nelts;
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		nslots = 0;
+
+		if (kh_size (d->trigramms[i]) > 0) {
+			nslots = 2;
+
+			while (nslots < kh_size (d->trigramms[i]) * 2) {
+				nslots <<= 1;
+			}
+		}
+
+		hdr->tables_size[i] = nslots;
+		hdr->tables_offset[i] = total_len;
+		total_len += sizeof (*tbl) * nslots;
+
+		if (nslots == 0) {
+			continue;
+		}
+
+		tbl = (struct rspamd_lang_model_slot *)(model + hdr->tables_offset[i]);
+		mask = nslots - 1;
+
+		kh_foreach (d->trigramms[i], key, chain, {
+			cur_elt = rspamd_language_model_insert (tbl, mask, melts, cur_elt,
+					key, &chain);
+		});
+	}
+
+	g_assert (cur_elt == nelts);
+	rspamd_language_detector_free_trigramms (d);
+	rspamd_language_detector_set_model (d, model, hdr->total_len, FALSE);
+}
+
+/*
+ * Checks that `cnt` elements of size `sz` starting from `off` fit in `len`
+ * bytes without overflows
+ */
+static inline gboolean
+rspamd_language_model_check_range (guint64 off, guint64 cnt, gsize sz,
+		gsize len)
+{
+	return off <= len && cnt <= (len - off) / sz;
+}
+
+/*
+ * Checks that slots of the table refer to the existing elements and that
+ * there is at least one free slot, so lookups always terminate
+ */
+static gboolean
+rspamd_language_model_check_table (const struct rspamd_lang_model_slot *tbl,
+		guint64 nslots, guint64 nelts)
+{
+	guint64 i, nfree = 0;
+
+	for (i = 0; i < nslots; i ++) {
+		if (tbl[i].nelts == 0) {
+			nfree ++;
+		}
+		else if ((guint64)tbl[i].elts_idx + tbl[i].nelts > nelts) {
+			return FALSE;
+		}
+	}
+
+	return nslots == 0 || nfree > 0;
+}
+
+static gboolean
+rspamd_language_detector_load_model (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		const gchar *path,
+		guint64 source_hash,
+		const ucl_object_t *stop_words)
+{
+	const struct rspamd_lang_model_header *hdr;
+	const struct rspamd_lang_model_lang *mlang;
+	const struct rspamd_lang_model_elt *melts;
+	struct rspamd_language_elt *nelt;
+	guchar *map;
+	gsize len;
+	guint64 i;
+
+	map = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+	if (map == NULL) {
+		msg_info_config ("cannot map language model %s: %s, build it from "
+				"the languages files", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_lang_model_header *)map;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, RSPAMD_LANG_MODEL_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->endian_check != 0x01020304 ||
+			hdr->source_hash != source_hash ||
+			hdr->total_len != len) {
+		msg_info_config ("language model %s is outdated or invalid, rebuild it",
+				path);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	if (!rspamd_language_model_check_range (hdr->langs_offset, hdr->nlangs,
+			sizeof (*mlang), len) ||
+			!rspamd_language_model_check_range (hdr->elts_offset, hdr->nelts,
+			sizeof (*melts), len)) {
+		goto err;
+	}
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		if (!rspamd_language_model_check_range (hdr->tables_offset[i],
+				hdr->tables_size[i], sizeof (struct rspamd_lang_model_slot),
+				len) ||
+				(hdr->tables_size[i] & (hdr->tables_size[i] - 1)) != 0) {
+			goto err;
+		}
+
+		if (!rspamd_language_model_check_table (
+				(const struct rspamd_lang_model_slot *)(map +
+						hdr->tables_offset[i]),
+				hdr->tables_size[i], hdr->nelts)) {
+			goto err;
+		}
+	}
+
+	mlang = (const struct rspamd_lang_model_lang *)(map + hdr->langs_offset);
+	melts = (const struct rspamd_lang_model_elt *)(map + hdr->elts_offset);
+
+	for (i = 0; i < hdr->nlangs; i ++) {
+		if (mlang[i].name[sizeof (mlang[i].name) - 1] != '\0' ||
+				mlang[i].category >= RSPAMD_LANGUAGE_MAX) {
+			goto err;
+		}
+	}
+
+	for (i = 0; i < hdr->nelts; i ++) {
+		if (melts[i].lang >= hdr->nlangs) {
+			goto err;
+		}
+	}
+
+	for (i = 0; i < hdr->nlangs; i ++) {
+		nelt = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*nelt));
+		nelt->name = rspamd_mempool_strdup (cfg->cfg_pool, mlang[i].name);
+		nelt->flags = mlang[i].flags;
+		nelt->category = mlang[i].category;
+		nelt->trigramms_words = mlang[i].trigramms_words;
+		nelt->mean = mlang[i].mean;
+		nelt->std = mlang[i].std;
+		nelt->idx = i;
+		rspamd_language_detector_read_stop_words (cfg, d, nelt, stop_words);
+		g_ptr_array_add (d->languages, nelt);
+	}
+
+	rspamd_language_detector_free_trigramms (d);
+	rspamd_language_detector_set_model (d, map, len, TRUE);
+
+	return TRUE;
+
+err:
+	msg_err_config ("language model %s is corrupted, rebuild it", path);
+	munmap (map, len);
+
+	return FALSE;
+}
+
+static void
+rspamd_language_detector_save_model (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		const gchar *path)
+{
+	gchar tmppath[PATH_MAX];
+	gint fd;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.XXXXXX", path);
+	fd = g_mkstemp_full (tmppath, O_WRONLY|O_CREAT|O_EXCL, 00644);
+
+	if (fd == -1) {
+		msg_info_config ("cannot create temporary file %s: %s", tmppath,
+				strerror (errno));
+
+		return;
+	}
+
+	if (write (fd, d->model, d->model_len) != (gssize)d->model_len) {
+		msg_info_config ("cannot write language model to %s: %s", tmppath,
+				strerror (errno));
+		close (fd);
+		unlink (tmppath);
+
+		return;
+	}
+
+	close (fd);
+
+	if (rename (tmppath, path) == -1) {
+		msg_info_config ("cannot rename %s to %s: %s", tmppath, path,
+				strerror (errno));
+		unlink (tmppath);
+
+		return;
+	}
+
+	msg_info_config ("saved compiled language model to %s", path);
+}
+
+/*
+ * Model is valid while the set of languages files and their content
+ * (size and modification time) is the same
+ */
+static guint64
+rspamd_language_detector_source_hash (GPtrArray *files)
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+	struct stat sb;
+	const gchar *path;
+	guint64 tmp;
+	guint i;
+
+	rspamd_cryptobox_fast_hash_init (&st, RSPAMD_LANG_MODEL_SEED);
+	rspamd_cryptobox_fast_hash_update (&st, RSPAMD_LANG_MODEL_MAGIC,
+			sizeof (RSPAMD_LANG_MODEL_MAGIC));
+
+	PTR_ARRAY_FOREACH (files, i, path) {
+		rspamd_cryptobox_fast_hash_update (&st, path, strlen (path));
+
+		if (stat (path, &sb) != -1) {
+			tmp = sb.st_size;
+			rspamd_cryptobox_fast_hash_update (&st, &tmp, sizeof (tmp));
+			tmp = sb.st_mtime;
+			rspamd_cryptobox_fast_hash_update (&st, &tmp, sizeof (tmp));
+		}
+	}
+
+	return rspamd_cryptobox_fast_hash_final (&st);
+}
+
 static void
 rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 {
 	if (d) {
+		rspamd_language_detector_free_trigramms (d);
+
 		for (guint i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
-			kh_destroy (rspamd_trigram_hash, d->trigramms[i]);
 			rspamd_multipattern_destroy (d->stop_words[i].mp);
 			g_array_free (d->stop_words[i].ranges, TRUE);
 		}
 
+		if (d->model) {
+			if (d->model_mapped) {
+				munmap ((gpointer)d->model, d->model_len);
+			}
+			else {
+				g_free ((gpointer)d->model);
+			}
+		}
+
 		if (d->languages) {
 			g_ptr_array_free (d->languages, TRUE);
 		}
@@ -776,9 +1257,10 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 {
 	const ucl_object_t *section, *elt, *languages_enable = NULL,
 			*languages_disable = NULL;
-	const gchar *languages_path = default_languages_path;
+	const gchar *languages_path = default_languages_path,
+			*model_cache = default_model_cache, *path;
 	glob_t gl;
-	size_t i, short_text_limit = default_short_text_limit, total = 0;
+	size_t i, short_text_limit = default_short_text_limit;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	GString *languages_pattern;
 	struct rspamd_ngramm_chain *chain, schain;
@@ -786,6 +1268,9 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 	struct rspamd_lang_detector *ret = NULL;
 	struct ucl_parser *parser;
 	ucl_object_t *stop_words;
+	GPtrArray *files;
+	guint64 source_hash;
+	gboolean cached = FALSE;
 
 	section = ucl_object_lookup (cfg->rcl_obj, "lang_detection");
 
@@ -802,6 +1287,17 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			short_text_limit = ucl_object_toint (elt);
 		}
 
+		elt = ucl_object_lookup (section, "model_cache");
+
+		if (elt) {
+			if (ucl_object_type (elt) == UCL_STRING) {
+				model_cache = ucl_object_tostring (elt);
+			}
+			else if (!ucl_object_toboolean (elt)) {
+				model_cache = NULL;
+			}
+		}
+
 		languages_enable = ucl_object_lookup (section, "languages_enable");
 		languages_disable = ucl_object_lookup (section, "languages_disable");
 	}
@@ -855,14 +1351,15 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 
 	g_assert (uc_err == U_ZERO_ERROR);
 
+	files = g_ptr_array_sized_new (gl.gl_pathc);
+
 	for (i = 0; i < gl.gl_pathc; i ++) {
 		fname = g_path_get_basename (gl.gl_pathv[i]);
 
 		if (!rspamd_ucl_array_find_str (fname, languages_disable) ||
 				(languages_enable == NULL ||
 						rspamd_ucl_array_find_str (fname, languages_enable))) {
-			rspamd_language_detector_read_file (cfg, ret, gl.gl_pathv[i],
-					stop_words);
+			g_ptr_array_add (files, gl.gl_pathv[i]);
 		}
 		else {
 			msg_info_config ("skip language file %s: disabled", fname);
@@ -871,27 +1368,48 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		g_free (fname);
 	}
 
+	source_hash = rspamd_language_detector_source_hash (files);
+
+	if (model_cache && rspamd_language_detector_load_model (cfg, ret,
+			model_cache, source_hash, stop_words)) {
+		cached = TRUE;
+	}
+	else {
+		PTR_ARRAY_FOREACH (files, i, path) {
+			rspamd_language_detector_read_file (cfg, ret, path, stop_words);
+		}
+
+		for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+			kh_foreach_value (ret->trigramms[i], schain, {
+				chain = &schain;
+				rspamd_language_detector_process_chain (cfg, chain);
+			});
+		}
+
+		rspamd_language_detector_compile_model (cfg, ret, source_hash);
+
+		if (model_cache) {
+			rspamd_language_detector_save_model (cfg, ret, model_cache);
+		}
+	}
+
+	g_ptr_array_free (files, TRUE);
+
 	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 		GError *err = NULL;
 
-		kh_foreach_value (ret->trigramms[i], schain, {
-			chain = &schain;
-			rspamd_language_detector_process_chain (cfg, chain);
-		});
-
 		if (!rspamd_multipattern_compile (ret->stop_words[i].mp, &err)) {
 			msg_err_config ("cannot compile stop words for %z language group: %e",
 					i, err);
 			g_error_free (err);
 		}
-
-		total += kh_size (ret->trigramms[i]);
 	}
 
 	msg_info_config ("loaded %d languages, "
-			"%d trigramms",
+			"%uL ngramms probabilities%s",
 			(gint)ret->languages->len,
-			(gint)total);
+			((const struct rspamd_lang_model_header *)ret->model)->nelts,
+			cached ? " from the compiled model" : "");
 
 	if (stop_words) {
 		ucl_object_unref (stop_words);
@@ -1047,72 +1565,60 @@ rspamd_language_detector_next_ngramm (rspamd_stat_token_t *tok, UChar32 *window,
 	return cur_off + 1;
 }
 
+static inline const struct rspamd_lang_model_slot *
+rspamd_language_detector_find_ngramm (struct rspamd_lang_detector *d,
+		enum rspamd_language_category cat,
+		const UChar32 *window)
+{
+	const struct rspamd_lang_model_slot *tbl = d->model_tables[cat];
+	guint64 mask = d->model_masks[cat], pos;
+
+	if (tbl == NULL) {
+		return NULL;
+	}
+
+	pos = rspamd_language_model_hash (window) & mask;
+
+	while (tbl[pos].nelts != 0) {
+		if (memcmp (tbl[pos].s, window, sizeof (tbl[pos].s)) == 0) {
+			return &tbl[pos];
+		}
+
+		pos = (pos + 1) & mask;
+	}
+
+	return NULL;
+}
+
 /*
  * Do full guess for a specific ngramm, checking all languages defined
  */
 static void
-rspamd_language_detector_process_ngramm_full (struct rspamd_task *task,
-											  struct rspamd_lang_detector *d,
+rspamd_language_detector_process_ngramm_full (struct rspamd_lang_detector *d,
 											  UChar32 *window,
-											  khash_t(rspamd_candidates_hash) *candidates,
-											  khash_t(rspamd_trigram_hash) *trigramms)
+											  enum rspamd_language_category cat,
+											  gdouble *scores)
 {
+	const struct rspamd_lang_model_slot *slot;
+	const struct rspamd_lang_model_elt *elts;
 	guint i;
-	gint ret;
-	struct rspamd_ngramm_chain *chain = NULL;
-	struct rspamd_ngramm_elt *elt;
-	struct rspamd_lang_detector_res *cand;
-	khiter_t k;
-	gdouble prob;
-
-	k = kh_get (rspamd_trigram_hash, trigramms, window);
-	if (k != kh_end (trigramms)) {
-		chain = &kh_value (trigramms, k);
-	}
 
-	if (chain) {
-		PTR_ARRAY_FOREACH (chain->languages, i, elt) {
-			prob = elt->prob;
-
-			if (prob < chain->mean) {
-				continue;
-			}
-
-			k = kh_get (rspamd_candidates_hash, candidates, elt->elt->name);
-			if (k != kh_end (candidates)) {
-				cand = kh_value (candidates, k);
-			}
-			else {
-				cand = NULL;
-			}
+	slot = rspamd_language_detector_find_ngramm (d, cat, window);
 
-#ifdef NGRAMMS_DEBUG
-			msg_err ("gramm: %s, lang: %s, prob: %.3f", chain->utf,
-					elt->elt->name, log2 (elt->prob));
-#endif
-			if (cand == NULL) {
-				cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
-				cand->elt = elt->elt;
-				cand->lang = elt->elt->name;
-				cand->prob = prob;
+	if (slot) {
+		elts = d->model_elts + slot->elts_idx;
 
-				k = kh_put (rspamd_candidates_hash, candidates, elt->elt->name,
-						&ret);
-				kh_value (candidates, k) = cand;
-			} else {
-				/* Update guess */
-				cand->prob += prob;
-			}
+		for (i = 0; i < slot->nelts; i ++) {
+			scores[elts[i].lang] += elts[i].prob;
 		}
 	}
 }
 
 static void
-rspamd_language_detector_detect_word (struct rspamd_task *task,
-									  struct rspamd_lang_detector *d,
+rspamd_language_detector_detect_word (struct rspamd_lang_detector *d,
 									  rspamd_stat_token_t *tok,
-									  khash_t(rspamd_candidates_hash) *candidates,
-									  khash_t(rspamd_trigram_hash) *trigramms)
+									  enum rspamd_language_category cat,
+									  gdouble *scores)
 {
 	const guint wlen = 3;
 	UChar32 window[3];
@@ -1121,8 +1627,7 @@ rspamd_language_detector_detect_word (struct rspamd_task *task,
 	/* Split words */
 	while ((cur = rspamd_language_detector_next_ngramm (tok, window, wlen, cur))
 			!= -1) {
-		rspamd_language_detector_process_ngramm_full (task,
-				d, window, candidates, trigramms);
+		rspamd_language_detector_process_ngramm_full (d, window, cat, scores);
 	}
 }
 
@@ -1205,9 +1710,16 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 	guint nparts = MIN (words->len, nwords);
 	goffset *selected_words;
 	rspamd_stat_token_t *tok;
+	struct rspamd_language_elt *lelt;
+	struct rspamd_lang_detector_res *cand;
+	gdouble *scores;
+	khiter_t k;
 	guint i;
+	gint r;
 
 	selected_words = g_new0 (goffset, nparts);
+	/* Accumulate scores per language index and convert them to candidates then */
+	scores = g_new0 (gdouble, d->languages->len);
 	rspamd_language_detector_random_select (words, nparts, selected_words);
 	msg_debug_lang_det ("randomly selected %d words", nparts);
 
@@ -1216,11 +1728,32 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 				selected_words[i]);
 
 		if (tok->unicode.len >= 3) {
-			rspamd_language_detector_detect_word (task, d, tok, candidates,
-					d->trigramms[cat]);
+			rspamd_language_detector_detect_word (d, tok, cat, scores);
 		}
 	}
 
+	PTR_ARRAY_FOREACH (d->languages, i, lelt) {
+		if (scores[i] > 0) {
+			k = kh_get (rspamd_candidates_hash, candidates, lelt->name);
+
+			if (k != kh_end (candidates)) {
+				cand = kh_value (candidates, k);
+				cand->prob += scores[i];
+			}
+			else {
+				cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
+				cand->elt = lelt;
+				cand->lang = lelt->name;
+				cand->prob = scores[i];
+
+				k = kh_put (rspamd_candidates_hash, candidates, lelt->name, &r);
+				kh_value (candidates, k) = cand;
+			}
+		}
+	}
+
+	g_free (scores);
+
 	/* Filter negligible candidates */
 	rspamd_language_detector_filter_negligible (task, candidates);
 	g_free (selected_words);
@@ -1900,8 +2433,8 @@ rspamd_language_detector_detect (struct rspamd_task *task,
 
 			if (result->len > 0 && !frequency_heuristic_applied) {
 				cand = g_ptr_array_index (result, 0);
-				cand->elt->occurencies++;
-				d->total_occurencies++;
+				rspamd_language_detector_count (d, cand->elt);
+				part->flags |= RSPAMD_MIME_TEXT_PART_LANG_COUNTED;
 			}
 
 			if (part->languages != NULL) {
@@ -1959,6 +2492,32 @@ rspamd_language_detector_is_stop_word (struct rspamd_lang_detector *d,
 	return FALSE;
 }
 
+struct rspamd_language_elt *
+rspamd_language_detector_find (struct rspamd_lang_detector *d,
+		const gchar *lang)
+{
+	struct rspamd_language_elt *elt;
+	guint i;
+
+	PTR_ARRAY_FOREACH (d->languages, i, elt) {
+		if (strcmp (elt->name, lang) == 0) {
+			return elt;
+		}
+	}
+
+	return NULL;
+}
+
+void
+rspamd_language_detector_count (struct rspamd_lang_detector *d,
+		struct rspamd_language_elt *elt)
+{
+	if (elt) {
+		elt->occurencies ++;
+		d->total_occurencies ++;
+	}
+}
+
 gint
 rspamd_language_detector_elt_flags (const struct rspamd_language_elt *elt)
 {
@@ -66,7 +66,10 @@ struct rspamd_lang_detector_res {
 };
 
 /**
- * Create new language detector object using configuration object
+ * Create new language detector object using configuration object.
+ * The compiled ngramms model is loaded from `lang_detection.model_cache`
+ * (`$DBDIR/languages.model` by default) if it is up to date, otherwise it
+ * is built from the languages files and saved there
  * @param cfg
  * @return
  */
@@ -97,6 +100,24 @@ gboolean rspamd_language_detector_detect (struct rspamd_task *task,
 gboolean rspamd_language_detector_is_stop_word (struct rspamd_lang_detector *d,
 												const gchar *word, gsize wlen);
 
+/**
+ * Find a language known by the detector
+ * @param d
+ * @param lang language name, e.g. "en"
+ * @return language elt or NULL
+ */
+struct rspamd_language_elt *rspamd_language_detector_find (struct rspamd_lang_detector *d,
+														  const gchar *lang);
+
+/**
+ * Account a part of the specified language in the languages frequencies,
+ * as `rspamd_language_detector_detect` does for the detected language
+ * @param d
+ * @param elt
+ */
+void rspamd_language_detector_count (struct rspamd_lang_detector *d,
+									 struct rspamd_language_elt *elt);
+
 /**
  * Return language flags for a specific language elt
  * @param elt
@@ -26,6 +26,7 @@
 #include "mime_encoding.h"
 #include "lang_detection.h"
 #include "libutil/multipattern.h"
+#include "libutil/hash.h"
 #include "libserver/mempool_vars_internal.h"
 
 #ifdef WITH_SNOWBALL
@@ -56,6 +57,38 @@ static const gchar gtube_pattern_no_action[] = "AJS*C4JDBQADN1.NSBN3*2IDNEN*"
 struct rspamd_multipattern *gtube_matcher = NULL;
 static const guint64 words_hash_seed = 0xdeadbabe;
 
+/*
+ * Results of charset conversion and language detection for text parts with
+ * the same content, reused by the subsequent tasks processed by this worker
+ */
+#define RSPAMD_TEXT_PART_CACHE_MAX_LEN (128 * 1024)
+#define RSPAMD_TEXT_PART_CACHE_FLAGS (RSPAMD_MIME_TEXT_PART_FLAG_UTF| \
+		RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED)
+
+struct rspamd_text_part_cache_lang {
+	gchar *lang;
+	gdouble prob;
+};
+
+struct rspamd_text_part_cache_entry {
+	guchar key[rspamd_cryptobox_HASHBYTES];
+	/* Charset conversion */
+	gboolean converted;
+	guint flags;
+	gchar *real_charset;
+	guchar *utf_raw_content;
+	gsize utf_raw_len;
+	/* Language detection */
+	gboolean lang_detected;
+	gboolean lang_counted;
+	guint unicode_scripts;
+	gchar *language;
+	guint nlanguages;
+	struct rspamd_text_part_cache_lang *languages;
+};
+
+static rspamd_lru_hash_t *text_parts_hash = NULL;
+
 static void
 free_byte_array_callback (void *pointer)
 {
@@ -202,14 +235,193 @@ rspamd_mime_part_create_words (struct rspamd_task *task,
 
 }
 
+static void
+rspamd_text_part_cache_entry_dtor (gpointer p)
+{
+	struct rspamd_text_part_cache_entry *entry = p;
+	guint i;
+
+	g_free (entry->real_charset);
+	g_free (entry->utf_raw_content);
+	g_free (entry->language);
+
+	for (i = 0; i < entry->nlanguages; i ++) {
+		g_free (entry->languages[i].lang);
+	}
+
+	g_free (entry->languages);
+	g_free (entry);
+}
+
+static guint32
+rspamd_text_part_cache_hash (gconstpointer p)
+{
+	return rspamd_cryptobox_fast_hash (p, rspamd_cryptobox_HASHBYTES,
+			rspamd_hash_seed ());
+}
+
+static gboolean
+rspamd_text_part_cache_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+/*
+ * Key includes declared charset and html flag as both of them change
+ * results for the same content
+ */
+static void
+rspamd_text_part_cache_key (struct rspamd_mime_text_part *part, guchar *key)
+{
+	rspamd_cryptobox_hash_state_t st;
+	struct rspamd_mime_part *mime_part = part->mime_part;
+	guchar html = IS_PART_HTML (part) ? 1 : 0;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, mime_part->digest,
+			sizeof (mime_part->digest));
+
+	if (mime_part->ct && mime_part->ct->charset.len > 0) {
+		rspamd_cryptobox_hash_update (&st, mime_part->ct->charset.begin,
+				mime_part->ct->charset.len);
+	}
+
+	rspamd_cryptobox_hash_update (&st, &html, sizeof (html));
+	rspamd_cryptobox_hash_final (&st, key);
+}
+
+static struct rspamd_text_part_cache_entry *
+rspamd_text_part_cache_lookup (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part,
+		gboolean create)
+{
+	struct rspamd_text_part_cache_entry *found;
+	guchar key[rspamd_cryptobox_HASHBYTES];
+
+	if (task->cfg == NULL || task->cfg->text_parts_cache_size == 0 ||
+			part->parsed.len == 0 ||
+			part->parsed.len > RSPAMD_TEXT_PART_CACHE_MAX_LEN) {
+		return NULL;
+	}
+
+	if (text_parts_hash == NULL) {
+		text_parts_hash = rspamd_lru_hash_new_full (
+				task->cfg->text_parts_cache_size, NULL,
+				rspamd_text_part_cache_entry_dtor,
+				rspamd_text_part_cache_hash, rspamd_text_part_cache_equal);
+	}
+
+	rspamd_text_part_cache_key (part, key);
+	found = rspamd_lru_hash_lookup (text_parts_hash, key, task->tv.tv_sec);
+
+	if (found == NULL && create) {
+		found = g_malloc0 (sizeof (*found));
+		memcpy (found->key, key, sizeof (found->key));
+		rspamd_lru_hash_insert (text_parts_hash, found->key, found,
+				task->tv.tv_sec, 0);
+	}
+
+	return found;
+}
+
+/*
+ * Converts text part to utf8 or restores conversion result from the cache
+ */
+static void
+rspamd_message_text_part_convert (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part)
+{
+	struct rspamd_text_part_cache_entry *found;
+
+	found = rspamd_text_part_cache_lookup (task, part, FALSE);
+
+	if (found && found->converted) {
+		if (rspamd_str_has_8bit (part->raw.begin, part->raw.len)) {
+			part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_8BIT_RAW;
+		}
+
+		part->flags |= found->flags;
+		part->real_charset = found->real_charset ?
+				rspamd_mempool_strdup (task->task_pool, found->real_charset) :
+				NULL;
+		/* Copy as found could be destroyed by LRU */
+		part->utf_raw_content = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*part->utf_raw_content) + sizeof (gpointer) * 4);
+		part->utf_raw_content->data = rspamd_mempool_alloc (task->task_pool,
+				MAX (found->utf_raw_len, 1));
+		memcpy (part->utf_raw_content->data, found->utf_raw_content,
+				found->utf_raw_len);
+		part->utf_raw_content->len = found->utf_raw_len;
+		debug_task ("use cached conversion from %s for part of length %z",
+				part->real_charset ? part->real_charset : "unknown charset",
+				part->parsed.len);
+
+		return;
+	}
+
+	rspamd_mime_text_part_maybe_convert (task, part);
+
+	/* 7bit content is cheap to check, no need to save it */
+	if (part->utf_raw_content &&
+			(part->flags & RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED)) {
+		found = rspamd_text_part_cache_lookup (task, part, TRUE);
+
+		if (found && !found->converted) {
+			found->converted = TRUE;
+			found->flags = part->flags & RSPAMD_TEXT_PART_CACHE_FLAGS;
+			found->real_charset = g_strdup (part->real_charset);
+			found->utf_raw_content = g_malloc (MAX (part->utf_raw_content->len, 1));
+			memcpy (found->utf_raw_content, part->utf_raw_content->data,
+					part->utf_raw_content->len);
+			found->utf_raw_len = part->utf_raw_content->len;
+		}
+	}
+}
+
 static void
 rspamd_mime_part_detect_language (struct rspamd_task *task,
 		struct rspamd_mime_text_part *part)
 {
 	struct rspamd_lang_detector_res *lang;
+	struct rspamd_text_part_cache_entry *found;
+	guint i;
 
 	if (!IS_PART_EMPTY (part) && part->utf_words && part->utf_words->len > 0 &&
 			task->lang_det) {
+		found = rspamd_text_part_cache_lookup (task, part, FALSE);
+
+		if (found && found->lang_detected) {
+			part->unicode_scripts = found->unicode_scripts;
+			part->language = rspamd_mempool_strdup (task->task_pool,
+					found->language);
+
+			if (found->nlanguages > 0) {
+				part->languages = g_ptr_array_sized_new (found->nlanguages);
+
+				for (i = 0; i < found->nlanguages; i ++) {
+					lang = rspamd_mempool_alloc0 (task->task_pool,
+							sizeof (*lang));
+					lang->lang = rspamd_mempool_strdup (task->task_pool,
+							found->languages[i].lang);
+					lang->prob = found->languages[i].prob;
+					lang->elt = rspamd_language_detector_find (task->lang_det,
+							lang->lang);
+					g_ptr_array_add (part->languages, lang);
+				}
+
+				if (found->lang_counted) {
+					/* Keep languages frequencies as without cache */
+					lang = g_ptr_array_index (part->languages, 0);
+					rspamd_language_detector_count (task->lang_det, lang->elt);
+					part->flags |= RSPAMD_MIME_TEXT_PART_LANG_COUNTED;
+				}
+			}
+
+			debug_task ("use cached part language: %s", part->language);
+
+			return;
+		}
+
 		if (rspamd_language_detector_detect (task, task->lang_det, part)) {
 			lang = g_ptr_array_index (part->languages, 0);
 			part->language = lang->lang;
@@ -219,6 +431,26 @@ rspamd_mime_part_detect_language (struct rspamd_task *task,
 		else {
 			part->language = "en"; /* Safe fallback */
 		}
+
+		found = rspamd_text_part_cache_lookup (task, part, TRUE);
+
+		if (found && !found->lang_detected) {
+			found->lang_detected = TRUE;
+			found->lang_counted = !!(part->flags & RSPAMD_MIME_TEXT_PART_LANG_COUNTED);
+			found->unicode_scripts = part->unicode_scripts;
+			found->language = g_strdup (part->language);
+
+			if (part->languages && part->languages->len > 0) {
+				found->nlanguages = part->languages->len;
+				found->languages = g_malloc (sizeof (*found->languages) *
+						found->nlanguages);
+
+				PTR_ARRAY_FOREACH (part->languages, i, lang) {
+					found->languages[i].lang = g_strdup (lang->lang);
+					found->languages[i].prob = lang->prob;
+				}
+			}
+		}
 	}
 }
 
@@ -714,7 +946,7 @@ rspamd_message_process_plain_text_part (struct rspamd_task *task,
 		return TRUE;
 	}
 
-	rspamd_mime_text_part_maybe_convert (task, text_part);
+	rspamd_message_text_part_convert (task, text_part);
 
 	if (text_part->utf_raw_content != NULL) {
 		/* Just have the same content */
@@ -744,7 +976,7 @@ rspamd_message_process_html_text_part (struct rspamd_task *task,
 		return TRUE;
 	}
 
-	rspamd_mime_text_part_maybe_convert (task, text_part);
+	rspamd_message_text_part_convert (task, text_part);
 
 	if (text_part->utf_raw_content == NULL) {
 		return FALSE;
@@ -753,13 +985,29 @@ rspamd_message_process_html_text_part (struct rspamd_task *task,
 	text_part->html = rspamd_mempool_alloc0 (task->task_pool,
 			sizeof (*text_part->html));
 	text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BALANCED;
-	text_part->utf_content = rspamd_html_process_part_full (
-			task->task_pool,
-			text_part->html,
-			text_part->utf_raw_content,
-			&text_part->exceptions,
-			MESSAGE_FIELD (task, urls),
-			MESSAGE_FIELD (task, emails));
+
+	if (task->cfg && task->cfg->html_stream_size > 0 &&
+			text_part->utf_raw_content->len >= task->cfg->html_stream_size) {
+		/* Do not build tags tree for huge parts */
+		debug_task ("process html part of %ud bytes in streaming mode",
+				text_part->utf_raw_content->len);
+		text_part->utf_content = rspamd_html_process_part_stream (
+				task->task_pool,
+				text_part->html,
+				text_part->utf_raw_content,
+				&text_part->exceptions,
+				MESSAGE_FIELD (task, urls),
+				MESSAGE_FIELD (task, emails));
+	}
+	else {
+		text_part->utf_content = rspamd_html_process_part_full (
+				task->task_pool,
+				text_part->html,
+				text_part->utf_raw_content,
+				&text_part->exceptions,
+				MESSAGE_FIELD (task, urls),
+				MESSAGE_FIELD (task, emails));
+	}
 
 	if (text_part->utf_content->len == 0) {
 		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
@@ -15,6 +15,7 @@
 #include "libmime/content_type.h"
 #include "libutil/ref.h"
 #include "libutil/str_util.h"
+#include "libserver/url.h"
 
 #include <unicode/uchar.h>
 #include <unicode/utext.h>
@@ -33,6 +34,10 @@ enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_ATTACHEMENT = (1 << 1),
 	RSPAMD_MIME_PART_BAD_CTE = (1 << 4),
 	RSPAMD_MIME_PART_MISSING_CTE = (1 << 5),
+	/* Parsed data has been checked while decoding, see two flags below */
+	RSPAMD_MIME_PART_PARSED_CHECKED = (1 << 6),
+	RSPAMD_MIME_PART_PARSED_8BIT = (1 << 7),
+	RSPAMD_MIME_PART_PARSED_UTF8 = (1 << 8),
 };
 
 enum rspamd_mime_part_type {
@@ -118,6 +123,8 @@ struct rspamd_mime_part {
 #define RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED (1 << 5)
 #define RSPAMD_MIME_TEXT_PART_HAS_SUBNORMAL (1 << 6)
 #define RSPAMD_MIME_TEXT_PART_NORMALISED (1 << 7)
+/* Detected language is counted in the languages frequencies */
+#define RSPAMD_MIME_TEXT_PART_LANG_COUNTED (1 << 8)
 
 #define IS_PART_EMPTY(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_EMPTY)
 #define IS_PART_UTF(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_UTF)
@@ -177,6 +184,8 @@ struct rspamd_message {
 	struct rspamd_received_header *received;	/**< list of received headers						*/
 	GHashTable *urls;							/**< list of parsed urls							*/
 	GHashTable *emails;							/**< list of parsed emails							*/
+	GHashTable *url_candidates;					/**< parsed urls by text candidates					*/
+	struct rspamd_url_extract_stat url_stat;	/**< urls extraction statistics						*/
 	struct rspamd_mime_headers_table *raw_headers;	/**< list of raw headers						*/
 	struct rspamd_mime_header *headers_order;	/**< order of raw headers							*/
 	struct rspamd_task *task;
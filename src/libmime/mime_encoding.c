@@ -72,6 +72,12 @@ static const UChar iso_8859_16_map[] = {
 		0x0171, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x0119, 0x021B, 0x00FF
 };
 
+/*
+ * Internal converters are used for single byte charsets: 7bit characters are
+ * treated as ASCII and 8bit ones are converted using tables. Tables for
+ * ICU single byte converters (e.g. windows-1251 or KOI8-R) are filled once
+ * from ICU itself when a converter is inserted to the cache.
+ */
 struct rspamd_charset_converter {
 	gchar *canon_name;
 	union {
@@ -79,6 +85,10 @@ struct rspamd_charset_converter {
 		const UChar *cnv_table;
 	} d;
 	gboolean is_internal;
+	/* Storage for tables built from ICU converters */
+	UChar uc_table[128];
+	/* UTF8 for 0x80..0xff characters, the first byte is length */
+	guchar utf8_table[128][4];
 };
 
 static GQuark
@@ -134,6 +144,103 @@ rspamd_converter_to_uchars (struct rspamd_charset_converter *cnv,
 }
 
 
+static void
+rspamd_converter_init_utf8_table (struct rspamd_charset_converter *conv)
+{
+	guint i;
+	gint32 off;
+
+	for (i = 0; i < G_N_ELEMENTS (conv->utf8_table); i ++) {
+		off = 0;
+		U8_APPEND_UNSAFE (&conv->utf8_table[i][1], off, conv->d.cnv_table[i]);
+		conv->utf8_table[i][0] = off;
+	}
+}
+
+/*
+ * Converts single byte ICU converter to an internal one if all characters
+ * are representable by a single UTF16 unit and 7bit characters are ASCII
+ */
+static gboolean
+rspamd_converter_maybe_make_internal (struct rspamd_charset_converter *conv)
+{
+	UChar uc[2];
+	gchar c;
+	gint32 r;
+	guint i;
+	UErrorCode uc_err;
+
+	if (ucnv_getMaxCharSize (conv->d.conv) != 1) {
+		return FALSE;
+	}
+
+	for (i = 0; i < 256; i ++) {
+		c = (gchar)i;
+		uc_err = U_ZERO_ERROR;
+		r = ucnv_toUChars (conv->d.conv, uc, G_N_ELEMENTS (uc), &c, 1, &uc_err);
+
+		if (!U_SUCCESS (uc_err) || r != 1 || U16_IS_SURROGATE (uc[0])) {
+			return FALSE;
+		}
+
+		if (i < 128) {
+			if (uc[0] != i) {
+				/* Not ASCII compatible, e.g. EBCDIC */
+				return FALSE;
+			}
+		}
+		else {
+			conv->uc_table[i - 128] = uc[0];
+		}
+	}
+
+	ucnv_close (conv->d.conv);
+	conv->d.cnv_table = conv->uc_table;
+	conv->is_internal = TRUE;
+	rspamd_converter_init_utf8_table (conv);
+
+	return TRUE;
+}
+
+/*
+ * Converts input using an internal converter directly to UTF8, `dest` must
+ * have space for at least `srclen * 3` bytes
+ */
+static gsize
+rspamd_converter_internal_to_utf8 (struct rspamd_charset_converter *cnv,
+		gchar *dest, const gchar *src, gsize srclen)
+{
+	const guchar *p = (const guchar *)src, *end = p + srclen, *u;
+	guchar *d = (guchar *)dest;
+	gsize run;
+
+	while (p < end) {
+		run = rspamd_str_find_8bit (p, end - p);
+
+		if (run > 0) {
+			memcpy (d, p, run);
+			d += run;
+			p += run;
+		}
+
+		/*
+		 * 8bit characters are usually grouped in words. Each character
+		 * takes at most 3 bytes, so we can always copy 3 bytes and then
+		 * move forward by the real length.
+		 */
+		while (p < end && *p >= 0x80) {
+			u = cnv->utf8_table[*p - 128];
+			d[0] = u[1];
+			d[1] = u[2];
+			d[2] = u[3];
+			d += u[0];
+			p ++;
+		}
+	}
+
+	return d - (guchar *)dest;
+}
+
 struct rspamd_charset_converter *
 rspamd_mime_get_converter_cached (const gchar *enc,
 								  rspamd_mempool_t *pool,
@@ -185,6 +292,8 @@ rspamd_mime_get_converter_cached (const gchar *enc,
 						NULL,
 						NULL,
 						err);
+				/* Tables are filled after callback is set to keep substitutions */
+				rspamd_converter_maybe_make_internal (conv);
 				rspamd_lru_hash_insert (cache, conv->canon_name, conv, 0, 0);
 			}
 			else {
@@ -198,6 +307,7 @@ rspamd_mime_get_converter_cached (const gchar *enc,
 			conv->is_internal = TRUE;
 			conv->d.cnv_table = iso_8859_16_map;
 			conv->canon_name = g_strdup (canon_name);
+			rspamd_converter_init_utf8_table (conv);
 
 			rspamd_lru_hash_insert (cache, conv->canon_name, conv, 0, 0);
 		}
@@ -332,6 +442,17 @@ rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
+	if (conv->is_internal) {
+		d = rspamd_mempool_alloc (pool, len * 3 + 1);
+		r = rspamd_converter_internal_to_utf8 (conv, d, input, len);
+
+		if (olen) {
+			*olen = r;
+		}
+
+		return d;
+	}
+
 	tmp_buf = g_new (UChar, len + 1);
 	uc_err = U_ZERO_ERROR;
 	r = rspamd_converter_to_uchars (conv, tmp_buf, len + 1, input, len, &uc_err);
@@ -397,6 +518,21 @@ rspamd_mime_text_part_utf8_convert (struct rspamd_task *task,
 		return FALSE;
 	}
 
+	if (conv->is_internal) {
+		d = rspamd_mempool_alloc (task->task_pool, input->len * 3 + 1);
+		r = rspamd_converter_internal_to_utf8 (conv, d,
+				(const gchar *)input->data, input->len);
+		msg_info_task ("converted from %s to UTF-8 inlen: %d, outlen: %d "
+				"(single byte table)",
+				charset, input->len, r);
+		text_part->utf_raw_content = rspamd_mempool_alloc (task->task_pool,
+				sizeof (*text_part->utf_raw_content) + sizeof (gpointer) * 4);
+		text_part->utf_raw_content->data = d;
+		text_part->utf_raw_content->len = r;
+
+		return TRUE;
+	}
+
 	tmp_buf = g_new (UChar, input->len + 1);
 	uc_err = U_ZERO_ERROR;
 	uc_len = rspamd_converter_to_uchars (conv,
@@ -490,6 +626,14 @@ rspamd_mime_to_utf8_byte_array (GByteArray *in,
 		return FALSE;
 	}
 
+	if (conv->is_internal) {
+		g_byte_array_set_size (out, in->len * 3);
+		out->len = rspamd_converter_internal_to_utf8 (conv, (gchar *)out->data,
+				(const gchar *)in->data, in->len);
+
+		return TRUE;
+	}
+
 	tmp_buf = g_new (UChar, in->len + 1);
 	uc_err = U_ZERO_ERROR;
 	r = rspamd_converter_to_uchars (conv,
@@ -558,6 +702,49 @@ rspamd_mime_charset_utf_enforce (gchar *in, gsize len)
 	}
 }
 
+/*
+ * Selects up to RSPAMD_CHARSET_MAX_CONTENT bytes of input for charset detection:
+ * leading 7bit text tells nothing about charset, so the sample starts shortly
+ * before the first 8bit character and ends on a characters boundary
+ */
+static const gchar *
+rspamd_mime_charset_sample (const gchar *in, gsize inlen, gsize *olen)
+{
+	const guchar *p = (const guchar *)in, *start, *end;
+	gsize first_8bit;
+	const gsize ascii_context = 64;
+
+	if (inlen <= RSPAMD_CHARSET_MAX_CONTENT) {
+		*olen = inlen;
+
+		return in;
+	}
+
+	first_8bit = rspamd_str_find_8bit (p, inlen);
+
+	if (first_8bit == inlen) {
+		*olen = RSPAMD_CHARSET_MAX_CONTENT;
+
+		return in;
+	}
+
+	start = p + (first_8bit > ascii_context ? first_8bit - ascii_context : 0);
+	end = MIN (start + RSPAMD_CHARSET_MAX_CONTENT, p + inlen);
+
+	if (end < p + inlen) {
+		/* Do not cut multibyte sequences in the middle */
+		guint i;
+
+		for (i = 0; i < 3 && end > start + 1 && (*end & 0xC0) == 0x80; i ++) {
+			end --;
+		}
+	}
+
+	*olen = end - start;
+
+	return (const gchar *)start;
+}
+
 const char *
 rspamd_mime_charset_find_by_content (const gchar *in, gsize inlen)
 {
@@ -573,6 +760,8 @@ rspamd_mime_charset_find_by_content (const gchar *in, gsize inlen)
 		g_assert (csd != NULL);
 	}
 
+	in = rspamd_mime_charset_sample (in, inlen, &inlen);
+
 	if (rspamd_fast_utf8_validate (in, inlen) == 0) {
 		return UTF8_CHARSET;
 	}
@@ -619,8 +808,7 @@ rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
 		 */
 		if (content_check) {
 			if (rspamd_fast_utf8_validate (in, len) != 0) {
-				real_charset = rspamd_mime_charset_find_by_content (in,
-						MIN (RSPAMD_CHARSET_MAX_CONTENT, len));
+				real_charset = rspamd_mime_charset_find_by_content (in, len);
 
 				if (real_charset) {
 
@@ -654,26 +842,49 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 {
 	GError *err = NULL;
 	const gchar *charset = NULL;
-	gboolean checked = FALSE, need_charset_heuristic = TRUE, valid_utf8 = FALSE;
+	gboolean checked = FALSE, need_charset_heuristic = TRUE, valid_utf8 = FALSE,
+		has_8bit_raw, has_8bit_parsed, parsed_checked;
 	GByteArray *part_content;
 	rspamd_ftok_t charset_tok;
 	struct rspamd_mime_part *part = text_part->mime_part;
 
-	if (rspamd_str_has_8bit (text_part->raw.begin, text_part->raw.len)) {
+	has_8bit_raw = rspamd_str_has_8bit (text_part->raw.begin, text_part->raw.len);
+
+	if (has_8bit_raw) {
 		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_8BIT_RAW;
 	}
 
-	/* Allocate copy storage */
-	part_content = g_byte_array_sized_new (text_part->parsed.len);
-	memcpy (part_content->data, text_part->parsed.begin, text_part->parsed.len);
+	/* Decoded content could be checked by mime parser in the same pass */
+	parsed_checked = (part->flags & RSPAMD_MIME_PART_PARSED_CHECKED) &&
+			text_part->parsed.begin == part->parsed_data.begin &&
+			text_part->parsed.len == part->parsed_data.len;
+
+	if (parsed_checked) {
+		has_8bit_parsed = !!(part->flags & RSPAMD_MIME_PART_PARSED_8BIT);
+	}
+	else if ((part->cte == RSPAMD_CTE_7BIT || part->cte == RSPAMD_CTE_8BIT) &&
+			text_part->parsed.len == text_part->raw.len) {
+		/* Parsed content is the same as raw one, no need to check it twice */
+		has_8bit_parsed = has_8bit_raw;
+	}
+	else {
+		has_8bit_parsed = rspamd_str_has_8bit (text_part->parsed.begin,
+				text_part->parsed.len);
+	}
+
+	/*
+	 * Content is not modified unless we need to enforce utf8 (and we copy it
+	 * in that case), so we can refer to the parsed data directly
+	 */
+	part_content = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*part_content) + sizeof (gpointer) * 4);
+	part_content->data = (guint8 *)text_part->parsed.begin;
 	part_content->len = text_part->parsed.len;
-	rspamd_mempool_notify_alloc (task->task_pool,
-			part_content->len);
-	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t)g_byte_array_unref, part_content);
 
-	if (rspamd_str_has_8bit (text_part->parsed.begin, text_part->parsed.len)) {
-		if (rspamd_fast_utf8_validate (text_part->parsed.begin, text_part->parsed.len) == 0) {
+	if (has_8bit_parsed) {
+		if (parsed_checked ? (part->flags & RSPAMD_MIME_PART_PARSED_UTF8) :
+				rspamd_fast_utf8_validate (text_part->parsed.begin,
+						text_part->parsed.len) == 0) {
 			/* Valid UTF, likely all good */
 			need_charset_heuristic = FALSE;
 			valid_utf8 = TRUE;
@@ -692,7 +903,7 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 	if (part->ct->charset.len == 0) {
 		if (need_charset_heuristic) {
 			charset = rspamd_mime_charset_find_by_content (part_content->data,
-					MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
+					part_content->len);
 
 			if (charset != NULL) {
 				msg_info_task ("detected charset %s", charset);
@@ -717,7 +928,7 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 			/* We don't know the real charset but can try heuristic */
 			if (need_charset_heuristic) {
 				charset = rspamd_mime_charset_find_by_content (part_content->data,
-						MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
+						part_content->len);
 				msg_info_task ("detected charset: %s", charset);
 				checked = TRUE;
 				text_part->real_charset = charset;
@@ -752,6 +963,15 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 	RSPAMD_FTOK_FROM_STR (&charset_tok, charset);
 
 	if (!valid_utf8) {
+		if (!checked) {
+			/* Content check can replace invalid characters in place */
+			guint8 *copy = rspamd_mempool_alloc (task->task_pool,
+					MAX (part_content->len, 1));
+
+			memcpy (copy, part_content->data, part_content->len);
+			part_content->data = copy;
+		}
+
 		if (rspamd_mime_charset_utf_check (&charset_tok, part_content->data,
 				part_content->len, !checked)) {
 			SET_PART_UTF (text_part);
@@ -133,7 +133,8 @@ rspamd_converter_to_uchars (struct rspamd_charset_converter *cnv,
 							UErrorCode *pErrorCode);
 
 /**
- * Detect charset in text
+ * Detect charset in text, only a sample of at most 512 bytes is examined,
+ * so it is safe to pass large inputs
  * @param in
  * @param inlen
  * @return detected charset name or NULL
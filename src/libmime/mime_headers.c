@@ -895,382 +895,6 @@ rspamd_mime_message_id_generate (const gchar *fqdn)
 	return g_string_free (out, FALSE);
 }
 
-enum rspamd_received_part_type {
-	RSPAMD_RECEIVED_PART_FROM,
-	RSPAMD_RECEIVED_PART_BY,
-	RSPAMD_RECEIVED_PART_FOR,
-	RSPAMD_RECEIVED_PART_WITH,
-	RSPAMD_RECEIVED_PART_UNKNOWN,
-};
-
-struct rspamd_received_comment {
-	gchar *data;
-	gsize dlen;
-	struct rspamd_received_comment *prev;
-};
-
-struct rspamd_received_part {
-	enum rspamd_received_part_type type;
-	gchar *data;
-	gsize dlen;
-	struct rspamd_received_comment *tail_comment;
-	struct rspamd_received_comment *head_comment;
-	struct rspamd_received_part *prev, *next;
-};
-
-static void
-rspamd_smtp_received_part_set_or_append (struct rspamd_task *task,
-										 const gchar *begin,
-										 gsize len,
-										 gchar **dest,
-										 gsize *destlen)
-{
-	if (len == 0) {
-		return;
-	}
-
-	if (*dest) {
-		/* Append */
-		gsize total_len = *destlen + len;
-		gchar *new_dest;
-
-		new_dest = rspamd_mempool_alloc (task->task_pool, total_len);
-		memcpy (new_dest, *dest, *destlen);
-		memcpy (new_dest + *destlen, begin, len);
-		rspamd_str_lc (new_dest + *destlen, len);
-		*dest = new_dest;
-		*destlen = total_len;
-	}
-	else {
-		/* Set */
-		*dest = rspamd_mempool_alloc (task->task_pool, len);
-		memcpy (*dest, begin, len);
-		rspamd_str_lc (*dest, len);
-		*dest = (gchar *)rspamd_string_len_strip (*dest, &len, " \t");
-		*destlen = len;
-	}
-}
-
-static struct rspamd_received_part *
-rspamd_smtp_received_process_part (struct rspamd_task *task,
-								   const char *data,
-								   size_t len,
-								   enum rspamd_received_part_type type,
-								   goffset *last)
-{
-	struct rspamd_received_part *npart;
-	const guchar *p, *c, *end;
-	guint obraces = 0, ebraces = 0;
-	gboolean seen_tcpinfo = FALSE;
-	enum _parse_state {
-		skip_spaces,
-		in_comment,
-		read_data,
-		read_tcpinfo,
-		all_done
-	} state, next_state;
-
-	npart = rspamd_mempool_alloc0 (task->task_pool, sizeof (*npart));
-	npart->type = type;
-
-	/* In this function, we just process comments and data separately */
-	p = data;
-	end = data + len;
-	c = data;
-	state = skip_spaces;
-	next_state = read_data;
-
-	while (p < end) {
-		switch (state) {
-		case skip_spaces:
-			if (!g_ascii_isspace (*p)) {
-				c = p;
-				state = next_state;
-			}
-			else {
-				p ++;
-			}
-			break;
-		case in_comment:
-			if (*p == '(') {
-				obraces ++;
-			}
-			else if (*p == ')') {
-				ebraces ++;
-
-				if (ebraces >= obraces) {
-					if (type != RSPAMD_RECEIVED_PART_UNKNOWN) {
-						if (p > c) {
-							struct rspamd_received_comment *comment;
-
-
-							comment = rspamd_mempool_alloc0 (task->task_pool,
-									sizeof (*comment));
-							rspamd_smtp_received_part_set_or_append (task,
-									c, p - c,
-									&comment->data, &comment->dlen);
-
-							if (!npart->head_comment) {
-								comment->prev = NULL;
-								npart->head_comment = comment;
-								npart->tail_comment = comment;
-							}
-							else {
-								comment->prev = npart->tail_comment;
-								npart->tail_comment = comment;
-							}
-						}
-					}
-
-					p ++;
-					c = p;
-					state = skip_spaces;
-					next_state = read_data;
-
-					continue;
-				}
-			}
-
-			p ++;
-			break;
-		case read_data:
-			if (*p == '(') {
-				if (p > c) {
-					if (type != RSPAMD_RECEIVED_PART_UNKNOWN) {
-						rspamd_smtp_received_part_set_or_append (task,
-								c, p - c,
-								&npart->data, &npart->dlen);
-					}
-				}
-
-				state = in_comment;
-				obraces = 1;
-				ebraces = 0;
-				p ++;
-				c = p;
-			}
-			else if (g_ascii_isspace (*p)) {
-				if (p > c) {
-					if (type != RSPAMD_RECEIVED_PART_UNKNOWN) {
-						rspamd_smtp_received_part_set_or_append (task,
-								c, p - c,
-								&npart->data, &npart->dlen);
-					}
-				}
-
-				state = skip_spaces;
-				next_state = read_data;
-				c = p;
-			}
-			else if (*p == ';') {
-				/* It is actually delimiter of date part if not in the comments */
-				if (p > c) {
-					if (type != RSPAMD_RECEIVED_PART_UNKNOWN) {
-						rspamd_smtp_received_part_set_or_append (task,
-								c, p - c,
-								&npart->data, &npart->dlen);
-					}
-				}
-
-				state = all_done;
-				continue;
-			}
-			else if (npart->dlen > 0) {
-				/* We have already received data and find something with no ( */
-				if (!seen_tcpinfo && type == RSPAMD_RECEIVED_PART_FROM) {
-					/* Check if we have something special here, such as TCPinfo */
-					if (*c == '[') {
-						state = read_tcpinfo;
-						p ++;
-					}
-					else {
-						state = all_done;
-						continue;
-					}
-				}
-				else {
-					state = all_done;
-					continue;
-				}
-			}
-			else {
-				p ++;
-			}
-			break;
-		case read_tcpinfo:
-			if (*p == ']') {
-				rspamd_smtp_received_part_set_or_append (task,
-						c, p - c + 1,
-						&npart->data, &npart->dlen);
-				seen_tcpinfo = TRUE;
-				state = skip_spaces;
-				next_state = read_data;
-				c = p;
-			}
-			p ++;
-			break;
-		case all_done:
-			if (p > (const guchar *)data) {
-				*last = p - (const guchar *) data;
-				return npart;
-			}
-			else {
-				/* Empty element */
-				return NULL;
-			}
-			break;
-		}
-	}
-
-	/* Leftover */
-	switch (state) {
-	case read_data:
-		if (p > c) {
-			if (type != RSPAMD_RECEIVED_PART_UNKNOWN) {
-				rspamd_smtp_received_part_set_or_append (task,
-						c, p - c,
-						&npart->data, &npart->dlen);
-			}
-
-			*last = p - (const guchar *)data;
-
-			return npart;
-		}
-		break;
-	case skip_spaces:
-		if (p > (const guchar *)data) {
-			*last = p - (const guchar *) data;
-
-			return npart;
-		}
-	default:
-		break;
-	}
-
-	return NULL;
-}
-
-static struct rspamd_received_part *
-rspamd_smtp_received_spill (struct rspamd_task *task,
-							const char *data,
-							size_t len,
-							goffset *date_pos)
-{
-	const guchar *p, *end;
-	struct rspamd_received_part *cur_part, *head = NULL;
-	goffset pos = 0;
-
-	p = data;
-	end = data + len;
-
-	while (p < end && g_ascii_isspace (*p)) {
-		p ++;
-	}
-
-	len = end - p;
-
-	/* Ignore all received but those started from from part */
-	if (len <= 4 || (lc_map[p[0]] != 'f' &&
-					 lc_map[p[1]] != 'r' &&
-					 lc_map[p[2]] != 'o' &&
-					 lc_map[p[3]] != 'm')) {
-		return NULL;
-	}
-
-	p += sizeof ("from") - 1;
-
-	/* We can now store from part */
-	cur_part = rspamd_smtp_received_process_part (task, p, end - p,
-			RSPAMD_RECEIVED_PART_FROM, &pos);
-
-	if (!cur_part) {
-		return NULL;
-	}
-
-	g_assert (pos != 0);
-	p += pos;
-	len = end > p ? end - p : 0;
-	DL_APPEND (head, cur_part);
-
-	if (len > 2 && (lc_map[p[0]] == 'b' &&
-					lc_map[p[1]] == 'y')) {
-		p += sizeof ("by") - 1;
-
-		cur_part = rspamd_smtp_received_process_part (task, p, end - p,
-				RSPAMD_RECEIVED_PART_BY, &pos);
-
-		if (!cur_part) {
-			return NULL;
-		}
-
-		g_assert (pos != 0);
-		p += pos;
-		len = end > p ? end - p : 0;
-		DL_APPEND (head, cur_part);
-	}
-
-	while (p < end) {
-		if (*p == ';') {
-			/* We are at the date separator, stop here */
-			*date_pos = p - (const guchar *)data + 1;
-			break;
-		}
-		else {
-			if (len > sizeof ("with") && (lc_map[p[0]] == 'w' &&
-										  lc_map[p[1]] == 'i' &&
-										  lc_map[p[2]] == 't' &&
-										  lc_map[p[3]] == 'h')) {
-				p += sizeof ("with") - 1;
-
-				cur_part = rspamd_smtp_received_process_part (task, p, end - p,
-						RSPAMD_RECEIVED_PART_WITH, &pos);
-			}
-			else if (len > sizeof ("for") && (lc_map[p[0]] == 'f' &&
-											  lc_map[p[1]] == 'o' &&
-											  lc_map[p[2]] == 'r')) {
-				p += sizeof ("for") - 1;
-				cur_part = rspamd_smtp_received_process_part (task, p, end - p,
-						RSPAMD_RECEIVED_PART_FOR, &pos);
-			}
-			else {
-				while (p < end) {
-					if (!(g_ascii_isspace (*p) || *p == '(' || *p == ';')) {
-						p ++;
-					}
-					else {
-						break;
-					}
-				}
-
-				if (p == end) {
-					return NULL;
-				}
-				else if (*p == ';') {
-					*date_pos = p - (const guchar *)data + 1;
-					break;
-				}
-				else {
-					cur_part = rspamd_smtp_received_process_part (task, p, end - p,
-							RSPAMD_RECEIVED_PART_UNKNOWN, &pos);
-				}
-			}
-
-			if (!cur_part) {
-				p ++;
-				len = end > p ? end - p : 0;
-			}
-			else {
-				g_assert (pos != 0);
-				p += pos;
-				len = end > p ? end - p : 0;
-				DL_APPEND (head, cur_part);
-			}
-		}
-	}
-
-	return head;
-}
-
 static gboolean
 rspamd_smtp_received_process_rdns (struct rspamd_task *task,
 								   const gchar *begin,
@@ -1299,28 +923,17 @@ rspamd_smtp_received_process_rdns (struct rspamd_task *task,
 		p ++;
 	}
 
-	if (hlen > 0) {
-		if (p == end) {
-			/* All data looks like a hostname */
-			gchar *dest;
+	/* All data looks like a hostname or hostname is followed by tcpinfo */
+	if (hlen > 0 && (p == end ||
+			(seen_dot && (g_ascii_isspace (*p) || *p == '[' || *p == '(')))) {
+		gchar *dest;
 
-			dest = rspamd_mempool_alloc (task->task_pool,
-					hlen + 1);
-			rspamd_strlcpy (dest, begin, hlen + 1);
-			*pdest = dest;
+		dest = rspamd_mempool_alloc (task->task_pool, hlen + 1);
+		rspamd_strlcpy (dest, begin, hlen + 1);
+		rspamd_str_lc (dest, hlen);
+		*pdest = dest;
 
-			return TRUE;
-		}
-		else if (seen_dot && (g_ascii_isspace (*p) || *p == '[' || *p == '(')) {
-			gchar *dest;
-
-			dest = rspamd_mempool_alloc (task->task_pool,
-					hlen + 1);
-			rspamd_strlcpy (dest, begin, hlen + 1);
-			*pdest = dest;
-
-			return TRUE;
-		}
+		return TRUE;
 	}
 
 	return FALSE;
@@ -1415,10 +1028,11 @@ rspamd_smtp_received_process_host_tcpinfo (struct rspamd_task *task,
 
 static void
 rspamd_smtp_received_process_from (struct rspamd_task *task,
-								   struct rspamd_received_part *rpart,
+								   const rspamd_ftok_t *data,
+								   const rspamd_ftok_t *comment,
 								   struct rspamd_received_header *rh)
 {
-	if (rpart->dlen > 0) {
+	if (data->len > 0) {
 		/* We have seen multiple cases:
 		 * - [ip] (hostname/unknown [real_ip])
 		 * - helo (hostname/unknown [real_ip])
@@ -1429,22 +1043,22 @@ rspamd_smtp_received_process_from (struct rspamd_task *task,
 		 */
 		gboolean seen_ip_in_data = FALSE;
 
-		if (rpart->head_comment && rpart->head_comment->dlen > 0) {
+		if (comment->len > 0) {
 			/* We can have info within comment as part of RFC */
 			rspamd_smtp_received_process_host_tcpinfo (
 					task, rh,
-					rpart->head_comment->data, rpart->head_comment->dlen);
+					comment->begin, comment->len);
 		}
 
 		if (!rh->real_ip) {
-			if (rpart->data[0] == '[') {
+			if (data->begin[0] == '[') {
 				/* No comment, just something that looks like SMTP IP */
-				const gchar *brace_pos = memchr (rpart->data, ']', rpart->dlen);
+				const gchar *brace_pos = memchr (data->begin, ']', data->len);
 				rspamd_inet_addr_t *addr;
 
 				if (brace_pos) {
-					addr = rspamd_parse_inet_address_pool (rpart->data + 1,
-							brace_pos - rpart->data - 1,
+					addr = rspamd_parse_inet_address_pool (data->begin + 1,
+							brace_pos - data->begin - 1,
 							task->task_pool,
 							RSPAMD_INET_ADDRESS_PARSE_RECEIVED);
 
@@ -1456,11 +1070,11 @@ rspamd_smtp_received_process_from (struct rspamd_task *task,
 						rh->from_ip = rh->real_ip;
 					}
 				}
-			} else if (g_ascii_isxdigit (rpart->data[0])) {
+			} else if (g_ascii_isxdigit (data->begin[0])) {
 				/* Try to parse IP address */
 				rspamd_inet_addr_t *addr;
-				addr = rspamd_parse_inet_address_pool (rpart->data,
-						rpart->dlen, task->task_pool,
+				addr = rspamd_parse_inet_address_pool (data->begin,
+						data->len, task->task_pool,
 						RSPAMD_INET_ADDRESS_PARSE_RECEIVED);
 				if (addr) {
 					seen_ip_in_data = TRUE;
@@ -1476,143 +1090,168 @@ rspamd_smtp_received_process_from (struct rspamd_task *task,
 			if (rh->real_ip) {
 				/* Get anounced hostname (usually helo) */
 				rspamd_smtp_received_process_rdns (task,
-						rpart->data,
-						rpart->dlen,
+						data->begin,
+						data->len,
 						&rh->from_hostname);
 			}
 			else {
 				rspamd_smtp_received_process_host_tcpinfo (task,
-						rh, rpart->data, rpart->dlen);
+						rh, data->begin, data->len);
 			}
 		}
 	}
 	else {
-		/* rpart->dlen = 0 */
+		/* data->len = 0 */
 
-		if (rpart->head_comment && rpart->head_comment->dlen > 0) {
+		if (comment->len > 0) {
 			rspamd_smtp_received_process_host_tcpinfo (task,
 					rh,
-					rpart->head_comment->data,
-					rpart->head_comment->dlen);
+					comment->begin,
+					comment->len);
 		}
 	}
 }
 
-int
-rspamd_smtp_received_parse (struct rspamd_task *task,
-							const char *data,
-							size_t len,
-							struct rspamd_received_header *rh)
+static gint
+rspamd_smtp_received_process_with (const rspamd_ftok_t *data)
 {
-	goffset date_pos = -1;
-	struct rspamd_received_part *head, *cur;
 	rspamd_ftok_t t1, t2;
+	gchar lc[16];
 
-	head = rspamd_smtp_received_spill (task, data, len, &date_pos);
+	/* All known protocols are short, so we can compare them in lowercase */
+	if (data->len == 0 || data->len >= sizeof (lc)) {
+		return RSPAMD_RECEIVED_UNKNOWN;
+	}
 
-	if (head == NULL) {
-		return -1;
+	memcpy (lc, data->begin, data->len);
+	rspamd_str_lc (lc, data->len);
+	t1.begin = lc;
+	t1.len = data->len;
+
+	RSPAMD_FTOK_ASSIGN (&t2, "smtp");
+
+	if (rspamd_ftok_cmp (&t1, &t2) == 0) {
+		return RSPAMD_RECEIVED_SMTP;
 	}
 
-	rh->flags = RSPAMD_RECEIVED_UNKNOWN;
+	RSPAMD_FTOK_ASSIGN (&t2, "esmtp");
 
-	DL_FOREACH (head, cur) {
-		switch (cur->type) {
-		case RSPAMD_RECEIVED_PART_FROM:
-			rspamd_smtp_received_process_from (task, cur, rh);
-			break;
-		case RSPAMD_RECEIVED_PART_BY:
-			rspamd_smtp_received_process_rdns (task,
-					cur->data,
-					cur->dlen,
-					&rh->by_hostname);
-			break;
-		case RSPAMD_RECEIVED_PART_WITH:
-			t1.begin = cur->data;
-			t1.len = cur->dlen;
+	if (rspamd_ftok_starts_with (&t1, &t2)) {
+		/*
+		 * esmtp, esmtps, esmtpsa
+		 */
+		if (t1.len == t2.len + 1) {
+			if (t1.begin[t2.len] == 'a') {
+				return RSPAMD_RECEIVED_ESMTPA|RSPAMD_RECEIVED_FLAG_AUTHENTICATED;
+			}
+			else if (t1.begin[t2.len] == 's') {
+				return RSPAMD_RECEIVED_ESMTPS|RSPAMD_RECEIVED_FLAG_SSL;
+			}
+		}
+		else if (t1.len == t2.len + 2) {
+			if (t1.begin[t2.len] == 's' &&
+					t1.begin[t2.len + 1] == 'a') {
+				return RSPAMD_RECEIVED_ESMTPSA|
+						RSPAMD_RECEIVED_FLAG_AUTHENTICATED|
+						RSPAMD_RECEIVED_FLAG_SSL;
+			}
+		}
+		else if (t1.len == t2.len) {
+			return RSPAMD_RECEIVED_ESMTP;
+		}
 
-			if (t1.len > 0) {
-				RSPAMD_FTOK_ASSIGN (&t2, "smtp");
+		return RSPAMD_RECEIVED_UNKNOWN;
+	}
 
-				if (rspamd_ftok_cmp (&t1, &t2) == 0) {
-					rh->flags = RSPAMD_RECEIVED_SMTP;
-				}
+	RSPAMD_FTOK_ASSIGN (&t2, "lmtp");
 
-				RSPAMD_FTOK_ASSIGN (&t2, "esmtp");
+	if (rspamd_ftok_cmp (&t1, &t2) == 0) {
+		return RSPAMD_RECEIVED_LMTP;
+	}
 
-				if (rspamd_ftok_starts_with (&t1, &t2)) {
-					/*
-					 * esmtp, esmtps, esmtpsa
-					 */
-					if (t1.len == t2.len + 1) {
-						if (t1.begin[t2.len] == 'a') {
-							rh->flags = RSPAMD_RECEIVED_ESMTPA;
-							rh->flags |= RSPAMD_RECEIVED_FLAG_AUTHENTICATED;
-						}
-						else if (t1.begin[t2.len] == 's') {
-							rh->flags = RSPAMD_RECEIVED_ESMTPS;
-							rh->flags |= RSPAMD_RECEIVED_FLAG_SSL;
-						}
-						continue;
-					}
-					else if (t1.len == t2.len + 2) {
-						if (t1.begin[t2.len] == 's' &&
-								t1.begin[t2.len + 1] == 'a') {
-							rh->flags = RSPAMD_RECEIVED_ESMTPSA;
-							rh->flags |= RSPAMD_RECEIVED_FLAG_AUTHENTICATED;
-							rh->flags |= RSPAMD_RECEIVED_FLAG_SSL;
-						}
-						continue;
-					}
-					else if (t1.len == t2.len) {
-						rh->flags = RSPAMD_RECEIVED_ESMTP;
-						continue;
-					}
-				}
+	RSPAMD_FTOK_ASSIGN (&t2, "imap");
 
-				RSPAMD_FTOK_ASSIGN (&t2, "lmtp");
+	if (rspamd_ftok_cmp (&t1, &t2) == 0) {
+		return RSPAMD_RECEIVED_IMAP;
+	}
 
-				if (rspamd_ftok_cmp (&t1, &t2) == 0) {
-					rh->flags = RSPAMD_RECEIVED_LMTP;
-					continue;
-				}
+	RSPAMD_FTOK_ASSIGN (&t2, "local");
 
-				RSPAMD_FTOK_ASSIGN (&t2, "imap");
+	if (rspamd_ftok_cmp (&t1, &t2) == 0) {
+		return RSPAMD_RECEIVED_LOCAL;
+	}
 
-				if (rspamd_ftok_cmp (&t1, &t2) == 0) {
-					rh->flags = RSPAMD_RECEIVED_IMAP;
-					continue;
-				}
+	RSPAMD_FTOK_ASSIGN (&t2, "http");
 
-				RSPAMD_FTOK_ASSIGN (&t2, "local");
+	if (rspamd_ftok_starts_with (&t1, &t2)) {
+		if (t1.len == t2.len + 1) {
+			if (t1.begin[t2.len] == 's') {
+				return RSPAMD_RECEIVED_HTTP|RSPAMD_RECEIVED_FLAG_SSL;
+			}
+		}
+		else if (t1.len == t2.len) {
+			return RSPAMD_RECEIVED_HTTP;
+		}
+	}
 
-				if (rspamd_ftok_cmp (&t1, &t2) == 0) {
-					rh->flags = RSPAMD_RECEIVED_LOCAL;
-					continue;
-				}
+	return RSPAMD_RECEIVED_UNKNOWN;
+}
 
-				RSPAMD_FTOK_ASSIGN (&t2, "http");
+static void
+rspamd_smtp_received_process_for (struct rspamd_task *task,
+								  const rspamd_ftok_t *data,
+								  struct rspamd_received_header *rh)
+{
+	const gchar *p = data->begin;
+	gsize len = data->len;
+	gchar *dest;
 
-				if (rspamd_ftok_starts_with (&t1, &t2)) {
-					if (t1.len == t2.len + 1) {
-						if (t1.begin[t2.len] == 's') {
-							rh->flags = RSPAMD_RECEIVED_HTTP;
-							rh->flags |= RSPAMD_RECEIVED_FLAG_SSL;
-						}
-					}
-					else if (t1.len == t2.len) {
-						rh->flags = RSPAMD_RECEIVED_HTTP;
-					}
+	/* <user@domain> or just user@domain */
+	if (len > 0 && *p == '<') {
+		p ++;
+		len --;
+	}
 
-					continue;
-				}
-			}
+	if (len > 0 && p[len - 1] == '>') {
+		len --;
+	}
 
-			break;
-		default:
-			/* Do nothing */
-			break;
-		}
+	if (len > 0) {
+		dest = rspamd_mempool_alloc (task->task_pool, len + 1);
+		rspamd_strlcpy (dest, p, len + 1);
+		rh->for_mbox = dest;
+	}
+}
+
+int
+rspamd_smtp_received_parse (struct rspamd_task *task,
+							const char *data,
+							size_t len,
+							struct rspamd_received_header *rh)
+{
+	struct rspamd_received_spans spans;
+
+	if (!rspamd_smtp_received_scan (data, len, &spans)) {
+		return -1;
+	}
+
+	rh->flags = RSPAMD_RECEIVED_UNKNOWN;
+	rspamd_smtp_received_process_from (task, &spans.from,
+			&spans.from_comment, rh);
+
+	if (spans.by.len > 0) {
+		rspamd_smtp_received_process_rdns (task,
+				spans.by.begin,
+				spans.by.len,
+				&rh->by_hostname);
+	}
+
+	if (spans.with.len > 0) {
+		rh->flags = rspamd_smtp_received_process_with (&spans.with);
+	}
+
+	if (spans.for_mbox.len > 0) {
+		rspamd_smtp_received_process_for (task, &spans.for_mbox, rh);
 	}
 
 	if (rh->real_ip && !rh->from_ip) {
@@ -1623,9 +1262,9 @@ rspamd_smtp_received_parse (struct rspamd_task *task,
 		rh->from_hostname = rh->real_hostname;
 	}
 
-	if (date_pos > 0 && date_pos < len) {
-		rh->timestamp = rspamd_parse_smtp_date (data + date_pos,
-				len - date_pos);
+	if (spans.date_pos > 0 && spans.date_pos < len) {
+		rh->timestamp = rspamd_parse_smtp_date (data + spans.date_pos,
+				len - spans.date_pos);
 	}
 
 	return 0;
@@ -20,12 +20,11 @@
 #include "mime_parser.h"
 #include "mime_headers.h"
 #include "message.h"
-#include "multipattern.h"
 #include "contrib/libottery/ottery.h"
+#include "contrib/fastutf8/fastutf8.h"
 #include "contrib/uthash/utlist.h"
 
 struct rspamd_mime_parser_lib_ctx {
-	struct rspamd_multipattern *mp_boundary;
 	guchar hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
 	guint key_usages;
 };
@@ -56,6 +55,7 @@ struct rspamd_mime_boundary {
 struct rspamd_mime_parser_ctx {
 	GPtrArray *stack; /* Stack of parts */
 	GArray *boundaries; /* Boundaries found in the whole message */
+	GPtrArray *decode_jobs; /* Parts to be decoded after parsing (shared with nested contexts) */
 	const gchar *start;
 	const gchar *pos;
 	const gchar *end;
@@ -63,6 +63,15 @@ struct rspamd_mime_parser_ctx {
 	guint nesting;
 };
 
+struct rspamd_mime_decode_job {
+	struct rspamd_mime_part *part;
+	rspamd_fstring_t *parsed;
+	enum rspamd_cte orig_cte;
+	gboolean failed;
+};
+
+static const gsize min_parallel_part_size = 32 * 1024;
+
 static enum rspamd_mime_parse_error
 rspamd_mime_parse_multipart_part (struct rspamd_task *task,
 		struct rspamd_mime_part *part,
@@ -151,11 +160,6 @@ static void
 rspamd_mime_parser_init_lib (void)
 {
 	lib_ctx = g_malloc0 (sizeof (*lib_ctx));
-	lib_ctx->mp_boundary = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_DEFAULT);
-	g_assert (lib_ctx->mp_boundary != NULL);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\r--", 0);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\n--", 0);
-	g_assert (rspamd_multipattern_compile (lib_ctx->mp_boundary, NULL));
 	ottery_rand_bytes (lib_ctx->hkey, sizeof (lib_ctx->hkey));
 }
 
@@ -500,6 +504,166 @@ rspamd_mime_parser_calc_digest (struct rspamd_mime_part *part)
 	}
 }
 
+/*
+ * Decodes transfer encoding of a part, can be called from any thread as it
+ * does not touch neither task nor its memory pool
+ */
+static void
+rspamd_mime_decode_part_data (struct rspamd_mime_decode_job *job)
+{
+	struct rspamd_mime_part *part = job->part;
+	rspamd_fstring_t *parsed = NULL;
+	gboolean is_text, has_8bit = FALSE, valid_utf8 = FALSE, checked = FALSE;
+	gssize r;
+
+	job->orig_cte = part->cte;
+	/* Text parts are checked for 8bit and utf8 while decoded data is in cache */
+	is_text = part->ct && (part->ct->flags & RSPAMD_CONTENT_TYPE_TEXT);
+
+	switch (part->cte) {
+	case RSPAMD_CTE_QP:
+		parsed = rspamd_fstring_sized_new (part->raw_data.len);
+
+		if (is_text) {
+			r = rspamd_decode_qp_buf_check (part->raw_data.begin,
+					part->raw_data.len,
+					parsed->str, parsed->allocated, &has_8bit, &valid_utf8);
+			checked = (r != -1);
+		}
+		else {
+			r = rspamd_decode_qp_buf (part->raw_data.begin, part->raw_data.len,
+					parsed->str, parsed->allocated);
+		}
+
+		if (r != -1) {
+			parsed->len = r;
+		}
+		else {
+			job->failed = TRUE;
+			memcpy (parsed->str, part->raw_data.begin, part->raw_data.len);
+			parsed->len = part->raw_data.len;
+		}
+		break;
+	case RSPAMD_CTE_B64:
+		parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
+		rspamd_cryptobox_base64_decode (part->raw_data.begin,
+				part->raw_data.len,
+				parsed->str, &parsed->len);
+		break;
+	case RSPAMD_CTE_UUE:
+		parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
+		r = rspamd_decode_uue_buf (part->raw_data.begin, part->raw_data.len,
+				parsed->str, parsed->allocated);
+		if (r != -1) {
+			parsed->len = r;
+		}
+		else {
+			job->failed = TRUE;
+			parsed->len = MIN (part->raw_data.len, parsed->allocated);
+			memcpy (parsed->str, part->raw_data.begin, parsed->len);
+		}
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	if (job->failed) {
+		part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
+		part->cte = RSPAMD_CTE_8BIT;
+	}
+	else if (is_text && !checked) {
+		has_8bit = rspamd_str_has_8bit ((const guchar *)parsed->str,
+				parsed->len);
+		valid_utf8 = !has_8bit || rspamd_fast_utf8_validate (
+				(const guchar *)parsed->str, parsed->len) == 0;
+		checked = TRUE;
+	}
+
+	if (checked) {
+		part->flags |= RSPAMD_MIME_PART_PARSED_CHECKED;
+
+		if (has_8bit) {
+			part->flags |= RSPAMD_MIME_PART_PARSED_8BIT;
+		}
+		if (valid_utf8) {
+			part->flags |= RSPAMD_MIME_PART_PARSED_UTF8;
+		}
+	}
+
+	job->parsed = parsed;
+	part->parsed_data.begin = parsed->str;
+	part->parsed_data.len = parsed->len;
+	rspamd_mime_parser_calc_digest (part);
+}
+
+/*
+ * Passes decoded data ownership to the task, must be called from the main thread
+ */
+static void
+rspamd_mime_decode_job_finish (struct rspamd_task *task,
+		struct rspamd_mime_decode_job *job)
+{
+	struct rspamd_mime_part *part = job->part;
+
+	if (job->failed) {
+		if (job->orig_cte == RSPAMD_CTE_QP) {
+			msg_err_task ("invalid quoted-printable encoded part, assume 8bit");
+		}
+		else {
+			msg_err_task ("invalid uuencoding in encoded part, assume 8bit");
+		}
+	}
+
+	rspamd_mempool_notify_alloc (task->task_pool, job->parsed->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_fstring_free, job->parsed);
+	msg_debug_mime ("parsed data part %T/%T of length %z (%z orig), %s cte",
+			&part->ct->type, &part->ct->subtype, part->parsed_data.len,
+			part->raw_data.len, rspamd_cte_to_string (job->orig_cte));
+}
+
+static void
+rspamd_mime_decode_thread_func (gpointer data, gpointer ud)
+{
+	rspamd_mime_decode_part_data ((struct rspamd_mime_decode_job *)data);
+}
+
+/*
+ * Decodes deferred parts using threads pool, the current thread takes the
+ * first part itself and waits for the rest
+ */
+static void
+rspamd_mime_decode_deferred_parts (struct rspamd_task *task,
+		GPtrArray *jobs)
+{
+	struct rspamd_mime_decode_job *job;
+	GError *err = NULL;
+	guint i, nthreads = 0;
+
+	if (jobs->len == 0) {
+		return;
+	}
+
+	if (task->cfg) {
+		nthreads = task->cfg->parts_decode_threads;
+	}
+
+	if (rspamd_threads_pool_run (jobs, rspamd_mime_decode_thread_func, NULL,
+			nthreads, &err)) {
+		msg_debug_mime ("decoded %ud parts using %ud threads", jobs->len,
+				nthreads);
+	}
+	else if (err) {
+		msg_err_task ("cannot create threads pool for parts decoding: %e",
+				err);
+		g_error_free (err);
+	}
+
+	PTR_ARRAY_FOREACH (jobs, i, job) {
+		rspamd_mime_decode_job_finish (task, job);
+	}
+}
+
 static enum rspamd_mime_parse_error
 rspamd_mime_parse_normal_part (struct rspamd_task *task,
 		struct rspamd_mime_part *part,
@@ -507,7 +671,7 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 		GError **err)
 {
 	rspamd_fstring_t *parsed;
-	gssize r;
+	struct rspamd_mime_decode_job *job;
 
 	g_assert (part != NULL);
 
@@ -549,64 +713,24 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 		}
 		break;
 	case RSPAMD_CTE_QP:
-		parsed = rspamd_fstring_sized_new (part->raw_data.len);
-		r = rspamd_decode_qp_buf (part->raw_data.begin, part->raw_data.len,
-				parsed->str, parsed->allocated);
-		if (r != -1) {
-			parsed->len = r;
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-			rspamd_mempool_notify_alloc (task->task_pool, parsed->len);
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
-		}
-		else {
-			msg_err_task ("invalid quoted-printable encoded part, assume 8bit");
-			part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
-			part->cte = RSPAMD_CTE_8BIT;
-			memcpy (parsed->str, part->raw_data.begin, part->raw_data.len);
-			parsed->len = part->raw_data.len;
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-			rspamd_mempool_notify_alloc (task->task_pool, parsed->len);
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
-		}
-		break;
 	case RSPAMD_CTE_B64:
-		parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
-		rspamd_cryptobox_base64_decode (part->raw_data.begin,
-				part->raw_data.len,
-				parsed->str, &parsed->len);
-		part->parsed_data.begin = parsed->str;
-		part->parsed_data.len = parsed->len;
-		rspamd_mempool_notify_alloc (task->task_pool, parsed->len);
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
-		break;
 	case RSPAMD_CTE_UUE:
-		parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
-		r = rspamd_decode_uue_buf (part->raw_data.begin, part->raw_data.len,
-				parsed->str, parsed->allocated);
-		rspamd_mempool_notify_alloc (task->task_pool, parsed->len);
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
-		if (r != -1) {
-			parsed->len = r;
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
+		job = rspamd_mempool_alloc0 (task->task_pool, sizeof (*job));
+		job->part = part;
+		part->part_number = MESSAGE_FIELD (task, parts)->len;
+		g_ptr_array_add (MESSAGE_FIELD (task, parts), part);
+
+		if (st->decode_jobs && part->raw_data.len >= min_parallel_part_size &&
+				!(part->ct->flags & RSPAMD_CONTENT_TYPE_MESSAGE)) {
+			/* Decode it later with other parts, message parts are parsed now */
+			g_ptr_array_add (st->decode_jobs, job);
 		}
 		else {
-			msg_err_task ("invalid uuencoding in encoded part, assume 8bit");
-			part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
-			part->cte = RSPAMD_CTE_8BIT;
-			parsed->len = MIN (part->raw_data.len, parsed->allocated);
-			memcpy (parsed->str, part->raw_data.begin, parsed->len);
-			rspamd_mempool_notify_alloc (task->task_pool, parsed->len);
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
+			rspamd_mime_decode_part_data (job);
+			rspamd_mime_decode_job_finish (task, job);
 		}
-		break;
+
+		return RSPAMD_MIME_PARSE_OK;
 	default:
 		g_assert_not_reached ();
 	}
@@ -979,22 +1103,21 @@ rspamd_mime_parse_multipart_part (struct rspamd_task *task,
 	return ret;
 }
 
-/* Process boundary like structures in a message */
-static gint
-rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
+/*
+ * Process boundary like structures in a message, match_pos is the offset
+ * just after `--` that starts a line
+ */
+static void
+rspamd_mime_preprocess_boundary (struct rspamd_mime_parser_ctx *st,
 		const gchar *text,
 		gsize len,
-		void *context)
+		gsize match_pos)
 {
 	const gchar *end = text + len, *p = text + match_pos, *bend;
 	gchar *lc_copy;
 	gsize blen;
 	gboolean closing = FALSE;
 	struct rspamd_mime_boundary b;
-	struct rspamd_mime_parser_ctx *st = context;
 	struct rspamd_task *task;
 
 	task = st->task;
@@ -1090,8 +1213,30 @@ rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
 			g_array_append_val (st->boundaries, b);
 		}
 	}
+}
+
+/*
+ * Finds all `--` sequences that follow `\r` or `\n` in a single pass,
+ * `text[0]` is used merely as a preceding character
+ */
+static void
+rspamd_mime_preprocess_boundaries (struct rspamd_mime_parser_ctx *st,
+		const gchar *text,
+		gsize len)
+{
+	gsize pos = 0, off;
 
-	return 0;
+	while (pos + 3 <= len) {
+		off = rspamd_str_find_line_dashes (text + pos, len - pos);
+
+		if (off == len - pos) {
+			break;
+		}
+
+		rspamd_mime_preprocess_boundary (st, text, len, pos + off);
+		/* Next match might start right after this `--` */
+		pos += off - 1;
+	}
 }
 
 static goffset
@@ -1167,16 +1312,14 @@ rspamd_mime_preprocess_message (struct rspamd_task *task,
 {
 
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
+		rspamd_mime_preprocess_boundaries (st,
 				top->raw_data.begin - 1,
-				top->raw_data.len + 1,
-				rspamd_mime_preprocess_cb, st, NULL);
+				top->raw_data.len + 1);
 	}
 	else {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
+		rspamd_mime_preprocess_boundaries (st,
 				st->pos,
-				st->end - st->pos,
-				rspamd_mime_preprocess_cb, st, NULL);
+				st->end - st->pos);
 	}
 }
 
@@ -1330,6 +1473,7 @@ rspamd_mime_parse_message (struct rspamd_task *task,
 		nst->stack = g_ptr_array_sized_new (4);
 		nst->boundaries = g_array_sized_new (FALSE, FALSE,
 				sizeof (struct rspamd_mime_boundary), 8);
+		nst->decode_jobs = st->decode_jobs;
 		nst->start = part->parsed_data.begin;
 		nst->end = nst->start + part->parsed_data.len;
 		nst->pos = nst->start;
@@ -1543,7 +1687,19 @@ rspamd_mime_parse_task (struct rspamd_task *task, GError **err)
 	}
 
 	st->start = task->msg.begin;
+
+	if (task->cfg && task->cfg->parts_decode_threads > 0) {
+		st->decode_jobs = g_ptr_array_new ();
+	}
+
 	ret = rspamd_mime_parse_message (task, NULL, st, err);
+
+	if (st->decode_jobs) {
+		/* Parts are registered in the task, so decode them even on errors */
+		rspamd_mime_decode_deferred_parts (task, st->decode_jobs);
+		g_ptr_array_free (st->decode_jobs, TRUE);
+	}
+
 	rspamd_mime_parse_stack_free (st);
 
 	return ret;
@@ -21,12 +21,37 @@
 #include "content_type.h"
 #include "task.h"
 #include "message.h"
+#include "fstring.h"
 
 
 #ifdef  __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Parts of a Received header found by `rspamd_smtp_received_scan`, all tokens
+ * point to the original header data
+ */
+struct rspamd_received_spans {
+	rspamd_ftok_t from; /* helo or `rdns [ip]` */
+	rspamd_ftok_t from_comment; /* the first comment after `from` */
+	rspamd_ftok_t by;
+	rspamd_ftok_t with;
+	rspamd_ftok_t for_mbox;
+	goffset date_pos; /* offset after `;` or -1 */
+};
+
+/**
+ * Tokenize Received header in a single pass with no allocations
+ * @param data header value
+ * @param len length of data
+ * @param spans output tokens
+ * @return FALSE if header does not start with `from` or if it has no date
+ * and ends with an unknown part name, e.g. `from x by y id`
+ */
+gboolean rspamd_smtp_received_scan (const char *data, size_t len,
+									struct rspamd_received_spans *spans);
+
 int rspamd_smtp_received_parse (struct rspamd_task *task,
 								const char *data, size_t len,
 								struct rspamd_received_header *rh);
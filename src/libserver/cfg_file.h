@@ -32,6 +32,8 @@
 
 #define DEFAULT_BIND_PORT 11333
 #define DEFAULT_CONTROL_PORT 11334
+/* Default limit of a message size, also used when the limit is disabled */
+#define DEFAULT_MAX_MESSAGE (50 * 1024 * 1024)
 
 /* Default metric name */
 #define DEFAULT_METRIC "default"
@@ -230,6 +232,9 @@ struct rspamd_worker_conf {
 	ucl_object_t *options;                          /**< other worker's options								*/
 	struct rspamd_worker_lua_script *scripts;       /**< registered lua scripts								*/
 	gboolean enabled;
+	gboolean reuseport;                             /**< bind a separate listen socket for each worker		*/
+	gboolean cpu_affinity;                          /**< pin each worker to its own CPU						*/
+	GPtrArray *reuseport_socks;                     /**< listen sockets lists indexed by worker's index		*/
 	ref_entry_t ref;
 };
 
@@ -381,6 +386,9 @@ struct rspamd_config {
 	gsize max_message;                              /**< maximum size for messages							*/
 	gsize max_pic_size;                             /**< maximum size for a picture to process				*/
 	gsize images_cache_size;                        /**< size of LRU cache for DCT data from images			*/
+	gsize text_parts_cache_size;                    /**< size of LRU cache for text parts processing results	*/
+	gsize html_stream_size;                         /**< minimum size of html part to be processed in streaming mode */
+	guint parts_decode_threads;                     /**< number of threads to decode large mime parts (0 to disable) */
 	gdouble task_timeout;                           /**< maximum message processing time					*/
 	gint default_max_shots;                         /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 	gint32 heartbeats_loss_max;                     /**< number of heartbeats lost to consider worker's termination */
@@ -470,6 +478,7 @@ struct rspamd_config {
 	guint full_gc_iters;                            /**< iterations between full gc cycle					*/
 	guint max_lua_urls;                             /**< maximum number of urls to be passed to Lua			*/
 	guint max_urls;                                 /**< maximum number of urls to be processed in general	*/
+	guint max_url_queries;                          /**< maximum number of urls queries to search for urls	*/
 	guint max_blas_threads;                         /**< maximum threads for openblas when learning ANN		*/
 	guint max_opts_len;                             /**< maximum length for all options for a symbol		*/
 
@@ -609,6 +618,11 @@ struct rspamd_classifier_config *rspamd_config_new_classifier (
 struct rspamd_worker_conf *rspamd_config_new_worker (struct rspamd_config *cfg,
 													 struct rspamd_worker_conf *c);
 
+/*
+ * Close and free per worker listen sockets created for `reuseport` option
+ */
+void rspamd_worker_conf_close_reuseport (struct rspamd_worker_conf *wcf);
+
 /*
  * Return a new metric structure, setting default and non-conflicting attributes
  */
@@ -829,16 +843,22 @@ struct rspamd_external_libs_ctx;
 struct rspamd_external_libs_ctx *rspamd_init_libs (void);
 
 /**
- * Reset and initialize decompressor
+ * Reset and return decompressor
  * @param ctx
+ * @param use_dict use decompressor with the input dictionary loaded
+ * @return ZSTD_DStream or NULL
  */
-gboolean rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx);
+void *rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx,
+		gboolean use_dict);
 
 /**
- * Reset and initialize compressor
+ * Reset and return compressor
  * @param ctx
+ * @param use_dict use compressor with the output dictionary loaded
+ * @return ZSTD_CStream or NULL
  */
-gboolean rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx);
+void *rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx,
+		gboolean use_dict);
 
 /**
  * Destroy external libraries context
@@ -2143,6 +2143,28 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_pic_size),
 				RSPAMD_CL_FLAG_INT_SIZE,
 				"Size of DCT data cache for images (256 elements by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"text_parts_cache",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, text_parts_cache_size),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Size of cache for charset conversion and language detection "
+				"results of text parts (256 elements by default, 0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"html_stream_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, html_stream_size),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Process HTML parts larger than this size in a single pass without "
+				"tags tree and styles (0 to disable, default; 1 to use it for all parts)");
+		rspamd_rcl_add_default_handler (sub,
+				"parts_decode_threads",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, parts_decode_threads),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of threads used to decode large encoded parts of a message "
+				"and to compress large requests in proxy concurrently "
+				"(0 to disable, default)");
 		rspamd_rcl_add_default_handler (sub,
 				"zstd_input_dictionary",
 				rspamd_rcl_parse_struct_string,
@@ -2240,6 +2262,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_urls),
 				RSPAMD_CL_FLAG_INT_32,
 				"Maximum count of URLs to process to avoid DoS (default: 10240)");
+		rspamd_rcl_add_default_handler (sub,
+				"max_url_queries",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, max_url_queries),
+				RSPAMD_CL_FLAG_INT_32,
+				"Maximum count of URLs which queries are searched for other URLs (default: 1024)");
 		rspamd_rcl_add_default_handler (sub,
 				"max_blas_threads",
 				rspamd_rcl_parse_struct_integer,
@@ -2440,6 +2468,19 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_worker_conf, enabled),
 				0,
 				"Enable or disable a worker (true by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"reuseport",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport),
+				0,
+				"Bind a separate SO_REUSEPORT socket for each worker process "
+				"(false by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"cpu_affinity",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity),
+				0,
+				"Pin each worker process to a separate CPU (false by default)");
 	}
 
 	if (!(skip_sections && g_hash_table_lookup (skip_sections, "modules"))) {
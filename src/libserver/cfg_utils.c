@@ -64,7 +64,6 @@
 #define DEFAULT_MIN_WORD 0
 #define DEFAULT_MAX_WORD 40
 #define DEFAULT_WORDS_DECAY 600
-#define DEFAULT_MAX_MESSAGE (50 * 1024 * 1024)
 #define DEFAULT_MAX_PIC (1 * 1024 * 1024)
 #define DEFAULT_MAX_SHOTS 100
 #define DEFAULT_MAX_SESSIONS 100
@@ -221,6 +220,7 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->cache_reload_time = 30.0;
 	cfg->max_lua_urls = 1024;
 	cfg->max_urls = cfg->max_lua_urls * 10;
+	cfg->max_url_queries = cfg->max_lua_urls;
 	cfg->max_blas_threads = 1;
 	cfg->max_opts_len = 4096;
 
@@ -261,6 +261,7 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
 	cfg->images_cache_size = 256;
+	cfg->text_parts_cache_size = 256;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init ();
 	cfg->neighbours = ucl_object_typed_new (UCL_OBJECT);
 #ifdef WITH_HIREDIS
@@ -1103,6 +1104,38 @@ rspamd_config_new_group (struct rspamd_config *cfg, const gchar *name)
 	return gr;
 }
 
+void
+rspamd_worker_conf_close_reuseport (struct rspamd_worker_conf *wcf)
+{
+	struct rspamd_worker_listen_socket *ls;
+	GList *cur;
+	guint i;
+
+	if (wcf->reuseport_socks == NULL) {
+		return;
+	}
+
+	for (i = 0; i < wcf->reuseport_socks->len; i ++) {
+		cur = g_ptr_array_index (wcf->reuseport_socks, i);
+
+		for (GList *l = cur; l != NULL; l = g_list_next (l)) {
+			ls = l->data;
+
+			if (ls->fd != -1) {
+				close (ls->fd);
+			}
+
+			rspamd_inet_address_free ((rspamd_inet_addr_t *)ls->addr);
+			g_free (ls);
+		}
+
+		g_list_free (cur);
+	}
+
+	g_ptr_array_free (wcf->reuseport_socks, TRUE);
+	wcf->reuseport_socks = NULL;
+}
+
 static void
 rspamd_worker_conf_dtor (struct rspamd_worker_conf *wcf)
 {
@@ -1116,6 +1149,7 @@ rspamd_worker_conf_dtor (struct rspamd_worker_conf *wcf)
 			g_free (cnf);
 		}
 
+		rspamd_worker_conf_close_reuseport (wcf);
 		ucl_object_unref (wcf->options);
 		g_queue_free (wcf->active_workers);
 		g_hash_table_unref (wcf->params);
@@ -2786,6 +2820,11 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 			ctx->in_zstream = NULL;
 		}
 
+		if (ctx->in_dict_zstream) {
+			ZSTD_freeDStream (ctx->in_dict_zstream);
+			ctx->in_dict_zstream = NULL;
+		}
+
 		if (cfg->zstd_input_dictionary) {
 			ctx->in_dict = rspamd_open_zstd_dictionary (
 					cfg->zstd_input_dictionary);
@@ -2836,7 +2875,10 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 		rspamd_ssl_ctx_config (cfg, ctx->ssl_ctx);
 		rspamd_ssl_ctx_config (cfg, ctx->ssl_ctx_noverify);
 
-		/* Init decompression */
+		/*
+		 * Init decompression: clients may send data compressed with or
+		 * without the dictionary, so there are separate streams
+		 */
 		ctx->in_zstream = ZSTD_createDStream ();
 		r = ZSTD_initDStream (ctx->in_zstream);
 
@@ -2847,7 +2889,24 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 			ctx->in_zstream = NULL;
 		}
 
-		/* Init compression */
+		if (ctx->in_dict) {
+			ctx->in_dict_zstream = ZSTD_createDStream ();
+			/* Dictionary is kept by the stream over resets */
+			r = ZSTD_initDStream_usingDict (ctx->in_dict_zstream,
+					ctx->in_dict->dict, ctx->in_dict->size);
+
+			if (ZSTD_isError (r)) {
+				msg_err ("cannot init decompression stream: %s",
+						ZSTD_getErrorName (r));
+				ZSTD_freeDStream (ctx->in_dict_zstream);
+				ctx->in_dict_zstream = NULL;
+			}
+		}
+
+		/*
+		 * Init compression: replies are compressed with the dictionary
+		 * only for clients that have used it for their requests
+		 */
 		ctx->out_zstream = ZSTD_createCStream ();
 		r = ZSTD_initCStream (ctx->out_zstream, 1);
 
@@ -2857,6 +2916,19 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 			ZSTD_freeCStream (ctx->out_zstream);
 			ctx->out_zstream = NULL;
 		}
+
+		if (ctx->out_dict) {
+			ctx->out_dict_zstream = ZSTD_createCStream ();
+			r = ZSTD_initCStream_usingDict (ctx->out_dict_zstream,
+					ctx->out_dict->dict, ctx->out_dict->size, 1);
+
+			if (ZSTD_isError (r)) {
+				msg_err ("cannot init compression stream: %s",
+						ZSTD_getErrorName (r));
+				ZSTD_freeCStream (ctx->out_dict_zstream);
+				ctx->out_dict_zstream = NULL;
+			}
+		}
 #ifdef HAVE_CBLAS
 		openblas_set_num_threads (cfg->max_blas_threads);
 #endif
@@ -2865,53 +2937,61 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 	return ret;
 }
 
-gboolean
-rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
+void *
+rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx,
+		gboolean use_dict)
 {
 	gsize r;
+	void **pstream;
 
-	if (ctx->in_zstream == NULL) {
-		return FALSE;
+	pstream = use_dict ? &ctx->in_dict_zstream : &ctx->in_zstream;
+
+	if (*pstream == NULL) {
+		return NULL;
 	}
 	else {
-		r = ZSTD_resetDStream (ctx->in_zstream);
+		r = ZSTD_resetDStream (*pstream);
 
 		if (ZSTD_isError (r)) {
 			msg_err ("cannot init decompression stream: %s",
 					ZSTD_getErrorName (r));
-			ZSTD_freeDStream (ctx->in_zstream);
-			ctx->in_zstream = NULL;
+			ZSTD_freeDStream (*pstream);
+			*pstream = NULL;
 
-			return FALSE;
+			return NULL;
 		}
 	}
 
-	return TRUE;
+	return *pstream;
 }
 
-gboolean
-rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
+void *
+rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx,
+		gboolean use_dict)
 {
 	gsize r;
+	void **pstream;
 
-	if (ctx->out_zstream == NULL) {
-		return FALSE;
+	pstream = use_dict ? &ctx->out_dict_zstream : &ctx->out_zstream;
+
+	if (*pstream == NULL) {
+		return NULL;
 	}
 	else {
 		/* Dictionary will be reused automatically if specified */
-		r = ZSTD_resetCStream (ctx->out_zstream, 0);
+		r = ZSTD_resetCStream (*pstream, 0);
 
 		if (ZSTD_isError (r)) {
 			msg_err ("cannot init compression stream: %s",
 					ZSTD_getErrorName (r));
-			ZSTD_freeCStream (ctx->out_zstream);
-			ctx->out_zstream = NULL;
+			ZSTD_freeCStream (*pstream);
+			*pstream = NULL;
 
-			return FALSE;
+			return NULL;
 		}
 	}
 
-	return TRUE;
+	return *pstream;
 }
 
 void
@@ -2934,10 +3014,18 @@ rspamd_deinit_libs (struct rspamd_external_libs_ctx *ctx)
 			ZSTD_freeCStream (ctx->out_zstream);
 		}
 
+		if (ctx->out_dict_zstream) {
+			ZSTD_freeCStream (ctx->out_dict_zstream);
+		}
+
 		if (ctx->in_zstream) {
 			ZSTD_freeDStream (ctx->in_zstream);
 		}
 
+		if (ctx->in_dict_zstream) {
+			ZSTD_freeDStream (ctx->in_dict_zstream);
+		}
+
 		rspamd_cryptobox_deinit (ctx->crypto_ctx);
 
 		g_free (ctx);
@@ -34,6 +34,7 @@
 static sig_atomic_t tags_sorted = 0;
 static sig_atomic_t entities_sorted = 0;
 static const guint max_tags = 8192; /* Ignore tags if this maximum is reached */
+static const guint max_stream_depth = 1024; /* Do not track deeper nesting in streaming mode */
 
 struct html_tag_def {
 	const gchar *name;
@@ -882,6 +883,110 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	return TRUE;
 }
 
+struct html_stream_level {
+	gint id;
+	gint flags;
+};
+
+/*
+ * The same as rspamd_html_process_tag but keeps merely a stack of the
+ * currently opened block tags instead of the tags tree
+ */
+static gboolean
+rspamd_html_process_tag_stream (struct html_content *hc,
+		struct html_tag *tag, GArray *levels, gboolean *balanced)
+{
+	struct html_stream_level *parent = NULL, lev;
+	gint i;
+
+	if (hc->total_tags > max_tags) {
+		hc->flags |= RSPAMD_HTML_FLAG_TOO_MANY_TAGS;
+	}
+
+	if (tag->id == -1) {
+		/* Ignore unknown tags */
+		hc->total_tags ++;
+		return FALSE;
+	}
+
+	if (levels->len > 0) {
+		parent = &g_array_index (levels, struct html_stream_level,
+				levels->len - 1);
+	}
+
+	if (!(tag->flags & CM_INLINE)) {
+		/* Block tag, counted as in the full mode */
+		if (hc->total_tags < max_tags) {
+			hc->total_tags ++;
+		}
+
+		if (tag->flags & FL_CLOSING) {
+			/* Find the corresponding opening tag and close everything above */
+			for (i = (gint)levels->len - 1; i >= 0; i --) {
+				if (g_array_index (levels, struct html_stream_level, i).id ==
+						tag->id) {
+					break;
+				}
+			}
+
+			if (i >= 0) {
+				g_array_set_size (levels, i);
+				*balanced = TRUE;
+			}
+			else {
+				msg_debug_html (
+						"mark part as unbalanced as it has not pairable closing tags");
+				hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
+				*balanced = FALSE;
+			}
+		}
+		else if (!(tag->flags & FL_CLOSED)) {
+			if (parent) {
+				if ((parent->flags & FL_IGNORE)) {
+					tag->flags |= FL_IGNORE;
+				}
+
+				if (!(parent->flags & FL_BLOCK) && parent->id == tag->id) {
+					/* Something like <a>bla<a>foo..., replace the parent */
+					hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
+					*balanced = FALSE;
+					parent->flags = tag->flags;
+
+					return TRUE;
+				}
+			}
+
+			if (tag->flags & (CM_HEAD|CM_UNKNOWN)) {
+				tag->flags |= FL_IGNORE;
+			}
+
+			if (levels->len < max_stream_depth) {
+				lev.id = tag->id;
+				lev.flags = tag->flags;
+				g_array_append_val (levels, lev);
+
+				if (levels->len > hc->max_depth) {
+					hc->max_depth = levels->len;
+				}
+			}
+
+			if (tag->flags & FL_IGNORE) {
+				return FALSE;
+			}
+		}
+	}
+	else {
+		/* Inline tag */
+		if (parent && (parent->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE))) {
+			tag->flags |= FL_IGNORE;
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 #define NEW_COMPONENT(comp_type) do {							\
 	comp = rspamd_mempool_alloc (pool, sizeof (*comp));			\
 	comp->type = (comp_type);									\
@@ -2593,9 +2698,10 @@ rspamd_html_propagate_style (struct html_content *hc,
 	}
 }
 
-GByteArray*
-rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
-		GByteArray *in, GList **exceptions, GHashTable *urls,  GHashTable *emails)
+static GByteArray*
+rspamd_html_process_part_common (rspamd_mempool_t *pool, struct html_content *hc,
+		GByteArray *in, GList **exceptions, GHashTable *urls,  GHashTable *emails,
+		gboolean streaming)
 {
 	const guchar *p, *c, *end, *savep = NULL;
 	guchar t;
@@ -2608,7 +2714,9 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	gint substate = 0, len, href_offset = -1;
 	struct html_tag *cur_tag = NULL, *content_tag = NULL;
 	struct rspamd_url *url = NULL, *turl;
-	GQueue *styles_blocks;
+	GQueue *styles_blocks = NULL, *stream_params = NULL;
+	GArray *stream_levels = NULL;
+	struct html_tag stream_tag;
 
 	enum {
 		parse_start = 0,
@@ -2633,6 +2741,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 
 	rspamd_html_library_init ();
 	hc->tags_seen = rspamd_mempool_alloc0 (pool, NBYTES (G_N_ELEMENTS (tag_defs)));
+	hc->tags_count = rspamd_mempool_alloc0 (pool, sizeof (guint) * N_TAGS);
 
 	/* Set white background color by default */
 	hc->bgcolor.d.comp.alpha = 0;
@@ -2642,7 +2751,17 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	hc->bgcolor.valid = TRUE;
 
 	dest = g_byte_array_sized_new (in->len / 3 * 2);
-	styles_blocks = g_queue_new ();
+
+	if (streaming) {
+		/* All tags share the same storage as we do not keep them */
+		hc->flags |= RSPAMD_HTML_FLAG_STREAMING;
+		stream_params = g_queue_new ();
+		stream_levels = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct html_stream_level), 32);
+	}
+	else {
+		styles_blocks = g_queue_new ();
+	}
 
 	p = in->data;
 	c = p;
@@ -2691,10 +2810,20 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				state = tag_content;
 				substate = 0;
 				savep = NULL;
-				cur_tag = rspamd_mempool_alloc0 (pool, sizeof (*cur_tag));
-				cur_tag->params = g_queue_new ();
-				rspamd_mempool_add_destructor (pool,
-						(rspamd_mempool_destruct_t)g_queue_free, cur_tag->params);
+
+				if (streaming) {
+					cur_tag = &stream_tag;
+					memset (cur_tag, 0, sizeof (*cur_tag));
+					g_queue_clear (stream_params);
+					cur_tag->params = stream_params;
+				}
+				else {
+					cur_tag = rspamd_mempool_alloc0 (pool, sizeof (*cur_tag));
+					cur_tag->params = g_queue_new ();
+					rspamd_mempool_add_destructor (pool,
+							(rspamd_mempool_destruct_t)g_queue_free,
+							cur_tag->params);
+				}
 				break;
 			}
 
@@ -2982,8 +3111,11 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 			if (cur_tag != NULL) {
 				balanced = TRUE;
 
-				if (rspamd_html_process_tag (pool, hc, cur_tag, &cur_level,
-						&balanced)) {
+				if (streaming ?
+						rspamd_html_process_tag_stream (hc, cur_tag,
+								stream_levels, &balanced) :
+						rspamd_html_process_tag (pool, hc, cur_tag, &cur_level,
+								&balanced)) {
 					state = content_write;
 					need_decode = FALSE;
 				}
@@ -2999,9 +3131,14 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 						}
 					}
 					setbit (hc->tags_seen, cur_tag->id);
+
+					if (!(cur_tag->flags & FL_CLOSING)) {
+						hc->tags_count[cur_tag->id] ++;
+					}
 				}
 
-				if (!(cur_tag->flags & (FL_CLOSED|FL_CLOSING))) {
+				/* Content is not tracked for the shared streaming tag */
+				if (!streaming && !(cur_tag->flags & (FL_CLOSED|FL_CLOSING))) {
 					content_tag = cur_tag;
 				}
 
@@ -3053,6 +3190,10 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				}
 
 				if (cur_tag->flags & FL_HREF) {
+					/* Url of an unclosed <a>, if this tag is nested in it */
+					struct rspamd_url *prev_url = url;
+					gint prev_href_offset = href_offset;
+
 					if (!(cur_tag->flags & (FL_CLOSING))) {
 						url = rspamd_html_process_url_tag (pool, cur_tag, hc);
 
@@ -3088,21 +3229,29 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 					}
 
 					if (cur_tag->id == Tag_A) {
-						if (!balanced && cur_level && cur_level->prev) {
+						if (!balanced && streaming) {
+							/* No tags tree, use the state of the previous <a> */
+							if (prev_url && !(cur_tag->flags & FL_CLOSING) &&
+									(gint)dest->len > prev_href_offset) {
+								rspamd_html_check_displayed_url (pool,
+										exceptions, urls, emails,
+										dest, target_tbl, prev_href_offset,
+										prev_url);
+							}
+						}
+						else if (!balanced && cur_level && cur_level->prev) {
 							struct html_tag *prev_tag;
-							struct rspamd_url *prev_url;
 
 							prev_tag = cur_level->prev->data;
 
 							if (prev_tag->id == Tag_A &&
 									!(prev_tag->flags & (FL_CLOSING)) &&
 									prev_tag->extra) {
-								prev_url = prev_tag->extra;
-
+								/* Displayed part ends where this tag starts */
 								rspamd_html_check_displayed_url (pool,
 										exceptions, urls, emails,
-										dest, target_tbl, href_offset,
-										prev_url);
+										dest, target_tbl, prev_href_offset,
+										prev_tag->extra);
 							}
 						}
 
@@ -3142,8 +3291,15 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 
 				if (cur_tag->id == Tag_IMG && !(cur_tag->flags & FL_CLOSING)) {
 					rspamd_html_process_img_tag (pool, cur_tag, hc, urls);
+
+					if (streaming) {
+						struct html_image *img = cur_tag->extra;
+
+						/* Tag storage is reused */
+						img->tag = NULL;
+					}
 				}
-				else if (cur_tag->flags & FL_BLOCK) {
+				else if (!streaming && (cur_tag->flags & FL_BLOCK)) {
 					struct html_block *bl;
 
 					if (cur_tag->flags & FL_CLOSING) {
@@ -3193,14 +3349,39 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	if (hc->html_tags) {
 		g_node_traverse (hc->html_tags, G_POST_ORDER, G_TRAVERSE_ALL, -1,
 				rspamd_html_propagate_lengths, NULL);
+		/* Root node has no tag */
+		hc->max_depth = g_node_max_height (hc->html_tags) - 1;
+	}
+
+	if (streaming) {
+		g_queue_free (stream_params);
+		g_array_free (stream_levels, TRUE);
+	}
+	else {
+		g_queue_free (styles_blocks);
 	}
 
-	g_queue_free (styles_blocks);
 	hc->parsed = dest;
 
 	return dest;
 }
 
+GByteArray*
+rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
+		GByteArray *in, GList **exceptions, GHashTable *urls,  GHashTable *emails)
+{
+	return rspamd_html_process_part_common (pool, hc, in, exceptions,
+			urls, emails, FALSE);
+}
+
+GByteArray*
+rspamd_html_process_part_stream (rspamd_mempool_t *pool, struct html_content *hc,
+		GByteArray *in, GList **exceptions, GHashTable *urls,  GHashTable *emails)
+{
+	return rspamd_html_process_part_common (pool, hc, in, exceptions,
+			urls, emails, TRUE);
+}
+
 GByteArray*
 rspamd_html_process_part (rspamd_mempool_t *pool,
 		struct html_content *hc,
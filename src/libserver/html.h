@@ -23,6 +23,7 @@ extern "C" {
 #define RSPAMD_HTML_FLAG_DUPLICATE_ELEMENTS (1 << 5)
 #define RSPAMD_HTML_FLAG_TOO_MANY_TAGS (1 << 6)
 #define RSPAMD_HTML_FLAG_HAS_DATA_URLS (1 << 7)
+#define RSPAMD_HTML_FLAG_STREAMING (1 << 8)
 
 /*
  * Image flags
@@ -125,6 +126,8 @@ struct html_content {
 	guint total_tags;
 	struct html_color bgcolor;
 	guchar *tags_seen;
+	guint *tags_count; /**< number of opening tags per tag id */
+	guint max_depth;
 	GPtrArray *images;
 	GPtrArray *blocks;
 	GByteArray *parsed;
@@ -143,6 +146,23 @@ GByteArray *rspamd_html_process_part_full (rspamd_mempool_t *pool,
 										   struct html_content *hc,
 										   GByteArray *in, GList **exceptions, GHashTable *urls, GHashTable *emails);
 
+/**
+ * Process HTML part in a single pass without building tags tree and styles
+ * blocks: only text, urls, images and tags statistics are extracted.
+ * Memory used besides the output is bounded by the tags nesting depth.
+ * `html_tags` and `blocks` are not filled, images have no tags associated
+ * @param pool
+ * @param hc
+ * @param in
+ * @param exceptions
+ * @param urls
+ * @param emails
+ * @return parsed text
+ */
+GByteArray *rspamd_html_process_part_stream (rspamd_mempool_t *pool,
+											 struct html_content *hc,
+											 GByteArray *in, GList **exceptions, GHashTable *urls, GHashTable *emails);
+
 /*
  * Returns true if a specified tag has been seen in a part
  */
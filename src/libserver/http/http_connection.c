@@ -53,6 +53,8 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_PROXY = 1u << 5u,
 	RSPAMD_HTTP_CONN_FLAG_PROXY_REQUEST = 1u << 6u,
 	RSPAMD_HTTP_CONN_OWN_SOCKET = 1u << 7u,
+	RSPAMD_HTTP_CONN_FLAG_KEEPALIVE = 1u << 8u,
+	RSPAMD_HTTP_CONN_FLAG_DATA_READ = 1u << 9u,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -76,6 +78,8 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Data read after the end of a keep-alive request (pipelined requests) */
+	rspamd_fstring_t *pending;
 };
 
 static const rspamd_ftok_t key_header = {
@@ -351,6 +355,16 @@ rspamd_http_on_headers_complete (http_parser * parser)
 		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_NEW_HEADER;
 	}
 
+	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if ((conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE) &&
+				http_should_keep_alive (parser)) {
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_KEEPALIVE;
+		}
+		else {
+			priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEPALIVE;
+		}
+	}
+
 	if (msg->method == HTTP_HEAD) {
 		/* We don't care about the rest */
 		rspamd_ev_watcher_stop (priv->ctx->event_loop, &priv->ev);
@@ -705,6 +719,14 @@ rspamd_http_on_message_complete (http_parser * parser)
 			conn->finished = TRUE;
 		}
 
+		if (conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE) {
+			/*
+			 * Stop parsing here: the rest of data belongs to the next
+			 * (pipelined) request and is saved until it is read
+			 */
+			http_parser_pause (parser, 1);
+		}
+
 		rspamd_http_connection_unref (conn);
 	}
 
@@ -894,7 +916,15 @@ rspamd_http_try_read (gint fd,
 		}
 	}
 
-	if (priv->ssl) {
+	if (priv->pending && priv->pending->len > 0) {
+		/* Pipelined data that has been read with the previous request */
+		r = MIN (len, priv->pending->len);
+		memcpy (data, priv->pending->str, r);
+		memmove (priv->pending->str, priv->pending->str + r,
+				priv->pending->len - r);
+		priv->pending->len -= r;
+	}
+	else if (priv->ssl) {
 		r = rspamd_ssl_read (priv->ssl, data, len);
 	}
 	else {
@@ -905,6 +935,8 @@ rspamd_http_try_read (gint fd,
 		return r;
 	}
 	else {
+		priv->flags |= RSPAMD_HTTP_CONN_FLAG_DATA_READ;
+
 		if (pbuf->zc_buf == NULL) {
 			priv->buf->data->len = r;
 		}
@@ -931,6 +963,22 @@ rspamd_http_ssl_err_handler (gpointer ud, GError *err)
 	rspamd_http_connection_unref (conn);
 }
 
+static void
+rspamd_http_save_pending (struct rspamd_http_connection_private *priv,
+		const gchar *data, gsize len)
+{
+	if (len == 0) {
+		return;
+	}
+
+	if (priv->pending == NULL) {
+		priv->pending = rspamd_fstring_new_init (data, len);
+	}
+	else {
+		priv->pending = rspamd_fstring_append (priv->pending, data, len);
+	}
+}
+
 static void
 rspamd_http_event_handler (int fd, short what, gpointer ud)
 {
@@ -939,6 +987,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct _rspamd_http_privbuf *pbuf;
 	const gchar *d;
 	gssize r;
+	gsize nparsed;
 	GError *err;
 
 	priv = conn->priv;
@@ -950,8 +999,15 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					d, r);
+
+			if (priv->parser.http_errno == HPE_PAUSED) {
+				/* Keep-alive request is finished, save the rest for later */
+				http_parser_pause (&priv->parser, 0);
+				rspamd_http_save_pending (priv, d + nparsed, r - nparsed);
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
 				if (priv->flags & RSPAMD_HTTP_CONN_FLAG_TOO_LARGE) {
 					err = g_error_new (HTTP_ERROR, 413,
 							"Request entity too large: %zu",
@@ -989,14 +1045,20 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 
 				return;
 			}
+			else if (priv->pending && priv->pending->len > 0 &&
+					ev_is_active (&priv->ev.io)) {
+				/* We still have pipelined data, socket won't signal it */
+				ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+			}
 		}
 		else if (r == 0) {
 			/* We can still call http parser */
 			http_parser_execute (&priv->parser, &priv->parser_cb, d, r);
 
 			if (!conn->finished) {
+				/* Peer has closed connection, so it is reported as a reset */
 				err = g_error_new (HTTP_ERROR,
-						errno,
+						ECONNRESET,
 						"IO read error: unexpected EOF");
 				conn->error_handler (conn, err);
 				g_error_free (err);
@@ -1027,8 +1089,14 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					d, r);
+
+			if (priv->parser.http_errno == HPE_PAUSED) {
+				http_parser_pause (&priv->parser, 0);
+				rspamd_http_save_pending (priv, d + nparsed, r - nparsed);
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -1302,6 +1370,13 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 	}
 
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_RESETED;
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_DATA_READ;
+}
+
+gboolean
+rspamd_http_connection_data_read (struct rspamd_http_connection *conn)
+{
+	return (conn->priv->flags & RSPAMD_HTTP_CONN_FLAG_DATA_READ) != 0;
 }
 
 struct rspamd_http_message *
@@ -1483,6 +1558,10 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			close (conn->fd);
 		}
 
+		if (priv->pending) {
+			rspamd_fstring_free (priv->pending);
+		}
+
 		g_free (priv);
 	}
 
@@ -1524,6 +1603,11 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 			rspamd_http_event_handler, conn);
 	rspamd_ev_watcher_start (priv->ctx->event_loop, &priv->ev, priv->timeout);
 
+	if (priv->pending && priv->pending->len > 0) {
+		/* Next pipelined request is already read */
+		ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+	}
+
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
 }
 
@@ -1669,6 +1753,10 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	const gchar *conn_type = "close";
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if (priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEPALIVE) {
+			conn_type = "keep-alive";
+		}
+
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
 			rspamd_ftok_t status;
@@ -1708,12 +1796,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s", /* NO \r\n at the end ! */
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1721,11 +1810,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z", /* NO \r\n at the end ! */
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
@@ -1733,11 +1823,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
+						conn_type,
 						priv->ctx->config.server_hdr,
 						datebuf, enclen);
 			}
@@ -1746,12 +1837,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1759,11 +1851,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
@@ -2359,6 +2452,15 @@ rspamd_http_connection_get_peer_key (struct rspamd_http_connection *conn)
 	return NULL;
 }
 
+gboolean
+rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return conn->type == RSPAMD_HTTP_SERVER &&
+			(priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEPALIVE);
+}
+
 gboolean
 rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn)
 {
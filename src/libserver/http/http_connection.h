@@ -89,6 +89,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SHARED = 1u << 3, /**< Store reply in shared memory */
 	RSPAMD_HTTP_REQUIRE_ENCRYPTION = 1u << 4,
 	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 1u << 5,
+	RSPAMD_HTTP_SERVER_KEEP_ALIVE = 1u << 6, /**< Allow clients to reuse server connection */
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -217,6 +218,14 @@ const struct rspamd_cryptobox_pubkey *rspamd_http_connection_get_peer_key (
  */
 gboolean rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if a server connection can be used for the next request after
+ * the current reply is written (both server and client allow keep-alive)
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn);
+
 /**
  * Handle a request using socket fd and user data ud
  * @param conn connection structure
@@ -290,6 +299,13 @@ rspamd_http_connection_unref (struct rspamd_http_connection *conn) {
  */
 void rspamd_http_connection_reset (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if any data has been read since the last reset
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_data_read (struct rspamd_http_connection *conn);
+
 /**
  * Sets global maximum size for HTTP message being processed
  * @param sz
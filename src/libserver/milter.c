@@ -149,6 +149,13 @@ rspamd_milter_session_reset (struct rspamd_milter_session *session,
 		}
 
 		priv->cur_hdr = 0;
+
+		if (priv->envelope_reply) {
+			g_string_free (priv->envelope_reply, TRUE);
+			priv->envelope_reply = NULL;
+		}
+
+		priv->envelope_checked = FALSE;
 	}
 
 	if (how & RSPAMD_MILTER_RESET_ADDR) {
@@ -274,6 +281,19 @@ rspamd_milter_plan_io (struct rspamd_milter_session *session,
 	(var) = ntohs (var); \
 } while (0)
 
+static void
+rspamd_milter_send_envelope_reply (struct rspamd_milter_session *session,
+		struct rspamd_milter_private *priv)
+{
+	if (priv->envelope_reply) {
+		rspamd_milter_send_action (session, RSPAMD_MILTER_REPLYCODE,
+				priv->envelope_reply);
+	}
+	else {
+		rspamd_milter_send_action (session, RSPAMD_MILTER_CONTINUE);
+	}
+}
+
 static gboolean
 rspamd_milter_process_command (struct rspamd_milter_session *session,
 		struct rspamd_milter_private *priv)
@@ -670,6 +690,11 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		actions |= RSPAMD_MILTER_ACTIONS_MASK;
 		protocol = RSPAMD_MILTER_FLAG_NOREPLY_MASK;
 
+		if (priv->rcpt_cb) {
+			/* We reply to recipients after early checks */
+			protocol &= ~RSPAMD_MILTER_FLAG_NR_RCPT;
+		}
+
 		return rspamd_milter_send_action (session, RSPAMD_MILTER_OPTNEG,
 			version, actions, protocol);
 		break;
@@ -739,6 +764,18 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 				break;
 			}
 		}
+
+		if (priv->rcpt_cb) {
+			if (!priv->envelope_checked) {
+				priv->envelope_checked = TRUE;
+				REF_RETAIN (session);
+				priv->rcpt_cb (priv->fd, session, priv->ud);
+				REF_RELEASE (session);
+			}
+			else {
+				rspamd_milter_send_envelope_reply (session, priv);
+			}
+		}
 		break;
 	case RSPAMD_MILTER_CMD_DATA:
 		if (!session->message) {
@@ -1086,7 +1123,8 @@ gboolean
 rspamd_milter_handle_socket (gint fd, ev_tstamp timeout,
 		rspamd_mempool_t *pool,
 		struct ev_loop *ev_base, rspamd_milter_finish finish_cb,
-		rspamd_milter_error error_cb, void *ud)
+		rspamd_milter_error error_cb, rspamd_milter_finish rcpt_cb,
+		void *ud)
 {
 	struct rspamd_milter_session *session;
 	struct rspamd_milter_private *priv;
@@ -1101,6 +1139,7 @@ rspamd_milter_handle_socket (gint fd, ev_tstamp timeout,
 	priv->ud = ud;
 	priv->fin_cb = finish_cb;
 	priv->err_cb = error_cb;
+	priv->rcpt_cb = rcpt_cb;
 	priv->parser.state = st_len_1;
 	priv->parser.buf = rspamd_fstring_sized_new (RSPAMD_MILTER_MESSAGE_CHUNK + 5);
 	priv->event_loop = ev_base;
@@ -1462,7 +1501,24 @@ rspamd_milter_to_http (struct rspamd_milter_session *session)
 			sizeof ("/" MSG_CMD_CHECK_V2) - 1);
 
 	if (session->message) {
-		rspamd_http_message_set_body_from_fstring_steal (msg, session->message);
+		/*
+		 * Message is written to a shared memory segment once, so copies of the
+		 * request (e.g. for mirrors) just map it and local scanners can
+		 * read it by segment name without any copying
+		 */
+		msg->flags |= RSPAMD_HTTP_FLAG_SHMEM;
+
+		if (rspamd_http_message_set_body (msg, session->message->str,
+				session->message->len)) {
+			rspamd_fstring_free (session->message);
+		}
+		else {
+			msg_warn_milter ("cannot store message in shared memory: %s, "
+					"use private memory", strerror (errno));
+			rspamd_http_message_set_body_from_fstring_steal (msg,
+					session->message);
+		}
+
 		session->message = NULL;
 	}
 
@@ -2045,6 +2101,65 @@ cleanup:
 	rspamd_milter_session_reset (session, RSPAMD_MILTER_RESET_ABORT);
 }
 
+void
+rspamd_milter_send_envelope_verdict (struct rspamd_milter_session *session,
+									 struct rspamd_action *action,
+									 const gchar *message)
+{
+	struct rspamd_milter_private *priv = session->priv;
+
+	if (priv->state == RSPAMD_MILTER_WANNA_DIE ||
+			priv->state == RSPAMD_MILTER_WRITE_AND_DIE) {
+		/* Connection is already closing */
+		return;
+	}
+
+	if (priv->envelope_reply) {
+		g_string_free (priv->envelope_reply, TRUE);
+		priv->envelope_reply = NULL;
+	}
+
+	if (action) {
+		switch (action->action_type) {
+		case METRIC_ACTION_REJECT:
+			if (priv->discard_on_reject || priv->quarantine_on_reject) {
+				/* Cannot discard or quarantine on envelope stage */
+				break;
+			}
+
+			if (message == NULL) {
+				message = milter_ctx->reject_message ?
+						milter_ctx->reject_message : RSPAMD_MILTER_REJECT_MESSAGE;
+			}
+
+			priv->envelope_reply = g_string_sized_new (64);
+			rspamd_printf_gstring (priv->envelope_reply, "%s %s %s",
+					RSPAMD_MILTER_RCODE_REJECT, RSPAMD_MILTER_XCODE_REJECT,
+					message);
+			break;
+		case METRIC_ACTION_SOFT_REJECT:
+			if (message == NULL) {
+				message = RSPAMD_MILTER_TEMPFAIL_MESSAGE;
+			}
+
+			priv->envelope_reply = g_string_sized_new (64);
+			rspamd_printf_gstring (priv->envelope_reply, "%s %s %s",
+					RSPAMD_MILTER_RCODE_TEMPFAIL, RSPAMD_MILTER_XCODE_TEMPFAIL,
+					message);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (priv->envelope_reply) {
+		msg_info_milter ("reply to envelope after early checks: %v",
+				priv->envelope_reply);
+	}
+
+	rspamd_milter_send_envelope_reply (session, priv);
+}
+
 void
 rspamd_milter_init_library (const struct rspamd_milter_context *ctx)
 {
@@ -50,6 +50,7 @@ struct rspamd_email_address;
 struct ev_loop;
 struct rspamd_http_message;
 struct rspamd_config;
+struct rspamd_action;
 
 struct rspamd_milter_context {
 	const gchar *spam_header;
@@ -85,13 +86,17 @@ typedef void (*rspamd_milter_error) (gint fd,
  * @param fd
  * @param finish_cb
  * @param error_cb
+ * @param rcpt_cb if not NULL, MTA waits for a reply on RCPT commands and this
+ * callback is called on the first recipient of each transaction, it must
+ * reply using `rspamd_milter_send_envelope_verdict`
  * @param ud
  * @return
  */
 gboolean rspamd_milter_handle_socket (gint fd, ev_tstamp timeout,
 									  rspamd_mempool_t *pool,
 									  struct ev_loop *ev_base, rspamd_milter_finish finish_cb,
-									  rspamd_milter_error error_cb, void *ud);
+									  rspamd_milter_error error_cb,
+									  rspamd_milter_finish rcpt_cb, void *ud);
 
 /**
  * Updates userdata for a session, returns previous userdata
@@ -167,6 +172,17 @@ void rspamd_milter_send_task_results (struct rspamd_milter_session *session,
 									  const gchar *new_body,
 									  gsize bodylen);
 
+/**
+ * Replies to RCPT command after early checks, the same reply is used for all
+ * other recipients of the current transaction
+ * @param session
+ * @param action action for the envelope or NULL to continue
+ * @param message SMTP message for rejection or NULL to use the default one
+ */
+void rspamd_milter_send_envelope_verdict (struct rspamd_milter_session *session,
+										  struct rspamd_action *action,
+										  const gchar *message);
+
 /**
  * Init internal milter context
  * @param spam_header spam header name (must NOT be NULL)
@@ -72,7 +72,11 @@ struct rspamd_milter_private {
 	gint cur_hdr;
 	rspamd_milter_finish fin_cb;
 	rspamd_milter_error err_cb;
+	rspamd_milter_finish rcpt_cb;
 	void *ud;
+	/* Reply to RCPT commands after early checks, NULL means continue */
+	GString *envelope_reply;
+	gboolean envelope_checked;
 	enum rspamd_milter_io_state state;
 	int fd;
 	gboolean discard_on_reject;
@@ -439,6 +439,35 @@ rspamd_protocol_process_flags (struct rspamd_task *task, const rspamd_ftok_t *hd
 	}
 }
 
+static void
+rspamd_protocol_apply_settings_id (struct rspamd_task *task,
+		const rspamd_ftok_t *hv_tok)
+{
+	task->settings_elt = rspamd_config_find_settings_name_ref (
+			task->cfg, hv_tok->begin, hv_tok->len);
+
+	if (task->settings_elt == NULL) {
+		GString *known_ids = g_string_new (NULL);
+		struct rspamd_config_settings_elt *cur;
+
+		DL_FOREACH (task->cfg->setting_ids, cur) {
+			rspamd_printf_gstring (known_ids, "%s(%ud);",
+					cur->name, cur->id);
+		}
+
+		msg_warn_protocol ("unknown settings id: %T(%d); known_ids: %v",
+				hv_tok,
+				rspamd_config_name_to_id (hv_tok->begin, hv_tok->len),
+				known_ids);
+
+		g_string_free (known_ids, TRUE);
+	}
+	else {
+		msg_debug_protocol ("applied settings id %T -> %ud", hv_tok,
+				task->settings_elt->id);
+	}
+}
+
 #define IF_HEADER(name) \
 	srch.begin = (name); \
 	srch.len = sizeof (name) - 1; \
@@ -581,29 +610,7 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 			case 'S':
 				IF_HEADER (SETTINGS_ID_HEADER) {
 					msg_debug_protocol ("read settings-id header, value: %T", hv_tok);
-					task->settings_elt = rspamd_config_find_settings_name_ref (
-							task->cfg, hv_tok->begin, hv_tok->len);
-
-					if (task->settings_elt == NULL) {
-						GString *known_ids = g_string_new (NULL);
-						struct rspamd_config_settings_elt *cur;
-
-						DL_FOREACH (task->cfg->setting_ids, cur) {
-							rspamd_printf_gstring (known_ids, "%s(%ud);",
-									cur->name, cur->id);
-						}
-
-						msg_warn_protocol ("unknown settings id: %T(%d); known_ids: %v",
-								hv_tok,
-								rspamd_config_name_to_id (hv_tok->begin, hv_tok->len),
-								known_ids);
-
-						g_string_free (known_ids, TRUE);
-					}
-					else {
-						msg_debug_protocol ("applied settings id %T -> %ud", hv_tok,
-								task->settings_elt->id);
-					}
+					rspamd_protocol_apply_settings_id (task, hv_tok);
 				}
 				IF_HEADER (SETTINGS_HEADER) {
 					msg_debug_protocol ("read settings header, value: %T", hv_tok);
@@ -858,6 +865,168 @@ rspamd_protocol_handle_request (struct rspamd_task *task,
 	return ret;
 }
 
+gboolean
+rspamd_protocol_handle_v3_request (struct rspamd_task *task,
+		const struct rspamd_protocol_v3_request *req,
+		const guchar *fields, gsize len)
+{
+	struct rspamd_protocol_v3_field fh;
+	const guchar *p = fields, *end = fields + len;
+	rspamd_ftok_t tok, *hn_tok, *hv_tok;
+	guint16 flags, ftype, flen;
+	gboolean has_ip = FALSE;
+	const gchar *c;
+
+	switch (req->cmd) {
+	case RSPAMD_PROTOCOL_V3_CMD_CHECK:
+		task->cmd = CMD_CHECK_V2;
+		break;
+	case RSPAMD_PROTOCOL_V3_CMD_PING:
+		task->cmd = CMD_PING;
+		break;
+	default:
+		g_set_error (&task->err, rspamd_protocol_quark (), 400,
+				"invalid command");
+		return FALSE;
+	}
+
+	flags = GUINT16_FROM_LE (req->flags);
+
+	if (flags & RSPAMD_PROTOCOL_V3_REQUEST_PASS_ALL) {
+		task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+	}
+	if (flags & RSPAMD_PROTOCOL_V3_REQUEST_NO_LOG) {
+		task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
+	}
+	if (flags & RSPAMD_PROTOCOL_V3_REQUEST_RAW) {
+		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+	}
+
+	while (p + sizeof (fh) <= end) {
+		memcpy (&fh, p, sizeof (fh));
+		ftype = GUINT16_FROM_LE (fh.type);
+		flen = GUINT16_FROM_LE (fh.len);
+		p += sizeof (fh);
+
+		if (flen > end - p) {
+			g_set_error (&task->err, rspamd_protocol_quark (), 400,
+					"truncated field %d", (gint)ftype);
+			return FALSE;
+		}
+
+		/* Fields data is owned by the task, so we can refer to it directly */
+		tok.begin = (const gchar *)p;
+		tok.len = flen;
+		p += flen;
+
+		if (flen == 0) {
+			msg_debug_protocol ("skip empty field %d", (gint)ftype);
+			continue;
+		}
+
+		switch (ftype) {
+		case RSPAMD_PROTOCOL_V3_FIELD_IP:
+			if (!rspamd_parse_inet_address (&task->from_addr,
+					tok.begin, tok.len,
+					RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
+				msg_err_protocol ("bad ip field: '%T'", &tok);
+			}
+			else {
+				has_ip = TRUE;
+			}
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_HELO:
+			task->helo = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_FROM:
+			if (task->from_envelope) {
+				rspamd_email_address_free (task->from_envelope);
+			}
+
+			task->from_envelope = rspamd_email_address_from_smtp (tok.begin,
+					tok.len);
+
+			if (!task->from_envelope) {
+				msg_err_protocol ("bad from field: '%T'", &tok);
+				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
+			}
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_RCPT:
+			rspamd_protocol_process_recipients (task, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_HOSTNAME:
+			task->hostname = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_USER:
+			task->user = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_DELIVER_TO:
+			task->deliver_to = rspamd_protocol_escape_braces (task, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_QUEUE_ID:
+			task->queue_id = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_SETTINGS_ID:
+			if (task->settings_elt) {
+				REF_RELEASE (task->settings_elt);
+			}
+
+			rspamd_protocol_apply_settings_id (task, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_FLAGS:
+			rspamd_protocol_process_flags (task, &tok);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_MTA_NAME:
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_MTA_NAME,
+					rspamd_mempool_ftokdup (task->task_pool, &tok), NULL);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_MTA_TAG:
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_MTA_TAG,
+					rspamd_mempool_ftokdup (task->task_pool, &tok), NULL);
+			break;
+		case RSPAMD_PROTOCOL_V3_FIELD_HEADER:
+			c = memchr (tok.begin, ':', tok.len);
+
+			if (c == NULL || c == tok.begin) {
+				msg_warn_protocol ("bad header field: '%T'", &tok);
+				break;
+			}
+
+			hn_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hn_tok));
+			hn_tok->begin = tok.begin;
+			hn_tok->len = c - tok.begin;
+			c ++;
+
+			while (c < tok.begin + tok.len && g_ascii_isspace (*c)) {
+				c ++;
+			}
+
+			hv_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hv_tok));
+			hv_tok->begin = c;
+			hv_tok->len = tok.begin + tok.len - c;
+			rspamd_task_add_request_header (task, hn_tok, hv_tok);
+			break;
+		default:
+			msg_debug_protocol ("unknown field %d: %T", (gint)ftype, &tok);
+			break;
+		}
+	}
+
+	if (p != end) {
+		g_set_error (&task->err, rspamd_protocol_quark (), 400,
+				"garbage after fields");
+		return FALSE;
+	}
+
+	if (!has_ip) {
+		task->flags |= RSPAMD_TASK_FLAG_NO_IP;
+	}
+
+	return TRUE;
+}
+
 /* Structure for writing tree data */
 struct tree_cb_data {
 	ucl_object_t *top;
@@ -902,6 +1071,36 @@ rspamd_protocol_extended_url (struct rspamd_task *task,
 	return obj;
 }
 
+static void
+rspamd_protocol_log_url (struct rspamd_task *task, struct rspamd_url *url,
+		const gchar *encoded, gsize enclen)
+{
+	const gchar *user_field = "unknown";
+	gboolean has_user = FALSE;
+	guint len = 0;
+
+	if (task->user) {
+		user_field = task->user;
+		len = strlen (task->user);
+		has_user = TRUE;
+	}
+	else if (task->from_envelope) {
+		user_field = task->from_envelope->addr;
+		len = task->from_envelope->addr_len;
+	}
+
+	if (!encoded) {
+		encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+	}
+
+	msg_notice_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
+		MESSAGE_FIELD_CHECK (task, message_id),
+		has_user ? "user" : "from",
+		len, user_field,
+		rspamd_inet_address_to_string (task->from_addr),
+		(gint)enclen, encoded);
+}
+
 /*
  * Callback for writing urls
  */
@@ -912,9 +1111,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	struct rspamd_url *url = value;
 	ucl_object_t *obj;
 	struct rspamd_task *task = cb->task;
-	const gchar *user_field = "unknown", *encoded = NULL;
-	gboolean has_user = FALSE;
-	guint len = 0;
+	const gchar *encoded = NULL;
 	gsize enclen = 0;
 
 	if (!(task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS)) {
@@ -946,26 +1143,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	ucl_array_append (cb->top, obj);
 
 	if (cb->task->cfg->log_urls) {
-		if (task->user) {
-			user_field = task->user;
-			len = strlen (task->user);
-			has_user = TRUE;
-		}
-		else if (task->from_envelope) {
-			user_field = task->from_envelope->addr;
-			len = task->from_envelope->addr_len;
-		}
-
-		if (!encoded) {
-			encoded = rspamd_url_encode (url, &enclen, task->task_pool);
-		}
-
-		msg_notice_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
-			MESSAGE_FIELD_CHECK (task, message_id),
-			has_user ? "user" : "from",
-			len, user_field,
-			rspamd_inet_address_to_string (task->from_addr),
-			(gint)enclen, encoded);
+		rspamd_protocol_log_url (task, url, encoded, enclen);
 	}
 }
 
@@ -1158,6 +1336,21 @@ rspamd_metric_group_ucl (struct rspamd_task *task,
 	return obj;
 }
 
+static void
+rspamd_protocol_add_smtp_message (struct rspamd_task *task,
+		struct rspamd_passthrough_result *pr)
+{
+	if (pr && pr->message && !(pr->flags & RSPAMD_PASSTHROUGH_NO_SMTP_MESSAGE)) {
+		/* Add smtp message if it does not exists: see #3269 for details */
+		if (ucl_object_lookup (task->messages, "smtp_message") == NULL) {
+			ucl_object_insert_key (task->messages,
+					ucl_object_fromstring_common (pr->message, 0, UCL_STRING_RAW),
+					"smtp_message", 0,
+					false);
+		}
+	}
+}
+
 static ucl_object_t *
 rspamd_scan_result_ucl (struct rspamd_task *task,
 						struct rspamd_scan_result *mres, ucl_object_t *top)
@@ -1182,15 +1375,7 @@ rspamd_scan_result_ucl (struct rspamd_task *task,
 		obj = top;
 	}
 
-	if (pr && pr->message && !(pr->flags & RSPAMD_PASSTHROUGH_NO_SMTP_MESSAGE)) {
-		/* Add smtp message if it does not exists: see #3269 for details */
-		if (ucl_object_lookup (task->messages, "smtp_message") == NULL) {
-			ucl_object_insert_key (task->messages,
-					ucl_object_fromstring_common (pr->message, 0, UCL_STRING_RAW),
-					"smtp_message", 0,
-					false);
-		}
-	}
+	rspamd_protocol_add_smtp_message (task, pr);
 
 	ucl_object_insert_key (obj,
 			ucl_object_frombool (RSPAMD_TASK_IS_SKIPPED (task)),
@@ -1400,6 +1585,19 @@ rspamd_protocol_output_profiling (struct rspamd_task *task,
 	ucl_object_insert_key (top, prof, "profile", 0, false);
 }
 
+static GString *
+rspamd_protocol_fold_dkim (struct rspamd_task *task, GString *dkim_sig)
+{
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER ||
+			!task->message) {
+		return rspamd_header_value_fold ("DKIM-Signature",
+				dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
+	}
+
+	return rspamd_header_value_fold ("DKIM-Signature",
+			dkim_sig->str, 80, MESSAGE_FIELD (task, nlines_type), NULL);
+}
+
 ucl_object_t *
 rspamd_protocol_write_ucl (struct rspamd_task *task,
 		enum rspamd_protocol_flags flags)
@@ -1482,19 +1680,7 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 				for (; dkim_sigs != NULL; dkim_sigs = dkim_sigs->next) {
 					GString *folded_header;
 					dkim_sig = (GString *) dkim_sigs->data;
-
-					if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER ||
-						!task->message) {
-
-						folded_header = rspamd_header_value_fold ("DKIM-Signature",
-								dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
-					}
-					else {
-						folded_header = rspamd_header_value_fold ("DKIM-Signature",
-								dkim_sig->str, 80,
-								MESSAGE_FIELD (task, nlines_type),
-								NULL);
-					}
+					folded_header = rspamd_protocol_fold_dkim (task, dkim_sig);
 
 					ucl_array_append (ar,
 							ucl_object_fromstring_common (folded_header->str,
@@ -1511,16 +1697,7 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 				/* Single DKIM signature */
 				GString *folded_header;
 				dkim_sig = (GString *) dkim_sigs->data;
-
-				if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) {
-					folded_header = rspamd_header_value_fold ("DKIM-Signature",
-							dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
-				}
-				else {
-					folded_header = rspamd_header_value_fold ("DKIM-Signature",
-							dkim_sig->str, 80, MESSAGE_FIELD (task, nlines_type),
-							NULL);
-				}
+				folded_header = rspamd_protocol_fold_dkim (task, dkim_sig);
 
 				ucl_object_insert_key (top,
 						ucl_object_fromstring_common (folded_header->str,
@@ -1550,114 +1727,703 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	return top;
 }
 
-void
-rspamd_protocol_http_reply (struct rspamd_http_message *msg,
-		struct rspamd_task *task, ucl_object_t **pobj)
+/*
+ * Direct JSON writer: serialises scan results from the task structures
+ * without building an intermediate UCL tree. The output is the same as
+ * compact JSON emitted from the tree built by `rspamd_protocol_write_ucl`.
+ */
+static void
+rspamd_protocol_json_string (rspamd_fstring_t **out, const gchar *str,
+		gsize len)
 {
-	struct rspamd_scan_result *metric_res;
-	const struct rspamd_re_cache_stat *restat;
+	const gchar *p = str, *c = str, *end = str + len;
 
-	ucl_object_t *top = NULL;
-	rspamd_fstring_t *reply;
-	gint flags = RSPAMD_PROTOCOL_DEFAULT;
-	struct rspamd_action *action;
+	*out = rspamd_fstring_append_chars (*out, '"', 1);
 
-	/* Removed in 2.0 */
-#if 0
-	GHashTableIter hiter;
-	gpointer h, v;
-	/* Write custom headers */
-	g_hash_table_iter_init (&hiter, task->reply_headers);
-	while (g_hash_table_iter_next (&hiter, &h, &v)) {
-		rspamd_ftok_t *hn = h, *hv = v;
+	while (p < end) {
+		guchar t = *p;
 
-		rspamd_http_message_add_header (msg, hn->begin, hv->begin);
-	}
-#endif
+		if (G_LIKELY (t >= 0x20 && t != '"' && t != '\\' && t != 0x7f)) {
+			p ++;
+			continue;
+		}
 
-	flags |= RSPAMD_PROTOCOL_URLS;
+		if (p > c) {
+			*out = rspamd_fstring_append (*out, c, p - c);
+		}
 
-	top = rspamd_protocol_write_ucl (task, flags);
+		switch (t) {
+		case '\0':
+			*out = rspamd_fstring_append (*out, "\\u0000", 6);
+			break;
+		case '\n':
+			*out = rspamd_fstring_append (*out, "\\n", 2);
+			break;
+		case '\r':
+			*out = rspamd_fstring_append (*out, "\\r", 2);
+			break;
+		case '\b':
+			*out = rspamd_fstring_append (*out, "\\b", 2);
+			break;
+		case '\t':
+			*out = rspamd_fstring_append (*out, "\\t", 2);
+			break;
+		case '\f':
+			*out = rspamd_fstring_append (*out, "\\f", 2);
+			break;
+		case '\v':
+			*out = rspamd_fstring_append (*out, "\\u000B", 6);
+			break;
+		case '\\':
+			*out = rspamd_fstring_append (*out, "\\\\", 2);
+			break;
+		case '"':
+			*out = rspamd_fstring_append (*out, "\\\"", 2);
+			break;
+		default:
+			/* The same as UCL does for other denied characters */
+			*out = rspamd_fstring_append (*out, "\\uFFFD", 6);
+			break;
+		}
 
-	if (pobj) {
-		*pobj = top;
+		c = ++p;
 	}
 
-	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
-		rspamd_roll_history_update (task->worker->srv->history, task);
-	}
-	else {
-		msg_debug_protocol ("skip history update due to no log flag");
+	if (p > c) {
+		*out = rspamd_fstring_append (*out, c, p - c);
 	}
 
-	rspamd_task_write_log (task);
+	*out = rspamd_fstring_append_chars (*out, '"', 1);
+}
 
-	if (task->cfg->log_flags & RSPAMD_LOG_FLAG_RE_CACHE) {
-		restat = rspamd_re_cache_get_stat (task->re_rt);
-		g_assert (restat != NULL);
-		msg_notice_task (
-				"regexp statistics: %ud pcre regexps scanned, %ud regexps matched,"
-				" %ud regexps total, %ud regexps cached,"
-				" %HL scanned using pcre, %HL scanned total",
-				restat->regexp_checked,
-				restat->regexp_matched,
-				restat->regexp_total,
-				restat->regexp_fast_cached,
-				restat->bytes_scanned_pcre,
-				restat->bytes_scanned);
+/* Writes separator if needed and a key */
+static inline void
+rspamd_protocol_json_key (rspamd_fstring_t **out, gboolean *first,
+		const gchar *key)
+{
+	if (!*first) {
+		*out = rspamd_fstring_append_chars (*out, ',', 1);
 	}
 
-	reply = rspamd_fstring_sized_new (1000);
+	*first = FALSE;
+	rspamd_protocol_json_string (out, key, strlen (key));
+	*out = rspamd_fstring_append_chars (*out, ':', 1);
+}
 
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		msg_debug_protocol ("writing json reply");
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
-	}
-	else {
-		if (RSPAMD_TASK_IS_SPAMC (task)) {
-			msg_debug_protocol ("writing spamc legacy reply to client");
-			rspamd_ucl_tospamc_output (top, &reply);
+static inline void
+rspamd_protocol_json_double (rspamd_fstring_t **out, gdouble val)
+{
+	/* Keep in sync with rspamd_fstring_emit_append_double */
+	if (isfinite (val)) {
+		if (val == (gdouble)((gint)val)) {
+			rspamd_printf_fstring (out, "%.1f", val);
 		}
 		else {
-			msg_debug_protocol ("writing rspamc legacy reply to client");
-			rspamd_ucl_torspamc_output (top, &reply);
+			rspamd_printf_fstring (out, "%.6f", val);
 		}
 	}
+	else {
+		*out = rspamd_fstring_append (*out, "null", 4);
+	}
+}
 
-	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK) {
-		/* Check if we need to insert a body block */
-		if (task->flags & RSPAMD_TASK_FLAG_MESSAGE_REWRITE) {
-			GString *hdr_offset = g_string_sized_new (30);
+static inline void
+rspamd_protocol_json_bool (rspamd_fstring_t **out, gboolean val)
+{
+	if (val) {
+		*out = rspamd_fstring_append (*out, "true", 4);
+	}
+	else {
+		*out = rspamd_fstring_append (*out, "false", 5);
+	}
+}
 
-			rspamd_printf_gstring (hdr_offset, "%z", RSPAMD_FSTRING_LEN (reply));
-			rspamd_http_message_add_header (msg, MESSAGE_OFFSET_HEADER,
-					hdr_offset->str);
-			msg_debug_protocol ("write body block at position %s",
-					hdr_offset->str);
-			g_string_free (hdr_offset, TRUE);
+static void
+rspamd_protocol_json_symbol (struct rspamd_task *task,
+		struct rspamd_symbol_result *sym, rspamd_fstring_t **out)
+{
+	struct rspamd_symbol_option *opt;
+	gboolean first = TRUE;
 
-			/* In case of milter, we append just body, otherwise - full message */
-			if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) {
-				const gchar *start;
-				goffset len, hdr_off;
+	*out = rspamd_fstring_append_chars (*out, '{', 1);
+	rspamd_protocol_json_key (out, &first, "name");
+	rspamd_protocol_json_string (out, sym->name, strlen (sym->name));
+	rspamd_protocol_json_key (out, &first, "score");
+	rspamd_protocol_json_double (out, sym->score);
 
-				start = task->msg.begin;
-				len = task->msg.len;
+	if (task->cmd == CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, &first, "metric_score");
+		rspamd_protocol_json_double (out, sym->sym ? sym->sym->score : 0.0);
+	}
 
-				hdr_off = MESSAGE_FIELD (task, raw_headers_content).len;
+	if (sym->sym != NULL && sym->sym->description) {
+		rspamd_protocol_json_key (out, &first, "description");
+		rspamd_protocol_json_string (out, sym->sym->description,
+				strlen (sym->sym->description));
+	}
 
-				if (hdr_off < len) {
-					start += hdr_off;
-					len -= hdr_off;
+	if (sym->options != NULL) {
+		gboolean first_opt = TRUE;
 
-					/* The problem here is that we need not end of headers, we need
-					 * start of body.
-					 *
-					 * Hence, we need to skip one \r\n till there is anything else in
-					 * a line.
-					 */
+		rspamd_protocol_json_key (out, &first, "options");
+		*out = rspamd_fstring_append_chars (*out, '[', 1);
 
-					if (*start == '\r' && len > 0) {
+		DL_FOREACH (sym->opts_head, opt) {
+			if (!first_opt) {
+				*out = rspamd_fstring_append_chars (*out, ',', 1);
+			}
+
+			first_opt = FALSE;
+			rspamd_protocol_json_string (out, opt->option, opt->optlen);
+		}
+
+		*out = rspamd_fstring_append_chars (*out, ']', 1);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+static void
+rspamd_protocol_json_scan_result (struct rspamd_task *task,
+		struct rspamd_scan_result *mres, rspamd_fstring_t **out,
+		gboolean *top_first)
+{
+	struct rspamd_symbol_result *sym;
+	struct rspamd_action *action;
+	struct rspamd_passthrough_result *pr = NULL;
+	const gchar *subject;
+	gboolean first = TRUE, *pfirst = top_first;
+
+	action = rspamd_check_action_metric (task, &pr);
+
+	if (task->cmd == CMD_CHECK) {
+		/* Legacy check: everything goes into "default" object */
+		rspamd_protocol_json_key (out, top_first, DEFAULT_METRIC);
+		*out = rspamd_fstring_append_chars (*out, '{', 1);
+		pfirst = &first;
+		rspamd_protocol_json_key (out, pfirst, "is_spam");
+		rspamd_protocol_json_bool (out, !(action->flags & RSPAMD_ACTION_HAM));
+	}
+
+	rspamd_protocol_add_smtp_message (task, pr);
+
+	rspamd_protocol_json_key (out, pfirst, "is_skipped");
+	rspamd_protocol_json_bool (out, RSPAMD_TASK_IS_SKIPPED (task));
+	rspamd_protocol_json_key (out, pfirst, "score");
+	rspamd_protocol_json_double (out, isnan (mres->score) ? 0.0 : mres->score);
+	rspamd_protocol_json_key (out, pfirst, "required_score");
+	rspamd_protocol_json_double (out,
+			rspamd_task_get_required_score (task, mres));
+	rspamd_protocol_json_key (out, pfirst, "action");
+	rspamd_protocol_json_string (out, action->name, strlen (action->name));
+
+	if (action->action_type == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = rspamd_protocol_rewrite_subject (task);
+
+		if (subject) {
+			rspamd_protocol_json_key (out, pfirst, "subject");
+			rspamd_protocol_json_string (out, subject, strlen (subject));
+		}
+	}
+
+	if (action->flags & RSPAMD_ACTION_MILTER) {
+		/* Treat milter action specially */
+		if (action->action_type == METRIC_ACTION_DISCARD) {
+			rspamd_protocol_json_key (out, pfirst, "reject");
+			rspamd_protocol_json_string (out, "discard", sizeof ("discard") - 1);
+		}
+		else if (action->action_type == METRIC_ACTION_QUARANTINE) {
+			rspamd_protocol_json_key (out, pfirst, "reject");
+			rspamd_protocol_json_string (out, "quarantine",
+					sizeof ("quarantine") - 1);
+		}
+	}
+
+	if (task->cmd != CMD_CHECK) {
+		/* For checkv2 we insert symbols as a separate object */
+		rspamd_protocol_json_key (out, pfirst, "symbols");
+		*out = rspamd_fstring_append_chars (*out, '{', 1);
+		first = TRUE;
+		pfirst = &first;
+	}
+
+	kh_foreach_value_ptr (mres->symbols, sym, {
+		if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+			rspamd_protocol_json_key (out, pfirst, sym->name);
+			rspamd_protocol_json_symbol (task, sym, out);
+		}
+	});
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+
+	/* Handle groups if needed */
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_GROUPS) {
+		struct rspamd_symbols_group *gr;
+		gdouble gr_score;
+
+		rspamd_protocol_json_key (out, top_first, "groups");
+		*out = rspamd_fstring_append_chars (*out, '{', 1);
+		first = TRUE;
+
+		kh_foreach (mres->sym_groups, gr, gr_score, {
+			gboolean gr_first = TRUE;
+
+			if (task->cfg->public_groups_only &&
+				!(gr->flags & RSPAMD_SYMBOL_GROUP_PUBLIC)) {
+				continue;
+			}
+
+			rspamd_protocol_json_key (out, &first, gr->name);
+			*out = rspamd_fstring_append_chars (*out, '{', 1);
+			rspamd_protocol_json_key (out, &gr_first, "score");
+			rspamd_protocol_json_double (out, gr_score);
+
+			if (gr->description) {
+				rspamd_protocol_json_key (out, &gr_first, "description");
+				rspamd_protocol_json_string (out, gr->description,
+						strlen (gr->description));
+			}
+
+			*out = rspamd_fstring_append_chars (*out, '}', 1);
+		});
+
+		*out = rspamd_fstring_append_chars (*out, '}', 1);
+	}
+}
+
+static void
+rspamd_protocol_json_extended_url (struct rspamd_task *task,
+		struct rspamd_url *url, const gchar *encoded, gsize enclen,
+		rspamd_fstring_t **out)
+{
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '{', 1);
+	rspamd_protocol_json_key (out, &first, "url");
+	rspamd_protocol_json_string (out, encoded, enclen);
+
+	if (url->tldlen > 0) {
+		rspamd_protocol_json_key (out, &first, "tld");
+		rspamd_protocol_json_string (out, url->tld, url->tldlen);
+	}
+	if (url->hostlen > 0) {
+		rspamd_protocol_json_key (out, &first, "host");
+		rspamd_protocol_json_string (out, url->host, url->hostlen);
+	}
+
+	rspamd_protocol_json_key (out, &first, "phished");
+	rspamd_protocol_json_bool (out, url->flags & RSPAMD_URL_FLAG_PHISHED);
+	rspamd_protocol_json_key (out, &first, "redirected");
+	rspamd_protocol_json_bool (out, url->flags & RSPAMD_URL_FLAG_REDIRECTED);
+
+	if (url->phished_url) {
+		encoded = rspamd_url_encode (url->phished_url, &enclen, task->task_pool);
+		rspamd_protocol_json_key (out, &first, "orig_url");
+		rspamd_protocol_json_extended_url (task, url->phished_url, encoded,
+				enclen, out);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+static void
+rspamd_protocol_json_urls (struct rspamd_task *task, GHashTable *input,
+		rspamd_fstring_t **out)
+{
+	GHashTableIter it;
+	GHashTable *seen = NULL;
+	struct rspamd_url *url;
+	const gchar *encoded;
+	gpointer k, v;
+	gsize enclen;
+	goffset err_offset;
+	gboolean first = TRUE;
+
+	if (!(task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS)) {
+		seen = g_hash_table_new (rspamd_url_host_hash, rspamd_urls_host_cmp);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '[', 1);
+	g_hash_table_iter_init (&it, input);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+		encoded = NULL;
+		enclen = 0;
+
+		if (seen) {
+			if (url->hostlen == 0 || g_hash_table_lookup (seen, url)) {
+				continue;
+			}
+
+			g_hash_table_insert (seen, url, url);
+
+			if (!first) {
+				*out = rspamd_fstring_append_chars (*out, ',', 1);
+			}
+
+			if ((err_offset = rspamd_fast_utf8_validate (url->host,
+					url->hostlen)) == 0) {
+				rspamd_protocol_json_string (out, url->host, url->hostlen);
+			}
+			else {
+				rspamd_protocol_json_string (out, url->host, err_offset - 1);
+			}
+		}
+		else {
+			if (!first) {
+				*out = rspamd_fstring_append_chars (*out, ',', 1);
+			}
+
+			encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+			rspamd_protocol_json_extended_url (task, url, encoded, enclen, out);
+		}
+
+		first = FALSE;
+
+		if (task->cfg->log_urls) {
+			rspamd_protocol_log_url (task, url, encoded, enclen);
+		}
+	}
+
+	*out = rspamd_fstring_append_chars (*out, ']', 1);
+
+	if (seen) {
+		g_hash_table_unref (seen);
+	}
+}
+
+static void
+rspamd_protocol_json_emails (struct rspamd_task *task, GHashTable *input,
+		rspamd_fstring_t **out)
+{
+	GHashTableIter it;
+	struct rspamd_url *url;
+	gpointer k, v;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '[', 1);
+	g_hash_table_iter_init (&it, input);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+
+		if (url->userlen > 0 && url->hostlen > 0 &&
+				url->host == url->user + url->userlen + 1) {
+			if (!first) {
+				*out = rspamd_fstring_append_chars (*out, ',', 1);
+			}
+
+			first = FALSE;
+			rspamd_protocol_json_string (out, url->user,
+					url->userlen + url->hostlen + 1);
+		}
+	}
+
+	*out = rspamd_fstring_append_chars (*out, ']', 1);
+}
+
+/*
+ * Writes reply in JSON directly to the output buffer; objects that are
+ * produced by Lua (messages, milter reply, profiling) are still emitted
+ * by UCL
+ */
+void
+rspamd_protocol_write_json (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out)
+{
+	GList *dkim_sigs;
+	GString *folded_header;
+	const ucl_object_t *milter_reply;
+	gboolean first = TRUE;
+
+	rspamd_task_set_finish_time (task);
+	*out = rspamd_fstring_append_chars (*out, '{', 1);
+
+	if (flags & RSPAMD_PROTOCOL_METRICS) {
+		rspamd_protocol_json_scan_result (task, task->result, out, &first);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
+		rspamd_protocol_json_key (out, &first, "messages");
+
+		if (G_UNLIKELY (task->cfg->compat_messages)) {
+			const ucl_object_t *cur;
+			ucl_object_iter_t iter = NULL;
+			gboolean first_msg = TRUE;
+
+			*out = rspamd_fstring_append_chars (*out, '[', 1);
+
+			while ((cur = ucl_object_iterate (task->messages, &iter, true)) != NULL) {
+				if (cur->type == UCL_STRING) {
+					if (!first_msg) {
+						*out = rspamd_fstring_append_chars (*out, ',', 1);
+					}
+
+					gsize mlen;
+					const gchar *mstr = ucl_object_tolstring (cur, &mlen);
+
+					first_msg = FALSE;
+					rspamd_protocol_json_string (out, mstr, mlen);
+				}
+			}
+
+			*out = rspamd_fstring_append_chars (*out, ']', 1);
+		}
+		else {
+			rspamd_ucl_emit_fstring (task->messages, UCL_EMIT_JSON_COMPACT, out);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_URLS && task->message) {
+		if (g_hash_table_size (MESSAGE_FIELD (task, urls)) > 0) {
+			rspamd_protocol_json_key (out, &first, "urls");
+			rspamd_protocol_json_urls (task, MESSAGE_FIELD (task, urls), out);
+		}
+
+		if (g_hash_table_size (MESSAGE_FIELD (task, emails)) > 0) {
+			rspamd_protocol_json_key (out, &first, "emails");
+			rspamd_protocol_json_emails (task, MESSAGE_FIELD (task, emails), out);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_EXTRA) {
+		if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
+			ucl_object_t *tmp = ucl_object_typed_new (UCL_OBJECT);
+
+			rspamd_protocol_output_profiling (task, tmp);
+			rspamd_protocol_json_key (out, &first, "profile");
+			rspamd_ucl_emit_fstring (ucl_object_lookup (tmp, "profile"),
+					UCL_EMIT_JSON_COMPACT, out);
+			ucl_object_unref (tmp);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_BASIC) {
+		const gchar *mid = MESSAGE_FIELD_CHECK (task, message_id);
+
+		if (mid) {
+			rspamd_protocol_json_key (out, &first, "message-id");
+			rspamd_protocol_json_string (out, mid, strlen (mid));
+		}
+
+		rspamd_protocol_json_key (out, &first, "time_real");
+		rspamd_protocol_json_double (out,
+				task->time_real_finish - task->task_timestamp);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_DKIM) {
+		dkim_sigs = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_DKIM_SIGNATURE);
+
+		if (dkim_sigs) {
+			gboolean multiple = dkim_sigs->next != NULL;
+
+			rspamd_protocol_json_key (out, &first, "dkim-signature");
+
+			if (multiple) {
+				*out = rspamd_fstring_append_chars (*out, '[', 1);
+			}
+
+			for (; dkim_sigs != NULL; dkim_sigs = dkim_sigs->next) {
+				folded_header = rspamd_protocol_fold_dkim (task,
+						(GString *)dkim_sigs->data);
+				rspamd_protocol_json_string (out, folded_header->str,
+						folded_header->len);
+				g_string_free (folded_header, TRUE);
+
+				if (dkim_sigs->next) {
+					*out = rspamd_fstring_append_chars (*out, ',', 1);
+				}
+			}
+
+			if (multiple) {
+				*out = rspamd_fstring_append_chars (*out, ']', 1);
+			}
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_RMILTER) {
+		milter_reply = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_MILTER_REPLY);
+
+		if (milter_reply) {
+			rspamd_protocol_json_key (out, &first,
+					task->cmd != CMD_CHECK ? "milter" : "rmilter");
+			rspamd_ucl_emit_fstring (milter_reply, UCL_EMIT_JSON_COMPACT, out);
+		}
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+static void
+rspamd_protocol_log_task (struct rspamd_task *task)
+{
+	const struct rspamd_re_cache_stat *restat;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
+		rspamd_roll_history_update (task->worker->srv->history, task);
+	}
+	else {
+		msg_debug_protocol ("skip history update due to no log flag");
+	}
+
+	rspamd_task_write_log (task);
+
+	if (task->cfg->log_flags & RSPAMD_LOG_FLAG_RE_CACHE) {
+		restat = rspamd_re_cache_get_stat (task->re_rt);
+		g_assert (restat != NULL);
+		msg_notice_task (
+				"regexp statistics: %ud pcre regexps scanned, %ud regexps matched,"
+				" %ud regexps total, %ud regexps cached,"
+				" %HL scanned using pcre, %HL scanned total",
+				restat->regexp_checked,
+				restat->regexp_matched,
+				restat->regexp_total,
+				restat->regexp_fast_cached,
+				restat->bytes_scanned_pcre,
+				restat->bytes_scanned);
+	}
+}
+
+static void
+rspamd_protocol_update_stats (struct rspamd_task *task)
+{
+	struct rspamd_scan_result *metric_res;
+	struct rspamd_action *action;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
+		/* Update stat for default metric */
+
+		msg_debug_protocol ("skip stats update due to no_stat flag");
+		metric_res = task->result;
+
+		if (metric_res != NULL) {
+
+			action = rspamd_check_action_metric (task, NULL);
+			/* TODO: handle custom actions in stats */
+			if (action->action_type == METRIC_ACTION_SOFT_REJECT &&
+					(task->flags & RSPAMD_TASK_FLAG_GREYLISTED)) {
+				/* Set stat action to greylist to display greylisted messages */
+#ifndef HAVE_ATOMIC_BUILTINS
+				task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST]++;
+#else
+				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST],
+						1, __ATOMIC_RELEASE);
+#endif
+			}
+			else if (action->action_type < METRIC_ACTION_MAX) {
+#ifndef HAVE_ATOMIC_BUILTINS
+				task->worker->srv->stat->actions_stat[action->action_type]++;
+#else
+				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action->action_type],
+						1, __ATOMIC_RELEASE);
+#endif
+			}
+		}
+
+		/* Increase counters */
+#ifndef HAVE_ATOMIC_BUILTINS
+		task->worker->srv->stat->messages_scanned++;
+#else
+		__atomic_add_fetch (&task->worker->srv->stat->messages_scanned,
+				1, __ATOMIC_RELEASE);
+#endif
+	}
+}
+
+void
+rspamd_protocol_http_reply (struct rspamd_http_message *msg,
+		struct rspamd_task *task, ucl_object_t **pobj)
+{
+	ucl_object_t *top = NULL;
+	rspamd_fstring_t *reply;
+	ZSTD_CStream *zstream;
+	gboolean use_dict;
+	gint flags = RSPAMD_PROTOCOL_DEFAULT;
+
+	/* Removed in 2.0 */
+#if 0
+	GHashTableIter hiter;
+	gpointer h, v;
+	/* Write custom headers */
+	g_hash_table_iter_init (&hiter, task->reply_headers);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		rspamd_ftok_t *hn = h, *hv = v;
+
+		rspamd_http_message_add_header (msg, hn->begin, hv->begin);
+	}
+#endif
+
+	flags |= RSPAMD_PROTOCOL_URLS;
+	reply = rspamd_fstring_sized_new (1000);
+
+	if (pobj == NULL && msg->method < HTTP_SYMBOLS &&
+			!RSPAMD_TASK_IS_SPAMC (task)) {
+		/* Nobody needs the tree, so we can write JSON directly */
+		msg_debug_protocol ("writing json reply");
+		rspamd_protocol_write_json (task, flags, &reply);
+	}
+	else {
+		top = rspamd_protocol_write_ucl (task, flags);
+
+		if (pobj) {
+			*pobj = top;
+		}
+
+		if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+			msg_debug_protocol ("writing json reply");
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+		}
+		else {
+			if (RSPAMD_TASK_IS_SPAMC (task)) {
+				msg_debug_protocol ("writing spamc legacy reply to client");
+				rspamd_ucl_tospamc_output (top, &reply);
+			}
+			else {
+				msg_debug_protocol ("writing rspamc legacy reply to client");
+				rspamd_ucl_torspamc_output (top, &reply);
+			}
+		}
+	}
+
+	rspamd_protocol_log_task (task);
+
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK) {
+		/* Check if we need to insert a body block */
+		if (task->flags & RSPAMD_TASK_FLAG_MESSAGE_REWRITE) {
+			GString *hdr_offset = g_string_sized_new (30);
+
+			rspamd_printf_gstring (hdr_offset, "%z", RSPAMD_FSTRING_LEN (reply));
+			rspamd_http_message_add_header (msg, MESSAGE_OFFSET_HEADER,
+					hdr_offset->str);
+			msg_debug_protocol ("write body block at position %s",
+					hdr_offset->str);
+			g_string_free (hdr_offset, TRUE);
+
+			/* In case of milter, we append just body, otherwise - full message */
+			if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) {
+				const gchar *start;
+				goffset len, hdr_off;
+
+				start = task->msg.begin;
+				len = task->msg.len;
+
+				hdr_off = MESSAGE_FIELD (task, raw_headers_content).len;
+
+				if (hdr_off < len) {
+					start += hdr_off;
+					len -= hdr_off;
+
+					/* The problem here is that we need not end of headers, we need
+					 * start of body.
+					 *
+					 * Hence, we need to skip one \r\n till there is anything else in
+					 * a line.
+					 */
+
+					if (*start == '\r' && len > 0) {
 						start ++;
 						len --;
 					}
@@ -1681,16 +2447,18 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		}
 	}
 
+	use_dict = (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED_DICT) &&
+			task->cfg->libs_ctx->out_dict != NULL;
+
 	if ((task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED) &&
-			rspamd_libs_reset_compression (task->cfg->libs_ctx)) {
+			(zstream = rspamd_libs_reset_compression (task->cfg->libs_ctx,
+					use_dict)) != NULL) {
 		/* We can compress output */
 		ZSTD_inBuffer zin;
 		ZSTD_outBuffer zout;
-		ZSTD_CStream *zstream;
 		rspamd_fstring_t *compressed_reply;
 		gsize r;
 
-		zstream = task->cfg->libs_ctx->out_zstream;
 		compressed_reply = rspamd_fstring_sized_new (ZSTD_compressBound (reply->len));
 		zin.pos = 0;
 		zin.src = reply->str;
@@ -1729,8 +2497,7 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		rspamd_http_message_set_body_from_fstring_steal (msg, compressed_reply);
 		rspamd_http_message_add_header (msg, COMPRESSION_HEADER, "zstd");
 
-		if (task->cfg->libs_ctx->out_dict &&
-				task->cfg->libs_ctx->out_dict->id != 0) {
+		if (use_dict && task->cfg->libs_ctx->out_dict->id != 0) {
 			gchar dict_str[32];
 
 			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
@@ -1743,44 +2510,196 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 
 end:
-	if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
-		/* Update stat for default metric */
+	rspamd_protocol_update_stats (task);
+}
 
-		msg_debug_protocol ("skip stats update due to no_stat flag");
-		metric_res = task->result;
+static inline gdouble
+rspamd_protocol_v3_double (gdouble val)
+{
+	union {
+		gdouble d;
+		guint64 u;
+	} cv;
 
-		if (metric_res != NULL) {
+	cv.d = val;
+	cv.u = GUINT64_TO_LE (cv.u);
 
-			action = rspamd_check_action_metric (task, NULL);
-			/* TODO: handle custom actions in stats */
-			if (action->action_type == METRIC_ACTION_SOFT_REJECT &&
-					(task->flags & RSPAMD_TASK_FLAG_GREYLISTED)) {
-				/* Set stat action to greylist to display greylisted messages */
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST]++;
-#else
-				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST],
-						1, __ATOMIC_RELEASE);
-#endif
-			}
-			else if (action->action_type < METRIC_ACTION_MAX) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[action->action_type]++;
-#else
-				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action->action_type],
-						1, __ATOMIC_RELEASE);
-#endif
+	return cv.d;
+}
+
+static inline gfloat
+rspamd_protocol_v3_float (gfloat val)
+{
+	union {
+		gfloat f;
+		guint32 u;
+	} cv;
+
+	cv.f = val;
+	cv.u = GUINT32_TO_LE (cv.u);
+
+	return cv.f;
+}
+
+static void
+rspamd_protocol_v3_init_reply (struct rspamd_protocol_v3_reply *hdr,
+		struct rspamd_config *cfg)
+{
+	memset (hdr, 0, sizeof (*hdr));
+	memcpy (hdr->magic, RSPAMD_PROTOCOL_V3_MAGIC, sizeof (hdr->magic));
+	hdr->version = RSPAMD_PROTOCOL_V3_VERSION;
+	hdr->action = GUINT16_TO_LE (METRIC_ACTION_NOACTION);
+	hdr->table_id = GUINT32_TO_LE (
+			(guint32)rspamd_symcache_get_cksum (cfg->cache));
+}
+
+static rspamd_fstring_t *
+rspamd_protocol_v3_append_name (rspamd_fstring_t *reply, const gchar *name)
+{
+	guint16 nlen;
+	gsize slen = strlen (name);
+
+	nlen = GUINT16_TO_LE ((guint16)MIN (slen, G_MAXUINT16));
+	reply = rspamd_fstring_append (reply, (const gchar *)&nlen, sizeof (nlen));
+
+	return rspamd_fstring_append (reply, name, MIN (slen, G_MAXUINT16));
+}
+
+rspamd_fstring_t *
+rspamd_protocol_v3_reply (struct rspamd_task *task, gboolean with_names)
+{
+	struct rspamd_protocol_v3_reply hdr;
+	struct rspamd_protocol_v3_symbol sr;
+	struct rspamd_scan_result *mres = task->result;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_passthrough_result *pr = NULL;
+	struct rspamd_action *action;
+	rspamd_fstring_t *reply;
+	const gchar *extra = NULL;
+	guint32 nsym = 0;
+	gint id;
+
+	rspamd_protocol_v3_init_reply (&hdr, task->cfg);
+	reply = rspamd_fstring_sized_new (sizeof (hdr) +
+			(mres ? kh_size (mres->symbols) : 0) * (sizeof (sr) + 24));
+	/* Header is filled in the end */
+	reply = rspamd_fstring_append (reply, (const gchar *)&hdr, sizeof (hdr));
+
+	if (task->err != NULL) {
+		hdr.flags |= RSPAMD_PROTOCOL_V3_REPLY_ERROR;
+		extra = task->err->message;
+	}
+	else if (task->cmd != CMD_PING && mres != NULL) {
+		action = rspamd_check_action_metric (task, &pr);
+
+		if (!(action->flags & RSPAMD_ACTION_HAM)) {
+			hdr.flags |= RSPAMD_PROTOCOL_V3_REPLY_SPAM;
+		}
+		if (RSPAMD_TASK_IS_SKIPPED (task)) {
+			hdr.flags |= RSPAMD_PROTOCOL_V3_REPLY_SKIPPED;
+		}
+		if (pr != NULL) {
+			hdr.flags |= RSPAMD_PROTOCOL_V3_REPLY_PASSTHROUGH;
+		}
+
+		hdr.action = GUINT16_TO_LE (action->action_type);
+
+		if (action->action_type == METRIC_ACTION_CUSTOM) {
+			extra = action->name;
+		}
+
+		hdr.score = rspamd_protocol_v3_double (
+				isnan (mres->score) ? 0.0 : mres->score);
+		hdr.required_score = rspamd_protocol_v3_double (
+				rspamd_task_get_required_score (task, mres));
+
+		if (task->settings_elt) {
+			hdr.settings_id = GUINT32_TO_LE (task->settings_elt->id);
+		}
+
+		kh_foreach_value_ptr (mres->symbols, sym, {
+			if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+				id = rspamd_symcache_find_symbol_unique_id (task->cfg->cache,
+						sym->name);
+
+				if (id < 0) {
+					/* Client cannot resolve this one without a name */
+					with_names = TRUE;
+					sr.id = GUINT32_TO_LE (RSPAMD_PROTOCOL_V3_UNKNOWN_ID);
+				}
+				else {
+					sr.id = GUINT32_TO_LE ((guint32)id);
+				}
+
+				sr.score = rspamd_protocol_v3_float (sym->score);
+				reply = rspamd_fstring_append (reply, (const gchar *)&sr,
+						sizeof (sr));
+				nsym ++;
 			}
+		});
+
+		if (with_names) {
+			hdr.flags |= RSPAMD_PROTOCOL_V3_REPLY_NAMES;
+
+			/* Iteration order is the same as no symbols are inserted meanwhile */
+			kh_foreach_value_ptr (mres->symbols, sym, {
+				if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+					reply = rspamd_protocol_v3_append_name (reply, sym->name);
+				}
+			});
 		}
 
-		/* Increase counters */
-#ifndef HAVE_ATOMIC_BUILTINS
-		task->worker->srv->stat->messages_scanned++;
-#else
-		__atomic_add_fetch (&task->worker->srv->stat->messages_scanned,
-				1, __ATOMIC_RELEASE);
-#endif
+		rspamd_protocol_log_task (task);
+		rspamd_protocol_write_log_pipe (task);
+		rspamd_protocol_update_stats (task);
 	}
+
+	if (extra) {
+		hdr.extra_len = GUINT32_TO_LE (strlen (extra));
+		reply = rspamd_fstring_append (reply, extra, strlen (extra));
+	}
+
+	hdr.nsymbols = GUINT32_TO_LE (nsym);
+	memcpy (reply->str, &hdr, sizeof (hdr));
+
+	return reply;
+}
+
+rspamd_fstring_t *
+rspamd_protocol_v3_symbols_table (struct rspamd_config *cfg)
+{
+	struct rspamd_protocol_v3_reply hdr;
+	struct rspamd_protocol_v3_symbol sr;
+	struct rspamd_symbol *sdef;
+	rspamd_fstring_t *reply, *names;
+	const gchar *name;
+	guint32 n = 0;
+
+	rspamd_protocol_v3_init_reply (&hdr, cfg);
+	hdr.flags = RSPAMD_PROTOCOL_V3_REPLY_NAMES;
+	reply = rspamd_fstring_sized_new (sizeof (hdr) +
+			rspamd_symcache_stats_symbols_count (cfg->cache) * sizeof (sr));
+	reply = rspamd_fstring_append (reply, (const gchar *)&hdr, sizeof (hdr));
+	names = rspamd_fstring_sized_new (
+			rspamd_symcache_stats_symbols_count (cfg->cache) * 24);
+
+	/* Unique ids are dense, so we can just iterate until the first gap */
+	while ((name = rspamd_symcache_symbol_by_unique_id (cfg->cache, n)) != NULL) {
+		sdef = g_hash_table_lookup (cfg->symbols, name);
+		sr.id = GUINT32_TO_LE (n);
+		sr.score = rspamd_protocol_v3_float (sdef ? sdef->score : 0.0);
+		reply = rspamd_fstring_append (reply, (const gchar *)&sr, sizeof (sr));
+		names = rspamd_protocol_v3_append_name (names, name);
+		n ++;
+	}
+
+	reply = rspamd_fstring_append (reply, names->str, names->len);
+	rspamd_fstring_free (names);
+
+	hdr.nsymbols = GUINT32_TO_LE (n);
+	memcpy (reply->str, &hdr, sizeof (hdr));
+
+	return reply;
 }
 
 void
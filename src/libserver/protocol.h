@@ -64,6 +64,37 @@ gboolean rspamd_protocol_handle_control (struct rspamd_task *task,
 gboolean rspamd_protocol_handle_request (struct rspamd_task *task,
 										 struct rspamd_http_message *msg);
 
+struct rspamd_protocol_v3_request;
+
+/**
+ * Process binary (v3) request header and envelope fields to the task structure
+ * @param task
+ * @param req request header (in wire byte order)
+ * @param fields fields data, must live as long as the task
+ * @param len length of fields
+ * @return
+ */
+gboolean rspamd_protocol_handle_v3_request (struct rspamd_task *task,
+											const struct rspamd_protocol_v3_request *req,
+											const guchar *fields, gsize len);
+
+/**
+ * Write binary (v3) reply for a task, also writes logs and updates stats
+ * like `rspamd_protocol_http_reply`
+ * @param task
+ * @param with_names append symbols names to the reply
+ * @return new string with reply
+ */
+rspamd_fstring_t *rspamd_protocol_v3_reply (struct rspamd_task *task,
+											gboolean with_names);
+
+/**
+ * Write binary (v3) reply with all symbols registered in the symbols cache
+ * @param cfg
+ * @return new string with reply
+ */
+rspamd_fstring_t *rspamd_protocol_v3_symbols_table (struct rspamd_config *cfg);
+
 /**
  * Write task results to http message
  * @param msg
@@ -104,6 +135,17 @@ enum rspamd_protocol_flags {
 ucl_object_t *rspamd_protocol_write_ucl (struct rspamd_task *task,
 										 enum rspamd_protocol_flags flags);
 
+/**
+ * Write reply in JSON to the output string, the result is the same as
+ * `rspamd_protocol_write_ucl` emitted as compact JSON
+ * @param task
+ * @param flags
+ * @param out output string (appended)
+ */
+void rspamd_protocol_write_json (struct rspamd_task *task,
+								 enum rspamd_protocol_flags flags,
+								 rspamd_fstring_t **out);
+
 /**
  * Write reply for specified task command
  * @param task task object
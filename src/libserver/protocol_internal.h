@@ -92,6 +92,99 @@ extern "C" {
 #define COMPRESSION_HEADER "Compression"
 #define MESSAGE_OFFSET_HEADER "Message-Offset"
 
+/*
+ * Binary scan protocol (v3)
+ *
+ * Request: struct rspamd_protocol_v3_request, then `fields_len` bytes of
+ * envelope fields, then `body_len` bytes of message. Each field is
+ * struct rspamd_protocol_v3_field followed by `len` bytes of value (values
+ * have the same syntax as the corresponding HTTP headers).
+ *
+ * Reply: struct rspamd_protocol_v3_reply, then `nsymbols` entries of
+ * struct rspamd_protocol_v3_symbol, then (if RSPAMD_PROTOCOL_V3_REPLY_NAMES
+ * is set) `nsymbols` names each prefixed by guint16 length, then
+ * `extra_len` bytes (error message or a custom action name).
+ *
+ * All integers are little endian. Symbol ids are ids in the symbols cache,
+ * they are stable while `table_id` is the same, so clients can fetch the table
+ * once via RSPAMD_PROTOCOL_V3_CMD_SYMBOLS and reuse it.
+ */
+#define RSPAMD_PROTOCOL_V3_MAGIC "RSP3"
+#define RSPAMD_PROTOCOL_V3_MAGIC_LEN 4
+#define RSPAMD_PROTOCOL_V3_VERSION 3
+#define RSPAMD_PROTOCOL_V3_MAX_FIELDS_LEN (1024 * 1024)
+#define RSPAMD_PROTOCOL_V3_UNKNOWN_ID 0xffffffffU
+
+enum rspamd_protocol_v3_cmd {
+	RSPAMD_PROTOCOL_V3_CMD_CHECK = 0,
+	RSPAMD_PROTOCOL_V3_CMD_SYMBOLS,
+	RSPAMD_PROTOCOL_V3_CMD_PING,
+};
+
+enum rspamd_protocol_v3_request_flags {
+	RSPAMD_PROTOCOL_V3_REQUEST_PASS_ALL = (1u << 0u),
+	RSPAMD_PROTOCOL_V3_REQUEST_NO_LOG = (1u << 1u),
+	RSPAMD_PROTOCOL_V3_REQUEST_RAW = (1u << 2u),
+	RSPAMD_PROTOCOL_V3_REQUEST_NAMES = (1u << 3u),
+};
+
+enum rspamd_protocol_v3_field_type {
+	RSPAMD_PROTOCOL_V3_FIELD_IP = 1,
+	RSPAMD_PROTOCOL_V3_FIELD_HELO,
+	RSPAMD_PROTOCOL_V3_FIELD_FROM,
+	RSPAMD_PROTOCOL_V3_FIELD_RCPT,
+	RSPAMD_PROTOCOL_V3_FIELD_HOSTNAME,
+	RSPAMD_PROTOCOL_V3_FIELD_USER,
+	RSPAMD_PROTOCOL_V3_FIELD_DELIVER_TO,
+	RSPAMD_PROTOCOL_V3_FIELD_QUEUE_ID,
+	RSPAMD_PROTOCOL_V3_FIELD_SETTINGS_ID,
+	RSPAMD_PROTOCOL_V3_FIELD_FLAGS,
+	RSPAMD_PROTOCOL_V3_FIELD_MTA_NAME,
+	RSPAMD_PROTOCOL_V3_FIELD_MTA_TAG,
+	/* "Name: value", passed as a generic request header */
+	RSPAMD_PROTOCOL_V3_FIELD_HEADER,
+};
+
+enum rspamd_protocol_v3_reply_flags {
+	RSPAMD_PROTOCOL_V3_REPLY_SPAM = (1u << 0u),
+	RSPAMD_PROTOCOL_V3_REPLY_SKIPPED = (1u << 1u),
+	RSPAMD_PROTOCOL_V3_REPLY_ERROR = (1u << 2u),
+	RSPAMD_PROTOCOL_V3_REPLY_NAMES = (1u << 3u),
+	RSPAMD_PROTOCOL_V3_REPLY_PASSTHROUGH = (1u << 4u),
+};
+
+struct rspamd_protocol_v3_request {
+	guchar magic[RSPAMD_PROTOCOL_V3_MAGIC_LEN];
+	guint8 version;
+	guint8 cmd;
+	guint16 flags;
+	guint32 fields_len;
+	guint32 body_len;
+};
+
+struct rspamd_protocol_v3_field {
+	guint16 type;
+	guint16 len;
+};
+
+struct rspamd_protocol_v3_reply {
+	guchar magic[RSPAMD_PROTOCOL_V3_MAGIC_LEN];
+	guint8 version;
+	guint8 flags;
+	guint16 action; /* enum rspamd_action_type */
+	guint32 table_id;
+	guint32 nsymbols;
+	guint32 extra_len;
+	guint32 settings_id;
+	gdouble score;
+	gdouble required_score;
+};
+
+struct rspamd_protocol_v3_symbol {
+	guint32 id;
+	gfloat score;
+};
+
 #ifdef  __cplusplus
 }
 #endif
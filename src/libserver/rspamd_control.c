@@ -218,6 +218,8 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 					elt->reply.reply.stat.uptime), "uptime", 0, false);
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.stat.maxrss), "maxrss", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.queue_depth), "queue_depth", 0, false);
 
 			total_utime += elt->reply.reply.stat.utime;
 			total_systime += elt->reply.reply.stat.systime;
@@ -588,6 +590,7 @@ rspamd_control_default_cmd_handler (gint fd,
 		}
 
 		rep.reply.stat.conns = cd->worker->nconns;
+		rep.reply.stat.queue_depth = rspamd_worker_listen_queue_depth (cd->worker);
 		rep.reply.stat.uptime = rspamd_get_calendar_ticks () - cd->worker->start_time;
 		break;
 	case RSPAMD_CONTROL_RELOAD:
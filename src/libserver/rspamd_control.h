@@ -108,6 +108,7 @@ struct rspamd_control_reply {
 			gdouble utime;
 			gdouble systime;
 			gulong maxrss;
+			guint queue_depth;
 		} stat;
 		struct {
 			guint status;
@@ -2654,6 +2654,60 @@ rspamd_symcache_symbol_by_id (struct rspamd_symcache *cache,
 	return item->symbol;
 }
 
+gint
+rspamd_symcache_find_symbol_unique_id (struct rspamd_symcache *cache,
+									   const gchar *name)
+{
+	struct rspamd_symcache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (name == NULL) {
+		return -1;
+	}
+
+	item = g_hash_table_lookup (cache->items_by_symbol, name);
+
+	if (item == NULL) {
+		return -1;
+	}
+
+	/* Virtual symbols have their own ids space, so we put them after real ones */
+	if (item->is_virtual) {
+		return cache->items_by_id->len + item->id;
+	}
+
+	return item->id;
+}
+
+const gchar *
+rspamd_symcache_symbol_by_unique_id (struct rspamd_symcache *cache,
+									 gint id)
+{
+	struct rspamd_symcache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (id < 0) {
+		return NULL;
+	}
+
+	if (id < (gint)cache->items_by_id->len) {
+		item = g_ptr_array_index (cache->items_by_id, id);
+	}
+	else {
+		id -= cache->items_by_id->len;
+
+		if (id >= (gint)cache->virtual->len) {
+			return NULL;
+		}
+
+		item = g_ptr_array_index (cache->virtual, id);
+	}
+
+	return item->symbol;
+}
+
 guint
 rspamd_symcache_stats_symbols_count (struct rspamd_symcache *cache)
 {
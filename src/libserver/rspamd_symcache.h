@@ -176,6 +176,25 @@ gboolean rspamd_symcache_stat_symbol (struct rspamd_symcache *cache,
 const gchar *rspamd_symcache_symbol_by_id (struct rspamd_symcache *cache,
 										   gint id);
 
+/**
+ * Find symbol in cache by name and returns an id that is unique for both real
+ * and virtual symbols (virtual symbols are placed after all real ones)
+ * @param cache
+ * @param name
+ * @return unique id of symbol or (-1) if a symbol has not been found
+ */
+gint rspamd_symcache_find_symbol_unique_id (struct rspamd_symcache *cache,
+											const gchar *name);
+
+/**
+ * Find symbol in cache by its unique id
+ * @param cache
+ * @param id
+ * @return symbol's name or NULL
+ */
+const gchar *rspamd_symcache_symbol_by_unique_id (struct rspamd_symcache *cache,
+												  gint id);
+
 /**
  * Returns number of symbols registered in symbols cache
  * @param cache
@@ -25,7 +25,10 @@
 #include "stat_api.h"
 #include "unix-std.h"
 #include "utlist.h"
+
+#define ZSTD_STATIC_LINKING_ONLY
 #include "contrib/zstd/zstd.h"
+
 #include "libserver/mempool_vars_internal.h"
 #include "libserver/cfg_file_private.h"
 #include "libmime/lang_detection.h"
@@ -532,15 +535,7 @@ rspamd_task_load_message (struct rspamd_task *task,
 			ZSTD_outBuffer zout;
 			guchar *out;
 			gsize outlen, r;
-			gulong dict_id;
-
-			if (!rspamd_libs_reset_decompression (task->cfg->libs_ctx)) {
-				g_set_error (&task->err, rspamd_task_quark(),
-						RSPAMD_PROTOCOL_ERROR,
-						"Cannot decompress, decompressor init failed");
-
-				return FALSE;
-			}
+			gulong dict_id = 0;
 
 			tok = rspamd_task_get_request_header (task, "dictionary");
 
@@ -567,8 +562,29 @@ rspamd_task_load_message (struct rspamd_task *task,
 					return FALSE;
 				}
 			}
+			else {
+				/* Frame header might still refer to a dictionary */
+				dict_id = ZSTD_getDictID_fromFrame (start, len);
+
+				if (dict_id != 0 && (!task->cfg->libs_ctx->in_dict ||
+						task->cfg->libs_ctx->in_dict->id != dict_id)) {
+					g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+							"Unknown dictionary, invalid dictionary id");
+
+					return FALSE;
+				}
+			}
 
-			zstream = task->cfg->libs_ctx->in_zstream;
+			zstream = rspamd_libs_reset_decompression (task->cfg->libs_ctx,
+					dict_id != 0);
+
+			if (zstream == NULL) {
+				g_set_error (&task->err, rspamd_task_quark(),
+						RSPAMD_PROTOCOL_ERROR,
+						"Cannot decompress, decompressor init failed");
+
+				return FALSE;
+			}
 
 			zin.pos = 0;
 			zin.src = start;
@@ -606,6 +622,10 @@ rspamd_task_load_message (struct rspamd_task *task,
 			task->msg.len = zout.pos;
 			task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED;
 
+			if (dict_id != 0) {
+				task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED_DICT;
+			}
+
 			msg_info_task ("loaded message from zstd compressed stream; "
 						   "compressed: %ul; uncompressed: %ul",
 					(gulong)zin.size, (gulong)zout.pos);
@@ -229,11 +229,64 @@ struct url_callback_data {
 	const gchar *last_at;
 	url_insert_function func;
 	void *funcd;
+	/* Optional cache of parsed urls by candidate strings */
+	GHashTable *seen;
+	struct rspamd_url_extract_stat *stat;
 };
 
+/* Values cached in `seen` for candidates that are not urls */
+static gchar url_seen_failed[2];
+#define URL_SEEN_FAILED(prefix_added) \
+	((struct rspamd_url *)&url_seen_failed[(prefix_added) ? 1 : 0])
+
+/*
+ * Public suffixes compiled to a flat array of labels: children of the root
+ * node are top level domains, children of `uk` are `co.uk`, `org.uk` and so on.
+ * Children of each node are stored contiguously and sorted, so a host is
+ * matched by a binary search per label starting from the rightmost one.
+ */
+enum rspamd_tld_node_flags {
+	RSPAMD_TLD_NODE_SUFFIX = (1u << 0u),
+	RSPAMD_TLD_NODE_STAR = (1u << 1u),
+};
+
+struct rspamd_tld_node {
+	guint32 label_off;
+	guint16 label_len;
+	guint16 flags;
+	guint32 children;
+	guint32 nchildren;
+};
+
+struct rspamd_tld_trie {
+	struct rspamd_tld_node *nodes;
+	gchar *labels;
+	guint32 nnodes;
+	guint32 max_label_len;
+};
+
+/* Used to build trie only */
+struct rspamd_tld_build_node {
+	rspamd_ftok_t label;
+	guint flags;
+	GHashTable *children;
+};
+
+/*
+ * Interned hosts are never evicted until the url library is reinitialised
+ * (e.g. on config reload), so both number of hosts and their total length
+ * are limited
+ */
+#define RSPAMD_URL_MAX_HOST_IDS (1u << 18u)
+#define RSPAMD_URL_MAX_HOST_IDS_SIZE (16u * 1024u * 1024u)
+
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	struct rspamd_tld_trie *tld_trie;
+	/* rspamd_ftok_t -> id */
+	GHashTable *host_ids;
+	gsize host_ids_size;
 };
 
 struct url_match_scanner *url_scanner = NULL;
@@ -403,9 +456,317 @@ rspamd_url_strerror (int err)
 	return NULL;
 }
 
+static struct rspamd_tld_build_node *
+rspamd_tld_build_node_new (const gchar *label, gsize len)
+{
+	struct rspamd_tld_build_node *n;
+
+	n = g_malloc0 (sizeof (*n) + len);
+	memcpy (n + 1, label, len);
+	n->label.begin = (const gchar *)(n + 1);
+	n->label.len = len;
+
+	return n;
+}
+
+static void
+rspamd_tld_build_node_free (gpointer p)
+{
+	struct rspamd_tld_build_node *n = (struct rspamd_tld_build_node *)p;
+
+	if (n->children) {
+		g_hash_table_unref (n->children);
+	}
+
+	g_free (n);
+}
+
+static void
+rspamd_tld_build_add (struct rspamd_tld_build_node *root,
+		const gchar *suffix, guint flags)
+{
+	struct rspamd_tld_build_node *cur = root, *child;
+	const gchar *p, *end = suffix + strlen (suffix);
+	rspamd_ftok_t tok;
+
+	while (end > suffix) {
+		p = end;
+
+		while (p > suffix && *(p - 1) != '.') {
+			p --;
+		}
+
+		tok.begin = p;
+		tok.len = end - p;
+
+		if (tok.len > 0) {
+			if (cur->children == NULL) {
+				cur->children = g_hash_table_new_full (rspamd_ftok_hash,
+						rspamd_ftok_equal, NULL, rspamd_tld_build_node_free);
+			}
+
+			child = g_hash_table_lookup (cur->children, &tok);
+
+			if (child == NULL) {
+				child = rspamd_tld_build_node_new (tok.begin, tok.len);
+				g_hash_table_insert (cur->children, &child->label, child);
+			}
+
+			cur = child;
+		}
+
+		end = p > suffix ? p - 1 : suffix;
+	}
+
+	if (cur != root) {
+		cur->flags |= flags;
+	}
+}
+
+static inline gint
+rspamd_tld_label_cmp (const gchar *l1, gsize len1, const gchar *l2, gsize len2)
+{
+	if (len1 != len2) {
+		return len1 < len2 ? -1 : 1;
+	}
+
+	return memcmp (l1, l2, len1);
+}
+
+static gint
+rspamd_tld_build_node_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_tld_build_node *n1 =
+			*(const struct rspamd_tld_build_node **)a,
+			*n2 = *(const struct rspamd_tld_build_node **)b;
+
+	return rspamd_tld_label_cmp (n1->label.begin, n1->label.len,
+			n2->label.begin, n2->label.len);
+}
+
+static struct rspamd_tld_trie *
+rspamd_tld_trie_compile (struct rspamd_tld_build_node *root)
+{
+	struct rspamd_tld_trie *trie;
+	struct rspamd_tld_build_node *bn;
+	struct rspamd_tld_node node;
+	GPtrArray *order, *children;
+	GArray *nodes;
+	GString *labels;
+	GHashTableIter it;
+	gpointer v;
+	guint i;
+
+	trie = g_malloc0 (sizeof (*trie));
+	order = g_ptr_array_new ();
+	nodes = g_array_new (FALSE, FALSE, sizeof (struct rspamd_tld_node));
+	labels = g_string_new (NULL);
+	g_ptr_array_add (order, root);
+
+	/* BFS order makes children of each node contiguous */
+	for (i = 0; i < order->len; i ++) {
+		bn = g_ptr_array_index (order, i);
+		node.label_off = labels->len;
+		node.label_len = bn->label.len;
+		node.flags = bn->flags;
+		node.children = order->len;
+		node.nchildren = 0;
+		g_string_append_len (labels, bn->label.begin, bn->label.len);
+
+		if (bn->label.len > trie->max_label_len) {
+			trie->max_label_len = bn->label.len;
+		}
+
+		if (bn->children) {
+			children = g_ptr_array_sized_new (g_hash_table_size (bn->children));
+			g_hash_table_iter_init (&it, bn->children);
+
+			while (g_hash_table_iter_next (&it, NULL, &v)) {
+				g_ptr_array_add (children, v);
+			}
+
+			g_ptr_array_sort (children, rspamd_tld_build_node_cmp);
+			node.nchildren = children->len;
+
+			for (guint j = 0; j < children->len; j ++) {
+				g_ptr_array_add (order, g_ptr_array_index (children, j));
+			}
+
+			g_ptr_array_free (children, TRUE);
+		}
+
+		g_array_append_val (nodes, node);
+	}
+
+	trie->nnodes = nodes->len;
+	trie->nodes = (struct rspamd_tld_node *)g_array_free (nodes, FALSE);
+	trie->labels = g_string_free (labels, FALSE);
+	g_ptr_array_free (order, TRUE);
+
+	return trie;
+}
+
+static void
+rspamd_tld_trie_destroy (struct rspamd_tld_trie *trie)
+{
+	if (trie) {
+		g_free (trie->nodes);
+		g_free (trie->labels);
+		g_free (trie);
+	}
+}
+
+/*
+ * Returns length of the effective second level domain of a host: public suffix
+ * with one more label (or two labels for wildcard suffixes) or 0 if a host
+ * has no public suffix
+ */
+static gsize
+rspamd_tld_trie_lookup (const struct rspamd_tld_trie *trie,
+		const gchar *host, gsize hostlen)
+{
+	const struct rspamd_tld_node *cur, *child;
+	const gchar *end = host + hostlen, *p, *q, *pos;
+	gchar lc[256];
+	gsize label_len, best = 0;
+	guint32 lo, hi, mid;
+	gint ndots, r;
+
+	if (trie == NULL || trie->nnodes == 0) {
+		return 0;
+	}
+
+	cur = &trie->nodes[0];
+
+	while (end > host && cur->nchildren > 0) {
+		p = end;
+
+		while (p > host && *(p - 1) != '.') {
+			p --;
+		}
+
+		label_len = end - p;
+
+		if (label_len == 0 || label_len > sizeof (lc)) {
+			break;
+		}
+
+		if (rspamd_str_has_8bit ((const guchar *)p, label_len)) {
+			/* IDN suffixes are stored lowercased as utf8 */
+			memcpy (lc, p, label_len);
+			label_len = rspamd_str_lc_utf8 (lc, label_len);
+		}
+		else {
+			for (gsize i = 0; i < label_len; i ++) {
+				lc[i] = g_ascii_tolower (p[i]);
+			}
+		}
+
+		if (label_len > trie->max_label_len) {
+			break;
+		}
+
+		child = NULL;
+		lo = cur->children;
+		hi = cur->children + cur->nchildren;
+
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			r = rspamd_tld_label_cmp (lc, label_len,
+					trie->labels + trie->nodes[mid].label_off,
+					trie->nodes[mid].label_len);
+
+			if (r == 0) {
+				child = &trie->nodes[mid];
+				break;
+			}
+			else if (r < 0) {
+				hi = mid;
+			}
+			else {
+				lo = mid + 1;
+			}
+		}
+
+		if (child == NULL || p == host) {
+			/* Suffix must be preceded by some label */
+			break;
+		}
+
+		cur = child;
+
+		if (cur->flags & (RSPAMD_TLD_NODE_SUFFIX|RSPAMD_TLD_NODE_STAR)) {
+			ndots = (cur->flags & RSPAMD_TLD_NODE_STAR) ? 2 : 1;
+			/* Skip the dot before suffix and take `ndots` more labels */
+			q = p - 2;
+			pos = host;
+
+			while (q >= host && ndots > 0) {
+				if (*q == '.') {
+					ndots --;
+					pos = q + 1;
+				}
+				else {
+					pos = q;
+				}
+
+				q --;
+			}
+
+			if (host + hostlen - pos > best) {
+				best = host + hostlen - pos;
+			}
+		}
+
+		end = p - 1;
+	}
+
+	return best;
+}
+
+guint32
+rspamd_url_host_id (const gchar *host, gsize hostlen)
+{
+	rspamd_ftok_t srch, *key;
+	gpointer id;
+	guint32 nid;
+
+	if (url_scanner == NULL || hostlen == 0) {
+		return 0;
+	}
+
+	srch.begin = host;
+	srch.len = hostlen;
+	id = g_hash_table_lookup (url_scanner->host_ids, &srch);
+
+	if (id != NULL) {
+		return GPOINTER_TO_UINT (id);
+	}
+
+	if (g_hash_table_size (url_scanner->host_ids) >= RSPAMD_URL_MAX_HOST_IDS ||
+			url_scanner->host_ids_size + hostlen > RSPAMD_URL_MAX_HOST_IDS_SIZE) {
+		/*
+		 * Hosts that are not interned yet will never be interned, so the
+		 * same host has always the same id (or no id)
+		 */
+		return 0;
+	}
+
+	key = g_malloc (sizeof (*key) + hostlen);
+	memcpy (key + 1, host, hostlen);
+	key->begin = (const gchar *)(key + 1);
+	key->len = hostlen;
+	nid = g_hash_table_size (url_scanner->host_ids) + 1;
+	g_hash_table_insert (url_scanner->host_ids, key, GUINT_TO_POINTER (nid));
+	url_scanner->host_ids_size += hostlen;
+
+	return nid;
+}
+
 static gboolean
 rspamd_url_parse_tld_file (const gchar *fname,
-		struct url_match_scanner *scanner)
+		struct url_match_scanner *scanner,
+		struct rspamd_tld_build_node *tld_root)
 {
 	FILE *f;
 	struct url_matcher m;
@@ -456,6 +817,10 @@ rspamd_url_parse_tld_file (const gchar *fname,
 		}
 
 		m.flags = flags;
+		/* Lookups are case insensitive, so suffixes are stored lowercased */
+		p[rspamd_str_lc_utf8 (p, strlen (p))] = '\0';
+		rspamd_tld_build_add (tld_root, p, (flags & URL_FLAG_STAR_MATCH) ?
+				RSPAMD_TLD_NODE_STAR : RSPAMD_TLD_NODE_SUFFIX);
 		rspamd_multipattern_add_pattern (url_scanner->search_trie, p,
 				RSPAMD_MULTIPATTERN_TLD|RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8);
 		m.pattern = rspamd_multipattern_get_pattern (url_scanner->search_trie,
@@ -498,6 +863,8 @@ rspamd_url_deinit (void)
 	if (url_scanner != NULL) {
 		rspamd_multipattern_destroy (url_scanner->search_trie);
 		g_array_free (url_scanner->matchers, TRUE);
+		rspamd_tld_trie_destroy (url_scanner->tld_trie);
+		g_hash_table_unref (url_scanner->host_ids);
 		g_free (url_scanner);
 
 		url_scanner = NULL;
@@ -509,12 +876,17 @@ rspamd_url_init (const gchar *tld_file)
 {
 	GError *err = NULL;
 	gboolean ret = TRUE;
+	struct rspamd_tld_build_node *tld_root;
 
 	if (url_scanner != NULL) {
 		rspamd_url_deinit ();
 	}
 
 	url_scanner = g_malloc (sizeof (struct url_match_scanner));
+	url_scanner->host_ids = g_hash_table_new_full (rspamd_ftok_hash,
+			rspamd_ftok_equal, g_free, NULL);
+	url_scanner->host_ids_size = 0;
+	tld_root = rspamd_tld_build_node_new ("", 0);
 
 	if (tld_file) {
 		/* Reserve larger multipattern */
@@ -533,9 +905,12 @@ rspamd_url_init (const gchar *tld_file)
 	rspamd_url_add_static_matchers (url_scanner);
 
 	if (tld_file != NULL) {
-		ret = rspamd_url_parse_tld_file (tld_file, url_scanner);
+		ret = rspamd_url_parse_tld_file (tld_file, url_scanner, tld_root);
 	}
 
+	url_scanner->tld_trie = rspamd_tld_trie_compile (tld_root);
+	rspamd_tld_build_node_free (tld_root);
+
 	if (!rspamd_multipattern_compile (url_scanner->search_trie, &err)) {
 		msg_err ("cannot compile tld patterns, url matching will be "
 				 "broken completely: %e", err);
@@ -1496,73 +1871,6 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-	ndots = 1;
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots ++;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = url->host;
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = url->host + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-		else {
-			pos = p;
-		}
-
-		p--;
-	}
-
-	if ((ndots == 0 || p == start - 1) &&
-			url->tldlen < url->host + url->hostlen - pos) {
-		url->tld = (gchar *) pos;
-		url->tldlen = url->host + url->hostlen - pos;
-	}
-
-	return 0;
-}
-
 static void
 rspamd_url_regen_from_inet_addr (struct rspamd_url *uri, const void *addr, int af,
 		rspamd_mempool_t *pool)
@@ -2166,9 +2474,26 @@ rspamd_url_parse (struct rspamd_url *uri,
 
 	if (uri->protocol & (PROTOCOL_HTTP|PROTOCOL_HTTPS|PROTOCOL_MAILTO|PROTOCOL_FTP|PROTOCOL_FILE)) {
 		/* Find TLD part */
-		rspamd_multipattern_lookup (url_scanner->search_trie,
-				uri->host, uri->hostlen,
-				rspamd_tld_trie_callback, uri, NULL);
+		gsize tldlen = 0;
+
+		if (uri->hostlen > 1 && uri->host[uri->hostlen - 1] == '.') {
+			/* This is dot at the end of domain */
+			tldlen = rspamd_tld_trie_lookup (url_scanner->tld_trie,
+					uri->host, uri->hostlen - 1);
+
+			if (tldlen > 0) {
+				uri->hostlen --;
+			}
+		}
+		else {
+			tldlen = rspamd_tld_trie_lookup (url_scanner->tld_trie,
+					uri->host, uri->hostlen);
+		}
+
+		if (tldlen > 0) {
+			uri->tld = uri->host + uri->hostlen - tldlen;
+			uri->tldlen = tldlen;
+		}
 
 		if (uri->tldlen == 0) {
 			if (!(parse_flags & RSPAMD_URL_PARSE_HREF)) {
@@ -2224,92 +2549,45 @@ rspamd_url_parse (struct rspamd_url *uri,
 		}
 	}
 
-	return URI_ERRNO_OK;
-}
-
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
-
-static gint
-rspamd_tld_trie_find_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
-
-	if (*pos != '.' || match_pos != (gint)cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint)cbdata->len - 1) {
-			/* Search more */
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
+	uri->host_id = rspamd_url_host_id (uri->host, uri->hostlen);
 
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-		else {
-			pos = p;
-		}
-
-		p--;
+	if (uri->tld == uri->host && uri->tldlen == uri->hostlen) {
+		uri->tld_id = uri->host_id;
 	}
-
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
-		}
+	else {
+		uri->tld_id = rspamd_url_host_id (uri->tld, uri->tldlen);
 	}
 
-	return 0;
+	return URI_ERRNO_OK;
 }
 
 gboolean
 rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
+	gsize tldlen;
 
 	g_assert (in != NULL);
 	g_assert (out != NULL);
 	g_assert (url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
-			rspamd_tld_trie_find_callback, &cbdata, NULL);
+	if (inlen > 1 && in[inlen - 1] == '.') {
+		/* Trailing dot is included in the result */
+		tldlen = rspamd_tld_trie_lookup (url_scanner->tld_trie, in, inlen - 1);
+
+		if (tldlen > 0) {
+			tldlen ++;
+		}
+	}
+	else {
+		tldlen = rspamd_tld_trie_lookup (url_scanner->tld_trie, in, inlen);
+	}
+
+	if (tldlen > 0) {
+		out->begin = in + inlen - tldlen;
+		out->len = tldlen;
 
-	if (out->len > 0) {
 		return TRUE;
 	}
 
@@ -2928,6 +3206,7 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 	struct url_callback_data *cb = context;
 	gint rc;
 	rspamd_mempool_t *pool;
+	gchar *key = NULL;
 
 	pos = text + match_pos;
 
@@ -2999,18 +3278,64 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 		cb->start = m.m_begin;
 		cb->fin = pos;
-		url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
 		g_strstrip (cb->url_str);
+
+		if (cb->seen) {
+			url = g_hash_table_lookup (cb->seen, cb->url_str);
+
+			if (url == URL_SEEN_FAILED (cb->prefix_added)) {
+				/* The same string has already failed to parse */
+				cb->prefix_added = FALSE;
+
+				if (cb->stat) {
+					cb->stat->duplicates ++;
+				}
+
+				return !multiple;
+			}
+
+			if (url != NULL && url != URL_SEEN_FAILED (!cb->prefix_added) &&
+					!!(url->flags & RSPAMD_URL_FLAG_SCHEMALESS) == cb->prefix_added) {
+				/* Parsing is the same for the same string, skip it */
+				cb->prefix_added = FALSE;
+
+				if (cb->stat) {
+					cb->stat->duplicates ++;
+				}
+
+				if (cb->func) {
+					if (!cb->func (url, cb->start - text,
+							(m.m_begin + m.m_len) - text, cb->funcd)) {
+						return -1;
+					}
+				}
+
+				return !multiple;
+			}
+
+			/* Parser modifies string in place, so we need a copy as a key */
+			key = rspamd_mempool_strdup (pool, cb->url_str);
+		}
+
+		url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
 		rc = rspamd_url_parse (url, cb->url_str,
 				strlen (cb->url_str), pool,
 				RSPAMD_URL_PARSE_TEXT);
 
+		if (cb->stat) {
+			cb->stat->candidates ++;
+		}
+
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
 			if (cb->prefix_added) {
 				url->flags |= RSPAMD_URL_FLAG_SCHEMALESS;
 				cb->prefix_added = FALSE;
 			}
 
+			if (key != NULL) {
+				g_hash_table_replace (cb->seen, key, url);
+			}
+
 			if (cb->func) {
 				if (!cb->func (url, cb->start - text, (m.m_begin + m.m_len) - text,
 						cb->funcd)) {
@@ -3019,10 +3344,22 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 				}
 			}
 		}
-		else if (rc != URI_ERRNO_OK) {
-			msg_debug_pool_check ("extract of url '%s' failed: %s",
-					cb->url_str,
-					rspamd_url_strerror (rc));
+		else {
+			if (key != NULL) {
+				/* Remember failures as well to skip parsing of the same string */
+				g_hash_table_replace (cb->seen, key,
+						URL_SEEN_FAILED (cb->prefix_added));
+			}
+
+			if (rc != URI_ERRNO_OK) {
+				msg_debug_pool_check ("extract of url '%s' failed: %s",
+						cb->url_str,
+						rspamd_url_strerror (rc));
+
+				if (cb->stat) {
+					cb->stat->failed ++;
+				}
+			}
 		}
 	}
 	else {
@@ -3065,6 +3402,29 @@ struct rspamd_url_mimepart_cbdata {
 	gsize url_len;
 };
 
+/*
+ * Returns FALSE if no more urls can be added to the table due to `max_urls`
+ */
+static gboolean
+rspamd_url_check_max_urls (struct rspamd_task *task, GHashTable *target_tbl)
+{
+	if (task->cfg && task->cfg->max_urls > 0 &&
+			g_hash_table_size (target_tbl) >= task->cfg->max_urls) {
+		if (!(task->flags & RSPAMD_TASK_FLAG_URLS_TRUNCATED)) {
+			msg_info_task ("message has too many URLs, we cannot process "
+						   "more: %d urls extracted",
+					(guint)g_hash_table_size (target_tbl));
+			task->flags |= RSPAMD_TASK_FLAG_URLS_TRUNCATED;
+		}
+
+		MESSAGE_FIELD (task, url_stat).dropped ++;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 		gsize end_offset, gpointer ud)
@@ -3074,11 +3434,13 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	struct rspamd_task *task;
 	gchar *url_str = NULL;
 	struct rspamd_url *query_url, *existing;
+	struct rspamd_url_extract_stat *stat;
 	GHashTable *target_tbl = NULL;
 	gint rc;
-	gboolean prefix_added;
+	gboolean prefix_added, is_dup = FALSE;
 
 	task = cbd->task;
+	stat = &MESSAGE_FIELD (task, url_stat);
 	ex = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_process_exception));
 
 	ex->pos = start_offset;
@@ -3108,23 +3470,19 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	}
 
 	if (target_tbl) {
-		/* Also check max urls */
-		if (cbd->task->cfg && cbd->task->cfg->max_urls > 0) {
-			if (g_hash_table_size (target_tbl) > cbd->task->cfg->max_urls) {
-				msg_err_task ("part has too many URLs, we cannot process more: "
-							  "%d urls extracted ",
-						(guint)g_hash_table_size (target_tbl));
-
+		if ((existing = g_hash_table_lookup (target_tbl, url)) == NULL) {
+			/* Also check max urls */
+			if (!rspamd_url_check_max_urls (task, target_tbl)) {
 				return FALSE;
 			}
-		}
 
-		if ((existing = g_hash_table_lookup (target_tbl, url)) == NULL) {
 			url->flags |= RSPAMD_URL_FLAG_FROM_TEXT;
 			g_hash_table_insert (target_tbl, url, url);
 		}
 		else {
 			existing->count++;
+			/* Query of this url has been already checked */
+			is_dup = TRUE;
 		}
 	}
 
@@ -3134,8 +3492,23 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 			cbd->part->exceptions,
 			ex);
 
+	if (url->querylen > 0 && !is_dup && task->cfg &&
+			task->cfg->max_url_queries > 0 &&
+			stat->query_checks >= task->cfg->max_url_queries) {
+		if (!(task->flags & RSPAMD_TASK_FLAG_URLS_QUERY_LIMIT)) {
+			msg_info_task ("message has too many URLs with queries, stop "
+						   "searching URLs in queries after %ud URLs",
+					stat->query_checks);
+			task->flags |= RSPAMD_TASK_FLAG_URLS_QUERY_LIMIT;
+		}
+
+		is_dup = TRUE;
+	}
+
 	/* We also search the query for additional url inside */
-	if (url->querylen > 0) {
+	if (url->querylen > 0 && !is_dup) {
+		stat->query_checks ++;
+
 		if (rspamd_url_find (task->task_pool, url->query, url->querylen,
 				&url_str, RSPAMD_URL_FIND_ALL, NULL, &prefix_added)) {
 			query_url = rspamd_mempool_alloc0 (task->task_pool,
@@ -3166,6 +3539,10 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 
 				if (target_tbl) {
 					if ((existing = g_hash_table_lookup (target_tbl, query_url)) == NULL) {
+						if (!rspamd_url_check_max_urls (task, target_tbl)) {
+							return FALSE;
+						}
+
 						url->flags |= RSPAMD_URL_FLAG_FROM_TEXT;
 						g_hash_table_insert (target_tbl, query_url, query_url);
 					}
@@ -3180,6 +3557,42 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	return TRUE;
 }
 
+static void
+rspamd_url_find_multiple_common (rspamd_mempool_t *pool,
+								 const gchar *in,
+								 gsize inlen,
+								 enum rspamd_url_find_type how,
+								 GPtrArray *nlines,
+								 url_insert_function func,
+								 gpointer ud,
+								 GHashTable *seen,
+								 struct rspamd_url_extract_stat *stat)
+{
+	struct url_callback_data cb;
+
+	g_assert (in != NULL);
+
+	if (inlen == 0) {
+		inlen = strlen (in);
+	}
+
+	memset (&cb, 0, sizeof (cb));
+	cb.begin = in;
+	cb.end = in + inlen;
+	cb.how = how;
+	cb.pool = pool;
+
+	cb.funcd = ud;
+	cb.func = func;
+	cb.newlines = nlines;
+	cb.seen = seen;
+	cb.stat = stat;
+
+	rspamd_multipattern_lookup (url_scanner->search_trie, in,
+			inlen,
+			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+}
+
 void
 rspamd_url_text_extract (rspamd_mempool_t *pool,
 						 struct rspamd_task *task,
@@ -3187,19 +3600,45 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 						 enum rspamd_url_find_type how)
 {
 	struct rspamd_url_mimepart_cbdata mcbd;
+	struct rspamd_message *msg = task->message;
 
 	if (part->utf_stripped_content == NULL || part->utf_stripped_content->len == 0) {
 		msg_warn_task ("got empty text part");
 		return;
 	}
 
+	if (task->flags & RSPAMD_TASK_FLAG_URLS_TRUNCATED) {
+		/* Limit has been reached in the previous parts */
+		return;
+	}
+
 	mcbd.task = task;
 	mcbd.part = part;
 	mcbd.url_len = 0;
 
-	rspamd_url_find_multiple (task->task_pool, part->utf_stripped_content->data,
+	/*
+	 * The same urls are likely repeated in a message (e.g. in text and html
+	 * alternatives), so we cache parsed urls by their text for all parts
+	 */
+	if (msg->url_candidates == NULL) {
+		msg->url_candidates = g_hash_table_new (rspamd_str_hash,
+				rspamd_str_equal);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)g_hash_table_unref,
+				msg->url_candidates);
+	}
+
+	rspamd_url_find_multiple_common (task->task_pool,
+			part->utf_stripped_content->data,
 			part->utf_stripped_content->len, how, part->newlines,
-			rspamd_url_text_part_callback, &mcbd);
+			rspamd_url_text_part_callback, &mcbd,
+			msg->url_candidates, &msg->url_stat);
+
+	msg_debug_task ("urls extraction stats: %ud candidates, %ud duplicates, "
+			"%ud failed, %ud queries checked, %ud dropped",
+			msg->url_stat.candidates, msg->url_stat.duplicates,
+			msg->url_stat.failed, msg->url_stat.query_checks,
+			msg->url_stat.dropped);
 }
 
 void
@@ -3211,27 +3650,8 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool,
 						  url_insert_function func,
 						  gpointer ud)
 {
-	struct url_callback_data cb;
-
-	g_assert (in != NULL);
-
-	if (inlen == 0) {
-		inlen = strlen (in);
-	}
-
-	memset (&cb, 0, sizeof (cb));
-	cb.begin = in;
-	cb.end = in + inlen;
-	cb.how = how;
-	cb.pool = pool;
-
-	cb.funcd = ud;
-	cb.func = func;
-	cb.newlines = nlines;
-
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	rspamd_url_find_multiple_common (pool, in, inlen, how, nlines, func, ud,
+			NULL, NULL);
 }
 
 void
@@ -3356,6 +3776,11 @@ rspamd_url_host_hash (gconstpointer u)
 {
 	const struct rspamd_url *url = u;
 
+	if (url->host_id != 0) {
+		/* The same host always has the same id (or no id at all) */
+		return url->host_id;
+	}
+
 	if (url->hostlen > 0) {
 		return (guint)rspamd_cryptobox_fast_hash (url->host, url->hostlen,
 				rspamd_hash_seed ());
@@ -3433,6 +3858,10 @@ rspamd_urls_host_cmp (gconstpointer a, gconstpointer b)
 	const struct rspamd_url *u1 = a, *u2 = b;
 	int r = 0;
 
+	if (u1->host_id != 0 && u2->host_id != 0) {
+		return u1->host_id == u2->host_id;
+	}
+
 	if (u1->hostlen != u2->hostlen) {
 		return FALSE;
 	}
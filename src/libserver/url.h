@@ -69,6 +69,18 @@ struct rspamd_url {
 
 	enum rspamd_url_flags flags;
 	guint count;
+	/* Interned ids of host and tld, 0 if not interned */
+	guint32 host_id;
+	guint32 tld_id;
+};
+
+/* Statistics of urls extraction from text parts */
+struct rspamd_url_extract_stat {
+	guint candidates;   /* candidates passed to the url parser */
+	guint duplicates;   /* candidates that are reused without parsing */
+	guint failed;       /* candidates that are not urls */
+	guint query_checks; /* urls which queries are searched for other urls */
+	guint dropped;      /* extractions stopped due to urls limit */
 };
 
 enum uri_errno {
@@ -167,6 +179,19 @@ const gchar *rspamd_url_strerror (int err);
  */
 gboolean rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out);
 
+/**
+ * Returns interned id for a (lowercased) host or tld, ids are stable while
+ * url library is not reinitialised, so they can be compared instead of strings.
+ * Interned hosts are kept till reinitialisation, at most 256k hosts and
+ * 16Mb of their names are interned, new hosts get no id after that. The
+ * same host always has the same id or no id, so two hosts without ids
+ * must be compared as strings
+ * @param host
+ * @param hostlen
+ * @return id or 0 if the interned hosts limit has been reached
+ */
+guint32 rspamd_url_host_id (const gchar *host, gsize hostlen);
+
 typedef gboolean (*url_insert_function) (struct rspamd_url *url,
 									 gsize start_offset, gsize end_offset, void *ud);
 
@@ -59,6 +59,16 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#include <netinet/tcp.h> /* for TCP_INFO */
+
+#if defined(__linux__) && defined(TCP_INFO)
+#define RSPAMD_HAVE_LISTEN_QUEUE_INFO 1
+#endif
+
 #include "contrib/libev/ev.h"
 #include "libstat/stat_api.h"
 
@@ -217,12 +227,20 @@ rspamd_worker_on_delayed_shutdown (EV_P_ ev_timer *w, int revents)
 	ev_break (loop, EVBREAK_ALL);
 }
 
+#define RSPAMD_REUSEPORT_DRAIN_INTERVAL 0.1
+
+static ev_timer reuseport_drain_ev;
+
 static void
 rspamd_worker_shutdown_check (EV_P_ ev_timer *w, int revents)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)w->data;
 
-	if (worker->state != rspamd_worker_wanna_die) {
+	if (ev_is_active (&reuseport_drain_ev)) {
+		/* Queued connections are still being accepted */
+		ev_timer_again (EV_A_ w);
+	}
+	else if (worker->state != rspamd_worker_wanna_die) {
 		rspamd_worker_terminate_handlers (worker);
 
 		if (worker->state == rspamd_worker_wanna_die) {
@@ -241,6 +259,47 @@ rspamd_worker_shutdown_check (EV_P_ ev_timer *w, int revents)
 	}
 }
 
+/*
+ * Reuseport sockets belong to a single worker, so connections that the kernel
+ * has already queued for such a socket are lost when it is closed. On reload we
+ * therefore keep accepting until the queue is empty and only then close the
+ * socket, so new connections go to the sockets of the new workers
+ */
+static void
+rspamd_worker_reuseport_drain (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)w->data;
+	struct rspamd_worker_listen_socket *ls;
+	GList *cur;
+	guint depth;
+	static guint nchecks = 0;
+
+	depth = rspamd_worker_listen_queue_depth (worker);
+
+	if (depth > 0 &&
+			++nchecks * RSPAMD_REUSEPORT_DRAIN_INTERVAL < SOFT_SHUTDOWN_TIME) {
+		ev_timer_again (EV_A_ w);
+
+		return;
+	}
+
+	if (depth > 0) {
+		msg_warn ("drop %ud queued connections on reuseport sockets", depth);
+	}
+
+	ev_timer_stop (EV_A_ w);
+	rspamd_worker_stop_accept (worker);
+
+	for (cur = worker->cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+		ls = cur->data;
+
+		if (ls->fd != -1) {
+			close (ls->fd);
+			ls->fd = -1;
+		}
+	}
+}
+
 /*
  * Config reload is designed by sending sigusr2 to active workers and pending shutdown of them
  */
@@ -284,7 +343,17 @@ rspamd_worker_usr2_handler (struct rspamd_worker_signal_handler *sigh, void *arg
 			ev_timer_start (sigh->event_loop, &shutdown_check_ev);
 		}
 
-		rspamd_worker_stop_accept (sigh->worker);
+		if (sigh->worker->cf->reuseport_socks) {
+			/* Accept connections queued before the new workers are started */
+			reuseport_drain_ev.data = sigh->worker;
+			ev_timer_init (&reuseport_drain_ev, rspamd_worker_reuseport_drain,
+					RSPAMD_REUSEPORT_DRAIN_INTERVAL,
+					RSPAMD_REUSEPORT_DRAIN_INTERVAL);
+			ev_timer_start (sigh->event_loop, &reuseport_drain_ev);
+		}
+		else {
+			rspamd_worker_stop_accept (sigh->worker);
+		}
 	}
 
 	/* No more signals */
@@ -684,6 +753,159 @@ rspamd_worker_drop_priv (struct rspamd_main *rspamd_main)
 	}
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+/*
+ * Returns the number of CPU bound processes of the worker types configured
+ * before this one, so workers of different types do not share CPUs
+ */
+static guint
+rspamd_worker_cpu_offset (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf)
+{
+	struct rspamd_worker_conf *cur_cf;
+	GList *cur;
+	guint offset = 0;
+
+	for (cur = rspamd_main->cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cur_cf = cur->data;
+
+		if (cur_cf == cf) {
+			return offset;
+		}
+
+		if (cur_cf->worker == NULL || !cur_cf->enabled || cur_cf->count <= 0 ||
+				!cur_cf->cpu_affinity) {
+			continue;
+		}
+
+		if (cur_cf->worker->flags &
+				(RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_THREADED)) {
+			offset ++;
+		}
+		else {
+			offset += cur_cf->count;
+		}
+	}
+
+	/* Worker is not in the current config */
+	return 0;
+}
+#endif
+
+static void
+rspamd_worker_set_affinity (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t allowed, target;
+	gint cpu, ncpus, nskip;
+
+	/* Select CPUs from those allowed for the main process */
+	CPU_ZERO (&allowed);
+
+	if (sched_getaffinity (0, sizeof (allowed), &allowed) == -1) {
+		msg_warn_main ("cannot get CPU affinity: %s", strerror (errno));
+
+		return;
+	}
+
+	ncpus = CPU_COUNT (&allowed);
+
+	if (ncpus <= 1) {
+		return;
+	}
+
+	nskip = (rspamd_worker_cpu_offset (rspamd_main, wrk->cf) + wrk->index) %
+			ncpus;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+		if (CPU_ISSET (cpu, &allowed) && nskip-- == 0) {
+			break;
+		}
+	}
+
+	CPU_ZERO (&target);
+	CPU_SET (cpu, &target);
+
+	if (sched_setaffinity (0, sizeof (target), &target) == -1) {
+		msg_warn_main ("cannot bind %s process (%d) to CPU %d: %s",
+				wrk->cf->worker->name, wrk->index, cpu, strerror (errno));
+	}
+	else {
+		msg_info_main ("bind %s process (%d) to CPU %d",
+				wrk->cf->worker->name, wrk->index, cpu);
+	}
+#else
+	msg_warn_main ("cannot bind %s process (%d) to CPU: not supported",
+			wrk->cf->worker->name, wrk->index);
+#endif
+}
+
+/*
+ * Uses a personal set of reuseport sockets for a worker and closes sockets
+ * of other workers
+ */
+static void
+rspamd_worker_select_reuseport (struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_conf *cf = wrk->cf;
+	struct rspamd_worker_listen_socket *ls;
+	GList *cur;
+	guint i;
+
+	for (i = 0; i < cf->reuseport_socks->len; i ++) {
+		cur = g_ptr_array_index (cf->reuseport_socks, i);
+
+		if (i == wrk->index) {
+			cf->listen_socks = cur;
+			continue;
+		}
+
+		for (; cur != NULL; cur = g_list_next (cur)) {
+			ls = cur->data;
+
+			if (ls->fd != -1) {
+				close (ls->fd);
+				ls->fd = -1;
+			}
+		}
+	}
+}
+
+guint
+rspamd_worker_listen_queue_depth (struct rspamd_worker *worker)
+{
+	guint depth = 0;
+#ifdef RSPAMD_HAVE_LISTEN_QUEUE_INFO
+	struct rspamd_worker_listen_socket *ls;
+	struct tcp_info info;
+	socklen_t optlen;
+	GList *cur;
+
+	if (worker->cf == NULL) {
+		return 0;
+	}
+
+	for (cur = worker->cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+		ls = cur->data;
+
+		if (ls->fd == -1 || ls->type != RSPAMD_WORKER_SOCKET_TCP ||
+				rspamd_inet_address_get_af (ls->addr) == AF_UNIX) {
+			continue;
+		}
+
+		optlen = sizeof (info);
+
+		/* For listening sockets Linux reports accept queue length here */
+		if (getsockopt (ls->fd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == 0) {
+			depth += info.tcpi_unacked;
+		}
+	}
+#endif
+
+	return depth;
+}
+
 static void
 rspamd_worker_set_limits (struct rspamd_main *rspamd_main,
 		struct rspamd_worker_conf *cf)
@@ -1014,6 +1236,14 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		rspamd_worker_drop_priv (rspamd_main);
 		/* Set limits */
 		rspamd_worker_set_limits (rspamd_main, cf);
+
+		if (cf->reuseport_socks && index < cf->reuseport_socks->len) {
+			rspamd_worker_select_reuseport (wrk);
+		}
+
+		if (cf->cpu_affinity) {
+			rspamd_worker_set_affinity (rspamd_main, wrk);
+		}
 		/* Re-set stack limit */
 		getrlimit (RLIMIT_STACK, &rlim);
 		rlim.rlim_cur = 100 * 1024 * 1024;
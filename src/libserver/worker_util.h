@@ -219,6 +219,14 @@ void rspamd_worker_init_monitored (struct rspamd_worker *worker,
 								   struct ev_loop *ev_base,
 								   struct rspamd_dns_resolver *resolver);
 
+/**
+ * Returns number of connections waiting to be accepted on the worker's
+ * listen sockets (if supported by OS, 0 otherwise)
+ * @param worker
+ * @return
+ */
+guint rspamd_worker_listen_queue_depth (struct rspamd_worker *worker);
+
 /**
  * Performs throttling for accept events
  * @param sock
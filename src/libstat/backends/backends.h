@@ -115,10 +115,46 @@ RSPAMD_STAT_BACKEND_DEF(mmaped_file);
 
 RSPAMD_STAT_BACKEND_DEF(sqlite3);
 
+RSPAMD_STAT_BACKEND_DEF(snapshot);
+
+/* Token used to build read-only statistics snapshots */
+struct rspamd_stat_snapshot_token {
+	guint64 hash;
+	gdouble value;
+};
+
+/**
+ * Writes a read-only snapshot of statfile to the specified path. The file is
+ * replaced atomically, so workers can reload it while it is being updated.
+ * @param path destination path
+ * @param tokens array of `struct rspamd_stat_snapshot_token` (sorted in place)
+ * @param learns number of learns for this statfile
+ * @param err error
+ * @return TRUE if a snapshot has been written
+ */
+gboolean rspamd_stat_snapshot_write (const gchar *path,
+									 GArray *tokens,
+									 guint64 learns,
+									 GError **err);
+
 #ifdef WITH_HIREDIS
 
 RSPAMD_STAT_BACKEND_DEF(redis);
 
+/**
+ * Checks if native expiry is enabled and can be used with the specified redis
+ * classifier options: it requires new schema, positive expiry and no tokens
+ * sharding. Classifiers with native expiry are skipped by bayes_expiry plugin
+ * @param obj classifier options
+ * @return TRUE if redis backend expires tokens itself
+ */
+gboolean rspamd_redis_native_expiry_enabled (const ucl_object_t *obj);
+
+/**
+ * Returns source of the server side script for a native expiry step
+ */
+const gchar *rspamd_redis_expiry_script_source (void);
+
 #endif
 
 #ifdef  __cplusplus
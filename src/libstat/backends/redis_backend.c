@@ -40,6 +40,13 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_EXPIRY_PREFIX "RS_expiry"
+#define REDIS_EXPIRY_DEFAULT_INTERVAL 5.0
+#define REDIS_EXPIRY_DEFAULT_COUNT 2000
+#define REDIS_EXPIRY_DEFAULT_SIGNIFICANT 10
+#define REDIS_EXPIRY_SIGNIFICANT_FACTOR 0.75
+/* Number of epochs buckets per expiry period */
+#define REDIS_EXPIRY_EPOCHS 16
 
 struct redis_stat_ctx {
 	lua_State *L;
@@ -54,7 +61,14 @@ struct redis_stat_ctx {
 	gboolean store_tokens;
 	gboolean new_schema;
 	gboolean enable_signatures;
+	gboolean shard_tokens;
+	gboolean native_expiry;
 	guint expiry;
+	guint expiry_count;
+	guint expiry_significant;
+	gdouble expiry_interval;
+	const gchar *expiry_prefix;
+	struct rspamd_redis_expiry_elt *expiry_elt;
 	gint cbref_user;
 };
 
@@ -73,15 +87,25 @@ struct redis_stat_runtime {
 	ev_timer timeout_event;
 	GArray *results;
 	GPtrArray *tokens;
+	GPtrArray *shards; /* struct redis_stat_shard */
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
 	guint64 learned;
 	gint id;
+	guint shards_inflight;
 	gboolean has_event;
 	GError *err;
 };
 
+/* Part of tokens that live on a specific redis server when sharding is on */
+struct redis_stat_shard {
+	struct redis_stat_runtime *rt;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	GPtrArray *tokens;
+};
+
 /* Used to get statistics from redis */
 struct rspamd_redis_stat_cbdata;
 
@@ -103,6 +127,23 @@ struct rspamd_redis_stat_cbdata {
 	gboolean wanna_die;
 };
 
+/* Native incremental expiry of tokens */
+struct rspamd_redis_expiry_elt {
+	struct redis_stat_ctx *ctx;
+	struct rspamd_stat_async_elt *async;
+	struct ev_loop *event_loop;
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	guint64 checked;
+	guint64 expired;
+	guint64 kept;
+	guint64 pending_epochs;
+	guint64 bucket_remaining;
+	gdouble last_ts;
+	gdouble rate;
+	gchar script_sha[41];
+};
+
 #define GET_TASK_ELT(task, elt) (task == NULL ? NULL : (task)->elt)
 
 static const gchar *M = "redis statistics";
@@ -361,6 +402,22 @@ rspamd_redis_expand_object (const gchar *pattern,
 	return tlen;
 }
 
+/*
+ * Expiry epochs are fractions of expiry time, tokens learned in the same
+ * epoch are stored in the same bucket
+ */
+static inline guint64
+rspamd_redis_expiry_epoch_len (struct redis_stat_ctx *ctx)
+{
+	return MAX (ctx->expiry / REDIS_EXPIRY_EPOCHS, 60);
+}
+
+static inline guint64
+rspamd_redis_expiry_epoch (struct redis_stat_ctx *ctx, gdouble now)
+{
+	return (guint64)now / rspamd_redis_expiry_epoch_len (ctx);
+}
+
 static void
 rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 {
@@ -375,6 +432,7 @@ rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 static rspamd_fstring_t *
 rspamd_redis_tokens_to_query (struct rspamd_task *task,
 		struct redis_stat_runtime *rt,
+		redisAsyncContext *redis,
 		GPtrArray *tokens,
 		const gchar *command,
 		const gchar *prefix,
@@ -382,10 +440,11 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 		gint idx,
 		gboolean intvals)
 {
-	rspamd_fstring_t *out;
+	rspamd_fstring_t *out, *bucket = NULL;
 	rspamd_token_t *tok;
-	gchar n0[512], n1[64];
-	guint i, l0, l1, cmd_len, prefix_len;
+	gchar n0[512], n1[64], bucket_name[256];
+	guint i, l0, l1, cmd_len, prefix_len, bucket_len = 0;
+	guint64 epoch = 0;
 	gint ret;
 
 	g_assert (tokens != NULL);
@@ -394,16 +453,36 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 	prefix_len = strlen (prefix);
 	out = rspamd_fstring_sized_new (1024);
 
+	if (learn && rt->ctx->native_expiry) {
+		/* SADD <bucket> <token> ... */
+		epoch = rspamd_redis_expiry_epoch (rt->ctx, ev_time ());
+		bucket_len = rspamd_snprintf (bucket_name, sizeof (bucket_name),
+				"%s_%uL", rt->ctx->expiry_prefix, epoch);
+		bucket = rspamd_fstring_sized_new (tokens->len * 32);
+		rspamd_printf_fstring (&bucket, ""
+						"*%d\r\n"
+						"$4\r\n"
+						"SADD\r\n"
+						"$%d\r\n"
+						"%s\r\n",
+				(gint)(tokens->len + 2),
+				bucket_len, bucket_name);
+	}
+
 	if (learn) {
 		rspamd_printf_fstring (&out, "*1\r\n$5\r\nMULTI\r\n");
 
-		ret = redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+		ret = redisAsyncFormattedCommand (redis, NULL, NULL,
 				out->str, out->len);
 
 		if (ret != REDIS_OK) {
-			msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+			msg_err_task ("call to redis failed: %s", redis->errstr);
 			rspamd_fstring_free (out);
 
+			if (bucket) {
+				rspamd_fstring_free (bucket);
+			}
+
 			return NULL;
 		}
 
@@ -414,11 +493,11 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 			/* Multi + HGET */
 			rspamd_printf_fstring (&out, "*1\r\n$5\r\nMULTI\r\n");
 
-			ret = redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+			ret = redisAsyncFormattedCommand (redis, NULL, NULL,
 					out->str, out->len);
 
 			if (ret != REDIS_OK) {
-				msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+				msg_err_task ("call to redis failed: %s", redis->errstr);
 				rspamd_fstring_free (out);
 
 				return NULL;
@@ -496,13 +575,17 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 						l1, n1);
 			}
 
-			ret = redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+			ret = redisAsyncFormattedCommand (redis, NULL, NULL,
 					out->str, out->len);
 
 			if (ret != REDIS_OK) {
-				msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+				msg_err_task ("call to redis failed: %s", redis->errstr);
 				rspamd_fstring_free (out);
 
+				if (bucket) {
+					rspamd_fstring_free (bucket);
+				}
+
 				return NULL;
 			}
 
@@ -515,14 +598,14 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 					 * ZINCRBY prefix_z 1.0 <token_id>
 					 */
 					if (tok->t1 && tok->t2) {
-						redisAsyncCommand (rt->redis, NULL, NULL,
+						redisAsyncCommand (redis, NULL, NULL,
 								"HSET %b_tokens %b %b:%b",
 								prefix, (size_t) prefix_len,
 								n0, (size_t) l0,
 								tok->t1->stemmed.begin, tok->t1->stemmed.len,
 								tok->t2->stemmed.begin, tok->t2->stemmed.len);
 					} else if (tok->t1) {
-						redisAsyncCommand (rt->redis, NULL, NULL,
+						redisAsyncCommand (redis, NULL, NULL,
 								"HSET %b_tokens %b %b",
 								prefix, (size_t) prefix_len,
 								n0, (size_t) l0,
@@ -537,14 +620,14 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 					 * ZINCRBY prefix_z 1.0 <token_id>
 					 */
 					if (tok->t1 && tok->t2) {
-						redisAsyncCommand (rt->redis, NULL, NULL,
+						redisAsyncCommand (redis, NULL, NULL,
 								"HSET %b %s %b:%b",
 								n0, (size_t) l0,
 								"tokens",
 								tok->t1->stemmed.begin, tok->t1->stemmed.len,
 								tok->t2->stemmed.begin, tok->t2->stemmed.len);
 					} else if (tok->t1) {
-						redisAsyncCommand (rt->redis, NULL, NULL,
+						redisAsyncCommand (redis, NULL, NULL,
 								"HSET %b %s %b",
 								n0, (size_t) l0,
 								"tokens",
@@ -552,14 +635,38 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 					}
 				}
 
-				redisAsyncCommand (rt->redis, NULL, NULL,
+				redisAsyncCommand (redis, NULL, NULL,
 						"ZINCRBY %b_z %b %b",
 						prefix, (size_t)prefix_len,
 						n1, (size_t)l1,
 						n0, (size_t)l0);
 			}
 
-			if (rt->ctx->new_schema && rt->ctx->expiry > 0) {
+			if (bucket) {
+				/* Tokens are expired by the native engine, record last learn */
+				out->len = 0;
+				l1 = rspamd_snprintf (n1, sizeof (n1), "%uL", epoch);
+
+				rspamd_printf_fstring (&out, ""
+								"*4\r\n"
+								"$4\r\n"
+								"HSET\r\n"
+								"$%d\r\n"
+								"%s\r\n"
+								"$1\r\n"
+								"T\r\n"
+								"$%d\r\n"
+								"%s\r\n",
+						l0, n0,
+						l1, n1);
+				redisAsyncFormattedCommand (redis, NULL, NULL,
+						out->str, out->len);
+				rspamd_printf_fstring (&bucket, ""
+								"$%d\r\n"
+								"%s\r\n",
+						l0, n0);
+			}
+			else if (rt->ctx->new_schema && rt->ctx->expiry > 0) {
 				out->len = 0;
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%d",
 						rt->ctx->expiry);
@@ -574,7 +681,7 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 								"%s\r\n",
 						l0, n0,
 						l1, n1);
-				redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+				redisAsyncFormattedCommand (redis, NULL, NULL,
 						out->str, out->len);
 			}
 
@@ -598,11 +705,11 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 						l0, n0,
 						1, rt->stcf->is_spam ? "S" : "H");
 
-				ret = redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+				ret = redisAsyncFormattedCommand (redis, NULL, NULL,
 						out->str, out->len);
 
 				if (ret != REDIS_OK) {
-					msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+					msg_err_task ("call to redis failed: %s", redis->errstr);
 					rspamd_fstring_free (out);
 
 					return NULL;
@@ -623,6 +730,15 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 		rspamd_printf_fstring (&out, "*1\r\n$4\r\nEXEC\r\n");
 	}
 
+	if (bucket) {
+		redisAsyncFormattedCommand (redis, NULL, NULL,
+				bucket->str, bucket->len);
+		redisAsyncCommand (redis, NULL, NULL,
+				"ZADD %s_epochs %uL %uL",
+				rt->ctx->expiry_prefix, epoch, epoch);
+		rspamd_fstring_free (bucket);
+	}
+
 	return out;
 }
 
@@ -1062,6 +1178,454 @@ rspamd_redis_async_stat_fin (struct rspamd_stat_async_elt *elt, gpointer d)
 	}
 }
 
+/*
+ * Performs one bounded expiry step: pops up to `count` tokens from the oldest
+ * outdated epoch bucket and removes those that have not been learned since
+ * then, unless they are significant. Significant tokens are moved to the
+ * current epoch bucket. Only one step per interval is done over all workers
+ * and hosts, other callers just get the accumulated counters.
+ *
+ * KEYS: epochs zset, stats hash, lock
+ * ARGV: buckets prefix, current epoch, cutoff epoch, count, interval,
+ * significant hits
+ * Returns: {stepped, checked, expired, kept, total checked, total expired,
+ * total kept, pending epochs, tokens left in the current bucket}
+ *
+ * SPOP with count is not deterministic, so effects replication must be
+ * turned on before any write
+ */
+static const gchar *rspamd_redis_expiry_script =
+		"if redis.replicate_commands then redis.replicate_commands() end;"
+		"local prefix = ARGV[1];"
+		"local now_epoch, cutoff = tonumber(ARGV[2]), tonumber(ARGV[3]);"
+		"local epochs_key, stats_key = KEYS[1], KEYS[2];"
+		"local checked, expired, kept, remaining, stepped = 0, 0, 0, 0, 0;"
+		"if redis.call('SET', KEYS[3], '1', 'NX', 'EX', ARGV[5]) then "
+		"  stepped = 1;"
+		"  local epochs = redis.call('ZRANGEBYSCORE', epochs_key, '-inf', cutoff,"
+		"    'LIMIT', 0, 1);"
+		"  if epochs[1] then "
+		"    local epoch = tonumber(epochs[1]);"
+		"    local bucket = prefix .. '_' .. epochs[1];"
+		"    for _,k in ipairs(redis.call('SPOP', bucket, ARGV[4])) do "
+		"      checked = checked + 1;"
+		"      local v = redis.call('HMGET', k, 'H', 'S', 'T');"
+		"      if (tonumber(v[3]) or 0) <= epoch then "
+		"        local ham, spam = tonumber(v[1]) or 0, tonumber(v[2]) or 0;"
+		"        local total = ham + spam;"
+		"        if total >= tonumber(ARGV[6]) and (ham > total * " G_STRINGIFY (REDIS_EXPIRY_SIGNIFICANT_FACTOR) " or"
+		"            spam > total * " G_STRINGIFY (REDIS_EXPIRY_SIGNIFICANT_FACTOR) ") then "
+		"          redis.call('HSET', k, 'T', now_epoch);"
+		"          redis.call('SADD', prefix .. '_' .. now_epoch, k);"
+		"          redis.call('ZADD', epochs_key, now_epoch, now_epoch);"
+		"          kept = kept + 1;"
+		"        else "
+		"          expired = expired + redis.call('DEL', k);"
+		"        end;"
+		"      end;"
+		"    end;"
+		"    remaining = redis.call('SCARD', bucket);"
+		"    if remaining == 0 then redis.call('ZREM', epochs_key, epochs[1]) end;"
+		"  end;"
+		"end;"
+		"local totals = {"
+		"  redis.call('HINCRBY', stats_key, 'checked', checked),"
+		"  redis.call('HINCRBY', stats_key, 'expired', expired),"
+		"  redis.call('HINCRBY', stats_key, 'kept', kept)};"
+		"return {stepped, checked, expired, kept, totals[1], totals[2], totals[3],"
+		"  redis.call('ZCOUNT', epochs_key, '-inf', cutoff), remaining};";
+
+const gchar *
+rspamd_redis_expiry_script_source (void)
+{
+	return rspamd_redis_expiry_script;
+}
+
+gboolean
+rspamd_redis_native_expiry_enabled (const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_lookup (obj, "native_expiry");
+
+	if (elt == NULL || !ucl_object_toboolean (elt)) {
+		return FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "new_schema");
+
+	if (elt == NULL || !ucl_object_toboolean (elt)) {
+		return FALSE;
+	}
+
+	elt = ucl_object_lookup_any (obj, "shard_tokens", "sharding", NULL);
+
+	if (elt != NULL && ucl_object_toboolean (elt)) {
+		return FALSE;
+	}
+
+	elt = ucl_object_lookup_any (obj, "expiry", "expire", NULL);
+
+	if (elt == NULL || ucl_object_toint (elt) <= 0) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_redis_expiry_cleanup (struct rspamd_redis_expiry_elt *elt)
+{
+	redisAsyncContext *redis;
+
+	if (elt->redis) {
+		redis = elt->redis;
+		elt->redis = NULL;
+		redisAsyncFree (redis);
+	}
+
+	elt->async->enabled = TRUE;
+}
+
+static void
+rspamd_redis_expiry_step_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_expiry_elt *elt = priv;
+	redisReply *reply = r, *cur;
+	gint64 vals[9];
+	gdouble now;
+	guint i;
+
+	if (elt->redis == NULL) {
+		/* Connection is being terminated */
+		return;
+	}
+
+	if (c->err == 0 && reply && reply->type == REDIS_REPLY_ARRAY &&
+			reply->elements == G_N_ELEMENTS (vals)) {
+		for (i = 0; i < G_N_ELEMENTS (vals); i ++) {
+			cur = reply->element[i];
+			vals[i] = cur->type == REDIS_REPLY_INTEGER ? cur->integer : 0;
+		}
+
+		now = ev_now (elt->event_loop);
+
+		if (elt->last_ts > 0 && now > elt->last_ts &&
+				(guint64)vals[5] >= elt->expired) {
+			elt->rate = (vals[5] - elt->expired) / (now - elt->last_ts);
+		}
+
+		elt->last_ts = now;
+		elt->checked = vals[4];
+		elt->expired = vals[5];
+		elt->kept = vals[6];
+		elt->pending_epochs = vals[7];
+		elt->bucket_remaining = vals[8];
+
+		if (vals[0] && vals[1] > 0) {
+			msg_debug ("expiry step for %s: %L checked, %L expired, %L kept; "
+					"%L epochs pending, %L tokens left in the current epoch",
+					elt->ctx->stcf->symbol, vals[1], vals[2], vals[3],
+					vals[7], vals[8]);
+		}
+
+		rspamd_upstream_ok (elt->selected);
+	}
+	else if (c->err != 0) {
+		msg_err ("cannot perform expiry step on %s: %s",
+				rspamd_upstream_name (elt->selected), c->errstr);
+		rspamd_upstream_fail (elt->selected, FALSE, c->errstr);
+	}
+	else if (reply && reply->type == REDIS_REPLY_ERROR) {
+		if (g_ascii_strncasecmp (reply->str, "NOSCRIPT", 8) == 0) {
+			/* Script cache has been flushed or another server is used */
+			msg_info ("expiry script is not loaded on %s, reload it",
+					rspamd_upstream_name (elt->selected));
+			elt->script_sha[0] = '\0';
+		}
+		else {
+			msg_err ("cannot perform expiry step on %s: %s",
+					rspamd_upstream_name (elt->selected), reply->str);
+		}
+	}
+
+	rspamd_redis_expiry_cleanup (elt);
+}
+
+static gint
+rspamd_redis_expiry_step (struct rspamd_redis_expiry_elt *elt)
+{
+	struct redis_stat_ctx *ctx = elt->ctx;
+	guint64 epoch, cutoff;
+
+	epoch = rspamd_redis_expiry_epoch (ctx, ev_now (elt->event_loop));
+	/* Buckets which are older than expiry time */
+	cutoff = epoch - MIN (epoch,
+			ctx->expiry / rspamd_redis_expiry_epoch_len (ctx) + 1);
+
+	return redisAsyncCommand (elt->redis, rspamd_redis_expiry_step_cb, elt,
+			"EVALSHA %s 3 %s_epochs %s_stats %s_lock %s %uL %uL %ud %d %ud",
+			elt->script_sha,
+			ctx->expiry_prefix, ctx->expiry_prefix, ctx->expiry_prefix,
+			ctx->expiry_prefix,
+			epoch, cutoff,
+			ctx->expiry_count,
+			MAX ((gint)ctx->expiry_interval, 1),
+			ctx->expiry_significant);
+}
+
+static void
+rspamd_redis_expiry_load_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_expiry_elt *elt = priv;
+	redisReply *reply = r;
+
+	if (elt->redis == NULL) {
+		/* Connection is being terminated */
+		return;
+	}
+
+	if (c->err == 0 && reply && reply->type == REDIS_REPLY_STRING &&
+			reply->len == sizeof (elt->script_sha) - 1) {
+		rspamd_strlcpy (elt->script_sha, reply->str, sizeof (elt->script_sha));
+
+		if (rspamd_redis_expiry_step (elt) == REDIS_OK) {
+			return;
+		}
+	}
+	else if (c->err != 0) {
+		msg_err ("cannot load expiry script on %s: %s",
+				rspamd_upstream_name (elt->selected), c->errstr);
+		rspamd_upstream_fail (elt->selected, FALSE, c->errstr);
+	}
+	else {
+		msg_err ("cannot load expiry script on %s: %s",
+				rspamd_upstream_name (elt->selected),
+				(reply && reply->type == REDIS_REPLY_ERROR) ?
+				reply->str : "bad reply");
+	}
+
+	rspamd_redis_expiry_cleanup (elt);
+}
+
+static void
+rspamd_redis_async_expiry_cb (struct rspamd_stat_async_elt *async, gpointer d)
+{
+	struct rspamd_redis_expiry_elt *elt = async->ud;
+	struct redis_stat_ctx *ctx = elt->ctx;
+	struct upstream_list *ups;
+	rspamd_inet_addr_t *addr;
+	gint ret;
+
+	if (elt->redis) {
+		/* Previous step has not finished in time */
+		rspamd_redis_expiry_cleanup (elt);
+	}
+
+	ups = rspamd_redis_get_servers (ctx, "write_servers");
+
+	if (!ups) {
+		return;
+	}
+
+	elt->selected = rspamd_upstream_get (ups, RSPAMD_UPSTREAM_MASTER_SLAVE,
+			NULL, 0);
+
+	if (elt->selected == NULL) {
+		return;
+	}
+
+	addr = rspamd_upstream_addr_next (elt->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		elt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		elt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (elt->redis == NULL) {
+		msg_warn ("cannot connect to redis server %s: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				strerror (errno));
+
+		return;
+	}
+	else if (elt->redis->err != REDIS_OK) {
+		msg_warn ("cannot connect to redis server %s: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				elt->redis->errstr);
+		redisAsyncFree (elt->redis);
+		elt->redis = NULL;
+
+		return;
+	}
+
+	redisLibevAttach (elt->event_loop, elt->redis);
+	rspamd_redis_maybe_auth (ctx, elt->redis);
+
+	if (elt->script_sha[0] == '\0') {
+		/* Script is sent once, all further steps use its digest */
+		ret = redisAsyncCommand (elt->redis, rspamd_redis_expiry_load_cb, elt,
+				"SCRIPT LOAD %s", rspamd_redis_expiry_script);
+	}
+	else {
+		ret = rspamd_redis_expiry_step (elt);
+	}
+
+	if (ret == REDIS_OK) {
+		/* Disable further events until this step is finished */
+		async->enabled = FALSE;
+	}
+	else {
+		rspamd_redis_expiry_cleanup (elt);
+	}
+}
+
+static void
+rspamd_redis_async_expiry_fin (struct rspamd_stat_async_elt *async, gpointer d)
+{
+	struct rspamd_redis_expiry_elt *elt = async->ud;
+
+	if (elt->redis) {
+		rspamd_redis_expiry_cleanup (elt);
+	}
+
+	g_free (elt);
+}
+
+static redisAsyncContext *
+rspamd_redis_stat_connect (struct rspamd_task *task,
+		struct redis_stat_ctx *ctx,
+		struct upstream *up)
+{
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *redis;
+
+	addr = rspamd_upstream_addr_next (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (redis == NULL) {
+		msg_warn_task ("cannot connect to redis server %s: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				strerror (errno));
+
+		return NULL;
+	}
+	else if (redis->err != REDIS_OK) {
+		msg_warn_task ("cannot connect to redis server %s: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				redis->errstr);
+		redisAsyncFree (redis);
+
+		return NULL;
+	}
+
+	redisLibevAttach (task->event_loop, redis);
+	rspamd_redis_maybe_auth (ctx, redis);
+
+	return redis;
+}
+
+static void
+rspamd_redis_shards_cleanup (struct redis_stat_runtime *rt)
+{
+	struct redis_stat_shard *shard;
+	redisAsyncContext *redis;
+	guint i;
+
+	PTR_ARRAY_FOREACH (rt->shards, i, shard) {
+		if (shard->redis) {
+			redis = shard->redis;
+			shard->redis = NULL;
+			/* This calls for all callbacks pending */
+			redisAsyncFree (redis);
+		}
+	}
+}
+
+/*
+ * Distributes tokens over the shards defined by the servers list and
+ * connects to all shards that own at least one token
+ */
+static gboolean
+rspamd_redis_shards_init (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens,
+		const gchar *servers)
+{
+	struct upstream_list *ups;
+	struct upstream *up;
+	struct redis_stat_shard *shard;
+	rspamd_token_t *tok;
+	guint i, j, nshards;
+
+	ups = rspamd_redis_get_servers (rt->ctx, servers);
+
+	if (!ups || (nshards = rspamd_upstreams_count (ups)) == 0) {
+		msg_err_task ("no %s defined for %s, cannot use shards",
+				servers, rt->stcf->symbol);
+		return FALSE;
+	}
+
+	rt->shards = g_ptr_array_sized_new (nshards);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, rt->shards);
+
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		up = rspamd_upstream_get_shard (ups, tok->data);
+		shard = NULL;
+
+		/* Number of shards is small, so linear search is fine */
+		for (j = 0; j < rt->shards->len; j ++) {
+			if (((struct redis_stat_shard *)g_ptr_array_index (rt->shards, j))
+					->selected == up) {
+				shard = g_ptr_array_index (rt->shards, j);
+				break;
+			}
+		}
+
+		if (shard == NULL) {
+			shard = rspamd_mempool_alloc0 (task->task_pool, sizeof (*shard));
+			shard->rt = rt;
+			shard->selected = up;
+			shard->tokens = g_ptr_array_sized_new (tokens->len / nshards + 1);
+			rspamd_mempool_add_destructor (task->task_pool,
+					rspamd_ptr_array_free_hard, shard->tokens);
+			g_ptr_array_add (rt->shards, shard);
+		}
+
+		g_ptr_array_add (shard->tokens, tok);
+	}
+
+	PTR_ARRAY_FOREACH (rt->shards, i, shard) {
+		shard->redis = rspamd_redis_stat_connect (task, rt->ctx,
+				shard->selected);
+
+		if (shard->redis == NULL) {
+			rspamd_upstream_fail (shard->selected, TRUE, "cannot connect");
+			rspamd_redis_shards_cleanup (rt);
+
+			return FALSE;
+		}
+	}
+
+	msg_debug_stat_redis ("distributed %ud tokens for %s over %ud shards",
+			tokens->len, rt->redis_object_expanded, rt->shards->len);
+
+	return TRUE;
+}
+
 /* Called on connection termination */
 static void
 rspamd_redis_fin (gpointer data)
@@ -1086,6 +1650,8 @@ rspamd_redis_fin (gpointer data)
 		/* This calls for all callbacks pending */
 		redisAsyncFree (redis);
 	}
+
+	rspamd_redis_shards_cleanup (rt);
 }
 
 static void
@@ -1110,6 +1676,8 @@ rspamd_redis_fin_learn (gpointer data)
 		/* This calls for all callbacks pending */
 		redisAsyncFree (redis);
 	}
+
+	rspamd_redis_shards_cleanup (rt);
 }
 
 static void
@@ -1133,6 +1701,8 @@ rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
 		redisAsyncFree (redis);
 	}
 
+	rspamd_redis_shards_cleanup (rt);
+
 	if (rt->tokens) {
 		g_ptr_array_unref (rt->tokens);
 		rt->tokens = NULL;
@@ -1240,6 +1810,139 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+/* Called when we have received tokens values from a specific shard */
+static void
+rspamd_redis_shard_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_shard *shard = (struct redis_stat_shard *)priv;
+	struct redis_stat_runtime *rt = shard->rt;
+	redisReply *reply = r, *elt;
+	struct rspamd_task *task;
+	rspamd_token_t *tok;
+	guint i, found = 0;
+	gulong val;
+
+	task = rt->task;
+
+	if (shard->redis == NULL || !rt->has_event) {
+		/* Connection is being terminated */
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == shard->tokens->len) {
+			for (i = 0; i < reply->elements; i ++) {
+				tok = g_ptr_array_index (shard->tokens, i);
+				elt = reply->element[i];
+
+				if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
+					tok->values[rt->id] = elt->integer;
+					found ++;
+				}
+				else if (elt->type == REDIS_REPLY_STRING) {
+					if (rt->stcf->clcf->flags &
+						RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+						rspamd_strtoul (elt->str, elt->len, &val);
+						tok->values[rt->id] = val;
+					}
+					else {
+						tok->values[rt->id] = strtof (elt->str, NULL);
+					}
+
+					found ++;
+				}
+				else {
+					tok->values[rt->id] = 0;
+				}
+			}
+
+			if (rt->stcf->is_spam) {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+			}
+			else {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+			}
+		}
+		else {
+			msg_err_task_check ("got invalid reply from redis shard %s: %s, "
+					"array of %ud elements expected",
+					rspamd_upstream_name (shard->selected),
+					rspamd_redis_type_to_string (reply->type),
+					shard->tokens->len);
+		}
+
+		msg_debug_stat_redis ("received tokens for %s from shard %s: "
+				"%ud processed, %ud found",
+				rt->redis_object_expanded,
+				rspamd_upstream_name (shard->selected),
+				shard->tokens->len, found);
+		rspamd_upstream_ok (shard->selected);
+	}
+	else {
+		msg_err_task ("error getting reply from redis shard %s: %s",
+				rspamd_upstream_name (shard->selected), c->errstr);
+		rspamd_upstream_fail (shard->selected, FALSE, c->errstr);
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot get values: error getting reply from redis shard %s: %s",
+					rspamd_upstream_name (shard->selected), c->errstr);
+		}
+	}
+
+	if (rt->shards_inflight > 0 && --rt->shards_inflight == 0) {
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
+/* Sends pipelined tokens queries to all shards in parallel */
+static gboolean
+rspamd_redis_shards_query (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	struct redis_stat_shard *shard;
+	rspamd_fstring_t *query;
+	guint i;
+	gint ret;
+
+	if (!rspamd_redis_shards_init (task, rt, rt->tokens, "read_servers")) {
+		return FALSE;
+	}
+
+	PTR_ARRAY_FOREACH (rt->shards, i, shard) {
+		query = rspamd_redis_tokens_to_query (task, rt, shard->redis,
+				shard->tokens,
+				rt->ctx->new_schema ? "HGET" : "HMGET",
+				rt->redis_object_expanded, FALSE, -1,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+
+		if (query == NULL) {
+			rspamd_redis_shards_cleanup (rt);
+
+			return FALSE;
+		}
+
+		ret = redisAsyncFormattedCommand (shard->redis,
+				rspamd_redis_shard_processed, shard,
+				query->str, query->len);
+		rspamd_fstring_free (query);
+
+		if (ret != REDIS_OK) {
+			msg_err_task ("call to redis shard %s failed: %s",
+					rspamd_upstream_name (shard->selected),
+					shard->redis->errstr);
+			rspamd_redis_shards_cleanup (rt);
+
+			return FALSE;
+		}
+	}
+
+	rt->shards_inflight = rt->shards->len;
+
+	return TRUE;
+}
+
 /* Called when we have connected to the redis server and got stats */
 static void
 rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1308,25 +2011,45 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 
 			if (rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
-				rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
-						task,
-						rt,
-						rt->tokens,
-						rt->ctx->new_schema ? "HGET" : "HMGET",
-						rt->redis_object_expanded, FALSE, -1,
-						rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-				g_assert (query != NULL);
-				rspamd_mempool_add_destructor (task->task_pool,
-						(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
-
-				int ret = redisAsyncFormattedCommand (rt->redis,
-						rspamd_redis_processed, rt,
-						query->str, query->len);
+				int ret;
 
-				if (ret != REDIS_OK) {
-					msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+				if (rt->ctx->shard_tokens) {
+					if (rspamd_redis_shards_query (task, rt)) {
+						ret = REDIS_OK;
+					}
+					else {
+						ret = REDIS_ERR;
+
+						if (!rt->err) {
+							g_set_error (&rt->err, rspamd_redis_stat_quark (),
+									EINVAL, "cannot query tokens shards for %s",
+									rt->redis_object_expanded);
+						}
+					}
 				}
 				else {
+					rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
+							task,
+							rt,
+							rt->redis,
+							rt->tokens,
+							rt->ctx->new_schema ? "HGET" : "HMGET",
+							rt->redis_object_expanded, FALSE, -1,
+							rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+					g_assert (query != NULL);
+					rspamd_mempool_add_destructor (task->task_pool,
+							(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+					ret = redisAsyncFormattedCommand (rt->redis,
+							rspamd_redis_processed, rt,
+							query->str, query->len);
+
+					if (ret != REDIS_OK) {
+						msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+					}
+				}
+
+				if (ret == REDIS_OK) {
 					/* Further is handled by rspamd_redis_processed */
 					final = FALSE;
 					/* Restart timeout */
@@ -1395,9 +2118,101 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 
 	if (rt->has_event) {
+		if (rt->shards && rt->shards_inflight > 0 && --rt->shards_inflight > 0) {
+			/* Wait for the remaining shards */
+			return;
+		}
+
+		rspamd_session_remove_event (task->s, rspamd_redis_fin_learn, rt);
+	}
+}
+
+/* Called when we have set tokens on a specific shard during learning */
+static void
+rspamd_redis_shard_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_shard *shard = (struct redis_stat_shard *)priv;
+	struct redis_stat_runtime *rt = shard->rt;
+	struct rspamd_task *task;
+
+	task = rt->task;
+
+	if (shard->redis == NULL || !rt->has_event) {
+		/* Connection is being terminated */
+		return;
+	}
+
+	if (c->err == 0) {
+		rspamd_upstream_ok (shard->selected);
+	}
+	else {
+		msg_err_task_check ("error getting reply from redis shard %s: %s",
+				rspamd_upstream_name (shard->selected), c->errstr);
+		rspamd_upstream_fail (shard->selected, FALSE, c->errstr);
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot learn tokens: error getting reply from redis shard %s: %s",
+					rspamd_upstream_name (shard->selected), c->errstr);
+		}
+	}
+
+	if (rt->shards_inflight > 0 && --rt->shards_inflight == 0) {
 		rspamd_session_remove_event (task->s, rspamd_redis_fin_learn, rt);
 	}
 }
+
+/* Sends tokens increments to all shards in parallel, each in its own MULTI */
+static gboolean
+rspamd_redis_shards_learn (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens,
+		const gchar *redis_cmd,
+		gint id)
+{
+	struct redis_stat_shard *shard;
+	rspamd_fstring_t *query;
+	guint i;
+	gint ret;
+
+	if (!rspamd_redis_shards_init (task, rt, tokens, "write_servers")) {
+		return FALSE;
+	}
+
+	PTR_ARRAY_FOREACH (rt->shards, i, shard) {
+		query = rspamd_redis_tokens_to_query (task, rt, shard->redis,
+				shard->tokens,
+				redis_cmd, rt->redis_object_expanded, TRUE, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+
+		if (query == NULL) {
+			rspamd_redis_shards_cleanup (rt);
+
+			return FALSE;
+		}
+
+		query->len = 0;
+		ret = rspamd_printf_fstring (&query, "*1\r\n$4\r\nEXEC\r\n");
+		ret = redisAsyncFormattedCommand (shard->redis,
+				rspamd_redis_shard_learned, shard,
+				query->str, ret);
+		rspamd_fstring_free (query);
+
+		if (ret != REDIS_OK) {
+			msg_err_task ("call to redis shard %s failed: %s",
+					rspamd_upstream_name (shard->selected),
+					shard->redis->errstr);
+			rspamd_redis_shards_cleanup (rt);
+
+			return FALSE;
+		}
+	}
+
+	/* Shards plus the main server that keeps learns counters */
+	rt->shards_inflight = rt->shards->len + 1;
+
+	return TRUE;
+}
 static void
 rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
@@ -1484,6 +2299,14 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 		backend->enable_signatures = FALSE;
 	}
 
+	elt = ucl_object_lookup_any (obj, "shard_tokens", "sharding", NULL);
+	if (elt) {
+		backend->shard_tokens = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->shard_tokens = FALSE;
+	}
+
 	elt = ucl_object_lookup_any (obj, "expiry", "expire", NULL);
 	if (elt) {
 		backend->expiry = ucl_object_toint (elt);
@@ -1491,6 +2314,109 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 	else {
 		backend->expiry = 0;
 	}
+
+	elt = ucl_object_lookup (obj, "native_expiry");
+	if (elt) {
+		backend->native_expiry = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->native_expiry = FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_interval");
+	if (elt) {
+		backend->expiry_interval = ucl_object_todouble (elt);
+	}
+	else {
+		backend->expiry_interval = REDIS_EXPIRY_DEFAULT_INTERVAL;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_count");
+	if (elt) {
+		backend->expiry_count = ucl_object_toint (elt);
+	}
+	else {
+		backend->expiry_count = REDIS_EXPIRY_DEFAULT_COUNT;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_significant_hits");
+	if (elt) {
+		backend->expiry_significant = ucl_object_toint (elt);
+	}
+	else {
+		backend->expiry_significant = REDIS_EXPIRY_DEFAULT_SIGNIFICANT;
+	}
+
+	if (backend->native_expiry) {
+		if (!rspamd_redis_native_expiry_enabled (obj)) {
+			msg_warn_config ("native expiry requires new schema, positive "
+					"expiry and no tokens sharding; disable it");
+			backend->native_expiry = FALSE;
+		}
+		else if (backend->expiry_interval <= 0 || backend->expiry_count == 0) {
+			msg_warn_config ("invalid native expiry interval or count; "
+					"use defaults");
+			backend->expiry_interval = REDIS_EXPIRY_DEFAULT_INTERVAL;
+			backend->expiry_count = REDIS_EXPIRY_DEFAULT_COUNT;
+		}
+	}
+}
+
+static void
+rspamd_redis_shards_names_cb (struct upstream *up, guint idx, void *ud)
+{
+	GPtrArray *names = (GPtrArray *)ud;
+
+	g_ptr_array_add (names, (gpointer)rspamd_upstream_name (up));
+}
+
+/*
+ * Tokens are learned on write servers and classified from read servers, so
+ * both lists must place each token on the same shard
+ */
+static gboolean
+rspamd_redis_shards_check (struct redis_stat_ctx *ctx)
+{
+	struct upstream_list *read_ups, *write_ups;
+	GPtrArray *read_names, *write_names;
+	gboolean ret = TRUE;
+	guint i;
+
+	read_ups = rspamd_redis_get_servers (ctx, "read_servers");
+	write_ups = rspamd_redis_get_servers (ctx, "write_servers");
+
+	if (read_ups == write_ups) {
+		return TRUE;
+	}
+
+	if (read_ups == NULL || write_ups == NULL) {
+		return FALSE;
+	}
+
+	read_names = g_ptr_array_new ();
+	write_names = g_ptr_array_new ();
+	rspamd_upstreams_foreach (read_ups, rspamd_redis_shards_names_cb,
+			read_names);
+	rspamd_upstreams_foreach (write_ups, rspamd_redis_shards_names_cb,
+			write_names);
+
+	if (read_names->len != write_names->len) {
+		ret = FALSE;
+	}
+	else {
+		for (i = 0; i < read_names->len; i ++) {
+			if (strcmp (g_ptr_array_index (read_names, i),
+					g_ptr_array_index (write_names, i)) != 0) {
+				ret = FALSE;
+				break;
+			}
+		}
+	}
+
+	g_ptr_array_free (read_names, TRUE);
+	g_ptr_array_free (write_names, TRUE);
+
+	return ret;
 }
 
 gpointer
@@ -1582,6 +2508,15 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 	lua_settop (L, 0);
 
 	rspamd_redis_parse_classifier_opts (backend, st->classifier->cfg->opts, cfg);
+
+	if (backend->shard_tokens && !rspamd_redis_shards_check (backend)) {
+		msg_err_config ("cannot init redis backend for %s: read_servers and "
+				"write_servers must be the same when tokens are sharded",
+				stf->symbol);
+		luaL_unref (L, LUA_REGISTRYINDEX, conf_ref);
+		g_free (backend);
+		return NULL;
+	}
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
 
@@ -1595,6 +2530,45 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 			REDIS_STAT_TIMEOUT);
 	st_elt->async = backend->stat_elt;
 
+	if (backend->native_expiry) {
+		struct rspamd_statfile_config *spam_stf = NULL;
+		GList *cur;
+		gchar prefix_buf[128];
+
+		/*
+		 * Expiry keys are per classifier: both statfiles share the name of
+		 * the spam one, as tokens are shared between them
+		 */
+		for (cur = stf->clcf->statfiles; cur != NULL; cur = g_list_next (cur)) {
+			spam_stf = cur->data;
+
+			if (spam_stf->is_spam) {
+				break;
+			}
+		}
+
+		rspamd_snprintf (prefix_buf, sizeof (prefix_buf), "%s_%s",
+				REDIS_EXPIRY_PREFIX,
+				cur != NULL ? spam_stf->symbol : stf->clcf->name);
+		backend->expiry_prefix = rspamd_mempool_strdup (cfg->cfg_pool,
+				prefix_buf);
+	}
+
+	/* Tokens are shared between statfiles, so we expire them just once */
+	if (backend->native_expiry && stf->is_spam) {
+		struct rspamd_redis_expiry_elt *ex_elt;
+
+		ex_elt = g_malloc0 (sizeof (*ex_elt));
+		ex_elt->event_loop = ctx->event_loop;
+		ex_elt->ctx = backend;
+		ex_elt->async = rspamd_stat_ctx_register_async (
+				rspamd_redis_async_expiry_cb,
+				rspamd_redis_async_expiry_fin,
+				ex_elt,
+				backend->expiry_interval);
+		backend->expiry_elt = ex_elt;
+	}
+
 	return (gpointer)backend;
 }
 
@@ -1774,6 +2748,8 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 		redisAsyncFree (redis);
 	}
 
+	rspamd_redis_shards_cleanup (rt);
+
 	if (rt->tokens) {
 		g_ptr_array_unref (rt->tokens);
 		rt->tokens = NULL;
@@ -1886,10 +2862,25 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->id = id;
-	query = rspamd_redis_tokens_to_query (task, rt, tokens,
-			redis_cmd, rt->redis_object_expanded, TRUE, id,
-			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-	g_assert (query != NULL);
+
+	if (rt->ctx->shard_tokens) {
+		/* Tokens go to shards, learns counters are kept on the main server */
+		if (!rspamd_redis_shards_learn (task, rt, tokens, redis_cmd, id)) {
+			return FALSE;
+		}
+
+		query = rspamd_fstring_sized_new (128);
+		rspamd_printf_fstring (&query, "*1\r\n$5\r\nMULTI\r\n");
+		redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+				query->str, query->len);
+	}
+	else {
+		query = rspamd_redis_tokens_to_query (task, rt, rt->redis, tokens,
+				redis_cmd, rt->redis_object_expanded, TRUE, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+		g_assert (query != NULL);
+	}
+
 	query->len = 0;
 
 	/*
@@ -2000,6 +2991,8 @@ rspamd_redis_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		redisAsyncFree (redis);
 	}
 
+	rspamd_redis_shards_cleanup (rt);
+
 	if (rt->err) {
 		g_propagate_error (err, rt->err);
 		rt->err = NULL;
@@ -2066,6 +3059,28 @@ rspamd_redis_get_stat (gpointer runtime,
 		}
 
 		if (st->stat) {
+			if (rt->ctx->expiry_elt) {
+				struct rspamd_redis_expiry_elt *ex = rt->ctx->expiry_elt;
+				ucl_object_t *ex_obj;
+
+				ex_obj = ucl_object_typed_new (UCL_OBJECT);
+				ucl_object_insert_key (ex_obj,
+						ucl_object_fromint (ex->checked), "checked", 0, false);
+				ucl_object_insert_key (ex_obj,
+						ucl_object_fromint (ex->expired), "expired", 0, false);
+				ucl_object_insert_key (ex_obj,
+						ucl_object_fromint (ex->kept), "kept", 0, false);
+				ucl_object_insert_key (ex_obj,
+						ucl_object_fromint (ex->pending_epochs),
+						"pending_epochs", 0, false);
+				ucl_object_insert_key (ex_obj,
+						ucl_object_fromint (ex->bucket_remaining),
+						"epoch_remaining", 0, false);
+				ucl_object_insert_key (ex_obj,
+						ucl_object_fromdouble (ex->rate), "rate", 0, false);
+				ucl_object_replace_key (st->stat, ex_obj, "expiry", 0, false);
+			}
+
 			return ucl_object_ref (st->stat);
 		}
 	}
@@ -0,0 +1,602 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Read-only statistics backend that uses precompiled snapshots of statfiles.
+ *
+ * Snapshot is an immutable file that is mapped by all workers in read-only
+ * mode, so its pages are shared between processes. The layout is the following:
+ *
+ * [header][hashes: guint64 * (ntokens + 1)][values: guint16 * (ntokens + 1)]
+ *
+ * Hashes are stored in Eytzinger (BFS) order starting from index 1, which
+ * allows cache friendly binary search with no explicit tree. Values are
+ * stored in logarithmic quantized form.
+ *
+ * Snapshots are generated from the live backend (e.g. by
+ * `rspamadm statsnapshot`) and are reloaded by workers when the file is
+ * replaced atomically.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "libstat/stat_internal.h"
+#include "ref.h"
+#include "unix-std.h"
+#include <math.h>
+
+#define SNAPSHOT_BACKEND_TYPE "snapshot"
+#define SNAPSHOT_MAGIC "rsstsnp"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_QUANT_SCALE 2048.0
+#define SNAPSHOT_DEFAULT_CHECK_INTERVAL 60.0
+
+struct rspamd_stat_snapshot_header {
+	guchar magic[8];
+	guint32 version;
+	guint32 flags;
+	guint64 create_time;
+	guint64 learns;
+	guint64 ntokens;
+	guint64 unused[3];
+};
+
+struct rspamd_stat_snapshot_map {
+	const struct rspamd_stat_snapshot_header *hdr;
+	const guint64 *hashes;
+	const guint16 *values;
+	gpointer map;
+	gsize len;
+	ino_t inode;
+	time_t mtime;
+	ref_entry_t ref;
+};
+
+/* Per task runtime: a snapshot that is used by the task */
+struct rspamd_stat_snapshot_runtime {
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_stat_snapshot_map *map;
+};
+
+struct rspamd_stat_snapshot_ctx {
+	struct rspamd_statfile_config *stcf;
+	struct rspamd_stat_snapshot_map *cur;
+	gchar *path;
+	gdouble check_interval;
+	gdouble last_check;
+};
+
+static GQuark
+rspamd_stat_snapshot_quark (void)
+{
+	return g_quark_from_static_string (SNAPSHOT_BACKEND_TYPE);
+}
+
+static inline guint16
+rspamd_stat_snapshot_quantize (gdouble value)
+{
+	gdouble q;
+
+	if (value <= 0 || isnan (value)) {
+		return 0;
+	}
+
+	q = log1p (value) * SNAPSHOT_QUANT_SCALE;
+
+	if (q >= G_MAXUINT16) {
+		return G_MAXUINT16;
+	}
+
+	return (guint16)(q + 0.5);
+}
+
+static inline gfloat
+rspamd_stat_snapshot_dequantize (guint16 q)
+{
+	if (q == 0) {
+		return 0.0f;
+	}
+
+	return expm1 (q / SNAPSHOT_QUANT_SCALE);
+}
+
+static void
+rspamd_stat_snapshot_map_dtor (struct rspamd_stat_snapshot_map *m)
+{
+	if (m->map) {
+		munmap (m->map, m->len);
+	}
+
+	g_free (m);
+}
+
+static struct rspamd_stat_snapshot_map *
+rspamd_stat_snapshot_map_open (const gchar *path, GError **err)
+{
+	struct rspamd_stat_snapshot_map *m;
+	const struct rspamd_stat_snapshot_header *hdr;
+	struct stat st;
+	gsize len = 0, expected;
+	gpointer map;
+
+	if (stat (path, &st) == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot stat %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	map = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+	if (map == NULL) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot map %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_stat_snapshot_header *)map;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC)) != 0 ||
+			hdr->version != SNAPSHOT_VERSION) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), EINVAL,
+				"invalid snapshot %s: bad header", path);
+		munmap (map, len);
+
+		return NULL;
+	}
+
+	expected = sizeof (*hdr) + (hdr->ntokens + 1) * (sizeof (guint64) +
+			sizeof (guint16));
+
+	if (hdr->ntokens > G_MAXUINT32 || len < expected) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), EINVAL,
+				"invalid snapshot %s: truncated file, %z bytes expected, "
+				"%z bytes found", path, expected, len);
+		munmap (map, len);
+
+		return NULL;
+	}
+
+	m = g_malloc0 (sizeof (*m));
+	m->map = map;
+	m->len = len;
+	m->hdr = hdr;
+	m->hashes = (const guint64 *)(((const guchar *)map) + sizeof (*hdr));
+	m->values = (const guint16 *)(m->hashes + hdr->ntokens + 1);
+	m->inode = st.st_ino;
+	m->mtime = st.st_mtime;
+	REF_INIT_RETAIN (m, rspamd_stat_snapshot_map_dtor);
+
+	if (madvise (map, len, MADV_RANDOM) == -1) {
+		msg_info ("madvise failed: %s", strerror (errno));
+	}
+
+	return m;
+}
+
+/*
+ * Checks if a snapshot has been replaced and maps the new version
+ */
+static void
+rspamd_stat_snapshot_maybe_reload (struct rspamd_stat_snapshot_ctx *ctx,
+		gdouble now)
+{
+	struct rspamd_stat_snapshot_map *nm;
+	struct stat st;
+	GError *err = NULL;
+
+	if (now - ctx->last_check < ctx->check_interval) {
+		return;
+	}
+
+	ctx->last_check = now;
+
+	if (stat (ctx->path, &st) == -1) {
+		return;
+	}
+
+	if (ctx->cur && ctx->cur->inode == st.st_ino &&
+			ctx->cur->mtime == st.st_mtime) {
+		return;
+	}
+
+	nm = rspamd_stat_snapshot_map_open (ctx->path, &err);
+
+	if (nm == NULL) {
+		msg_err ("cannot reload snapshot for %s: %e", ctx->stcf->symbol, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	msg_info ("loaded snapshot %s for %s: %uL tokens, %uL learns",
+			ctx->path, ctx->stcf->symbol, nm->hdr->ntokens, nm->hdr->learns);
+
+	if (ctx->cur) {
+		/* Tasks in flight still hold their own references */
+		REF_RELEASE (ctx->cur);
+	}
+
+	ctx->cur = nm;
+}
+
+static inline gfloat
+rspamd_stat_snapshot_lookup (const struct rspamd_stat_snapshot_map *m,
+		guint64 key)
+{
+	const guint64 *hashes = m->hashes;
+	guint64 n = m->hdr->ntokens, k = 1;
+
+	while (k <= n) {
+		k = 2 * k + (hashes[k] < key);
+	}
+
+	/* Revert right turns and the final left turn */
+	while (k & 1) {
+		k >>= 1;
+	}
+	k >>= 1;
+
+	if (k != 0 && hashes[k] == key) {
+		return rspamd_stat_snapshot_dequantize (m->values[k]);
+	}
+
+	return 0.0f;
+}
+
+static gint
+rspamd_stat_snapshot_token_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_stat_snapshot_token *t1 = a, *t2 = b;
+
+	if (t1->hash < t2->hash) {
+		return -1;
+	}
+	else if (t1->hash > t2->hash) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static gsize
+rspamd_stat_snapshot_eytzinger (const struct rspamd_stat_snapshot_token *sorted,
+		gsize i, gsize k, gsize n,
+		guint64 *hashes, guint16 *values)
+{
+	if (k <= n) {
+		i = rspamd_stat_snapshot_eytzinger (sorted, i, 2 * k, n,
+				hashes, values);
+		hashes[k] = sorted[i].hash;
+		values[k] = rspamd_stat_snapshot_quantize (sorted[i].value);
+		i ++;
+		i = rspamd_stat_snapshot_eytzinger (sorted, i, 2 * k + 1, n,
+				hashes, values);
+	}
+
+	return i;
+}
+
+gboolean
+rspamd_stat_snapshot_write (const gchar *path,
+		GArray *tokens,
+		guint64 learns,
+		GError **err)
+{
+	struct rspamd_stat_snapshot_header hdr;
+	struct rspamd_stat_snapshot_token *tok, *prev;
+	guint64 *hashes;
+	guint16 *values;
+	gsize ntokens = 0, i;
+	gchar *tmp_path;
+	gint fd;
+	gboolean ret = FALSE;
+
+	g_assert (tokens != NULL);
+
+	g_array_sort (tokens, rspamd_stat_snapshot_token_cmp);
+
+	/* Merge duplicates in place */
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, struct rspamd_stat_snapshot_token, i);
+
+		if (ntokens > 0) {
+			prev = &g_array_index (tokens, struct rspamd_stat_snapshot_token,
+					ntokens - 1);
+
+			if (prev->hash == tok->hash) {
+				prev->value += tok->value;
+				continue;
+			}
+		}
+
+		g_array_index (tokens, struct rspamd_stat_snapshot_token, ntokens) = *tok;
+		ntokens ++;
+	}
+
+	g_array_set_size (tokens, ntokens);
+
+	hashes = g_malloc0 ((ntokens + 1) * sizeof (*hashes));
+	values = g_malloc0 ((ntokens + 1) * sizeof (*values));
+	rspamd_stat_snapshot_eytzinger ((struct rspamd_stat_snapshot_token *)tokens->data,
+			0, 1, ntokens, hashes, values);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.create_time = time (NULL);
+	hdr.learns = learns;
+	hdr.ntokens = ntokens;
+
+	/* Write to a temporary file and rename it to replace snapshot atomically */
+	tmp_path = g_strdup_printf ("%s.new", path);
+	fd = rspamd_file_xopen (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 00644,
+			FALSE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot open %s: %s", tmp_path, strerror (errno));
+		goto end;
+	}
+
+	if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			write (fd, hashes, (ntokens + 1) * sizeof (*hashes)) !=
+					(gssize)((ntokens + 1) * sizeof (*hashes)) ||
+			write (fd, values, (ntokens + 1) * sizeof (*values)) !=
+					(gssize)((ntokens + 1) * sizeof (*values))) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot write %s: %s", tmp_path, strerror (errno));
+		close (fd);
+		unlink (tmp_path);
+		goto end;
+	}
+
+	close (fd);
+
+	if (rename (tmp_path, path) == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot rename %s to %s: %s", tmp_path, path, strerror (errno));
+		unlink (tmp_path);
+		goto end;
+	}
+
+	ret = TRUE;
+
+end:
+	g_free (tmp_path);
+	g_free (hashes);
+	g_free (values);
+
+	return ret;
+}
+
+gpointer
+rspamd_snapshot_init (struct rspamd_stat_ctx *ctx,
+		struct rspamd_config *cfg, struct rspamd_statfile *st)
+{
+	struct rspamd_statfile_config *stf = st->stcf;
+	struct rspamd_stat_snapshot_ctx *sctx;
+	const ucl_object_t *elt;
+	GError *err = NULL;
+
+	elt = ucl_object_lookup_any (stf->opts, "filename", "path", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		msg_err_config ("statfile %s has no snapshot path defined", stf->symbol);
+		return NULL;
+	}
+
+	sctx = g_malloc0 (sizeof (*sctx));
+	sctx->stcf = stf;
+	sctx->path = g_strdup (ucl_object_tostring (elt));
+	sctx->check_interval = SNAPSHOT_DEFAULT_CHECK_INTERVAL;
+
+	elt = ucl_object_lookup (stf->opts, "check_interval");
+
+	if (elt == NULL && st->classifier->cfg->opts) {
+		elt = ucl_object_lookup (st->classifier->cfg->opts, "check_interval");
+	}
+
+	if (elt) {
+		sctx->check_interval = ucl_object_todouble (elt);
+	}
+
+	sctx->cur = rspamd_stat_snapshot_map_open (sctx->path, &err);
+
+	if (sctx->cur == NULL) {
+		/* Snapshot might be generated later, so it is not fatal */
+		msg_warn_config ("cannot load snapshot for %s: %e", stf->symbol, err);
+		g_error_free (err);
+	}
+
+	sctx->last_check = rspamd_get_ticks (FALSE);
+
+	return sctx;
+}
+
+void
+rspamd_snapshot_close (gpointer p)
+{
+	struct rspamd_stat_snapshot_ctx *sctx = p;
+
+	if (sctx) {
+		if (sctx->cur) {
+			REF_RELEASE (sctx->cur);
+		}
+
+		g_free (sctx->path);
+		g_free (sctx);
+	}
+}
+
+static void
+rspamd_stat_snapshot_map_unref (gpointer p)
+{
+	struct rspamd_stat_snapshot_map *m = p;
+
+	REF_RELEASE (m);
+}
+
+gpointer
+rspamd_snapshot_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn,
+		gpointer p)
+{
+	struct rspamd_stat_snapshot_ctx *sctx = p;
+	struct rspamd_stat_snapshot_runtime *rt;
+
+	if (learn) {
+		msg_info_task ("cannot learn %s: snapshot backend is read-only",
+				stcf->symbol);
+		return NULL;
+	}
+
+	rspamd_stat_snapshot_maybe_reload (sctx, rspamd_get_ticks (FALSE));
+
+	if (sctx->cur == NULL) {
+		return NULL;
+	}
+
+	rt = rspamd_mempool_alloc (task->task_pool, sizeof (*rt));
+	rt->stcf = stcf;
+	/* Keep the current map alive for this task even if it is reloaded */
+	rt->map = sctx->cur;
+	REF_RETAIN (rt->map);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_stat_snapshot_map_unref, rt->map);
+
+	return rt;
+}
+
+gboolean
+rspamd_snapshot_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
+		gint id,
+		gpointer p)
+{
+	struct rspamd_stat_snapshot_runtime *rt = p;
+	rspamd_token_t *tok;
+	guint i;
+
+	g_assert (tokens != NULL);
+	g_assert (p != NULL);
+
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		tok->values[id] = rspamd_stat_snapshot_lookup (rt->map, tok->data);
+	}
+
+	if (rt->stcf->is_spam) {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+	}
+	else {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_snapshot_finalize_process (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	return TRUE;
+}
+
+gboolean
+rspamd_snapshot_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+		gint id,
+		gpointer p)
+{
+	return FALSE;
+}
+
+gboolean
+rspamd_snapshot_finalize_learn (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx, GError **err)
+{
+	g_set_error (err, rspamd_stat_snapshot_quark (), EPERM,
+			"snapshot backend is read-only");
+
+	return FALSE;
+}
+
+gulong
+rspamd_snapshot_total_learns (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	struct rspamd_stat_snapshot_runtime *rt = runtime;
+
+	return rt != NULL ? rt->map->hdr->learns : 0;
+}
+
+gulong
+rspamd_snapshot_inc_learns (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	return rspamd_snapshot_total_learns (task, runtime, ctx);
+}
+
+gulong
+rspamd_snapshot_dec_learns (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	return rspamd_snapshot_total_learns (task, runtime, ctx);
+}
+
+ucl_object_t *
+rspamd_snapshot_get_stat (gpointer runtime,
+		gpointer ctx)
+{
+	struct rspamd_stat_snapshot_ctx *sctx = ctx;
+	struct rspamd_stat_snapshot_runtime *rt = runtime;
+	struct rspamd_stat_snapshot_map *m = rt != NULL ? rt->map : NULL;
+	ucl_object_t *res = NULL;
+
+	if (m == NULL && sctx != NULL) {
+		m = sctx->cur;
+	}
+
+	if (m != NULL) {
+		res = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (res, ucl_object_fromint (m->hdr->learns),
+				"revision", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (m->len),
+				"size", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (m->hdr->ntokens),
+				"total", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (m->hdr->ntokens),
+				"used", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (m->hdr->create_time),
+				"created", 0, false);
+		if (sctx != NULL) {
+			ucl_object_insert_key (res, ucl_object_fromstring (sctx->stcf->symbol),
+					"symbol", 0, false);
+		}
+		ucl_object_insert_key (res, ucl_object_fromstring (SNAPSHOT_BACKEND_TYPE),
+				"type", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (0),
+				"languages", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (0),
+				"users", 0, false);
+	}
+
+	return res;
+}
+
+gpointer
+rspamd_snapshot_load_tokenizer_config (gpointer runtime,
+		gsize *len)
+{
+	return NULL;
+}
@@ -20,6 +20,7 @@
 #include "rspamd.h"
 #include "stat_internal.h"
 #include "math.h"
+#include <float.h>
 
 #define msg_err_bayes(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "bayes", task->task_pool->tag.uid, \
@@ -56,12 +57,13 @@ bayes_error_quark (void)
 static gdouble
 inv_chi_square (struct rspamd_task *task, gdouble value, gint freedom_deg)
 {
-	double prob, sum, m;
+	double prob, sum, m, e_value;
 	gint i;
 
 	errno = 0;
 	m = -value;
 	prob = exp (value);
+	e_value = prob;
 
 	if (errno == ERANGE) {
 		/*
@@ -80,8 +82,6 @@ inv_chi_square (struct rspamd_task *task, gdouble value, gint freedom_deg)
 
 	sum = prob;
 
-	msg_debug_bayes ("m: %f, probability: %g", m, prob);
-
 	/*
 	 * m is our confidence in class
 	 * prob is e ^ x (small value since x is normally less than zero
@@ -91,9 +91,19 @@ inv_chi_square (struct rspamd_task *task, gdouble value, gint freedom_deg)
 	for (i = 1; i < freedom_deg; i++) {
 		prob *= m / (gdouble)i;
 		sum += prob;
-		msg_debug_bayes ("i=%d, probability: %g, sum: %g", i, prob, sum);
+
+		/*
+		 * After i > m the terms are monotonically decreasing, so once they
+		 * cannot change the sum we can stop: the tail is negligible
+		 */
+		if (i > m && prob < sum * DBL_EPSILON) {
+			break;
+		}
 	}
 
+	msg_debug_bayes ("m: %f, probability: %g, sum: %g after %d iterations",
+			m, e_value, sum, i);
+
 	return MIN (1.0, sum);
 }
 
@@ -107,6 +117,23 @@ struct bayes_task_closure {
 	struct rspamd_task *task;
 };
 
+/*
+ * Tokens counts in form of structure of arrays, so the classification
+ * kernel could be processed without pointers chasing and branches
+ */
+struct bayes_tokens_soa {
+	gdouble *spam_cnt;
+	gdouble *ham_cnt;
+	gdouble *fw;
+	gdouble *is_text;
+	guint n;
+};
+
+/* Number of tokens multiplied before the products are renormalised */
+#define BAYES_KERNEL_BATCH 16
+/* Number of statfiles per class handled without allocations */
+#define BAYES_MAX_STATFILES 16
+
 /*
  * Mathematically we use pow(complexity, complexity), where complexity is the
  * window index
@@ -115,141 +142,159 @@ static const double feature_weight[] = { 0, 3125, 256, 27, 1, 0, 0, 0 };
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
 /*
- * In this callback we calculate local probabilities for tokens
+ * In this function we collect counts for tokens and filter those that
+ * are not suitable for classification
  */
 static void
-bayes_classify_token (struct rspamd_classifier *ctx,
-		rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_gather_tokens (struct rspamd_classifier *ctx,
+		GPtrArray *tokens, struct bayes_task_closure *cl,
+		struct bayes_tokens_soa *soa)
 {
-	guint i;
-	gint id;
-	guint spam_count = 0, ham_count = 0, total_count = 0;
+	guint i, j, nspam = 0, nham = 0;
+	gint id, spam_ids_buf[BAYES_MAX_STATFILES], ham_ids_buf[BAYES_MAX_STATFILES];
+	gint *spam_ids = spam_ids_buf, *ham_ids = ham_ids_buf;
+	gdouble spam_count, ham_count, total_count, val;
 	struct rspamd_statfile *st;
 	struct rspamd_task *task;
-	const gchar *token_type = "txt";
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, val;
+	rspamd_token_t *tok;
 
 	task = cl->task;
 
-#if 0
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
-		/* Ignore lua metatokens for now */
-		return;
-	}
-#endif
-
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
-		val = rspamd_random_double_fast ();
-
-		if (val <= cl->meta_skip_prob) {
-			if (tok->t1 && tok->t2) {
-				msg_debug_bayes (
-						"token(meta) %uL <%*s:%*s> probabilistically skipped",
-						tok->data,
-						(int) tok->t1->original.len, tok->t1->original.begin,
-						(int) tok->t2->original.len, tok->t2->original.begin);
-			}
-
-			return;
-		}
+	if (ctx->statfiles_ids->len > BAYES_MAX_STATFILES) {
+		/* Too many statfiles to fit on stack */
+		spam_ids = rspamd_mempool_alloc (task->task_pool,
+				sizeof (gint) * ctx->statfiles_ids->len);
+		ham_ids = rspamd_mempool_alloc (task->task_pool,
+				sizeof (gint) * ctx->statfiles_ids->len);
 	}
 
+	/* Resolve statfiles classes once and not for each token */
 	for (i = 0; i < ctx->statfiles_ids->len; i++) {
 		id = g_array_index (ctx->statfiles_ids, gint, i);
 		st = g_ptr_array_index (ctx->ctx->statfiles, id);
 		g_assert (st != NULL);
-		val = tok->values[id];
 
-		if (val > 0) {
-			if (st->stcf->is_spam) {
-				spam_count += val;
-			}
-			else {
-				ham_count += val;
-			}
-
-			total_count += val;
-			cl->total_hits += val;
+		if (st->stcf->is_spam) {
+			spam_ids[nspam++] = id;
+		}
+		else {
+			ham_ids[nham++] = id;
 		}
 	}
 
-	/* Probability for this token */
-	if (total_count >= ctx->cfg->min_token_hits) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
+	soa->n = 0;
 
-		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			fw = 1.0;
-		}
-		else {
-			fw = feature_weight[tok->window_idx %
-					G_N_ELEMENTS (feature_weight)];
-		}
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
+			val = rspamd_random_double_fast ();
 
+			if (val <= cl->meta_skip_prob) {
+				if (tok->t1 && tok->t2) {
+					msg_debug_bayes (
+							"token(meta) %uL <%*s:%*s> probabilistically skipped",
+							tok->data,
+							(int) tok->t1->original.len, tok->t1->original.begin,
+							(int) tok->t2->original.len, tok->t2->original.begin);
+				}
 
-		w = (fw * total_count) / (1.0 + fw * total_count);
+				continue;
+			}
+		}
 
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
+		spam_count = 0;
+		ham_count = 0;
 
-		if ((bayes_spam_prob > 0.5 && bayes_spam_prob < 0.5 + ctx->cfg->min_prob_strength) ||
-			(bayes_spam_prob < 0.5 && bayes_spam_prob > 0.5 - ctx->cfg->min_prob_strength)) {
-			msg_debug_bayes (
-					"token %uL <%*s:%*s> skipped, probability not in range: %f",
-					tok->data,
-					(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
-					(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
-					bayes_spam_prob);
+		for (j = 0; j < nspam; j ++) {
+			val = tok->values[spam_ids[j]];
+			spam_count += val > 0 ? val : 0;
+		}
 
-			return;
+		for (j = 0; j < nham; j ++) {
+			val = tok->values[ham_ids[j]];
+			ham_count += val > 0 ? val : 0;
 		}
 
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
+		total_count = spam_count + ham_count;
+		cl->total_hits += total_count;
 
-		cl->spam_prob += log (bayes_spam_prob);
-		cl->ham_prob += log (bayes_ham_prob);
-		cl->processed_tokens ++;
+		/* Probability for this token */
+		if (total_count >= ctx->cfg->min_token_hits && total_count > 0) {
+			soa->spam_cnt[soa->n] = spam_count;
+			soa->ham_cnt[soa->n] = ham_count;
 
-		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
-			cl->text_tokens ++;
-		}
-		else {
-			token_type = "meta";
-		}
+			if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+				soa->fw[soa->n] = 1.0;
+			}
+			else {
+				soa->fw[soa->n] = feature_weight[tok->window_idx %
+						G_N_ELEMENTS (feature_weight)];
+			}
 
-		if (tok->t1 && tok->t2) {
-			msg_debug_bayes ("token(%s) %uL <%*s:%*s>: weight: %f, cf: %f, "
-					"total_count: %ud, "
-					"spam_count: %ud, ham_count: %ud,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam probability: %.3f, current ham probability: %.3f",
-					token_type,
-					tok->data,
-					(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
-					(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
-					fw, w, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+			soa->is_text[soa->n] =
+					(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) ? 0.0 : 1.0;
+			soa->n ++;
+
+			if (tok->t1 && tok->t2) {
+				msg_debug_bayes ("token(%s) %uL <%*s:%*s>: "
+						"spam_count: %.0f, ham_count: %.0f",
+						(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) ? "meta" : "txt",
+						tok->data,
+						(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
+						(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
+						spam_count, ham_count);
+			}
 		}
-		else {
-			msg_debug_bayes ("token(%s) %uL <?:?>: weight: %f, cf: %f, "
-					"total_count: %ud, "
-					"spam_count: %ud, ham_count: %ud,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam probability: %.3f, current ham probability: %.3f",
-					token_type,
-					tok->data,
-					fw, w, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+	}
+}
+
+/*
+ * Classification kernel: calculates probabilities for all gathered tokens
+ * and accumulates their logarithms. The loop has no branches and no calls,
+ * so it is vectorised by compiler. Instead of calling log for each token
+ * we multiply probabilities in batches, splitting mantissa and exponent
+ * after each batch to avoid underflow, so `log` is called just once.
+ */
+static void
+bayes_classify_kernel (const struct bayes_tokens_soa *soa,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble min_prob_strength,
+		struct bayes_task_closure *cl)
+{
+	gdouble spam_prod = 1.0, ham_prod = 1.0, processed = 0, text = 0;
+	gdouble spam_freq, ham_freq, spam_prob, total, w, bsp, bhp, keep;
+	gint spam_exp = 0, ham_exp = 0, e;
+	guint i, j, end;
+
+	for (i = 0; i < soa->n; i += BAYES_KERNEL_BATCH) {
+		end = MIN (i + BAYES_KERNEL_BATCH, soa->n);
+
+		for (j = i; j < end; j ++) {
+			spam_freq = soa->spam_cnt[j] / spam_learns;
+			ham_freq = soa->ham_cnt[j] / ham_learns;
+			total = soa->spam_cnt[j] + soa->ham_cnt[j];
+			spam_prob = spam_freq / (spam_freq + ham_freq);
+			w = (soa->fw[j] * total) / (1.0 + soa->fw[j] * total);
+			bsp = PROB_COMBINE (spam_prob, total, w, 0.5);
+			bhp = PROB_COMBINE (1.0 - spam_prob, total, w, 0.5);
+			/* Skip tokens with probability in (0.5 - MPS, 0.5 + MPS) */
+			keep = (bsp == 0.5 || fabs (bsp - 0.5) >= min_prob_strength) ?
+					1.0 : 0.0;
+			spam_prod *= keep * bsp + (1.0 - keep);
+			ham_prod *= keep * bhp + (1.0 - keep);
+			processed += keep;
+			text += keep * soa->is_text[j];
 		}
+
+		spam_prod = frexp (spam_prod, &e);
+		spam_exp += e;
+		ham_prod = frexp (ham_prod, &e);
+		ham_exp += e;
 	}
+
+	cl->spam_prob += log (spam_prod) + spam_exp * M_LN2;
+	cl->ham_prob += log (ham_prod) + ham_exp * M_LN2;
+	cl->processed_tokens += processed;
+	cl->text_tokens += text;
 }
 
 
@@ -278,6 +323,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 	gchar sumbuf[32];
 	struct rspamd_statfile *st = NULL;
 	struct bayes_task_closure cl;
+	struct bayes_tokens_soa soa;
 	rspamd_token_t *tok;
 	guint i, text_tokens = 0;
 	gint id;
@@ -331,11 +377,17 @@ bayes_classify (struct rspamd_classifier * ctx,
 		cl.meta_skip_prob = 1.0 - text_tokens / tokens->len;
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		bayes_classify_token (ctx, tok, &cl);
-	}
+	soa.spam_cnt = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->len * 4);
+	soa.ham_cnt = soa.spam_cnt + tokens->len;
+	soa.fw = soa.ham_cnt + tokens->len;
+	soa.is_text = soa.fw + tokens->len;
+
+	bayes_gather_tokens (ctx, tokens, &cl, &soa);
+	bayes_classify_kernel (&soa,
+			MAX (1., (gdouble)ctx->spam_learns),
+			MAX (1., (gdouble)ctx->ham_learns),
+			ctx->cfg->min_prob_strength, &cl);
 
 	if (cl.processed_tokens == 0) {
 		msg_info_bayes ("no tokens found in bayes database "
@@ -29,6 +29,7 @@ struct rspamd_task;
 struct rspamd_stat_ctx;
 struct rspamd_config;
 struct rspamd_statfile;
+struct rspamd_learn_filter;
 
 struct rspamd_stat_cache {
 	const char *name;
@@ -49,6 +50,9 @@ struct rspamd_stat_cache {
 				   gboolean is_spam,
 				   gpointer runtime);
 
+	/* Seeds a new learn filter, returns TRUE if it is seeded or being seeded */
+	gboolean (*seed) (struct rspamd_learn_filter *flt, gpointer ctx);
+
 	void (*close) (gpointer ctx);
 
 	gpointer ctx;
@@ -67,6 +71,8 @@ struct rspamd_stat_cache {
         gint rspamd_stat_cache_##name##_learn (struct rspamd_task *task, \
                 gboolean is_spam, \
                 gpointer runtime); \
+        gboolean rspamd_stat_cache_##name##_seed (struct rspamd_learn_filter *flt, \
+                gpointer ctx); \
         void rspamd_stat_cache_##name##_close (gpointer ctx)
 
 RSPAMD_STAT_CACHE_DEF(sqlite3);
@@ -77,6 +83,72 @@ RSPAMD_STAT_CACHE_DEF(redis);
 
 #endif
 
+/**
+ * Opens (or creates) a shared learn filter stored in the specified file
+ * @param path path to the filter file
+ * @param nelts number of elements for a new filter (0 for default)
+ * @param err
+ * @return new filter or NULL
+ */
+struct rspamd_learn_filter *rspamd_learn_filter_open (const gchar *path,
+		gsize nelts, GError **err);
+
+/**
+ * Checks if a digest might have been learned
+ * @return 0 if the digest has definitely not been learned, -1 if the filter
+ * cannot tell, or mask of classes the digest might have been learned as
+ */
+gint rspamd_learn_filter_check (struct rspamd_learn_filter *flt,
+		const guchar *digest);
+
+/**
+ * Records that a digest has been learned as the specified class
+ */
+void rspamd_learn_filter_add (struct rspamd_learn_filter *flt,
+		const guchar *digest, gboolean is_spam);
+
+typedef gboolean (*rspamd_learn_filter_seed_cb) (struct rspamd_learn_filter *flt,
+		gpointer ud);
+
+/**
+ * Checks if a filter has not been filled from the learn cache yet
+ */
+gboolean rspamd_learn_filter_need_seed (struct rspamd_learn_filter *flt);
+
+/**
+ * Starts seeding of a new filter: until it is done, the filter does not give
+ * negative answers. Only one process seeds a filter file, it holds the file
+ * lock until `rspamd_learn_filter_seed_end` is called
+ * @return TRUE if the caller should fill the filter now
+ */
+gboolean rspamd_learn_filter_seed_begin (struct rspamd_learn_filter *flt);
+
+/**
+ * Finishes seeding started by `rspamd_learn_filter_seed_begin`
+ * @param seeded TRUE if all learned digests have been added to the filter
+ */
+void rspamd_learn_filter_seed_end (struct rspamd_learn_filter *flt,
+		gboolean seeded);
+
+/**
+ * Fills a new filter with digests from the learn cache synchronously
+ * @param cb callback that adds all learned digests to the filter
+ * @return TRUE if the filter is seeded
+ */
+gboolean rspamd_learn_filter_seed (struct rspamd_learn_filter *flt,
+		rspamd_learn_filter_seed_cb cb, gpointer ud);
+
+/**
+ * Unmaps learn filter
+ */
+void rspamd_learn_filter_close (struct rspamd_learn_filter *flt);
+
+/**
+ * Returns digest of task tokens (and statistics user) used to identify
+ * learned messages, it is calculated once per task
+ */
+const guchar *rspamd_stat_cache_words_digest (struct rspamd_task *task);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,583 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Local learn filter is a cuckoo filter of learned messages digests stored in
+ * a memory mapped file. The file is mapped as shared, so all workers use the
+ * same filter and it survives restarts.
+ *
+ * Each slot is 16 bits: 14 bits of fingerprint and 2 bits of learned classes.
+ * Filter can have false positives but no false negatives (unless it has
+ * overflowed, which is recorded in the header and disables negative answers),
+ * so a negative lookup allows to skip a query to the real learn cache.
+ *
+ * A new filter knows nothing about messages learned before its creation, so
+ * it gives no negative answers until it is seeded from the learn cache.
+ *
+ * The lock word stores pid of its holder: if the holder has died, the lock is
+ * taken over and the elements it was moving (if any) are inserted again.
+ */
+#include "config.h"
+#include "learn_cache.h"
+#include "rspamd.h"
+#include "stat_internal.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+#include <sys/mman.h>
+
+#define LEARN_FILTER_MAGIC "rslfilt2"
+#define LEARN_FILTER_SLOTS 4
+#define LEARN_FILTER_MAX_KICKS 500
+#define LEARN_FILTER_MAX_SPINS 10000
+#define LEARN_FILTER_MAX_WAITS 100
+#define LEARN_FILTER_DEFAULT_SIZE (1u << 20u)
+#define LEARN_FILTER_FLAG_OVERFLOW (1u << 0u)
+#define LEARN_FILTER_FLAG_UNSEEDED (1u << 1u)
+
+#define LEARN_FILTER_CLASS_SPAM (1u << 0u)
+#define LEARN_FILTER_CLASS_HAM (1u << 1u)
+
+struct rspamd_learn_filter_hdr {
+	gchar magic[8];
+	guint32 nbuckets;
+	gint lock;
+	guint flags;
+	guint count;
+	/* Elements being moved by the lock holder: bucket << 32 | slot << 16 | slot */
+	guint64 pending;
+};
+
+struct rspamd_learn_filter {
+	struct rspamd_learn_filter_hdr *hdr;
+	guint16 *slots;
+	gsize len;
+	guint32 mask;
+	gboolean unreliable;
+	gint seed_fd; /* Locked file descriptor while this process seeds the filter */
+	gchar *path;
+};
+
+static void rspamd_learn_filter_recover (struct rspamd_learn_filter *flt,
+		guint64 pending);
+
+static gboolean
+rspamd_learn_filter_lock (struct rspamd_learn_filter *flt)
+{
+	gint pid = getpid (), owner;
+	guint spins = 0, waits = 0;
+	guint64 pending;
+
+	while (!g_atomic_int_compare_and_exchange (&flt->hdr->lock, 0, pid)) {
+		/*
+		 * The lock is held for a few hundreds instructions at most, so if we
+		 * cannot get it, then its holder might be dead
+		 */
+		if (++spins < LEARN_FILTER_MAX_SPINS) {
+			continue;
+		}
+
+		spins = 0;
+		owner = g_atomic_int_get (&flt->hdr->lock);
+
+		/* Our own pid here means a dead process from the previous run */
+		if (owner != 0 && (owner == pid ||
+				(kill (owner, 0) == -1 && errno == ESRCH))) {
+			if (g_atomic_int_compare_and_exchange (&flt->hdr->lock,
+					owner, pid)) {
+				msg_warn ("learn filter %s: process %d has died while "
+						"holding the lock, take it over", flt->path, owner);
+				pending = flt->hdr->pending;
+
+				if (pending != 0) {
+					flt->hdr->pending = 0;
+					rspamd_learn_filter_recover (flt, pending);
+				}
+
+				return TRUE;
+			}
+		}
+		else if (++waits > LEARN_FILTER_MAX_WAITS) {
+			return FALSE;
+		}
+		else {
+			usleep (100);
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_learn_filter_unlock (struct rspamd_learn_filter *flt)
+{
+	g_atomic_int_set (&flt->hdr->lock, 0);
+}
+
+static inline guint16
+rspamd_learn_filter_fp (guint64 h)
+{
+	guint16 fp = (h >> 50u) & 0x3fffu;
+
+	return fp == 0 ? 1 : fp;
+}
+
+static inline guint32
+rspamd_learn_filter_alt (struct rspamd_learn_filter *flt, guint32 idx,
+		guint16 fp)
+{
+	return (idx ^ ((guint32)fp * 0x5bd1e995u)) & flt->mask;
+}
+
+static guint16 *
+rspamd_learn_filter_find (struct rspamd_learn_filter *flt, guint32 idx,
+		guint16 fp)
+{
+	guint16 *bucket = &flt->slots[(gsize)idx * LEARN_FILTER_SLOTS];
+	guint i;
+
+	for (i = 0; i < LEARN_FILTER_SLOTS; i ++) {
+		if ((bucket[i] >> 2u) == fp) {
+			return &bucket[i];
+		}
+	}
+
+	return NULL;
+}
+
+static gboolean
+rspamd_learn_filter_put (struct rspamd_learn_filter *flt, guint32 idx,
+		guint16 slot)
+{
+	guint16 *bucket = &flt->slots[(gsize)idx * LEARN_FILTER_SLOTS];
+	guint i;
+
+	for (i = 0; i < LEARN_FILTER_SLOTS; i ++) {
+		if (bucket[i] == 0) {
+			bucket[i] = slot;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Inserts slot to one of its buckets moving other elements if needed, must be
+ * called with the lock held; returns FALSE if the filter is full and an
+ * element has been lost
+ */
+static gboolean
+rspamd_learn_filter_insert (struct rspamd_learn_filter *flt, guint32 idx,
+		guint16 victim)
+{
+	guint kick;
+
+	if (rspamd_learn_filter_put (flt, idx, victim) ||
+			rspamd_learn_filter_put (flt,
+					rspamd_learn_filter_alt (flt, idx, victim >> 2u), victim)) {
+		return TRUE;
+	}
+
+	for (kick = 0; kick < LEARN_FILTER_MAX_KICKS; kick ++) {
+		guint16 tmp, *bucket;
+
+		bucket = &flt->slots[(gsize)idx * LEARN_FILTER_SLOTS];
+		tmp = bucket[kick % LEARN_FILTER_SLOTS];
+		/* Elements in hands must survive if we die here */
+		flt->hdr->pending = ((guint64)idx << 32u) | ((guint64)victim << 16u) |
+				tmp;
+		bucket[kick % LEARN_FILTER_SLOTS] = victim;
+		victim = tmp;
+		idx = rspamd_learn_filter_alt (flt, idx, victim >> 2u);
+
+		if (rspamd_learn_filter_put (flt, idx, victim)) {
+			flt->hdr->pending = 0;
+
+			return TRUE;
+		}
+	}
+
+	flt->hdr->pending = 0;
+
+	return FALSE;
+}
+
+/* Ensures that slot is stored in one of its buckets */
+static void
+rspamd_learn_filter_restore (struct rspamd_learn_filter *flt, guint32 idx,
+		guint16 slot)
+{
+	guint16 *found;
+
+	if (slot == 0) {
+		return;
+	}
+
+	found = rspamd_learn_filter_find (flt, idx, slot >> 2u);
+
+	if (found == NULL) {
+		found = rspamd_learn_filter_find (flt,
+				rspamd_learn_filter_alt (flt, idx, slot >> 2u), slot >> 2u);
+	}
+
+	if (found != NULL) {
+		*found |= slot & 0x3u;
+	}
+	else if (!rspamd_learn_filter_insert (flt, idx, slot)) {
+		g_atomic_int_or (&flt->hdr->flags, LEARN_FILTER_FLAG_OVERFLOW);
+	}
+}
+
+/* Puts back elements that a dead lock holder has been moving */
+static void
+rspamd_learn_filter_recover (struct rspamd_learn_filter *flt, guint64 pending)
+{
+	guint32 idx = (pending >> 32u) & flt->mask;
+
+	rspamd_learn_filter_restore (flt, idx, (pending >> 16u) & 0xffffu);
+	rspamd_learn_filter_restore (flt, idx, pending & 0xffffu);
+}
+
+struct rspamd_learn_filter *
+rspamd_learn_filter_open (const gchar *path, gsize nelts, GError **err)
+{
+	struct rspamd_learn_filter *flt;
+	struct rspamd_learn_filter_hdr *hdr;
+	struct stat st;
+	guint32 nbuckets = 1;
+	gsize len;
+	gpointer map;
+	gint fd;
+
+	if (nelts == 0) {
+		nelts = LEARN_FILTER_DEFAULT_SIZE;
+	}
+
+	while ((gsize)nbuckets * LEARN_FILTER_SLOTS < nelts && nbuckets < G_MAXINT32) {
+		nbuckets <<= 1u;
+	}
+
+	fd = open (path, O_RDWR | O_CREAT, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, g_quark_from_static_string ("learn-filter"), errno,
+				"cannot open %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	/* Serialise initialisation between workers */
+	rspamd_file_lock (fd, FALSE);
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, g_quark_from_static_string ("learn-filter"), errno,
+				"cannot stat %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		struct rspamd_learn_filter_hdr nhdr;
+
+		memset (&nhdr, 0, sizeof (nhdr));
+		memcpy (nhdr.magic, LEARN_FILTER_MAGIC, sizeof (nhdr.magic));
+		nhdr.nbuckets = nbuckets;
+		nhdr.flags = LEARN_FILTER_FLAG_UNSEEDED;
+		len = sizeof (nhdr) + (gsize)nbuckets * LEARN_FILTER_SLOTS *
+				sizeof (guint16);
+
+		if (ftruncate (fd, len) == -1 ||
+				write (fd, &nhdr, sizeof (nhdr)) != sizeof (nhdr)) {
+			g_set_error (err, g_quark_from_static_string ("learn-filter"), errno,
+					"cannot create %s: %s", path, strerror (errno));
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+			(void)unlink (path);
+
+			return NULL;
+		}
+	}
+	else {
+		len = st.st_size;
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, g_quark_from_static_string ("learn-filter"), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	hdr = map;
+
+	/* Existing file defines the filter size, not configuration */
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, LEARN_FILTER_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->nbuckets == 0 ||
+			(hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+			len != sizeof (*hdr) + (gsize)hdr->nbuckets * LEARN_FILTER_SLOTS *
+					sizeof (guint16)) {
+		g_set_error (err, g_quark_from_static_string ("learn-filter"), EINVAL,
+				"invalid learn filter file %s", path);
+		munmap (map, len);
+
+		return NULL;
+	}
+
+	flt = g_malloc0 (sizeof (*flt));
+	flt->hdr = hdr;
+	flt->slots = (guint16 *)(hdr + 1);
+	flt->len = len;
+	flt->mask = hdr->nbuckets - 1;
+	flt->seed_fd = -1;
+	flt->path = g_strdup (path);
+
+	return flt;
+}
+
+gint
+rspamd_learn_filter_check (struct rspamd_learn_filter *flt,
+		const guchar *digest)
+{
+	guint64 h;
+	guint32 i1, i2;
+	guint16 fp, *slot;
+	gint ret;
+
+	if (flt->unreliable || (g_atomic_int_get ((gint *)&flt->hdr->flags) &
+			(LEARN_FILTER_FLAG_OVERFLOW|LEARN_FILTER_FLAG_UNSEEDED))) {
+		return -1;
+	}
+
+	memcpy (&h, digest, sizeof (h));
+	fp = rspamd_learn_filter_fp (h);
+	i1 = h & flt->mask;
+	i2 = rspamd_learn_filter_alt (flt, i1, fp);
+
+	if (!rspamd_learn_filter_lock (flt)) {
+		return -1;
+	}
+
+	slot = rspamd_learn_filter_find (flt, i1, fp);
+
+	if (slot == NULL) {
+		slot = rspamd_learn_filter_find (flt, i2, fp);
+	}
+
+	ret = slot ? (*slot & 0x3u) : 0;
+	rspamd_learn_filter_unlock (flt);
+
+	return ret;
+}
+
+void
+rspamd_learn_filter_add (struct rspamd_learn_filter *flt,
+		const guchar *digest, gboolean is_spam)
+{
+	guint64 h;
+	guint32 i1, i2;
+	guint16 fp, cls, *slot;
+
+	memcpy (&h, digest, sizeof (h));
+	fp = rspamd_learn_filter_fp (h);
+	i1 = h & flt->mask;
+	i2 = rspamd_learn_filter_alt (flt, i1, fp);
+	cls = is_spam ? LEARN_FILTER_CLASS_SPAM : LEARN_FILTER_CLASS_HAM;
+
+	if (!rspamd_learn_filter_lock (flt)) {
+		/*
+		 * We cannot record this learn, so negative answers are not safe;
+		 * the lock holder is alive, so it is a temporary problem and
+		 * we do not spoil the shared filter but stop using it in this process
+		 */
+		if (!flt->unreliable) {
+			msg_warn ("learn filter %s: cannot lock, stop using it "
+					"in this process", flt->path);
+			flt->unreliable = TRUE;
+		}
+
+		return;
+	}
+
+	slot = rspamd_learn_filter_find (flt, i1, fp);
+
+	if (slot == NULL) {
+		slot = rspamd_learn_filter_find (flt, i2, fp);
+	}
+
+	if (slot != NULL) {
+		/*
+		 * We never clear class bits as the same fingerprint might be shared
+		 * by another message
+		 */
+		*slot |= cls;
+		rspamd_learn_filter_unlock (flt);
+
+		return;
+	}
+
+	if (rspamd_learn_filter_insert (flt, (h >> 32u) & 1u ? i1 : i2,
+			(fp << 2u) | cls)) {
+		flt->hdr->count ++;
+		rspamd_learn_filter_unlock (flt);
+
+		return;
+	}
+
+	/* Filter is full and we have lost one element */
+	msg_warn ("learn filter %s is full (%ud elements), switch to "
+			"the learn cache only; remove the file to reset it",
+			flt->path, flt->hdr->count);
+	g_atomic_int_or (&flt->hdr->flags, LEARN_FILTER_FLAG_OVERFLOW);
+	rspamd_learn_filter_unlock (flt);
+}
+
+gboolean
+rspamd_learn_filter_need_seed (struct rspamd_learn_filter *flt)
+{
+	return (g_atomic_int_get ((gint *)&flt->hdr->flags) &
+			LEARN_FILTER_FLAG_UNSEEDED) != 0;
+}
+
+gboolean
+rspamd_learn_filter_seed_begin (struct rspamd_learn_filter *flt)
+{
+	gint fd;
+
+	if (!rspamd_learn_filter_need_seed (flt) || flt->seed_fd != -1) {
+		return FALSE;
+	}
+
+	fd = open (flt->path, O_RDWR);
+
+	if (fd == -1) {
+		msg_err ("cannot open learn filter %s: %s", flt->path,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	/* Another process is seeding it now, keep falling back to the cache */
+	if (!rspamd_file_lock (fd, TRUE)) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (!rspamd_learn_filter_need_seed (flt)) {
+		rspamd_file_unlock (fd, TRUE);
+		close (fd);
+
+		return FALSE;
+	}
+
+	flt->seed_fd = fd;
+
+	return TRUE;
+}
+
+void
+rspamd_learn_filter_seed_end (struct rspamd_learn_filter *flt,
+		gboolean seeded)
+{
+	if (flt->seed_fd == -1) {
+		return;
+	}
+
+	if (seeded) {
+		/*
+		 * Learns done while seeding are added to the filter by the learners
+		 * themselves, so the filter is complete now
+		 */
+		msg_info ("learn filter %s has been seeded from the learn cache: "
+				"%ud elements", flt->path, flt->hdr->count);
+		g_atomic_int_and (&flt->hdr->flags, ~LEARN_FILTER_FLAG_UNSEEDED);
+	}
+
+	rspamd_file_unlock (flt->seed_fd, TRUE);
+	close (flt->seed_fd);
+	flt->seed_fd = -1;
+}
+
+gboolean
+rspamd_learn_filter_seed (struct rspamd_learn_filter *flt,
+		rspamd_learn_filter_seed_cb cb, gpointer ud)
+{
+	gboolean ret;
+
+	if (!rspamd_learn_filter_seed_begin (flt)) {
+		return !rspamd_learn_filter_need_seed (flt);
+	}
+
+	ret = cb (flt, ud);
+	rspamd_learn_filter_seed_end (flt, ret);
+
+	return ret;
+}
+
+void
+rspamd_learn_filter_close (struct rspamd_learn_filter *flt)
+{
+	if (flt) {
+		/* Seeding has not been finished, another process will do it */
+		rspamd_learn_filter_seed_end (flt, FALSE);
+		munmap (flt->hdr, flt->len);
+		g_free (flt->path);
+		g_free (flt);
+	}
+}
+
+const guchar *
+rspamd_stat_cache_words_digest (struct rspamd_task *task)
+{
+	rspamd_cryptobox_hash_state_t st;
+	rspamd_token_t *tok;
+	guchar *out;
+	gchar *user = NULL;
+	guint i;
+
+	out = rspamd_mempool_get_variable (task->task_pool, "words_digest");
+
+	if (out != NULL) {
+		return out;
+	}
+
+	out = rspamd_mempool_alloc (task->task_pool, rspamd_cryptobox_HASHBYTES);
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+
+	user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
+	/* Use dedicated hash space for per users cache */
+	if (user != NULL) {
+		rspamd_cryptobox_hash_update (&st, user, strlen (user));
+	}
+
+	for (i = 0; i < task->tokens->len; i ++) {
+		tok = g_ptr_array_index (task->tokens, i);
+		rspamd_cryptobox_hash_update (&st, (guchar *)&tok->data,
+				sizeof (tok->data));
+	}
+
+	rspamd_cryptobox_hash_final (&st, out);
+	rspamd_mempool_set_variable (task->task_pool, "words_digest", out, NULL);
+
+	return out;
+}
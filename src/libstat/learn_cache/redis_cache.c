@@ -32,9 +32,13 @@
 
 static const gchar *M = "redis learn cache";
 
+struct rspamd_redis_cache_seed;
+
 struct rspamd_redis_cache_ctx {
 	lua_State *L;
 	struct rspamd_statfile_config *stcf;
+	struct ev_loop *event_loop;
+	struct rspamd_redis_cache_seed *seed; /* Seeding of learn filter in progress */
 	const gchar *password;
 	const gchar *dbname;
 	const gchar *redis_object;
@@ -51,6 +55,15 @@ struct rspamd_redis_cache_runtime {
 	gboolean has_event;
 };
 
+/* Learn filter is filled from the learned ids hash by HSCAN in the event loop */
+struct rspamd_redis_cache_seed {
+	struct rspamd_redis_cache_ctx *ctx;
+	struct rspamd_learn_filter *flt;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	ev_timer timer_ev;
+};
+
 static GQuark
 rspamd_stat_cache_redis_quark (void)
 {
@@ -196,35 +209,22 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
-static void
+static gchar *
 rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 {
-	rspamd_cryptobox_hash_state_t st;
-	rspamd_token_t *tok;
-	guint i;
-	guchar out[rspamd_cryptobox_HASHBYTES];
 	gchar *b32out;
-	gchar *user = NULL;
-
-	rspamd_cryptobox_hash_init (&st, NULL, 0);
 
-	user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
-	/* Use dedicated hash space for per users cache */
-	if (user != NULL) {
-		rspamd_cryptobox_hash_update (&st, user, strlen (user));
-	}
+	b32out = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 
-	for (i = 0; i < task->tokens->len; i ++) {
-		tok = g_ptr_array_index (task->tokens, i);
-		rspamd_cryptobox_hash_update (&st, (guchar *)&tok->data,
-				sizeof (tok->data));
+	if (b32out == NULL) {
+		b32out = rspamd_encode_base32 (rspamd_stat_cache_words_digest (task),
+				rspamd_cryptobox_HASHBYTES);
+		g_assert (b32out != NULL);
+		rspamd_mempool_set_variable (task->task_pool, "words_hash", b32out,
+				g_free);
 	}
 
-	rspamd_cryptobox_hash_final (&st, out);
-
-	b32out = rspamd_encode_base32 (out, sizeof (out));
-	g_assert (b32out != NULL);
-	rspamd_mempool_set_variable (task->task_pool, "words_hash", b32out, g_free);
+	return b32out;
 }
 
 gpointer
@@ -326,6 +326,7 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 	lua_settop (L, 0);
 
 	cache_ctx->stcf = stf;
+	cache_ctx->event_loop = ctx->event_loop;
 
 	return (gpointer)cache_ctx;
 }
@@ -474,8 +475,8 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 		return RSPAMD_LEARN_INGORE;
 	}
 
-	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
-	g_assert (h != NULL);
+	/* Check might have been skipped by the local learn filter */
+	h = rspamd_stat_cache_redis_generate_id (task);
 
 	flag = (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM) ? 1 : -1;
 
@@ -492,6 +493,191 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	return RSPAMD_LEARN_OK;
 }
 
+static void
+rspamd_redis_cache_seed_fin (struct rspamd_redis_cache_seed *seed,
+		gboolean seeded)
+{
+	redisAsyncContext *redis;
+
+	ev_timer_stop (seed->ctx->event_loop, &seed->timer_ev);
+	seed->ctx->seed = NULL;
+	rspamd_learn_filter_seed_end (seed->flt, seeded);
+
+	if (seed->redis) {
+		redis = seed->redis;
+		seed->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+
+	g_free (seed);
+}
+
+static void
+rspamd_redis_cache_seed_timeout (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_redis_cache_seed *seed =
+			(struct rspamd_redis_cache_seed *)w->data;
+
+	msg_warn ("cannot seed learn filter from redis server %s: timeout",
+			rspamd_upstream_name (seed->selected));
+	rspamd_upstream_fail (seed->selected, FALSE, "timeout");
+	rspamd_redis_cache_seed_fin (seed, FALSE);
+}
+
+static void
+rspamd_redis_cache_seed_scan (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cache_seed *seed = priv;
+	redisReply *reply = r, *elts;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	glong val;
+	guint i;
+
+	if (seed->redis == NULL) {
+		/* Connection is being terminated */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2 ||
+			reply->element[0]->type != REDIS_REPLY_STRING ||
+			reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		msg_warn ("cannot scan learn cache %s: %s", seed->ctx->redis_object,
+				c->err != 0 ? c->errstr :
+				(reply && reply->type == REDIS_REPLY_ERROR ?
+						reply->str : "bad reply"));
+
+		if (c->err != 0) {
+			rspamd_upstream_fail (seed->selected, FALSE, c->errstr);
+		}
+
+		rspamd_redis_cache_seed_fin (seed, FALSE);
+
+		return;
+	}
+
+	elts = reply->element[1];
+
+	for (i = 0; i + 1 < elts->elements; i += 2) {
+		if (elts->element[i]->type != REDIS_REPLY_STRING ||
+				elts->element[i + 1]->type != REDIS_REPLY_STRING ||
+				rspamd_decode_base32_buf (elts->element[i]->str,
+						elts->element[i]->len, digest,
+						sizeof (digest)) != sizeof (digest)) {
+			continue;
+		}
+
+		val = 0;
+		rspamd_strtol (elts->element[i + 1]->str,
+				elts->element[i + 1]->len, &val);
+
+		if (val != 0) {
+			rspamd_learn_filter_add (seed->flt, digest, val > 0);
+		}
+	}
+
+	if (reply->element[0]->len == 1 && reply->element[0]->str[0] == '0') {
+		rspamd_upstream_ok (seed->selected);
+		rspamd_redis_cache_seed_fin (seed, TRUE);
+
+		return;
+	}
+
+	if (redisAsyncCommand (seed->redis, rspamd_redis_cache_seed_scan, seed,
+			"HSCAN %s %b COUNT 1000", seed->ctx->redis_object,
+			reply->element[0]->str, (gsize)reply->element[0]->len) != REDIS_OK) {
+		rspamd_redis_cache_seed_fin (seed, FALSE);
+
+		return;
+	}
+
+	ev_timer_again (seed->ctx->event_loop, &seed->timer_ev);
+}
+
+gboolean
+rspamd_stat_cache_redis_seed (struct rspamd_learn_filter *flt, gpointer c)
+{
+	struct rspamd_redis_cache_ctx *ctx = (struct rspamd_redis_cache_ctx *)c;
+	struct rspamd_redis_cache_seed *seed;
+	struct upstream_list *ups;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *redis;
+
+	if (ctx->seed != NULL) {
+		return TRUE;
+	}
+
+	if (ctx->event_loop == NULL) {
+		return FALSE;
+	}
+
+	ups = rspamd_redis_get_servers (ctx, "read_servers");
+
+	if (!ups || (up = rspamd_upstream_get (ups, RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL, 0)) == NULL) {
+		msg_err ("no read servers defined for %s, cannot seed learn filter",
+				ctx->stcf->symbol);
+		return FALSE;
+	}
+
+	if (!rspamd_learn_filter_seed_begin (flt)) {
+		return !rspamd_learn_filter_need_seed (flt);
+	}
+
+	addr = rspamd_upstream_addr_next (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (redis == NULL || redis->err != REDIS_OK) {
+		msg_warn ("cannot connect to redis server %s to seed learn filter: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				redis ? redis->errstr : strerror (errno));
+
+		if (redis) {
+			redisAsyncFree (redis);
+		}
+
+		rspamd_learn_filter_seed_end (flt, FALSE);
+
+		return FALSE;
+	}
+
+	seed = g_malloc0 (sizeof (*seed));
+	seed->ctx = ctx;
+	seed->flt = flt;
+	seed->selected = up;
+	seed->redis = redis;
+	ctx->seed = seed;
+
+	redisLibevAttach (ctx->event_loop, redis);
+	rspamd_redis_cache_maybe_auth (ctx, redis);
+
+	/* Timeout is restarted for each scan step */
+	seed->timer_ev.data = seed;
+	ev_timer_init (&seed->timer_ev, rspamd_redis_cache_seed_timeout,
+			ctx->timeout, ctx->timeout);
+
+	if (redisAsyncCommand (redis, rspamd_redis_cache_seed_scan, seed,
+			"HSCAN %s 0 COUNT 1000", ctx->redis_object) != REDIS_OK) {
+		rspamd_redis_cache_seed_fin (seed, FALSE);
+
+		return FALSE;
+	}
+
+	ev_timer_again (ctx->event_loop, &seed->timer_ev);
+
+	return TRUE;
+}
+
 void
 rspamd_stat_cache_redis_close (gpointer c)
 {
@@ -500,6 +686,10 @@ rspamd_stat_cache_redis_close (gpointer c)
 
 	L = ctx->L;
 
+	if (ctx->seed) {
+		rspamd_redis_cache_seed_fin (ctx->seed, FALSE);
+	}
+
 	if (ctx->conf_ref) {
 		luaL_unref (L, LUA_REGISTRYINDEX, ctx->conf_ref);
 	}
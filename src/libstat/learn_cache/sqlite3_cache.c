@@ -175,11 +175,7 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 		gpointer runtime)
 {
 	struct rspamd_stat_sqlite3_ctx *ctx = runtime;
-	rspamd_cryptobox_hash_state_t st;
-	rspamd_token_t *tok;
-	guchar *out;
-	gchar *user = NULL;
-	guint i;
+	const guchar *out;
 	gint rc;
 	gint64 flag;
 
@@ -188,35 +184,16 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 	}
 
 	if (ctx != NULL && ctx->db != NULL) {
-		out = rspamd_mempool_alloc (task->task_pool, rspamd_cryptobox_HASHBYTES);
-
-		rspamd_cryptobox_hash_init (&st, NULL, 0);
-
-		user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
-		/* Use dedicated hash space for per users cache */
-		if (user != NULL) {
-			rspamd_cryptobox_hash_update (&st, user, strlen (user));
-		}
-
-		for (i = 0; i < task->tokens->len; i ++) {
-			tok = g_ptr_array_index (task->tokens, i);
-			rspamd_cryptobox_hash_update (&st, (guchar *)&tok->data,
-					sizeof (tok->data));
-		}
-
-		rspamd_cryptobox_hash_final (&st, out);
+		out = rspamd_stat_cache_words_digest (task);
 
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_DEF);
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_GET_LEARN, (gint64)rspamd_cryptobox_HASHBYTES,
-				out, &flag);
+				(guchar *)out, &flag);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 
-		/* Save hash into variables */
-		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
-
 		if (rc == SQLITE_OK) {
 			/* We have some existing record in the table */
 			if (!!flag == !!is_spam) {
@@ -242,15 +219,17 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 {
 	struct rspamd_stat_sqlite3_ctx *ctx = runtime;
 	gboolean unlearn = !!(task->flags & RSPAMD_TASK_FLAG_UNLEARN);
-	guchar *h;
+	const guchar *h;
 	gint64 flag;
 
-	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
-
-	if (h == NULL) {
+	if (ctx == NULL || ctx->db == NULL ||
+			task->tokens == NULL || task->tokens->len == 0) {
 		return RSPAMD_LEARN_INGORE;
 	}
 
+	/* Check might have been skipped by the local learn filter */
+	h = rspamd_stat_cache_words_digest (task);
+
 	flag = !!is_spam ? 1 : 0;
 
 	if (!unlearn) {
@@ -259,7 +238,7 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_IM);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_ADD_LEARN,
-				(gint64)rspamd_cryptobox_HASHBYTES, h, flag);
+				(gint64)rspamd_cryptobox_HASHBYTES, (guchar *)h, flag);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 	}
@@ -269,7 +248,7 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_UPDATE_LEARN,
 				flag,
-				(gint64)rspamd_cryptobox_HASHBYTES, h);
+				(gint64)rspamd_cryptobox_HASHBYTES, (guchar *)h);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 	}
@@ -279,6 +258,49 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 	return RSPAMD_LEARN_OK;
 }
 
+static gboolean
+rspamd_stat_cache_sqlite3_seed_cb (struct rspamd_learn_filter *flt, gpointer c)
+{
+	struct rspamd_stat_sqlite3_ctx *ctx = (struct rspamd_stat_sqlite3_ctx *)c;
+	sqlite3_stmt *stmt;
+	gint rc;
+
+	if (ctx == NULL || ctx->db == NULL) {
+		return FALSE;
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT digest, flag FROM learns;", -1,
+			&stmt, NULL) != SQLITE_OK) {
+		msg_err ("cannot read sqlite3 cache: %s", sqlite3_errmsg (ctx->db));
+
+		return FALSE;
+	}
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		if (sqlite3_column_bytes (stmt, 0) == rspamd_cryptobox_HASHBYTES) {
+			rspamd_learn_filter_add (flt, sqlite3_column_blob (stmt, 0),
+					sqlite3_column_int64 (stmt, 1) != 0);
+		}
+	}
+
+	sqlite3_finalize (stmt);
+
+	if (rc != SQLITE_DONE) {
+		msg_err ("cannot read sqlite3 cache: %s", sqlite3_errmsg (ctx->db));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_stat_cache_sqlite3_seed (struct rspamd_learn_filter *flt, gpointer c)
+{
+	/* Local database is read fast enough to seed it in place */
+	return rspamd_learn_filter_seed (flt, rspamd_stat_cache_sqlite3_seed_cb, c);
+}
+
 void
 rspamd_stat_cache_sqlite3_close (gpointer c)
 {
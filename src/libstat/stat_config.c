@@ -73,6 +73,7 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 static struct rspamd_stat_backend stat_backends[] = {
 		RSPAMD_STAT_BACKEND_ELT(mmap, mmaped_file),
 		RSPAMD_STAT_BACKEND_ELT(sqlite3, sqlite3),
+		RSPAMD_STAT_BACKEND_ELT(snapshot, snapshot),
 #ifdef WITH_HIREDIS
 		RSPAMD_STAT_BACKEND_ELT(redis, redis)
 #endif
@@ -84,6 +85,7 @@ static struct rspamd_stat_backend stat_backends[] = {
 		.runtime = rspamd_stat_cache_##eltn##_runtime, \
 		.check = rspamd_stat_cache_##eltn##_check, \
 		.learn = rspamd_stat_cache_##eltn##_learn, \
+		.seed = rspamd_stat_cache_##eltn##_seed, \
 		.close = rspamd_stat_cache_##eltn##_close \
 	}
 
@@ -296,6 +298,42 @@ rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base)
 			cache_name = clf->backend;
 		}
 
+		if (clf->opts && !skip_cache) {
+			const ucl_object_t *filter_obj, *elt;
+			const gchar *filter_path = NULL;
+			gint64 filter_size = 0;
+			GError *err = NULL;
+
+			filter_obj = ucl_object_lookup (clf->opts, "learn_filter");
+
+			if (filter_obj && ucl_object_type (filter_obj) == UCL_STRING) {
+				filter_path = ucl_object_tostring (filter_obj);
+			}
+			else if (filter_obj && ucl_object_type (filter_obj) == UCL_OBJECT) {
+				elt = ucl_object_lookup (filter_obj, "path");
+
+				if (elt) {
+					filter_path = ucl_object_tostring (elt);
+				}
+
+				elt = ucl_object_lookup (filter_obj, "size");
+
+				if (elt) {
+					ucl_object_toint_safe (elt, &filter_size);
+				}
+			}
+
+			if (filter_path) {
+				cl->filter = rspamd_learn_filter_open (filter_path,
+						MAX (filter_size, 0), &err);
+
+				if (cl->filter == NULL) {
+					msg_err_config ("cannot open learn filter: %e", err);
+					g_error_free (err);
+				}
+			}
+		}
+
 		curst = clf->statfiles;
 
 		while (curst) {
@@ -348,6 +386,15 @@ rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base)
 			curst = curst->next;
 		}
 
+		/* Workers only: a new filter must know what is already learned */
+		if (cl->filter && cl->cache && cl->cachecf && ev_base &&
+				rspamd_learn_filter_need_seed (cl->filter)) {
+			if (!cl->cache->seed (cl->filter, cl->cachecf)) {
+				msg_info_config ("learn filter is not seeded yet, "
+						"use the learn cache only");
+			}
+		}
+
 		g_ptr_array_add (stat_ctx->classifiers, cl);
 
 		cur = cur->next;
@@ -385,6 +432,10 @@ rspamd_stat_close (void)
 			cl->cache->close (cl->cachecf);
 		}
 
+		if (cl->filter) {
+			rspamd_learn_filter_close (cl->filter);
+		}
+
 		g_array_free (cl->statfiles_ids, TRUE);
 
 		if (cl->subrs->fin_func) {
@@ -41,6 +41,7 @@ struct rspamd_classifier {
 	GArray *statfiles_ids; /* int */
 	struct rspamd_stat_cache *cache;
 	gpointer cachecf;
+	struct rspamd_learn_filter *filter;
 	gulong spam_learns;
 	gulong ham_learns;
 	gint autolearn_cbref;
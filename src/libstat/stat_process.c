@@ -447,6 +447,15 @@ rspamd_stat_cache_check (struct rspamd_stat_ctx *st_ctx,
 		sel = cl;
 
 		if (sel->cache && sel->cachecf) {
+			if (sel->filter && task->tokens && task->tokens->len > 0 &&
+					rspamd_learn_filter_check (sel->filter,
+							rspamd_stat_cache_words_digest (task)) == 0) {
+				/* Definitely not learned, no need to ask the learn cache */
+				msg_debug_bayes ("message has not been learned according "
+						"to the local learn filter");
+				continue;
+			}
+
 			rt = cl->cache->runtime (task, sel->cachecf, FALSE);
 			learn_res = cl->cache->check (task, spam, rt);
 		}
@@ -787,6 +796,11 @@ rspamd_stat_backends_post_learn (struct rspamd_stat_ctx *st_ctx,
 			cache_run = cl->cache->runtime (task, cl->cachecf, TRUE);
 			cl->cache->learn (task, spam, cache_run);
 		}
+
+		if (cl->filter && task->tokens && task->tokens->len > 0) {
+			rspamd_learn_filter_add (cl->filter,
+					rspamd_stat_cache_words_digest (task), spam);
+		}
 	}
 
 	g_atomic_int_add (&task->worker->srv->stat->messages_learned, 1);
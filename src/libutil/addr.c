@@ -1042,12 +1042,13 @@ rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
 
 int
 rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+		enum rspamd_inet_address_listen_opts opts)
 {
 	gint fd, r;
 	gint on = 1;
 	const struct sockaddr *sa;
 	const char *path;
+	gboolean async = !!(opts & RSPAMD_INET_ADDRESS_LISTEN_ASYNC);
 
 	if (addr == NULL) {
 		return -1;
@@ -1072,6 +1073,20 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	(void)setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+	if ((opts & RSPAMD_INET_ADDRESS_LISTEN_REUSEPORT) && addr->af != AF_UNIX) {
+#ifdef SO_REUSEPORT
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint)) == -1) {
+			msg_warn ("cannot set SO_REUSEPORT on %s: %s",
+					rspamd_inet_address_to_string_pretty (addr),
+					strerror (errno));
+		}
+#else
+		msg_warn ("SO_REUSEPORT is not supported, cannot use it for %s",
+				rspamd_inet_address_to_string_pretty (addr));
+#endif
+	}
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -1744,7 +1744,8 @@ rspamd_string_find_eoh (GString *input, goffset *body_start)
 				state = got_lf;
 			}
 			else {
-				p++;
+				/* Skip the rest of line at once */
+				p += rspamd_str_find_newline (p, end - p);
 			}
 			break;
 
@@ -2077,21 +2078,99 @@ rspamd_decode_hex (const gchar *in, gsize inlen)
 	return NULL;
 }
 
-gssize
-rspamd_decode_qp_buf (const gchar *in, gsize inlen,
-		gchar *out, gsize outlen)
+/* Values of hex digits, 0xff for other characters */
+static const guchar qp_hex_values[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* Decoded qp output is checked by blocks of this size while it is in cache */
+#define RSPAMD_QP_CHECK_BLOCK 4096
+
+/*
+ * Checks a block of the decoded output: detects 8bit characters and then
+ * validates utf8 up to the last complete character, returns the new start of
+ * not checked data
+ */
+static inline gchar *
+rspamd_decode_qp_check_block (gchar *start, gchar *o, gboolean eof,
+		gboolean *has_8bit, gboolean *valid_utf8)
 {
-	gchar *o, *end, *pos, c;
+	gchar *b = o;
+
+	if (!*has_8bit) {
+		if (!rspamd_str_has_8bit ((const guchar *)start, o - start)) {
+			/* All decoded characters are 7bit */
+			return o;
+		}
+
+		*has_8bit = TRUE;
+	}
+
+	if (!*valid_utf8) {
+		return o;
+	}
+
+	if (!eof) {
+		/* Do not split the last character, it is checked with the next block */
+		while (b > start && b > o - 4 && ((guchar)b[-1] & 0xC0) == 0x80) {
+			b --;
+		}
+
+		if (b > start && (guchar)b[-1] >= 0xC0) {
+			b --;
+		}
+	}
+
+	if (b > start && rspamd_fast_utf8_validate ((const guchar *)start,
+			b - start) != 0) {
+		*valid_utf8 = FALSE;
+	}
+
+	return b;
+}
+
+/*
+ * Common qp decoder, when `check` is TRUE it also detects 8bit characters and
+ * validates utf8 of the decoded output while it is in cache
+ */
+static inline gssize
+rspamd_decode_qp_buf_common (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen, gboolean check,
+		gboolean *has_8bit, gboolean *valid_utf8)
+{
+	gchar *o, *end, *pos, *vstart, c;
 	const gchar *p;
 	guchar ret;
 	gssize remain, processed;
+	gboolean b8 = FALSE, utf8 = TRUE;
 
 	p = in;
 	o = out;
+	vstart = out;
 	end = out + outlen;
 	remain = inlen;
 
 	while (remain > 0 && o < end) {
+		if (check && o - vstart >= RSPAMD_QP_CHECK_BLOCK) {
+			vstart = rspamd_decode_qp_check_block (vstart, o, FALSE,
+					&b8, &utf8);
+		}
+
 		if (*p == '=') {
 			remain --;
 
@@ -2110,6 +2189,33 @@ rspamd_decode_qp_buf (const gchar *in, gsize inlen,
 
 			p ++;
 decode:
+			/* Fast path for runs of well formed escapes, e.g. =D0=BF=D1=80 */
+			if (remain >= 2 && qp_hex_values[(guchar)p[0]] != 0xff &&
+					qp_hex_values[(guchar)p[1]] != 0xff && end - o > 0) {
+				for (;;) {
+					ret = qp_hex_values[(guchar)p[0]] * 16 +
+							qp_hex_values[(guchar)p[1]];
+					*o++ = (gchar)ret;
+
+					p += 2;
+					remain -= 2;
+
+					if (remain >= 3 && p[0] == '=' &&
+							qp_hex_values[(guchar)p[1]] != 0xff &&
+							qp_hex_values[(guchar)p[2]] != 0xff &&
+							end - o > 0) {
+						/* Skip '=' of the next escape */
+						p ++;
+						remain --;
+					}
+					else {
+						break;
+					}
+				}
+
+				continue;
+			}
+
 			/* Decode character after '=' */
 			c = *p++;
 			remain --;
@@ -2155,51 +2261,71 @@ decode:
 			}
 		}
 		else {
-			if (end - o >= remain) {
-				if ((pos = memccpy (o, p, '=', remain)) == NULL) {
-					/* All copied */
-					o += remain;
-					break;
+			if (end - o < remain) {
+				/* Buffer overflow */
+				return (-1);
+			}
+			if ((pos = memccpy (o, p, '=', remain)) == NULL) {
+				/* All copied */
+				o += remain;
+				break;
+			}
+			else {
+				processed = pos - o;
+				remain -= processed;
+				p += processed;
+
+				if (remain > 0) {
+					o = pos - 1;
+					/*
+					 * Skip comparison and jump inside decode branch,
+					 * as we know that we have found match
+					 */
+					goto decode;
 				}
 				else {
-					processed = pos - o;
-					remain -= processed;
-					p += processed;
+					/* Last '=' character, bugon */
+					o = pos;
 
-					if (remain > 0) {
-						o = pos - 1;
-						/*
-						 * Skip comparison and jump inside decode branch,
-						 * as we know that we have found match
-						 */
-						goto decode;
+					if (end - o > 0) {
+						*o = '=';
 					}
 					else {
-						/* Last '=' character, bugon */
-						o = pos;
-
-						if (end - o > 0) {
-							*o = '=';
-						}
-						else {
-							/* Buffer overflow */
-							return (-1);
-						}
-
-						break;
+						/* Buffer overflow */
+						return (-1);
 					}
+
+					break;
 				}
 			}
-			else {
-				/* Buffer overflow */
-				return (-1);
-			}
 		}
 	}
 
+	if (check) {
+		rspamd_decode_qp_check_block (vstart, o, TRUE, &b8, &utf8);
+		*has_8bit = b8;
+		*valid_utf8 = utf8;
+	}
+
 	return (o - out);
 }
 
+gssize
+rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen)
+{
+	return rspamd_decode_qp_buf_common (in, inlen, out, outlen, FALSE,
+			NULL, NULL);
+}
+
+gssize
+rspamd_decode_qp_buf_check (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen, gboolean *has_8bit, gboolean *valid_utf8)
+{
+	return rspamd_decode_qp_buf_common (in, inlen, out, outlen, TRUE,
+			has_8bit, valid_utf8);
+}
+
 gssize
 rspamd_decode_uue_buf (const gchar *in, gsize inlen,
 					  gchar *out, gsize outlen)
@@ -3396,3 +3522,108 @@ rspamd_str_has_8bit (const guchar *beg, gsize len)
 
 	return rspamd_str_has_8bit_u64 (beg, len);
 }
+
+gsize
+rspamd_str_find_newline (const gchar *s, gsize len)
+{
+	const gchar *p = s, *end = s + len;
+
+#if defined(__x86_64__)
+	const __m128i cr = _mm_set1_epi8 ('\r'), lf = _mm_set1_epi8 ('\n');
+
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)p);
+		guint mask = _mm_movemask_epi8 (_mm_or_si128 (
+				_mm_cmpeq_epi8 (v, cr), _mm_cmpeq_epi8 (v, lf)));
+
+		if (mask != 0) {
+			return (p - s) + __builtin_ctz (mask);
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (p < end && *p != '\r' && *p != '\n') {
+		p ++;
+	}
+
+	return p - s;
+}
+
+gsize
+rspamd_str_find_line_dashes (const gchar *s, gsize len)
+{
+	const gchar *p = s + 1, *end = s + len;
+
+	if (len < 3) {
+		return len;
+	}
+
+#if defined(__x86_64__)
+	const __m128i dash = _mm_set1_epi8 ('-'), cr = _mm_set1_epi8 ('\r'),
+			lf = _mm_set1_epi8 ('\n');
+
+	/* We load p - 1 ... p + 16 */
+	while (end - p >= 17) {
+		__m128i prev = _mm_loadu_si128 ((const __m128i *)(p - 1));
+		__m128i cur = _mm_loadu_si128 ((const __m128i *)p);
+		__m128i next = _mm_loadu_si128 ((const __m128i *)(p + 1));
+		guint mask;
+
+		mask = _mm_movemask_epi8 (_mm_and_si128 (
+				_mm_and_si128 (_mm_cmpeq_epi8 (cur, dash),
+						_mm_cmpeq_epi8 (next, dash)),
+				_mm_or_si128 (_mm_cmpeq_epi8 (prev, cr),
+						_mm_cmpeq_epi8 (prev, lf))));
+
+		if (mask != 0) {
+			return (p - s) + __builtin_ctz (mask) + 2;
+		}
+
+		p += 16;
+	}
+#endif
+
+	/* Tail (or the whole input): memchr is vectorised by libc */
+	while (p < end - 1) {
+		p = memchr (p, '-', end - p - 1);
+
+		if (p == NULL) {
+			break;
+		}
+
+		if (p[1] == '-' && (p[-1] == '\r' || p[-1] == '\n')) {
+			return (p - s) + 2;
+		}
+
+		p ++;
+	}
+
+	return len;
+}
+
+gsize
+rspamd_str_find_8bit (const guchar *s, gsize len)
+{
+	const guchar *p = s, *end = s + len;
+
+#if defined(__x86_64__)
+	while (end - p >= 16) {
+		/* movemask collects exactly the high bits of each byte */
+		guint mask = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)p));
+
+		if (mask != 0) {
+			return (p - s) + __builtin_ctz (mask);
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (p < end && *p < 0x80) {
+		p ++;
+	}
+
+	return p - s;
+}
@@ -278,6 +278,21 @@ gchar *rspamd_encode_qp_fold (const guchar *in, gsize inlen, gint str_len,
 gssize rspamd_decode_qp_buf (const gchar *in, gsize inlen,
 							 gchar *out, gsize outlen);
 
+/**
+ * Decode quoted-printable encoded buffer and check the decoded data in the same
+ * pass, input and output must not overlap
+ * @param in input
+ * @param inlen length of input
+ * @param out output
+ * @param outlen length of output
+ * @param has_8bit set to TRUE if decoded data has 8bit characters
+ * @param valid_utf8 set to TRUE if decoded data is a valid utf8
+ * @return real size of decoded output or (-1) if outlen is not enough
+ */
+gssize rspamd_decode_qp_buf_check (const gchar *in, gsize inlen,
+								   gchar *out, gsize outlen,
+								   gboolean *has_8bit, gboolean *valid_utf8);
+
 /**
  * Decode uuencode encoded buffer, input and output must not overlap
  * @param in input
@@ -442,6 +457,35 @@ gsize rspamd_memspn (const gchar *s, const gchar *e, gsize len);
 #define rspamd_is_aligned_as(p, v) rspamd_is_aligned(p, _Alignof(__typeof((v))))
 gboolean rspamd_str_has_8bit (const guchar *beg, gsize len);
 
+/**
+ * Returns offset of the first `\r` or `\n` character in a string (or `len`
+ * if there are no newlines)
+ * @param s
+ * @param len
+ * @return
+ */
+gsize rspamd_str_find_newline (const gchar *s, gsize len);
+
+/**
+ * Returns offset just after the first `--` that starts a line, i.e. follows
+ * `\r` or `\n` (or `len` if there are no such sequences, `--` at the very
+ * end of a string is not distinguished). `s[0]` is used merely as a
+ * preceding character
+ * @param s
+ * @param len
+ * @return
+ */
+gsize rspamd_str_find_line_dashes (const gchar *s, gsize len);
+
+/**
+ * Returns offset of the first character with the high bit set (or `len`
+ * if a string is 7bit only)
+ * @param s
+ * @param len
+ * @return
+ */
+gsize rspamd_str_find_8bit (const guchar *s, gsize len);
+
 struct UConverter;
 
 struct UConverter *rspamd_get_utf8_converter (void);
@@ -59,6 +59,10 @@ struct upstream {
 	gchar *name;
 	ev_timer ev;
 	gdouble last_fail;
+	/* Peak EWMA of latency and requests in flight for latency rotation */
+	gdouble latency;
+	gdouble last_latency_ts;
+	guint inflight;
 	gpointer ud;
 	enum rspamd_upstream_flag flags;
 	struct upstream_list *ls;
@@ -100,6 +104,8 @@ struct upstream_list {
 	enum rspamd_upstream_flag flags;
 	guint cur_elt;
 	enum rspamd_upstream_rotation rot_alg;
+	/* Average latency of the list, used for upstreams with no samples */
+	gdouble latency;
 #ifdef UPSTREAMS_THREAD_SAFE
 	rspamd_mutex_t *lock;
 #endif
@@ -146,6 +152,9 @@ static const guint default_dns_retransmits = DEFAULT_DNS_RETRANSMITS;
 /* TODO: make it configurable */
 #define DEFAULT_LAZY_RESOLVE_TIME 3600.0
 static const gdouble default_lazy_resolve_time = DEFAULT_LAZY_RESOLVE_TIME;
+/* Latency samples are forgotten with this time constant (seconds) */
+#define DEFAULT_LATENCY_DECAY 10.0
+static const gdouble default_latency_decay = DEFAULT_LATENCY_DECAY;
 
 static const struct upstream_limits default_limits = {
 		.revive_time = DEFAULT_REVIVE_TIME,
@@ -748,6 +757,10 @@ rspamd_upstream_fail (struct upstream *upstream,
 			upstream->name,
 			reason);
 
+	if (upstream->inflight > 0) {
+		upstream->inflight --;
+	}
+
 	if (upstream->ctx && upstream->active_idx != -1) {
 		sec_cur = rspamd_get_ticks (FALSE);
 
@@ -853,6 +866,10 @@ rspamd_upstream_ok (struct upstream *upstream)
 	struct upstream_list_watcher *w;
 
 	RSPAMD_UPSTREAM_LOCK (upstream);
+	if (upstream->inflight > 0) {
+		upstream->inflight --;
+	}
+
 	if (upstream->errors > 0 && upstream->active_idx != -1) {
 		/* We touch upstream if and only if it is active */
 		msg_debug_upstream ("reset errors on upstream %s (was %ud)", upstream->name, upstream->errors);
@@ -873,6 +890,50 @@ rspamd_upstream_ok (struct upstream *upstream)
 	RSPAMD_UPSTREAM_UNLOCK (upstream);
 }
 
+void
+rspamd_upstream_ok_latency (struct upstream *upstream, gdouble latency)
+{
+	gdouble now, w;
+	struct upstream_list *ls = upstream->ls;
+
+	if (latency >= 0) {
+		now = rspamd_get_ticks (FALSE);
+
+		RSPAMD_UPSTREAM_LOCK (upstream);
+
+		if (upstream->latency == 0 || latency > upstream->latency) {
+			/* Peak EWMA: react to slowdowns immediately */
+			upstream->latency = latency;
+		}
+		else {
+			w = exp (-(now - upstream->last_latency_ts) / default_latency_decay);
+			upstream->latency = upstream->latency * w + latency * (1.0 - w);
+		}
+
+		upstream->last_latency_ts = now;
+		RSPAMD_UPSTREAM_UNLOCK (upstream);
+
+		if (ls) {
+			RSPAMD_UPSTREAM_LOCK (ls);
+			ls->latency = ls->latency == 0 ? latency :
+					ls->latency * 0.9 + latency * 0.1;
+			RSPAMD_UPSTREAM_UNLOCK (ls);
+		}
+	}
+
+	rspamd_upstream_ok (upstream);
+}
+
+void
+rspamd_upstream_release (struct upstream *upstream)
+{
+	RSPAMD_UPSTREAM_LOCK (upstream);
+	if (upstream->inflight > 0) {
+		upstream->inflight --;
+	}
+	RSPAMD_UPSTREAM_UNLOCK (upstream);
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
@@ -1204,6 +1265,10 @@ rspamd_upstreams_parse_line_len (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "latency:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
 
 	while (p < end) {
 		span_len = rspamd_memcspn (p, separators, end - p);
@@ -1475,6 +1540,87 @@ rspamd_upstream_get_hashed (struct upstream_list *ups,
 	return up;
 }
 
+static inline gdouble
+rspamd_upstream_latency_cost (struct upstream *up, gdouble list_latency,
+		gdouble now)
+{
+	gdouble latency, last_ts;
+	guint inflight;
+
+	RSPAMD_UPSTREAM_LOCK (up);
+	latency = up->latency;
+	last_ts = up->last_latency_ts;
+	inflight = up->inflight;
+	RSPAMD_UPSTREAM_UNLOCK (up);
+
+	if (latency == 0) {
+		/* No samples yet, assume it is as fast as others */
+		latency = list_latency > 0 ? list_latency : 1.0;
+	}
+	else if (now > last_ts) {
+		/*
+		 * Peak decays with no samples, so a slow upstream is retried
+		 * after a while instead of being avoided until it gets a request
+		 */
+		latency *= exp (-(now - last_ts) / default_latency_decay);
+	}
+
+	return latency * (inflight + 1) / MAX (up->weight, 1);
+}
+
+/*
+ * Power of two choices: select two random upstreams and use one with the lower
+ * expected latency (peak EWMA multiplied by number of requests in flight)
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups,
+							 struct upstream *except)
+{
+	struct upstream *up1, *up2;
+	guint nalive, i1, i2;
+	gdouble list_latency, now;
+
+	RSPAMD_UPSTREAM_LOCK (ups);
+	nalive = ups->alive->len;
+
+	if (except && except->active_idx >= 0 && nalive > 1) {
+		/* Skip the excepted upstream by selecting from the rest */
+		if (nalive == 2) {
+			RSPAMD_UPSTREAM_UNLOCK (ups);
+			up1 = g_ptr_array_index (ups->alive, 0);
+
+			return up1 == except ? g_ptr_array_index (ups->alive, 1) : up1;
+		}
+	}
+
+	do {
+		i1 = ottery_rand_range (nalive - 1);
+		up1 = g_ptr_array_index (ups->alive, i1);
+	} while (except && up1 == except && nalive > 1);
+
+	if (nalive == 1) {
+		RSPAMD_UPSTREAM_UNLOCK (ups);
+
+		return up1;
+	}
+
+	do {
+		i2 = ottery_rand_range (nalive - 1);
+		up2 = g_ptr_array_index (ups->alive, i2);
+	} while (i2 == i1 || (except && up2 == except));
+
+	list_latency = ups->latency;
+	RSPAMD_UPSTREAM_UNLOCK (ups);
+	now = rspamd_get_ticks (FALSE);
+
+	if (rspamd_upstream_latency_cost (up2, list_latency, now) <
+			rspamd_upstream_latency_cost (up1, list_latency, now)) {
+		return up2;
+	}
+
+	return up1;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 							struct upstream* except,
@@ -1494,12 +1640,6 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	}
 	RSPAMD_UPSTREAM_UNLOCK (ups);
 
-	if (ups->alive->len == 1 && default_type != RSPAMD_UPSTREAM_SEQUENTIAL) {
-		/* Fast path */
-		up =  g_ptr_array_index (ups->alive, 0);
-		goto end;
-	}
-
 	if (!forced) {
 		type = ups->rot_alg != RSPAMD_UPSTREAM_UNDEF ? ups->rot_alg : default_type;
 	}
@@ -1507,6 +1647,12 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		type = default_type != RSPAMD_UPSTREAM_UNDEF ? default_type : ups->rot_alg;
 	}
 
+	if (ups->alive->len == 1 && default_type != RSPAMD_UPSTREAM_SEQUENTIAL) {
+		/* Fast path */
+		up =  g_ptr_array_index (ups->alive, 0);
+		goto end;
+	}
+
 	if (type == RSPAMD_UPSTREAM_HASHED && (keylen == 0 || key == NULL)) {
 		/* Cannot use hashed rotation when no key is specified, switch to random */
 		type = RSPAMD_UPSTREAM_RANDOM;
@@ -1534,11 +1680,18 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 
 		up = g_ptr_array_index (ups->alive, ups->cur_elt ++);
 		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		up = rspamd_upstream_get_latency (ups, except);
+		break;
 	}
 
 end:
 	if (up) {
 		up->checked ++;
+
+		if (type == RSPAMD_UPSTREAM_LATENCY) {
+			up->inflight ++;
+		}
 	}
 
 	return up;
@@ -1568,6 +1721,28 @@ struct upstream *rspamd_upstream_get_except (struct upstream_list *ups,
 	return rspamd_upstream_get_common (ups, except, default_type, key, keylen, FALSE);
 }
 
+struct upstream*
+rspamd_upstream_get_shard (struct upstream_list *ups, guint64 key)
+{
+	guint32 idx;
+	struct upstream *up;
+
+	if (ups == NULL || ups->ups->len == 0) {
+		return NULL;
+	}
+
+	/*
+	 * Shards placement must not depend on upstreams liveness, as the data
+	 * is not replicated between shards, so we select from all upstreams
+	 */
+	idx = rspamd_consistent_hash (mum_hash_step (key, ups->hash_seed),
+			ups->ups->len);
+	up = g_ptr_array_index (ups->ups, idx);
+	up->checked ++;
+
+	return up;
+}
+
 void
 rspamd_upstream_reresolve (struct upstream_ctx *ctx)
 {
@@ -16,6 +16,7 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -67,6 +68,25 @@ void rspamd_upstream_fail (struct upstream *upstream, gboolean addr_failure, con
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Increase upstream successes count and add a latency sample (in seconds)
+ * used by `RSPAMD_UPSTREAM_LATENCY` rotation. This rotation also counts
+ * requests in flight, so callers must finish each request with either
+ * `rspamd_upstream_ok_latency`, `rspamd_upstream_ok`, `rspamd_upstream_fail`
+ * or `rspamd_upstream_release`
+ * @param up
+ * @param latency request latency, negative value means no sample
+ */
+void rspamd_upstream_ok_latency (struct upstream *up, gdouble latency);
+
+/**
+ * Finish a request that has been dropped without a result (e.g. cancelled
+ * or retried on a stale connection): the request is no longer counted as
+ * in flight, errors and latency of an upstream are not changed
+ * @param up
+ */
+void rspamd_upstream_release (struct upstream *up);
+
 /**
  * Set weight for an upstream
  * @param up
@@ -294,6 +314,18 @@ struct upstream *rspamd_upstream_get_except (struct upstream_list *ups,
 											 enum rspamd_upstream_rotation default_type,
 											 const guchar *key, gsize keylen);
 
+/**
+ * Get an upstream that owns the specified key when upstreams are used as shards.
+ * Unlike `RSPAMD_UPSTREAM_HASHED` rotation, the selection is stable and does
+ * not depend on the upstreams state, so the same key is always mapped to the
+ * same upstream as long as the list of upstreams is not changed
+ * @param ups upstream list
+ * @param key 64 bit key (e.g. a token hash)
+ * @return
+ */
+struct upstream *rspamd_upstream_get_shard (struct upstream_list *ups,
+											guint64 key);
+
 /**
  * Re-resolve addresses for all upstreams registered
  */
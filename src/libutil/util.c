@@ -2610,6 +2610,89 @@ rspamd_glob_path (const gchar *dir,
 	return res;
 }
 
+struct rspamd_threads_batch {
+	GMutex mtx;
+	GCond cond;
+	guint pending;
+	GFunc func;
+	gpointer ud;
+};
+
+struct rspamd_threads_job {
+	struct rspamd_threads_batch *batch;
+	gpointer data;
+};
+
+static GThreadPool *threads_pool = NULL;
+
+static void
+rspamd_threads_pool_func (gpointer data, gpointer ud)
+{
+	struct rspamd_threads_job *job = data;
+	struct rspamd_threads_batch *batch = job->batch;
+
+	batch->func (job->data, batch->ud);
+
+	g_mutex_lock (&batch->mtx);
+
+	if (--batch->pending == 0) {
+		g_cond_signal (&batch->cond);
+	}
+
+	g_mutex_unlock (&batch->mtx);
+}
+
+gboolean
+rspamd_threads_pool_run (GPtrArray *jobs, GFunc func, gpointer ud,
+		guint nthreads, GError **err)
+{
+	struct rspamd_threads_batch batch;
+	struct rspamd_threads_job *pool_jobs;
+	guint i;
+
+	if (jobs->len > 1 && nthreads > 0 && threads_pool == NULL) {
+		/* Threads are created lazily, so it is safe for forked workers */
+		threads_pool = g_thread_pool_new (rspamd_threads_pool_func, NULL,
+				nthreads, FALSE, err);
+	}
+
+	if (jobs->len <= 1 || nthreads == 0 || threads_pool == NULL) {
+		for (i = 0; i < jobs->len; i ++) {
+			func (g_ptr_array_index (jobs, i), ud);
+		}
+
+		return FALSE;
+	}
+
+	g_mutex_init (&batch.mtx);
+	g_cond_init (&batch.cond);
+	batch.pending = jobs->len - 1;
+	batch.func = func;
+	batch.ud = ud;
+	pool_jobs = g_new (struct rspamd_threads_job, jobs->len - 1);
+
+	for (i = 1; i < jobs->len; i ++) {
+		pool_jobs[i - 1].batch = &batch;
+		pool_jobs[i - 1].data = g_ptr_array_index (jobs, i);
+		g_thread_pool_push (threads_pool, &pool_jobs[i - 1], NULL);
+	}
+
+	func (g_ptr_array_index (jobs, 0), ud);
+
+	g_mutex_lock (&batch.mtx);
+
+	while (batch.pending > 0) {
+		g_cond_wait (&batch.cond, &batch.mtx);
+	}
+
+	g_mutex_unlock (&batch.mtx);
+	g_cond_clear (&batch.cond);
+	g_mutex_clear (&batch.mtx);
+	g_free (pool_jobs);
+
+	return TRUE;
+}
+
 double
 rspamd_set_counter (struct rspamd_counter_data *cd, gdouble value)
 {
@@ -478,6 +478,22 @@ double rspamd_set_counter_ema (struct rspamd_counter_data *cd,
 double rspamd_set_counter (struct rspamd_counter_data *cd,
 						   gdouble value);
 
+/**
+ * Calls func for each element of jobs. If nthreads is not zero, jobs are
+ * processed by the shared threads pool: the current thread takes the first
+ * job itself and waits for the rest. Pool is created on the first parallel
+ * call, so it is safe for forked processes. Jobs are processed serially if
+ * the pool cannot be created, err is set in this case
+ * @param jobs array of jobs data
+ * @param func function called as func (job, ud), it must be thread safe
+ * @param ud user data
+ * @param nthreads maximum number of threads in the pool
+ * @param err error
+ * @return TRUE if jobs have been processed in parallel
+ */
+gboolean rspamd_threads_pool_run (GPtrArray *jobs, GFunc func, gpointer ud,
+								  guint nthreads, GError **err);
+
 enum rspamd_pbkdf_version_id {
 	RSPAMD_PBKDF_ID_V1 = 1,
 	RSPAMD_PBKDF_ID_V2 = 2,
@@ -68,6 +68,8 @@ LUA_FUNCTION_DEF (html, has_tag);
  * - `unknown_element` - part has some unknown elements
  * - `duplicate_element` - part has some duplicate elements that should be unique (namely, `title` tag)
  * - `unbalanced` - part has unbalanced tags
+ * - `data_urls` - part has images with data urls
+ * - `streaming` - part has been processed without building tags tree (so no tags and blocks are available)
  * @param {string} name name of property
  * @return {boolean} true if the part has the specified property
  */
@@ -98,6 +100,17 @@ LUA_FUNCTION_DEF (html, get_images);
  */
 LUA_FUNCTION_DEF (html, get_blocks);
 
+/***
+ * @method html:get_tags_stat()
+ * Returns statistics about HTML tags that is available in both normal and streaming modes:
+ *
+ * - `total` - number of block and unknown tags (opening and closing ones), inline tags are not counted
+ * - `max_depth` - maximum nesting level of tags
+ * - `tags` - table indexed by tag name with number of opening tags of each type
+ * @return {table} tags statistics
+ */
+LUA_FUNCTION_DEF (html, get_tags_stat);
+
 /***
  * @method html:foreach_tag(tagname, callback)
  * Processes HTML tree calling the specified callback for each tag of the specified
@@ -118,6 +131,7 @@ static const struct luaL_reg htmllib_m[] = {
 	LUA_INTERFACE_DEF (html, has_property),
 	LUA_INTERFACE_DEF (html, get_images),
 	LUA_INTERFACE_DEF (html, get_blocks),
+	LUA_INTERFACE_DEF (html, get_tags_stat),
 	LUA_INTERFACE_DEF (html, foreach_tag),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -235,6 +249,7 @@ lua_html_has_property (lua_State *L)
 		 * - `duplicate_element`
 		 * - `unbalanced`
 		 * - `data_urls`
+		 * - `streaming`
 		 */
 		if (strcmp (propname, "no_html") == 0) {
 			ret = hc->flags & RSPAMD_HTML_FLAG_BAD_START;
@@ -257,6 +272,9 @@ lua_html_has_property (lua_State *L)
 		else if (strcmp (propname, "data_urls") == 0) {
 			ret = hc->flags & RSPAMD_HTML_FLAG_HAS_DATA_URLS;
 		}
+		else if (strcmp (propname, "streaming") == 0) {
+			ret = hc->flags & RSPAMD_HTML_FLAG_STREAMING;
+		}
 	}
 
 	lua_pushboolean (L, ret);
@@ -444,6 +462,47 @@ lua_html_get_blocks (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_html_get_tags_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct html_content *hc = lua_check_html (L, 1);
+	const gchar *tagname;
+	guint i;
+
+	if (hc != NULL) {
+		lua_createtable (L, 0, 3);
+		lua_pushstring (L, "total");
+		lua_pushinteger (L, hc->total_tags);
+		lua_settable (L, -3);
+		lua_pushstring (L, "max_depth");
+		lua_pushinteger (L, hc->max_depth);
+		lua_settable (L, -3);
+		lua_pushstring (L, "tags");
+		lua_newtable (L);
+
+		if (hc->tags_count) {
+			for (i = 0; i < N_TAGS; i ++) {
+				if (hc->tags_count[i] > 0) {
+					tagname = rspamd_html_tag_by_id (i);
+
+					if (tagname) {
+						lua_pushinteger (L, hc->tags_count[i]);
+						lua_setfield (L, -2, tagname);
+					}
+				}
+			}
+		}
+
+		lua_settable (L, -3);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 struct lua_html_traverse_ud {
 	lua_State *L;
 	struct html_content *html;
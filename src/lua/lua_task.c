@@ -231,6 +231,17 @@ LUA_FUNCTION_DEF (task, get_urls);
  * @return {boolean} true if a task has urls (urls or emails if `need_emails` is true)
  */
 LUA_FUNCTION_DEF (task, has_urls);
+/***
+ * @method task:get_urls_stat()
+ * Returns statistics of urls extraction from text parts:
+ * - `candidates`: number of candidates passed to the url parser
+ * - `duplicates`: number of candidates reused without parsing
+ * - `failed`: number of candidates that are not urls
+ * - `query_checks`: number of urls which queries are searched for urls
+ * - `dropped`: number of urls dropped due to `max_urls` limit
+ * @return {table} urls extraction statistics or nil if there is no message
+ */
+LUA_FUNCTION_DEF (task, get_urls_stat);
 /***
  * @method task:inject_url(url)
  * Inserts an url into a task (useful for redirected urls)
@@ -945,6 +956,8 @@ LUA_FUNCTION_DEF (task, set_flag);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `urls_truncated`: message has more urls than `max_urls`
+ * - `urls_query_limit`: urls queries are not searched for more urls after `max_url_queries`
  * @param {string} flag to check
  * @return {boolean} true if flags is set
  */
@@ -963,6 +976,8 @@ LUA_FUNCTION_DEF (task, has_flag);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `urls_truncated`: message has more urls than `max_urls`
+ * - `urls_query_limit`: urls queries are not searched for more urls after `max_url_queries`
  * - `milter`: task is initiated by milter connection
  * @return {array of strings} table with all flags as strings
  */
@@ -1109,6 +1124,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, has_pre_result),
 	LUA_INTERFACE_DEF (task, append_message),
 	LUA_INTERFACE_DEF (task, has_urls),
+	LUA_INTERFACE_DEF (task, get_urls_stat),
 	LUA_INTERFACE_DEF (task, get_urls),
 	LUA_INTERFACE_DEF (task, inject_url),
 	LUA_INTERFACE_DEF (task, get_content),
@@ -2430,6 +2446,40 @@ lua_task_has_urls (lua_State * L)
 	return 2;
 }
 
+static gint
+lua_task_get_urls_stat (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct rspamd_url_extract_stat *stat;
+
+	if (task) {
+		if (task->message) {
+			stat = &MESSAGE_FIELD (task, url_stat);
+			lua_createtable (L, 0, 5);
+
+			lua_pushinteger (L, stat->candidates);
+			lua_setfield (L, -2, "candidates");
+			lua_pushinteger (L, stat->duplicates);
+			lua_setfield (L, -2, "duplicates");
+			lua_pushinteger (L, stat->failed);
+			lua_setfield (L, -2, "failed");
+			lua_pushinteger (L, stat->query_checks);
+			lua_setfield (L, -2, "query_checks");
+			lua_pushinteger (L, stat->dropped);
+			lua_setfield (L, -2, "dropped");
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static gint
 lua_task_inject_url (lua_State * L)
 {
@@ -5118,6 +5168,10 @@ lua_task_has_flag (lua_State *L)
 				RSPAMD_TASK_FLAG_MIME);
 		LUA_TASK_GET_FLAG (flag, "message_rewrite",
 				RSPAMD_TASK_FLAG_MESSAGE_REWRITE);
+		LUA_TASK_GET_FLAG (flag, "urls_truncated",
+				RSPAMD_TASK_FLAG_URLS_TRUNCATED);
+		LUA_TASK_GET_FLAG (flag, "urls_query_limit",
+				RSPAMD_TASK_FLAG_URLS_QUERY_LIMIT);
 		LUA_TASK_GET_PROTOCOL_FLAG (flag, "milter",
 				RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
 
@@ -5191,6 +5245,14 @@ lua_task_get_flags (lua_State *L)
 					lua_pushstring (L, "message_rewrite");
 					lua_rawseti (L, -2, idx++);
 					break;
+				case RSPAMD_TASK_FLAG_URLS_TRUNCATED:
+					lua_pushstring (L, "urls_truncated");
+					lua_rawseti (L, -2, idx++);
+					break;
+				case RSPAMD_TASK_FLAG_URLS_QUERY_LIMIT:
+					lua_pushstring (L, "urls_query_limit");
+					lua_rawseti (L, -2, idx++);
+					break;
 				default:
 					break;
 				}
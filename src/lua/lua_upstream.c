@@ -25,6 +25,7 @@
  * - round-robin: balance upstreams one by one selecting accordingly to their weight
  * - hash: use stable hashing algorithm to distribute values according to some static strings
  * - master-slave: always prefer upstream with higher priority unless it is not available
+ * - latency: select the best of two random upstreams by latency and requests in flight (`latency:` prefix)
  *
  * Here is an example of upstreams manipulations:
  * @example
@@ -151,8 +152,9 @@ lua_upstream_fail (lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional request latency in seconds used by `latency` rotation
  */
 static gint
 lua_upstream_ok (lua_State *L)
@@ -161,7 +163,12 @@ lua_upstream_ok (lua_State *L)
 	struct upstream *up = lua_check_upstream (L);
 
 	if (up) {
-		rspamd_upstream_ok (up);
+		if (lua_isnumber (L, 2)) {
+			rspamd_upstream_ok_latency (up, lua_tonumber (L, 2));
+		}
+		else {
+			rspamd_upstream_ok (up);
+		}
 	}
 
 	return 0;
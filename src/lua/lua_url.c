@@ -53,6 +53,8 @@ LUA_FUNCTION_DEF (url, get_text);
 LUA_FUNCTION_DEF (url, tostring);
 LUA_FUNCTION_DEF (url, get_raw);
 LUA_FUNCTION_DEF (url, get_tld);
+LUA_FUNCTION_DEF (url, get_host_id);
+LUA_FUNCTION_DEF (url, get_tld_id);
 LUA_FUNCTION_DEF (url, get_flags);
 LUA_FUNCTION_DEF (url, get_protocol);
 LUA_FUNCTION_DEF (url, to_table);
@@ -68,6 +70,7 @@ LUA_FUNCTION_DEF (url, get_visible);
 LUA_FUNCTION_DEF (url, create);
 LUA_FUNCTION_DEF (url, init);
 LUA_FUNCTION_DEF (url, all);
+LUA_FUNCTION_DEF (url, intern_host);
 
 static const struct luaL_reg urllib_m[] = {
 	LUA_INTERFACE_DEF (url, get_length),
@@ -79,6 +82,8 @@ static const struct luaL_reg urllib_m[] = {
 	LUA_INTERFACE_DEF (url, get_fragment),
 	LUA_INTERFACE_DEF (url, get_text),
 	LUA_INTERFACE_DEF (url, get_tld),
+	LUA_INTERFACE_DEF (url, get_host_id),
+	LUA_INTERFACE_DEF (url, get_tld_id),
 	LUA_INTERFACE_DEF (url, get_raw),
 	LUA_INTERFACE_DEF (url, get_protocol),
 	LUA_INTERFACE_DEF (url, to_table),
@@ -102,6 +107,7 @@ static const struct luaL_reg urllib_f[] = {
 	LUA_INTERFACE_DEF (url, init),
 	LUA_INTERFACE_DEF (url, create),
 	LUA_INTERFACE_DEF (url, all),
+	LUA_INTERFACE_DEF (url, intern_host),
 	{NULL, NULL}
 };
 
@@ -566,6 +572,63 @@ lua_url_get_tld (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method url:get_host_id()
+ * Get interned id of the url host, urls with the same host have the same id,
+ * so ids can be compared instead of hosts. At most 256k hosts are interned
+ * per process (till configuration reload), the host itself is returned for
+ * hosts that are not interned, so results can always be compared
+ * @return {number|string} host id or host if the host has not been interned
+ */
+static gint
+lua_url_get_host_id (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_url *url = lua_check_url (L, 1);
+
+	if (url != NULL) {
+		if (url->url->host_id != 0) {
+			lua_pushinteger (L, url->url->host_id);
+		}
+		else {
+			lua_pushlstring (L, url->url->host, url->url->hostlen);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method url:get_tld_id()
+ * Get interned id of the url eSLD, it is the same as host id for the equal
+ * host, e.g. `url:get_tld_id()` for `http://example.com/` is equal to
+ * `url:get_host_id()` for `http://www.example.com/`
+ * @return {number|string} eSLD id or eSLD if it has not been interned
+ */
+static gint
+lua_url_get_tld_id (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_url *url = lua_check_url (L, 1);
+
+	if (url != NULL) {
+		if (url->url->tld_id != 0) {
+			lua_pushinteger (L, url->url->tld_id);
+		}
+		else {
+			lua_pushlstring (L, url->url->tld, url->url->tldlen);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 /***
  * @method url:get_protocol()
  * Get protocol name
@@ -777,6 +840,35 @@ lua_url_init (lua_State *L)
 	return 0;
 }
 
+/***
+ * @function url.intern_host(host)
+ * Get interned id for a host or eSLD to compare it with `url:get_host_id()` or
+ * `url:get_tld_id()`. Ids are not preserved when configuration is reloaded.
+ * Interned hosts are never evicted till then, so this function should be used
+ * for hosts from configuration and not for arbitrary ones
+ * @param {string} host lowercased host name
+ * @return {number|string} host id or host itself if hosts limit has been reached
+ */
+static gint
+lua_url_intern_host (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	gsize len;
+	const gchar *host = luaL_checklstring (L, 1, &len);
+	guint32 id;
+
+	id = rspamd_url_host_id (host, len);
+
+	if (id != 0) {
+		lua_pushinteger (L, id);
+	}
+	else {
+		lua_pushlstring (L, host, len);
+	}
+
+	return 1;
+}
+
 static gboolean
 lua_url_table_inserter (struct rspamd_url *url, gsize start_offset,
 		gsize end_offset, gpointer ud)
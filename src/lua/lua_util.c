@@ -23,6 +23,7 @@
 #include "libmime/content_type.h"
 #include "libmime/mime_headers.h"
 #include "libutil/hash.h"
+#include "libstat/backends/backends.h"
 
 #ifdef WITH_LUA_REPL
 #include "replxx.h"
@@ -631,6 +632,25 @@ LUA_FUNCTION_DEF (util, parse_content_type);
  */
 LUA_FUNCTION_DEF (util, mime_header_encode);
 
+/***
+ *  @function util.write_stat_snapshot(path, tokens, learns)
+ * Writes read-only statistics snapshot used by `snapshot` statistics backend
+ * @param {string} path output file (replaced atomically)
+ * @param {table} tokens table indexed by token ids (as decimal strings) with token values
+ * @param {number} learns number of learns for a statfile
+ * @return {boolean,string} true if a snapshot has been written or false and error string
+ */
+LUA_FUNCTION_DEF (util, write_stat_snapshot);
+
+/***
+ *  @function util.stat_native_expiry(classifier)
+ * Checks if redis statistics backend expires tokens of the classifier itself
+ * (so expiry plugin must skip this classifier)
+ * @param {table} classifier classifier configuration
+ * @return {boolean} true if native expiry is used
+ */
+LUA_FUNCTION_DEF (util, stat_native_expiry);
+
 
 static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, create_event_base),
@@ -692,6 +712,8 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, get_hostname),
 	LUA_INTERFACE_DEF (util, parse_content_type),
 	LUA_INTERFACE_DEF (util, mime_header_encode),
+	LUA_INTERFACE_DEF (util, write_stat_snapshot),
+	LUA_INTERFACE_DEF (util, stat_native_expiry),
 	LUA_INTERFACE_DEF (util, pack),
 	LUA_INTERFACE_DEF (util, unpack),
 	LUA_INTERFACE_DEF (util, packsize),
@@ -2898,6 +2920,88 @@ lua_util_mime_header_encode (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_util_write_stat_snapshot (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	const gchar *path = luaL_checkstring (L, 1), *key;
+	struct rspamd_stat_snapshot_token tok;
+	GArray *tokens;
+	GError *err = NULL;
+	guint64 learns;
+	gulong hash;
+	gsize keylen;
+
+	if (!path || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	learns = luaL_optnumber (L, 3, 0);
+	tokens = g_array_sized_new (FALSE, FALSE, sizeof (tok),
+			rspamd_lua_table_size (L, 2));
+
+	for (lua_pushnil (L); lua_next (L, 2); lua_pop (L, 1)) {
+		if (lua_type (L, -2) == LUA_TSTRING) {
+			key = lua_tolstring (L, -2, &keylen);
+
+			if (!rspamd_strtoul (key, keylen, &hash)) {
+				continue;
+			}
+
+			tok.hash = hash;
+		}
+		else if (lua_type (L, -2) == LUA_TNUMBER) {
+			tok.hash = lua_tonumber (L, -2);
+		}
+		else {
+			continue;
+		}
+
+		tok.value = lua_tonumber (L, -1);
+		g_array_append_val (tokens, tok);
+	}
+
+	if (!rspamd_stat_snapshot_write (path, tokens, learns, &err)) {
+		g_array_free (tokens, TRUE);
+		lua_pushboolean (L, false);
+		lua_pushstring (L, err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return 2;
+	}
+
+	g_array_free (tokens, TRUE);
+	lua_pushboolean (L, true);
+
+	return 1;
+}
+
+static gint
+lua_util_stat_native_expiry (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	ucl_object_t *obj;
+	gboolean ret = FALSE;
+
+	if (lua_type (L, 1) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	obj = ucl_object_lua_import (L, 1);
+
+	if (obj) {
+		ret = rspamd_redis_native_expiry_enabled (obj);
+		ucl_object_unref (obj);
+	}
+
+	lua_pushboolean (L, ret);
+
+	return 1;
+}
+
 static gint
 lua_util_is_valid_utf8 (lua_State *L)
 {
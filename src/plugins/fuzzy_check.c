@@ -135,6 +135,7 @@ struct fuzzy_client_session {
 	gint state;
 	gint fd;
 	guint retransmits;
+	gdouble start_ts;
 };
 
 struct fuzzy_learn_session {
@@ -2258,7 +2259,8 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	struct fuzzy_cmd_io *io;
 	guint nreplied = 0, i;
 
-	rspamd_upstream_ok (session->server);
+	rspamd_upstream_ok_latency (session->server,
+			rspamd_get_ticks (FALSE) - session->start_ts);
 
 	for (i = 0; i < session->commands->len; i++) {
 		io = g_ptr_array_index (session->commands, i);
@@ -2928,6 +2930,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				session->rule = rule;
 				session->results = g_ptr_array_sized_new (32);
 				session->event_loop = task->event_loop;
+				session->start_ts = rspamd_get_ticks (FALSE);
 
 				rspamd_ev_watcher_init (&session->ev,
 						sock,
@@ -93,6 +93,13 @@ local function check_redis_classifier(cls, cfg)
           symbol_spam, cls)
       return
     end
+
+    if rspamd_util.stat_native_expiry(cls) then
+      logger.infox(rspamd_config,
+          'disable expiry for classifier %s: native expiry is used',
+          symbol_spam)
+      return
+    end
     -- Now try to load redis_params if needed
 
     local redis_params
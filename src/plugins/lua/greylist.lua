@@ -195,7 +195,12 @@ local function greylist_check(task)
 
   local body_key = data_key(task)
   local meta_key = envelope_key(task)
-  local hash_key = body_key .. meta_key
+  local hash_key = (body_key or '') .. meta_key
+  local keys = {meta_key}
+
+  if body_key then
+    table.insert(keys, 1, body_key)
+  end
 
   local function redis_get_cb(err, data)
     local ret_body = false
@@ -203,6 +208,11 @@ local function greylist_check(task)
     local ret_meta = false
     local greylisted_meta = false
 
+    if data and not body_key then
+      -- Envelope only check, e.g. before a message is received
+      data = {false, data[1]}
+    end
+
     if data then
       local end_time_body,end_time_meta
       local now = rspamd_util.get_time()
@@ -265,7 +275,7 @@ local function greylist_check(task)
       false, -- is write
       redis_get_cb, --callback
       'MGET', -- command
-      {body_key, meta_key} -- arguments
+      keys -- arguments
   )
   if not ret then
     rspamd_logger.errx(task, 'cannot make redis request to check results')
@@ -349,7 +359,13 @@ local function greylist_set(task)
   local body_key = data_key(task)
   local meta_key = envelope_key(task)
   local upstream, ret, conn
-  local hash_key = body_key .. meta_key
+  local hash_key = (body_key or '') .. meta_key
+  -- There is no body key if a message has not been received yet
+  local keys = {meta_key}
+
+  if body_key then
+    table.insert(keys, 1, body_key)
+  end
 
   local function redis_set_cb(err)
     if err then
@@ -380,13 +396,15 @@ local function greylist_set(task)
       true, -- is write
       redis_set_cb, --callback
       'EXPIRE', -- command
-      {body_key, tostring(toint(settings['expire']))} -- arguments
+      {keys[1], tostring(toint(settings['expire']))} -- arguments
     )
     -- Update greylisting record expire
     if ret then
-      conn:add_cmd('EXPIRE', {
-        meta_key, tostring(toint(settings['expire']))
-      })
+      for i = 2,#keys do
+        conn:add_cmd('EXPIRE', {
+          keys[i], tostring(toint(settings['expire']))
+        })
+      end
     else
       rspamd_logger.errx(task, 'got error while connecting to redis')
     end
@@ -403,13 +421,15 @@ local function greylist_set(task)
       true, -- is write
       redis_set_cb, --callback
       'SETEX', -- command
-      {body_key, tostring(toint(settings['expire'])), t} -- arguments
+      {keys[1], tostring(toint(settings['expire'])), t} -- arguments
     )
 
     if ret then
-      conn:add_cmd('SETEX', {
-        meta_key, tostring(toint(settings['expire'])), t
-      })
+      for i = 2,#keys do
+        conn:add_cmd('SETEX', {
+          keys[i], tostring(toint(settings['expire'])), t
+        })
+      end
     else
       rspamd_logger.errx(task, 'got error while connecting to redis')
     end
@@ -477,12 +497,15 @@ if opts then
       type = 'postfilter',
       callback = greylist_set,
       priority = 6,
+      -- Triplets are also checked on envelope only, e.g. for milter RCPT
+      flags = 'empty',
     })
     rspamd_config:register_symbol({
       name = 'GREYLIST_CHECK',
       type = 'prefilter',
       callback = greylist_check,
       priority = 6,
+      flags = 'empty',
     })
   end
 end
@@ -0,0 +1,195 @@
+%%{
+  # Tokenizer for Received headers: it splits header after `from` to words,
+  # comments and date delimiter, semantic is done in scan state functions
+  machine smtp_received_parser;
+
+  ctext = any - ("(" | ")");
+  # We allow up to 4 levels of nested comments
+  comment4 = "(" ctext* ")";
+  comment3 = "(" (ctext | comment4)* ")";
+  comment2 = "(" (ctext | comment3)* ")";
+  comment = "(" (ctext | comment2)* ")";
+  word = (any - (space | "(" | ";"))+;
+
+  main := |*
+    space+;
+    comment => {
+      rspamd_received_scan_comment (&st, ts + 1, te - 1);
+    };
+    word => {
+      rspamd_received_scan_word (&st, ts, te);
+    };
+    ";" => {
+      if (rspamd_received_scan_semicolon (&st)) {
+        spans->date_pos = te - data;
+        fbreak;
+      }
+    };
+    # Unbalanced braces and other garbage
+    any;
+  *|;
+}%%
+
+#include "smtp_parsers.h"
+#include "str_util.h"
+
+%% write data;
+
+enum rspamd_received_scan_part {
+  RSPAMD_RECEIVED_SCAN_FROM = 0,
+  RSPAMD_RECEIVED_SCAN_BY,
+  RSPAMD_RECEIVED_SCAN_WITH,
+  RSPAMD_RECEIVED_SCAN_FOR,
+  RSPAMD_RECEIVED_SCAN_UNKNOWN,
+};
+
+struct rspamd_received_scan_state {
+  struct rspamd_received_spans *spans;
+  rspamd_ftok_t *data; /* Where to store data of the current part */
+  const char *unknown_end; /* End of the word that has started unknown part */
+  enum rspamd_received_scan_part part;
+  gboolean has_data;
+  gboolean has_tcpinfo;
+  gboolean has_comment;
+};
+
+static inline gboolean
+rspamd_received_scan_is_keyword (const char *s, const char *e,
+    const char *kw, gsize kwlen)
+{
+  return ((gsize)(e - s) == kwlen && rspamd_lc_cmp (s, kw, kwlen) == 0);
+}
+
+static void
+rspamd_received_scan_comment (struct rspamd_received_scan_state *st,
+    const char *s, const char *e)
+{
+  /* Only the first non-empty comment of `from` part is meaningful */
+  if (st->part != RSPAMD_RECEIVED_SCAN_FROM || st->has_comment || e <= s) {
+    return;
+  }
+
+  st->has_comment = TRUE;
+
+  while (s < e && (*s == ' ' || *s == '\t')) {
+    s ++;
+  }
+  while (e > s && (*(e - 1) == ' ' || *(e - 1) == '\t')) {
+    e --;
+  }
+
+  st->spans->from_comment.begin = s;
+  st->spans->from_comment.len = e - s;
+}
+
+static void
+rspamd_received_scan_word (struct rspamd_received_scan_state *st,
+    const char *s, const char *e)
+{
+  struct rspamd_received_spans *spans = st->spans;
+
+  if (!st->has_data) {
+    st->has_data = TRUE;
+
+    if (st->data) {
+      st->data->begin = s;
+      st->data->len = e - s;
+    }
+
+    return;
+  }
+
+  if (st->part == RSPAMD_RECEIVED_SCAN_FROM && !st->has_tcpinfo && *s == '[') {
+    /* Postfix/qmail style: `from rdns [ip]`, tcpinfo is a part of data */
+    const char *ebrace = memchr (s, ']', e - s);
+
+    if (ebrace) {
+      st->has_tcpinfo = TRUE;
+      st->data->len = ebrace + 1 - st->data->begin;
+
+      return;
+    }
+  }
+
+  /* Current part is over, this word starts the next one */
+  st->has_data = FALSE;
+  st->has_tcpinfo = FALSE;
+  st->data = NULL;
+
+  if (st->part == RSPAMD_RECEIVED_SCAN_FROM &&
+      rspamd_received_scan_is_keyword (s, e, "by", sizeof ("by") - 1)) {
+    st->part = RSPAMD_RECEIVED_SCAN_BY;
+    st->data = &spans->by;
+  }
+  else if (rspamd_received_scan_is_keyword (s, e, "with", sizeof ("with") - 1)) {
+    st->part = RSPAMD_RECEIVED_SCAN_WITH;
+
+    if (spans->with.len == 0) {
+      st->data = &spans->with;
+    }
+  }
+  else if (rspamd_received_scan_is_keyword (s, e, "for", sizeof ("for") - 1)) {
+    st->part = RSPAMD_RECEIVED_SCAN_FOR;
+
+    if (spans->for_mbox.len == 0) {
+      st->data = &spans->for_mbox;
+    }
+  }
+  else {
+    /* `id xxx`, `envelope-from <xxx>` and so on */
+    st->part = RSPAMD_RECEIVED_SCAN_UNKNOWN;
+    st->unknown_end = e;
+  }
+}
+
+static gboolean
+rspamd_received_scan_semicolon (struct rspamd_received_scan_state *st)
+{
+  if (!st->has_data && (st->part == RSPAMD_RECEIVED_SCAN_BY ||
+      st->part == RSPAMD_RECEIVED_SCAN_WITH ||
+      st->part == RSPAMD_RECEIVED_SCAN_FOR)) {
+    /* Broken `with;ESMTP`, not a date delimiter */
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean
+rspamd_smtp_received_scan (const char *data, size_t len,
+    struct rspamd_received_spans *spans)
+{
+  const char *p = data, *pe = data + len, *eof = data + len;
+  const char *ts, *te;
+  struct rspamd_received_scan_state st;
+  gint cs = 0, act = 0;
+
+  memset (spans, 0, sizeof (*spans));
+  spans->date_pos = -1;
+
+  while (p < pe && g_ascii_isspace (*p)) {
+    p ++;
+  }
+
+  /* Ignore all received but those started from from part */
+  if (pe - p <= 4 || rspamd_lc_cmp (p, "from", sizeof ("from") - 1) != 0) {
+    return FALSE;
+  }
+
+  p += sizeof ("from") - 1;
+
+  memset (&st, 0, sizeof (st));
+  st.spans = spans;
+  st.part = RSPAMD_RECEIVED_SCAN_FROM;
+  st.data = &spans->from;
+
+  %% write init;
+  %% write exec;
+
+  if (spans->date_pos == -1 && st.unknown_end == pe) {
+    /* Header ends with an unknown part name, e.g. `by x id`, and has no date */
+    return FALSE;
+  }
+
+  return TRUE;
+}
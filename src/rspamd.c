@@ -392,7 +392,8 @@ rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 
 static GList *
 create_listen_socket (GPtrArray *addrs, guint cnt,
-		enum rspamd_worker_socket_type listen_type)
+		enum rspamd_worker_socket_type listen_type,
+		enum rspamd_inet_address_listen_opts opts)
 {
 	GList *result = NULL;
 	gint fd;
@@ -407,7 +408,7 @@ create_listen_socket (GPtrArray *addrs, guint cnt,
 		 */
 		if (listen_type & RSPAMD_WORKER_SOCKET_TCP) {
 			fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-					SOCK_STREAM, TRUE);
+					SOCK_STREAM, RSPAMD_INET_ADDRESS_LISTEN_ASYNC|opts);
 			if (fd != -1) {
 				ls = g_malloc0 (sizeof (*ls));
 				ls->addr = rspamd_inet_address_copy (g_ptr_array_index (addrs, i));
@@ -418,7 +419,7 @@ create_listen_socket (GPtrArray *addrs, guint cnt,
 		}
 		if (listen_type & RSPAMD_WORKER_SOCKET_UDP) {
 			fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-					SOCK_DGRAM, TRUE);
+					SOCK_DGRAM, RSPAMD_INET_ADDRESS_LISTEN_ASYNC|opts);
 			if (fd != -1) {
 				ls = g_malloc0 (sizeof (*ls));
 				ls->addr = rspamd_inet_address_copy (g_ptr_array_index (addrs, i));
@@ -589,6 +590,75 @@ make_listen_key (struct rspamd_worker_bind_conf *cf)
 	return rspamd_cryptobox_fast_hash_final (&st);
 }
 
+/*
+ * Creates a separate set of listen sockets for each worker of a type, so the
+ * kernel distributes connections between workers instead of waking up all of
+ * them on each connection
+ */
+static gboolean
+create_reuseport_sockets (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf)
+{
+	struct rspamd_worker_bind_conf *bcf;
+	GList *socks, *ls;
+	gint i;
+	guint j;
+
+	if (cf->worker->flags & (RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_THREADED)) {
+		msg_warn_main ("cannot use reuseport for %s worker: it has a single "
+				"process", cf->worker->name);
+
+		return FALSE;
+	}
+
+	LL_FOREACH (cf->bind_conf, bcf) {
+		if (bcf->is_systemd) {
+			msg_warn_main ("cannot use reuseport for %s worker: systemd socket "
+					"%s", cf->worker->name, bcf->name);
+
+			return FALSE;
+		}
+
+		for (j = 0; j < bcf->cnt; j ++) {
+			if (rspamd_inet_address_get_af (
+					g_ptr_array_index (bcf->addrs, j)) == AF_UNIX) {
+				msg_warn_main ("cannot use reuseport for %s worker: unix socket "
+						"%s", cf->worker->name, bcf->name);
+
+				return FALSE;
+			}
+		}
+	}
+
+	rspamd_worker_conf_close_reuseport (cf);
+	cf->reuseport_socks = g_ptr_array_sized_new (cf->count);
+
+	for (i = 0; i < cf->count; i ++) {
+		socks = NULL;
+
+		LL_FOREACH (cf->bind_conf, bcf) {
+			ls = create_listen_socket (bcf->addrs, bcf->cnt,
+					cf->worker->listen_type,
+					RSPAMD_INET_ADDRESS_LISTEN_REUSEPORT);
+
+			if (ls == NULL) {
+				msg_err_main ("cannot listen on reuseport socket %s: %s",
+						bcf->name, strerror (errno));
+				g_ptr_array_add (cf->reuseport_socks, socks);
+				rspamd_worker_conf_close_reuseport (cf);
+
+				return FALSE;
+			}
+
+			socks = g_list_concat (socks, ls);
+		}
+
+		g_ptr_array_add (cf->reuseport_socks, socks);
+	}
+
+	return TRUE;
+}
+
 static void
 spawn_worker_type (struct rspamd_main *rspamd_main, struct ev_loop *event_loop,
 		struct rspamd_worker_conf *cf)
@@ -657,7 +727,14 @@ spawn_workers (struct rspamd_main *rspamd_main, struct ev_loop *ev_base)
 			if (cf->worker->flags & RSPAMD_WORKER_ALWAYS_START) {
 				g_ptr_array_add (seen_mandatory_workers, cf->worker);
 			}
-			if (cf->worker->flags & RSPAMD_WORKER_HAS_SOCKET) {
+			if ((cf->worker->flags & RSPAMD_WORKER_HAS_SOCKET) &&
+					cf->reuseport && cf->bind_conf &&
+					create_reuseport_sockets (rspamd_main, cf)) {
+				msg_info_main ("use separate reuseport sockets for %d %s workers",
+						(gint)cf->count, cf->worker->name);
+				spawn_worker_type (rspamd_main, ev_base, cf);
+			}
+			else if (cf->worker->flags & RSPAMD_WORKER_HAS_SOCKET) {
 				LL_FOREACH (cf->bind_conf, bcf) {
 					key = make_listen_key (bcf);
 
@@ -668,7 +745,8 @@ spawn_workers (struct rspamd_main *rspamd_main, struct ev_loop *ev_base)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type,
+									RSPAMD_INET_ADDRESS_LISTEN_DEFAULT);
 						}
 						else {
 							ls = systemd_get_socket (rspamd_main,
@@ -759,6 +837,11 @@ kill_old_workers (gpointer key, gpointer value, gpointer unused)
 		w->state = rspamd_worker_state_terminating;
 		kill (w->pid, SIGUSR2);
 		ev_io_stop (rspamd_main->event_loop, &w->srv_ev);
+		/*
+		 * Old workers drain their own copies of reuseport sockets, so we close
+		 * ours to let the kernel forget the socket once the worker closes it
+		 */
+		rspamd_worker_conf_close_reuseport (w->cf);
 		msg_info_main ("send signal to worker %P", w->pid);
 	}
 	else {
@@ -1420,7 +1503,7 @@ main (gint argc, gchar **argv, gchar **env)
 		}
 		else {
 			control_fd = rspamd_inet_address_listen (control_addr, SOCK_STREAM,
-					TRUE);
+					RSPAMD_INET_ADDRESS_LISTEN_ASYNC);
 			if (control_fd == -1) {
 				msg_err_main ("cannot open control socket at path: %s",
 						rspamd_main->cfg->control_socket_path);
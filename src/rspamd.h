@@ -363,7 +363,9 @@ struct rspamd_external_libs_ctx {
 	struct zstd_dictionary *in_dict;
 	struct zstd_dictionary *out_dict;
 	void *out_zstream;
+	void *out_dict_zstream; /* same as out_zstream but with out_dict loaded */
 	void *in_zstream;
+	void *in_dict_zstream; /* same as in_zstream but with in_dict loaded */
 	ref_entry_t ref;
 };
 
@@ -22,6 +22,7 @@
 #include "libserver/protocol.h"
 #include "libserver/protocol_internal.h"
 #include "libserver/cfg_file.h"
+#include "libserver/cfg_file_private.h"
 #include "libserver/url.h"
 #include "libserver/dns.h"
 #include "libmime/message.h"
@@ -36,6 +37,7 @@
 #include "libserver/milter.h"
 #include "libserver/milter_internal.h"
 #include "libmime/lang_detection.h"
+#define ZSTD_STATIC_LINKING_ONLY
 #include "contrib/zstd/zstd.h"
 
 #include <math.h>
@@ -80,6 +82,15 @@ worker_t rspamd_proxy_worker = {
 	RSPAMD_WORKER_VER
 };
 
+/* Latency samples kept for each upstream to calculate hedging delay */
+#define PROXY_LATENCY_SAMPLES 128
+/* Hedging delay is recalculated after this number of new samples */
+#define PROXY_HEDGE_UPDATE_INTERVAL 16
+#define PROXY_HEDGE_DEFAULT_DELAY 1.0
+/* Minimum size of a request part compressed in a separate thread */
+#define PROXY_COMPRESS_CHUNK (256 * 1024)
+#define PROXY_HEDGE_MIN_DELAY 0.01
+
 struct rspamd_http_upstream {
 	gchar *name;
 	gchar *settings_id;
@@ -91,6 +102,14 @@ struct rspamd_http_upstream {
 	gboolean local;
 	gboolean self_scan;
 	gboolean compress;
+	gboolean keepalive;
+	/* Send hedged request after this percentile of latency, 0 to disable */
+	gdouble hedge_percentile;
+	/* Delay before hedged request, updated from the latency samples */
+	gdouble hedge_delay;
+	/* Ring of the recent latency samples */
+	gdouble latencies[PROXY_LATENCY_SAMPLES];
+	guint nlatencies;
 };
 
 struct rspamd_http_mirror {
@@ -141,6 +160,8 @@ struct rspamd_proxy_ctx {
 	gboolean discard_on_reject;
 	/* Quarantine messages instead of rejecting them */
 	gboolean quarantine_on_reject;
+	/* Check envelope of milter sessions before message is sent */
+	gboolean early_checks;
 	/* Milter spam header */
 	gchar *spam_header;
 	/* CA name that can be used for client certificates */
@@ -152,12 +173,19 @@ struct rspamd_proxy_ctx {
 	struct rspamd_milter_context milter_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Compression level for requests to backends */
+	gint compression_level;
+	/* Compression contexts reused by all sessions, one per compressing thread */
+	GPtrArray *zcctxs;
+	ZSTD_CDict *zcdict;
+	ZSTD_DStream *zdstream;
 };
 
 enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_REUSED = 1 << 3,
 };
 
 struct rspamd_proxy_session;
@@ -173,6 +201,8 @@ struct rspamd_proxy_backend_connection {
 	struct rspamd_proxy_session *s;
 	gint backend_sock;
 	ev_tstamp timeout;
+	/* Request start time, used for upstream latency */
+	gdouble start_ts;
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
 	gint parser_to_ref;
@@ -197,6 +227,9 @@ struct rspamd_proxy_session {
 	gchar *fname;
 	gpointer shmem_ref;
 	struct rspamd_proxy_backend_connection *master_conn;
+	/* Hedged request racing with the master one */
+	struct rspamd_proxy_backend_connection *hedge_conn;
+	ev_timer hedge_ev;
 	struct rspamd_http_message *client_message;
 	GPtrArray *mirror_conns;
 	gsize map_len;
@@ -397,6 +430,29 @@ rspamd_proxy_parse_upstream (rspamd_mempool_t *pool,
 		up->compress = TRUE;
 	}
 
+	elt = ucl_object_lookup_any (obj, "keepalive", "keep_alive", NULL);
+	if (elt && ucl_object_toboolean (elt)) {
+		up->keepalive = TRUE;
+	}
+
+	up->hedge_delay = PROXY_HEDGE_DEFAULT_DELAY;
+
+	elt = ucl_object_lookup (obj, "hedge_percentile");
+	if (elt) {
+		if (!ucl_object_todouble_safe (elt, &up->hedge_percentile) ||
+				up->hedge_percentile < 0 || up->hedge_percentile > 100) {
+			g_set_error (err, rspamd_proxy_quark (), 100,
+					"hedge_percentile must be a number from 0 to 100");
+
+			goto err;
+		}
+	}
+
+	elt = ucl_object_lookup (obj, "hedge_delay");
+	if (elt) {
+		ucl_object_todouble_safe (elt, &up->hedge_delay);
+	}
+
 	elt = ucl_object_lookup (obj, "hosts");
 
 	if (elt == NULL && !up->self_scan) {
@@ -736,6 +792,7 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			(rspamd_mempool_destruct_t)rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
 	ctx->spam_header = RSPAMD_MILTER_SPAM_HEADER;
+	ctx->compression_level = 1;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -786,6 +843,14 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, max_retries),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of retries for master connection");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"compression_level",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, compression_level),
+			RSPAMD_CL_FLAG_INT_32,
+			"Zstd compression level for requests to backends (1 by default)");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"milter",
@@ -802,6 +867,15 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, discard_on_reject),
 			0,
 			"Tell MTA to discard rejected messages silently");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"early_checks",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, early_checks),
+			0,
+			"Check envelope of milter sessions on the first recipient "
+			"(requires self_scan)");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"quarantine_on_reject",
@@ -845,7 +919,13 @@ proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 		if (conn->backend_conn) {
 			rspamd_http_connection_reset (conn->backend_conn);
 			rspamd_http_connection_unref (conn->backend_conn);
-			close (conn->backend_sock);
+
+			/* Keep-alive connections own their sockets */
+			if (conn->backend_sock != -1) {
+				close (conn->backend_sock);
+			}
+
+			conn->backend_conn = NULL;
 		}
 
 		conn->flags |= RSPAMD_BACKEND_CLOSED;
@@ -997,6 +1077,14 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 		proxy_backend_close_connection (session->master_conn);
 	}
 
+	ev_timer_stop (session->ctx->event_loop, &session->hedge_ev);
+
+	if (session->hedge_conn) {
+		/* Unfinished request has no result */
+		rspamd_upstream_release (session->hedge_conn->up);
+		proxy_backend_close_connection (session->hedge_conn);
+	}
+
 	if (session->client_milter_conn) {
 		rspamd_milter_session_unref (session->client_milter_conn);
 	}
@@ -1055,56 +1143,171 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 	g_free (session);
 }
 
+/*
+ * Sets file requested by a client as a body of a message to a remote backend:
+ * file is mapped, so each backend message shares the same pages
+ */
 static void
-proxy_request_compress (struct rspamd_http_message *msg)
+proxy_message_set_file_body (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
 {
-	guint flags;
-	ZSTD_CCtx *zctx;
-	rspamd_fstring_t *body;
+	gint fd;
+
+	fd = open (session->fname, O_RDONLY);
+
+	if (fd != -1) {
+		if (rspamd_http_message_set_body_from_fd (msg, fd)) {
+			close (fd);
+
+			return;
+		}
+
+		close (fd);
+	}
+
+	msg_info_session ("cannot map %s: %s, copy it", session->fname,
+			strerror (errno));
+	rspamd_http_message_storage_cleanup (msg);
+	msg->flags &= ~(RSPAMD_HTTP_FLAG_SHMEM|RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE);
+	rspamd_http_message_set_body (msg, session->map, session->map_len);
+}
+
+struct proxy_compress_job {
+	ZSTD_CCtx *cctx;
 	const gchar *in;
 	gsize inlen;
+	gchar *out;
+	gsize outlen;
+	gsize r;
+};
+
+static void
+proxy_compress_job_func (gpointer data, gpointer ud)
+{
+	struct proxy_compress_job *job = (struct proxy_compress_job *)data;
+	struct rspamd_proxy_ctx *ctx = (struct rspamd_proxy_ctx *)ud;
+
+	/* Digested dictionary is read only, so it is shared by threads */
+	if (ctx->zcdict) {
+		job->r = ZSTD_compress_usingCDict (job->cctx, job->out, job->outlen,
+				job->in, job->inlen, ctx->zcdict);
+	}
+	else {
+		job->r = ZSTD_compressCCtx (job->cctx, job->out, job->outlen,
+				job->in, job->inlen, ctx->compression_level);
+	}
+}
+
+/*
+ * Large requests are split into parts compressed as independent zstd frames
+ * by the parts decoding threads pool, as concatenated frames are decompressed
+ * as a single stream
+ */
+static void
+proxy_request_compress (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_http_message *msg)
+{
+	guint flags, njobs, i;
+	rspamd_fstring_t *body;
+	struct proxy_compress_job *jobs;
+	GPtrArray *jobs_ptrs;
+	GError *err = NULL;
+	const gchar *in;
+	gsize inlen, chunk, outlen, pos;
 
 	flags = rspamd_http_message_get_flags (msg);
 
 	if (!rspamd_http_message_find_header (msg, COMPRESSION_HEADER)) {
-		if ((flags & RSPAMD_HTTP_FLAG_SHMEM) ||
-				!(flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
-			/* Cannot compress shared or empty message */
+		/*
+		 * Shared body is replaced by a private compressed one, the shared
+		 * segment itself is not modified
+		 */
+		if (!(flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
+			/* Cannot compress empty message */
 			return;
 		}
 
 		in = rspamd_http_message_get_body (msg, &inlen);
 
-		if (in == NULL || inlen == 0) {
+		if (in == NULL || inlen == 0 || ctx->zcctxs->len == 0) {
 			return;
 		}
 
-		body = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
-		zctx = ZSTD_createCCtx ();
-		body->len = ZSTD_compressCCtx (zctx, body->str, body->allocated,
-				in, inlen, 1);
+		njobs = MIN (ctx->zcctxs->len,
+				(inlen + PROXY_COMPRESS_CHUNK - 1) / PROXY_COMPRESS_CHUNK);
+		njobs = MAX (njobs, 1);
+		chunk = (inlen + njobs - 1) / njobs;
+		jobs = g_new0 (struct proxy_compress_job, njobs);
+		jobs_ptrs = g_ptr_array_sized_new (njobs);
+		outlen = 0;
 
-		if (ZSTD_isError (body->len)) {
-			msg_err ("compression error");
-			rspamd_fstring_free (body);
-			ZSTD_freeCCtx (zctx);
+		for (i = 0; i < njobs; i ++) {
+			jobs[i].cctx = g_ptr_array_index (ctx->zcctxs, i);
+			jobs[i].in = in + i * chunk;
+			jobs[i].inlen = MIN (chunk, inlen - i * chunk);
+			jobs[i].outlen = ZSTD_compressBound (jobs[i].inlen);
+			outlen += jobs[i].outlen;
+			g_ptr_array_add (jobs_ptrs, &jobs[i]);
+		}
 
-			return;
+		body = rspamd_fstring_sized_new (outlen);
+		pos = 0;
+
+		for (i = 0; i < njobs; i ++) {
+			jobs[i].out = body->str + pos;
+			pos += jobs[i].outlen;
 		}
 
-		ZSTD_freeCCtx (zctx);
+		if (!rspamd_threads_pool_run (jobs_ptrs, proxy_compress_job_func, ctx,
+				ctx->cfg->parts_decode_threads, &err) && err) {
+			msg_err ("cannot create threads pool for compression: %e", err);
+			g_error_free (err);
+		}
+
+		g_ptr_array_free (jobs_ptrs, TRUE);
+		pos = 0;
+
+		for (i = 0; i < njobs; i ++) {
+			if (ZSTD_isError (jobs[i].r)) {
+				msg_err ("compression error: %s", ZSTD_getErrorName (jobs[i].r));
+				rspamd_fstring_free (body);
+				g_free (jobs);
+
+				return;
+			}
+
+			/* Frames are moved together as they are shorter than bounds */
+			memmove (body->str + pos, jobs[i].out, jobs[i].r);
+			pos += jobs[i].r;
+		}
+
+		g_free (jobs);
+		body->len = pos;
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_add_header (msg, COMPRESSION_HEADER, "zstd");
+
+		if (ctx->zcdict) {
+			gchar dict_str[32];
+
+			/* Backends decompress requests with their input dictionary */
+			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
+					ctx->cfg->libs_ctx->in_dict->id);
+			rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+		}
 	}
 }
 
 static void
-proxy_request_decompress (struct rspamd_http_message *msg)
+proxy_request_decompress (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_http_message *msg)
 {
 	rspamd_fstring_t *body;
 	const gchar *in;
+	const rspamd_ftok_t *dict_hdr;
+	struct zstd_dictionary *dict;
 	gsize inlen, outlen, r;
-	ZSTD_DStream *zstream;
+	gulong dict_id;
+	guint64 content_size;
 	ZSTD_inBuffer zin;
 	ZSTD_outBuffer zout;
 
@@ -1115,36 +1318,69 @@ proxy_request_decompress (struct rspamd_http_message *msg)
 			return;
 		}
 
-		zstream = ZSTD_createDStream ();
-		ZSTD_initDStream (zstream);
+		if (ctx->zdstream == NULL) {
+			msg_err ("cannot decompress reply: no decompression stream");
+
+			return;
+		}
+
+		dict_hdr = rspamd_http_message_find_header (msg, "Dictionary");
+
+		if (dict_hdr) {
+			/* Backends compress replies with their output dictionary */
+			dict = ctx->cfg->libs_ctx->out_dict;
+
+			if (!rspamd_strtoul (dict_hdr->begin, dict_hdr->len, &dict_id) ||
+					dict == NULL || dict->id != dict_id) {
+				msg_err ("cannot decompress reply: unknown dictionary %T",
+						dict_hdr);
+
+				return;
+			}
+		}
+
+		r = ZSTD_resetDStream (ctx->zdstream);
+
+		if (ZSTD_isError (r)) {
+			msg_err ("cannot reset decompression stream: %s",
+					ZSTD_getErrorName (r));
+
+			return;
+		}
 
 		zin.pos = 0;
 		zin.src = in;
 		zin.size = inlen;
 
-		if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
+		content_size = ZSTD_getFrameContentSize (zin.src, zin.size);
+
+		if (content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+				content_size == ZSTD_CONTENTSIZE_ERROR ||
+				content_size == 0) {
 			outlen = ZSTD_DStreamOutSize ();
 		}
+		else {
+			outlen = content_size;
+		}
 
 		body = rspamd_fstring_sized_new (outlen);
 		zout.dst = body->str;
 		zout.pos = 0;
-		zout.size = outlen;
+		zout.size = body->allocated;
 
 		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream (zstream, &zout, &zin);
+			r = ZSTD_decompressStream (ctx->zdstream, &zout, &zin);
 
 			if (ZSTD_isError (r)) {
 				msg_err ("Decompression error: %s", ZSTD_getErrorName (r));
-				ZSTD_freeDStream (zstream);
 				rspamd_fstring_free (body);
 
 				return;
 			}
 
 			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 2 + 1;
+				/* We need to extend output buffer, at least twice */
+				body->len = zout.pos;
 				body = rspamd_fstring_grow (body, zout.size);
 				zout.size = body->allocated;
 				zout.dst = body->str;
@@ -1152,9 +1388,90 @@ proxy_request_decompress (struct rspamd_http_message *msg)
 		}
 
 		body->len = zout.pos;
-		ZSTD_freeDStream (zstream);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_remove_header (msg, COMPRESSION_HEADER);
+		rspamd_http_message_remove_header (msg, "Dictionary");
+	}
+}
+
+static void
+proxy_init_compression (struct rspamd_proxy_ctx *ctx)
+{
+	struct rspamd_external_libs_ctx *libs_ctx = ctx->cfg->libs_ctx;
+	ZSTD_CCtx *zcctx;
+	guint i;
+	gsize r;
+
+	ctx->zcctxs = g_ptr_array_new ();
+
+	/* The current thread compresses a part of request as well */
+	for (i = 0; i < ctx->cfg->parts_decode_threads + 1; i ++) {
+		zcctx = ZSTD_createCCtx ();
+
+		if (zcctx == NULL) {
+			break;
+		}
+
+		g_ptr_array_add (ctx->zcctxs, zcctx);
+	}
+
+	if (ctx->zcctxs->len == 0) {
+		msg_err ("cannot create compression context");
+	}
+	else if (libs_ctx->in_dict) {
+		/* Digest dictionary once instead of doing it for each request */
+		ctx->zcdict = ZSTD_createCDict (libs_ctx->in_dict->dict,
+				libs_ctx->in_dict->size, ctx->compression_level);
+
+		if (ctx->zcdict == NULL) {
+			msg_err ("cannot load compression dictionary, "
+					 "compress without dictionary");
+		}
+	}
+
+	ctx->zdstream = ZSTD_createDStream ();
+
+	if (ctx->zdstream) {
+		if (libs_ctx->out_dict) {
+			r = ZSTD_initDStream_usingDict (ctx->zdstream,
+					libs_ctx->out_dict->dict, libs_ctx->out_dict->size);
+		}
+		else {
+			r = ZSTD_initDStream (ctx->zdstream);
+		}
+
+		if (ZSTD_isError (r)) {
+			msg_err ("cannot init decompression stream: %s",
+					ZSTD_getErrorName (r));
+			ZSTD_freeDStream (ctx->zdstream);
+			ctx->zdstream = NULL;
+		}
+	}
+}
+
+static void
+proxy_deinit_compression (struct rspamd_proxy_ctx *ctx)
+{
+	if (ctx->zcdict) {
+		ZSTD_freeCDict (ctx->zcdict);
+		ctx->zcdict = NULL;
+	}
+
+	if (ctx->zcctxs) {
+		guint i;
+		ZSTD_CCtx *zcctx;
+
+		PTR_ARRAY_FOREACH (ctx->zcctxs, i, zcctx) {
+			ZSTD_freeCCtx (zcctx);
+		}
+
+		g_ptr_array_free (ctx->zcctxs, TRUE);
+		ctx->zcctxs = NULL;
+	}
+
+	if (ctx->zdstream) {
+		ZSTD_freeDStream (ctx->zdstream);
+		ctx->zdstream = NULL;
 	}
 }
 
@@ -1316,7 +1633,7 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	session = bk_conn->s;
 
-	proxy_request_decompress (msg);
+	proxy_request_decompress (session->ctx, msg);
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
 			bk_conn->parser_from_ref, msg, NULL)) {
@@ -1328,7 +1645,8 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	}
 
 	msg_info_session ("finished mirror connection to %s", bk_conn->name);
-	rspamd_upstream_ok (bk_conn->up);
+	rspamd_upstream_ok_latency (bk_conn->up,
+			rspamd_get_ticks (FALSE) - bk_conn->start_ts);
 
 	proxy_backend_close_connection (bk_conn);
 	REF_RELEASE (bk_conn->s);
@@ -1364,6 +1682,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 
 		bk_conn->up = rspamd_upstream_get (m->u,
 				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+		bk_conn->start_ts = rspamd_get_ticks (FALSE);
 		bk_conn->parser_from_ref = m->parser_from_ref;
 		bk_conn->parser_to_ref = m->parser_to_ref;
 
@@ -1428,14 +1747,13 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 		}
 		else {
 			if (session->fname) {
-				msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
-				rspamd_http_message_set_body (msg, session->map, session->map_len);
+				proxy_message_set_file_body (session, msg);
 			}
 
 			msg->method = HTTP_POST;
 
 			if (m->compress) {
-				proxy_request_compress (msg);
+				proxy_request_compress (session->ctx, msg);
 
 				if (session->client_milter_conn) {
 					rspamd_http_message_add_header (msg, "Content-Type",
@@ -1509,6 +1827,125 @@ proxy_client_write_error (struct rspamd_proxy_session *session, gint code,
 	}
 }
 
+static gint
+proxy_latency_cmp (const void *a, const void *b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	return (d1 > d2) - (d1 < d2);
+}
+
+/*
+ * Only scan requests are idempotent: learn and fuzzy storage requests must not
+ * be sent twice, and their latencies are not comparable to the scan ones
+ */
+static gboolean
+proxy_session_is_scan (struct rspamd_proxy_session *session)
+{
+	struct rspamd_http_message *msg = session->client_message;
+	struct http_parser_url u;
+	const gchar *p;
+	gsize pathlen;
+	guint i;
+	static const gchar *scan_cmds[] = {
+		MSG_CMD_CHECK,
+		MSG_CMD_CHECK_V2,
+		MSG_CMD_SCAN,
+		MSG_CMD_SYMBOLS,
+		MSG_CMD_REPORT,
+		MSG_CMD_REPORT_IFSPAM,
+		MSG_CMD_PROCESS,
+		MSG_CMD_SKIP,
+	};
+
+	if (session->client_milter_conn) {
+		return TRUE;
+	}
+
+	if (msg == NULL || msg->url == NULL || msg->url->len == 0 ||
+			http_parser_parse_url (RSPAMD_FSTRING_DATA (msg->url),
+					RSPAMD_FSTRING_LEN (msg->url), 0, &u) != 0 ||
+			!(u.field_set & (1u << UF_PATH))) {
+		return FALSE;
+	}
+
+	p = RSPAMD_FSTRING_DATA (msg->url) + u.field_data[UF_PATH].off;
+	pathlen = u.field_data[UF_PATH].len;
+
+	if (pathlen > 0 && *p == '/') {
+		p ++;
+		pathlen --;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (scan_cmds); i ++) {
+		if (strlen (scan_cmds[i]) == pathlen &&
+				rspamd_lc_cmp (p, scan_cmds[i], pathlen) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+proxy_backend_add_latency (struct rspamd_http_upstream *backend,
+		gdouble latency)
+{
+	gdouble sorted[PROXY_LATENCY_SAMPLES];
+	guint n;
+
+	if (backend->hedge_percentile <= 0) {
+		return;
+	}
+
+	backend->latencies[backend->nlatencies % PROXY_LATENCY_SAMPLES] = latency;
+	backend->nlatencies ++;
+
+	/* Do not sort samples on each reply */
+	if (backend->nlatencies % PROXY_HEDGE_UPDATE_INTERVAL == 0) {
+		n = MIN (backend->nlatencies, PROXY_LATENCY_SAMPLES);
+		memcpy (sorted, backend->latencies, n * sizeof (gdouble));
+		qsort (sorted, n, sizeof (gdouble), proxy_latency_cmp);
+		backend->hedge_delay = MAX (PROXY_HEDGE_MIN_DELAY,
+				sorted[(guint)((n - 1) * backend->hedge_percentile / 100.0)]);
+	}
+}
+
+/*
+ * The first reply of racing requests wins: the other request is cancelled
+ * and the winner becomes the master connection
+ */
+static void
+proxy_backend_settle_race (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *winner)
+{
+	struct rspamd_proxy_backend_connection *loser;
+
+	ev_timer_stop (session->ctx->event_loop, &session->hedge_ev);
+
+	if (session->hedge_conn == NULL) {
+		return;
+	}
+
+	if (winner == session->hedge_conn) {
+		loser = session->master_conn;
+		session->master_conn = winner;
+		msg_info_session ("hedged request to %s has won",
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (winner->up)));
+		/* Latency of the slow master is at least the elapsed time */
+		rspamd_upstream_ok_latency (loser->up,
+				rspamd_get_ticks (FALSE) - loser->start_ts);
+	}
+	else {
+		loser = session->hedge_conn;
+		rspamd_upstream_release (loser->up);
+	}
+
+	session->hedge_conn = NULL;
+	proxy_backend_close_connection (loser);
+}
+
 static void
 proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
@@ -1516,6 +1953,68 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 	struct rspamd_proxy_session *session;
 
 	session = bk_conn->s;
+
+	if (session->hedge_conn) {
+		/* Another request is still in flight, so just wait for it */
+		msg_info_session ("abnormally closing %s connection to backend: %s, "
+				"error: %e; wait for another request",
+				bk_conn->name,
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (bk_conn->up)),
+				err);
+
+		if (bk_conn->flags & RSPAMD_BACKEND_REUSED) {
+			/* Stale keep-alive connection is not a backend failure */
+			rspamd_upstream_release (bk_conn->up);
+		}
+		else {
+			rspamd_upstream_fail (bk_conn->up, FALSE,
+					err ? err->message : "unknown");
+		}
+
+		proxy_backend_close_connection (bk_conn);
+
+		if (bk_conn == session->master_conn) {
+			session->master_conn = session->hedge_conn;
+		}
+
+		session->hedge_conn = NULL;
+
+		return;
+	}
+
+	if ((bk_conn->flags & RSPAMD_BACKEND_REUSED) && err &&
+			err->code == ECONNRESET &&
+			!rspamd_http_connection_data_read (conn)) {
+		/*
+		 * Pooled connection might be closed by backend while it was idle,
+		 * it is not a backend failure, so just try another connection.
+		 * Request could not be processed if nothing has been replied.
+		 */
+		session->retries ++;
+		msg_debug_session ("stale keep-alive connection to backend: %s, "
+				"error: %e, retries left: %d",
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (session->master_conn->up)),
+				err,
+				session->ctx->max_retries - session->retries);
+		/* Request is retried, so it is neither success nor failure */
+		rspamd_upstream_release (bk_conn->up);
+		proxy_backend_close_connection (session->master_conn);
+
+		if (session->ctx->max_retries > 0 &&
+				session->retries >= session->ctx->max_retries) {
+			msg_err_session ("cannot connect to upstream, maximum retries "
+					"has been reached: %d", session->retries);
+			proxy_client_write_error (session, err->code, err->message);
+		}
+		else if (!proxy_send_master_message (session)) {
+			proxy_client_write_error (session, err->code, err->message);
+		}
+
+		return;
+	}
+
 	session->retries ++;
 	msg_info_session ("abnormally closing connection from backend: %s, error: %e,"
 					  " retries left: %d",
@@ -1555,14 +2054,45 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_proxy_session *session, *nsession;
 	rspamd_fstring_t *reply;
 	goffset body_offset = -1;
+	gdouble latency;
 
 	session = bk_conn->s;
+	proxy_backend_settle_race (session, bk_conn);
+
+	if (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) {
+		const rspamd_ftok_t *conn_hdr;
+		rspamd_ftok_t cmp;
+
+		/*
+		 * We steal message below, so keep-alive headers are checked here:
+		 * connection is returned to the pool only if backend agrees
+		 */
+		conn_hdr = rspamd_http_message_find_header (msg, "Connection");
+		RSPAMD_FTOK_ASSIGN (&cmp, "keep-alive");
+
+		if (conn_hdr == NULL || rspamd_ftok_casecmp (conn_hdr, &cmp) != 0) {
+			conn->opts &= ~RSPAMD_HTTP_CLIENT_KEEP_ALIVE;
+		}
+	}
+
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
-	proxy_request_decompress (msg);
+	proxy_request_decompress (session->ctx, msg);
 
 	rspamd_http_message_remove_header (msg, "Content-Length");
 	rspamd_http_message_remove_header (msg, "Key");
-	rspamd_http_connection_reset (session->master_conn->backend_conn);
+
+	if (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) {
+		/*
+		 * Connection is moved to the keep-alive pool when this handler
+		 * returns and it might be reused by another session, so it must
+		 * not be reset or closed by this one
+		 */
+		rspamd_http_connection_unref (bk_conn->backend_conn);
+		bk_conn->backend_conn = NULL;
+	}
+	else {
+		rspamd_http_connection_reset (session->master_conn->backend_conn);
+	}
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
 			bk_conn->parser_from_ref, msg, &body_offset)) {
@@ -1592,7 +2122,14 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
-	rspamd_upstream_ok (bk_conn->up);
+	if (proxy_session_is_scan (session)) {
+		latency = rspamd_get_ticks (FALSE) - bk_conn->start_ts;
+		rspamd_upstream_ok_latency (bk_conn->up, latency);
+		proxy_backend_add_latency (session->backend, latency);
+	}
+	else {
+		rspamd_upstream_ok (bk_conn->up);
+	}
 
 	if (session->client_milter_conn) {
 		nsession = proxy_session_refresh (session);
@@ -1829,13 +2366,261 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 	return TRUE;
 }
 
+/*
+ * Takes a connection to the selected upstream from the keep-alive pool of
+ * the HTTP context or opens a new one that returns to the pool after reply.
+ * Pool is filled by finished requests, so its size follows the number of
+ * concurrent requests to each backend address.
+ */
 static gboolean
-proxy_send_master_message (struct rspamd_proxy_session *session)
+proxy_backend_keepalive_connection (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_upstream *backend)
+{
+	rspamd_inet_addr_t *addr;
+
+	addr = rspamd_upstream_addr_next (bk_conn->up);
+	bk_conn->backend_sock = -1;
+	/* Upstream name is used as host, so other keep-alive users do not mix */
+	bk_conn->backend_conn = rspamd_http_context_check_keepalive (
+			session->ctx->http_ctx, addr, backend->name);
+
+	if (bk_conn->backend_conn) {
+		bk_conn->flags |= RSPAMD_BACKEND_REUSED;
+		msg_debug_session ("reuse keep-alive connection to %s",
+				rspamd_inet_address_to_string_pretty (addr));
+
+		return TRUE;
+	}
+
+	bk_conn->backend_conn = rspamd_http_connection_new_client (
+			session->ctx->http_ctx,
+			NULL,
+			proxy_backend_master_error_handler,
+			proxy_backend_master_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
+			addr);
+
+	if (bk_conn->backend_conn == NULL) {
+		return FALSE;
+	}
+
+	rspamd_http_context_prepare_keepalive (session->ctx->http_ctx,
+			bk_conn->backend_conn, addr, backend->name);
+
+	return TRUE;
+}
+
+static gboolean
+proxy_backend_connect (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_upstream *backend)
+{
+	bk_conn->flags &= ~RSPAMD_BACKEND_REUSED;
+	bk_conn->start_ts = rspamd_get_ticks (FALSE);
+
+	if (backend->keepalive) {
+		if (!proxy_backend_keepalive_connection (session, bk_conn, backend)) {
+			return FALSE;
+		}
+	}
+	else {
+		bk_conn->backend_sock = rspamd_inet_address_connect (
+				rspamd_upstream_addr_next (bk_conn->up),
+				SOCK_STREAM, TRUE);
+
+		if (bk_conn->backend_sock == -1) {
+			return FALSE;
+		}
+
+		bk_conn->backend_conn = rspamd_http_connection_new_client_socket (
+				session->ctx->http_ctx,
+				NULL,
+				proxy_backend_master_error_handler,
+				proxy_backend_master_finish_handler,
+				RSPAMD_HTTP_CLIENT_SIMPLE,
+				bk_conn->backend_sock);
+	}
+
+	bk_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
+
+	return TRUE;
+}
+
+static gboolean
+proxy_backend_write_message (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_upstream *backend)
 {
 	struct rspamd_http_message *msg;
+	GError *err = NULL;
+
+	msg = rspamd_http_connection_copy_msg (session->client_message, &err);
+
+	if (msg == NULL) {
+		msg_err_session ("cannot copy message to send it to the upstream: %e",
+				err);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return FALSE;
+	}
+
+	bk_conn->parser_from_ref = backend->parser_from_ref;
+	bk_conn->parser_to_ref = backend->parser_to_ref;
+
+	if (backend->key) {
+		msg->peer_key = rspamd_pubkey_ref (backend->key);
+	}
+
+	if (backend->settings_id != NULL) {
+		rspamd_http_message_remove_header (msg, "Settings-ID");
+		rspamd_http_message_add_header (msg, "Settings-ID",
+				backend->settings_id);
+	}
+
+	if (backend->local ||
+			rspamd_inet_address_is_local (
+					rspamd_upstream_addr_cur (bk_conn->up))) {
+
+		if (session->fname) {
+			rspamd_http_message_add_header (msg, "File", session->fname);
+		}
+
+		msg->method = HTTP_GET;
+
+		rspamd_http_connection_write_message_shared (
+				bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->timeout);
+	}
+	else {
+		if (session->fname) {
+			proxy_message_set_file_body (session, msg);
+		}
+
+		msg->method = HTTP_POST;
+
+		if (backend->compress) {
+			proxy_request_compress (session->ctx, msg);
+			if (session->client_milter_conn) {
+				rspamd_http_message_add_header (msg, "Content-Type",
+						"application/octet-stream");
+			}
+		}
+		else {
+			if (session->client_milter_conn) {
+				rspamd_http_message_add_header (msg, "Content-Type",
+						"text/plain");
+			}
+		}
+
+		rspamd_http_connection_write_message (
+				bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->timeout);
+	}
+
+	return TRUE;
+}
+
+/*
+ * If master backend has not replied after the configured percentile of its
+ * latency, the same request is sent to another upstream and the first reply
+ * wins, so a single stuck scanner does not delay replies
+ */
+static void
+proxy_backend_hedge_timer (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_proxy_session *session =
+			(struct rspamd_proxy_session *)w->data;
+	struct rspamd_http_upstream *backend = session->backend;
+	struct rspamd_proxy_backend_connection *bk_conn;
+	struct upstream *up;
+	gpointer hash_key;
+	guint hash_len;
+
+	if (session->hedge_conn || session->master_conn == NULL ||
+			(session->master_conn->flags & RSPAMD_BACKEND_CLOSED)) {
+		return;
+	}
+
+	hash_key = rspamd_inet_address_get_hash_key (session->client_addr,
+			&hash_len);
+	up = rspamd_upstream_get_except (backend->u, session->master_conn->up,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, hash_key, hash_len);
+
+	if (up == NULL) {
+		return;
+	}
+
+	if (up == session->master_conn->up) {
+		/* Finish request accounting, no other upstreams are available */
+		rspamd_upstream_release (up);
+
+		return;
+	}
+
+	bk_conn = rspamd_mempool_alloc0 (session->pool, sizeof (*bk_conn));
+	bk_conn->s = session;
+	bk_conn->name = "hedged";
+	bk_conn->up = up;
+	bk_conn->timeout = backend->timeout;
+	bk_conn->flags = RSPAMD_BACKEND_CLOSED;
+
+	msg_info_session ("master backend %s has not replied in %.3f seconds, "
+			"send hedged request to %s",
+			rspamd_inet_address_to_string_pretty (
+					rspamd_upstream_addr_cur (session->master_conn->up)),
+			rspamd_get_ticks (FALSE) - session->master_conn->start_ts,
+			rspamd_inet_address_to_string_pretty (
+					rspamd_upstream_addr_cur (up)));
+
+	if (!proxy_backend_connect (session, bk_conn, backend)) {
+		msg_err_session ("cannot connect upstream: %s",
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (up)));
+		rspamd_upstream_fail (up, TRUE, strerror (errno));
+
+		return;
+	}
+
+	if (!proxy_backend_write_message (session, bk_conn, backend)) {
+		rspamd_upstream_release (up);
+		proxy_backend_close_connection (bk_conn);
+
+		return;
+	}
+
+	session->hedge_conn = bk_conn;
+}
+
+static void
+proxy_backend_plan_hedge (struct rspamd_proxy_session *session,
+		struct rspamd_http_upstream *backend)
+{
+	ev_timer_stop (session->ctx->event_loop, &session->hedge_ev);
+
+	if (backend->hedge_percentile <= 0 || session->hedge_conn ||
+			backend->hedge_delay >= backend->timeout ||
+			rspamd_upstreams_alive (backend->u) < 2 ||
+			!proxy_session_is_scan (session)) {
+		return;
+	}
+
+	session->hedge_ev.data = session;
+	ev_timer_init (&session->hedge_ev, proxy_backend_hedge_timer,
+			backend->hedge_delay, 0.0);
+	ev_timer_start (session->ctx->event_loop, &session->hedge_ev);
+}
+
+static gboolean
+proxy_send_master_message (struct rspamd_proxy_session *session)
+{
 	struct rspamd_http_upstream *backend = NULL;
 	const rspamd_ftok_t *host;
-	GError *err = NULL;
 	gchar hostbuf[512];
 
 	host = rspamd_http_message_find_header (session->client_message, "Host");
@@ -1898,11 +2683,7 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr_next (session->master_conn->up),
-				SOCK_STREAM, TRUE);
-
-		if (session->master_conn->backend_sock == -1) {
+		if (!proxy_backend_connect (session, session->master_conn, backend)) {
 			msg_err_session ("cannot connect upstream: %s(%s)",
 					host ? hostbuf : "default",
 							rspamd_inet_address_to_string_pretty (
@@ -1914,83 +2695,14 @@ retry:
 			goto retry;
 		}
 
-		msg = rspamd_http_connection_copy_msg (session->client_message, &err);
-		if (msg == NULL) {
-			msg_err_session ("cannot copy message to send it to the upstream: %e",
-					err);
-
-			if (err) {
-				g_error_free (err);
-			}
+		if (!proxy_backend_write_message (session, session->master_conn,
+				backend)) {
+			proxy_backend_close_connection (session->master_conn);
 
 			goto err; /* No fallback here */
 		}
 
-		session->master_conn->backend_conn = rspamd_http_connection_new_client_socket (
-				session->ctx->http_ctx,
-				NULL,
-				proxy_backend_master_error_handler,
-				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				session->master_conn->backend_sock);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
-		session->master_conn->parser_from_ref = backend->parser_from_ref;
-		session->master_conn->parser_to_ref = backend->parser_to_ref;
-
-		if (backend->key) {
-			msg->peer_key = rspamd_pubkey_ref (backend->key);
-		}
-
-		if (backend->settings_id != NULL) {
-			rspamd_http_message_remove_header (msg, "Settings-ID");
-			rspamd_http_message_add_header (msg, "Settings-ID",
-					backend->settings_id);
-		}
-
-		if (backend->local ||
-				rspamd_inet_address_is_local (
-						rspamd_upstream_addr_cur (
-								session->master_conn->up))) {
-
-			if (session->fname) {
-				rspamd_http_message_add_header (msg, "File", session->fname);
-			}
-
-			msg->method = HTTP_GET;
-
-			rspamd_http_connection_write_message_shared (
-					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
-					session->master_conn->timeout);
-		}
-		else {
-			if (session->fname) {
-				msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
-				rspamd_http_message_set_body (msg,
-						session->map, session->map_len);
-			}
-
-			msg->method = HTTP_POST;
-
-			if (backend->compress) {
-				proxy_request_compress (msg);
-				if (session->client_milter_conn) {
-					rspamd_http_message_add_header (msg, "Content-Type",
-							"application/octet-stream");
-				}
-			}
-			else {
-				if (session->client_milter_conn) {
-					rspamd_http_message_add_header (msg, "Content-Type",
-							"text/plain");
-				}
-			}
-
-			rspamd_http_connection_write_message (
-					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
-					session->master_conn->timeout);
-		}
+		proxy_backend_plan_hedge (session, backend);
 	}
 
 	return TRUE;
@@ -2123,6 +2835,102 @@ proxy_milter_finish_handler (gint fd,
 	}
 }
 
+/*
+ * Early checks are done in process on the first recipient: task has no
+ * message, so only symbols allowed for empty messages (e.g. RBL, ratelimit or
+ * greylisting) are checked and MTA can reject a transaction before DATA
+ */
+static gboolean
+proxy_milter_early_fin (void *ud)
+{
+	struct rspamd_task *task = ud;
+	struct rspamd_milter_session *rms = task->fin_arg;
+	struct rspamd_action *action = NULL;
+	struct rspamd_passthrough_result *pr = NULL;
+	const ucl_object_t *elt;
+	const gchar *message = NULL;
+
+	if (task->flags & RSPAMD_TASK_FLAG_PROCESSING) {
+		/* Session is checked again after processing */
+		return FALSE;
+	}
+
+	if (!RSPAMD_TASK_IS_PROCESSED (task)) {
+		rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+
+		if (!RSPAMD_TASK_IS_PROCESSED (task)) {
+			/* One more iteration */
+			return FALSE;
+		}
+	}
+
+	if (task->err == NULL && !(task->flags & RSPAMD_TASK_FLAG_SKIP)) {
+		action = rspamd_check_action_metric (task, &pr);
+
+		if (pr && pr->message) {
+			message = pr->message;
+		}
+		else if (task->messages &&
+				(elt = ucl_object_lookup (task->messages, "smtp_message"))) {
+			message = ucl_object_tostring (elt);
+		}
+	}
+
+	msg_info_task ("finished early checks, action: %s",
+			action ? action->name : "no action");
+	rspamd_milter_send_envelope_verdict (rms, action, message);
+	rspamd_milter_session_unref (rms);
+	rspamd_session_destroy (task->s);
+
+	return TRUE;
+}
+
+static void
+proxy_milter_rcpt_handler (gint fd,
+		struct rspamd_milter_session *rms,
+		void *ud)
+{
+	struct rspamd_proxy_session *session = ud;
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	struct rspamd_http_message *msg;
+	struct rspamd_task *task;
+
+	/* No body at this stage, so it is just a container for envelope */
+	msg = rspamd_milter_to_http (rms);
+	task = rspamd_task_new (session->worker, ctx->cfg, NULL,
+			ctx->lang_det, ctx->event_loop, FALSE);
+	task->sock = -1;
+	task->resolver = ctx->resolver;
+	task->fin_arg = rspamd_milter_session_ref (rms);
+	task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_MILTER;
+
+	if (rms->addr) {
+		task->client_addr = rspamd_inet_address_copy (rms->addr);
+	}
+
+	task->s = rspamd_session_create (task->task_pool, proxy_milter_early_fin,
+			NULL, (event_finalizer_t)rspamd_task_free, task);
+	/* Request headers of the task point to the message */
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_http_message_unref, msg);
+
+	if (!rspamd_protocol_handle_request (task, msg) ||
+			!rspamd_task_load_message (task, msg, "", 0)) {
+		msg_err_task ("cannot handle envelope: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+
+	if (ctx->cfg->task_timeout > 0) {
+		task->timeout_ev.data = task;
+		ev_timer_init (&task->timeout_ev, rspamd_task_timeout,
+				ctx->cfg->task_timeout, 0.0);
+		ev_timer_start (task->event_loop, &task->timeout_ev);
+	}
+
+	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+	rspamd_session_pending (task->s);
+}
+
 static void
 proxy_milter_error_handler (gint fd,
 		struct rspamd_milter_session *rms,
@@ -2225,6 +3033,7 @@ proxy_accept_socket (EV_P_ ev_io *w, int revents)
 				ctx->event_loop,
 				proxy_milter_finish_handler,
 				proxy_milter_error_handler,
+				ctx->early_checks ? proxy_milter_rcpt_handler : NULL,
 				session);
 	}
 }
@@ -2329,6 +3138,12 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 				ctx->event_loop);
 	}
 
+	if (ctx->early_checks && !(ctx->milter && ctx->has_self_scan)) {
+		msg_warn ("early checks require milter mode and self_scan, "
+				"disable them");
+		ctx->early_checks = FALSE;
+	}
+
 	ctx->milter_ctx.spam_header = ctx->spam_header;
 	ctx->milter_ctx.discard_on_reject = ctx->discard_on_reject;
 	ctx->milter_ctx.quarantine_on_reject = ctx->quarantine_on_reject;
@@ -2337,6 +3152,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 	ctx->milter_ctx.reject_message = ctx->reject_message;
 	ctx->milter_ctx.cfg = ctx->cfg;
 	rspamd_milter_init_library (&ctx->milter_ctx);
+	proxy_init_compression (ctx);
 
 	if (is_controller) {
 		rspamd_worker_init_controller (worker, NULL);
@@ -2367,6 +3183,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 		rspamd_controller_on_terminate (worker, NULL);
 	}
 
+	proxy_deinit_compression (ctx);
 	REF_RELEASE (ctx->cfg);
 	rspamd_log_close (worker->srv->logger);
 
@@ -22,6 +22,7 @@
 #include "libserver/maps/map.h"
 #include "libutil/upstream.h"
 #include "libserver/protocol.h"
+#include "libserver/protocol_internal.h"
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
 #include "libserver/dns.h"
@@ -33,6 +34,8 @@
 #include "worker_private.h"
 #include "libserver/http/http_private.h"
 #include "libserver/cfg_file_private.h"
+#include "libutil/libev_helper.h"
+#include "utlist.h"
 #include <math.h>
 #include "unix-std.h"
 
@@ -74,6 +77,43 @@ struct rspamd_worker_session {
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_worker *worker;
+	struct rspamd_io_ev sniff_ev;
+	/* Session waits for the next request on a keep-alive connection */
+	gboolean keepalive;
+};
+
+enum rspamd_worker_v3_state {
+	RSPAMD_WORKER_V3_READ_HEADER = 0,
+	RSPAMD_WORKER_V3_READ_DATA,
+	RSPAMD_WORKER_V3_PROCESS,
+	RSPAMD_WORKER_V3_WRITE_REPLY,
+};
+
+/* Initial size of a binary request buffer */
+#define RSPAMD_WORKER_V3_CHUNK (16 * 1024)
+
+/*
+ * Binary (v3) protocol session, unlike HTTP one, it can process many requests
+ * one after another, so it owns socket and address and outlives tasks
+ */
+struct rspamd_worker_v3_session {
+	gint fd;
+	enum rspamd_worker_v3_state state;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_worker *worker;
+	struct rspamd_task *task;
+	struct rspamd_io_ev ev;
+	struct rspamd_protocol_v3_request req;
+	guchar *data;
+	gsize data_len;
+	/* Allocated part of data, it grows as data actually arrives */
+	gsize data_alloc;
+	gsize pos;
+	rspamd_fstring_t *reply;
+	/* Request is being read or replied without a task, that counts itself */
+	gboolean active;
+	struct rspamd_worker_v3_session *prev, *next;
 };
 /*
  * Reduce number of tasks proceeded
@@ -102,6 +142,72 @@ reduce_tasks_count (gpointer arg)
 	}
 }
 
+static struct rspamd_task *
+rspamd_worker_new_task (struct rspamd_worker_ctx *ctx,
+	struct rspamd_worker *worker,
+	gboolean debug_mempool)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (worker, ctx->cfg, NULL, ctx->lang_det,
+			ctx->event_loop, debug_mempool);
+
+	/* Copy some variables */
+	if (ctx->is_mime) {
+		task->flags |= RSPAMD_TASK_FLAG_MIME;
+	}
+	else {
+		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+	}
+
+	task->worker = worker;
+	task->resolver = ctx->resolver;
+	/* TODO: allow to disable autolearn in protocol */
+	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
+
+	worker->nconns++;
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)reduce_tasks_count,
+			worker);
+
+	/* Set up async session */
+	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
+
+	return task;
+}
+
+static void
+rspamd_worker_start_task (struct rspamd_worker_ctx *ctx,
+	struct rspamd_task *task)
+{
+	/* Set global timeout for the task */
+	if (ctx->task_timeout > 0.0) {
+		task->timeout_ev.data = task;
+		ev_timer_init (&task->timeout_ev, rspamd_task_timeout,
+				ctx->task_timeout,
+				ctx->task_timeout);
+		ev_set_priority (&task->timeout_ev, EV_MAXPRI);
+		ev_timer_start (task->event_loop, &task->timeout_ev);
+	}
+
+	/*
+	 * Guard reads and drops any extra data, so it is not used for keep-alive
+	 * connections: the next pipelined request might be there
+	 */
+	if (task->sock != -1 && (task->http_conn == NULL ||
+			!rspamd_http_connection_is_keepalive (task->http_conn))) {
+		/* Set socket guard */
+		task->guard_ev.data = task;
+		ev_io_init (&task->guard_ev,
+				rspamd_worker_guard_handler,
+				task->sock, EV_READ);
+		ev_io_start (task->event_loop, &task->guard_ev);
+	}
+
+	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+}
+
 static gint
 rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
@@ -126,10 +232,7 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
-	task = rspamd_task_new (session->worker,
-			session->ctx->cfg, NULL, session->ctx->lang_det,
-			session->ctx->event_loop,
-			debug_mempool);
+	task = rspamd_worker_new_task (ctx, session->worker, debug_mempool);
 	session->task = task;
 
 	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
@@ -137,38 +240,16 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 			rspamd_inet_address_get_port (session->addr),
 			task);
 
-	/* Copy some variables */
-	if (ctx->is_mime) {
-		task->flags |= RSPAMD_TASK_FLAG_MIME;
-	}
-	else {
-		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
-	}
-
 	/* We actually transfer ownership from session to task here  */
 	task->sock = session->fd;
 	task->client_addr = session->addr;
-	task->worker = session->worker;
 	task->http_conn = session->http_conn;
 
-	task->resolver = ctx->resolver;
-	/* TODO: allow to disable autolearn in protocol */
-	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
-
-	session->worker->nconns++;
-	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t)reduce_tasks_count,
-			session->worker);
-
 	/* Session memory is also now handled by task */
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t)g_free,
 			session);
 
-	/* Set up async session */
-	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
-			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
-
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -185,24 +266,7 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
-	/* Set global timeout for the task */
-	if (ctx->task_timeout > 0.0) {
-		task->timeout_ev.data = task;
-		ev_timer_init (&task->timeout_ev, rspamd_task_timeout,
-				ctx->task_timeout,
-				ctx->task_timeout);
-		ev_set_priority (&task->timeout_ev, EV_MAXPRI);
-		ev_timer_start (task->event_loop, &task->timeout_ev);
-	}
-
-	/* Set socket guard */
-	task->guard_ev.data = task;
-	ev_io_init (&task->guard_ev,
-			rspamd_worker_guard_handler,
-			task->sock, EV_READ);
-	ev_io_start (task->event_loop, &task->guard_ev);
-
-	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+	rspamd_worker_start_task (ctx, task);
 
 	return 0;
 }
@@ -281,8 +345,14 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, error: %e",
-				rspamd_inet_address_to_string_pretty (session->addr), err);
+		if (session->keepalive) {
+			msg_debug ("closing keep-alive connection from: %s: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
+		else {
+			msg_info ("no data received from: %s, error: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
 		rspamd_http_connection_reset (session->http_conn);
 		rspamd_http_connection_unref (session->http_conn);
 		rspamd_inet_address_free (session->addr);
@@ -291,6 +361,37 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+/*
+ * Moves connection from a finished task to a new session that waits for the
+ * next request. Requests are processed one by one, so replies are written in
+ * the same order and pipelined data is not read until the current task is done.
+ */
+static void
+rspamd_worker_keepalive_session (struct rspamd_task *task)
+{
+	struct rspamd_worker_session *session;
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *)task->worker->ctx;
+
+	session = g_malloc0 (sizeof (*session));
+	session->magic = G_MAXINT64;
+	session->fd = task->sock;
+	session->addr = rspamd_inet_address_copy (task->client_addr);
+	session->ctx = ctx;
+	session->worker = task->worker;
+	session->http_conn = task->http_conn;
+	session->keepalive = TRUE;
+
+	/* Task must not close socket or free connection */
+	task->sock = -1;
+	task->http_conn = NULL;
+	rspamd_session_destroy (task->s);
+
+	rspamd_http_connection_reset (session->http_conn);
+	rspamd_http_connection_read_message (session->http_conn,
+			session,
+			ctx->timeout);
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -310,9 +411,18 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	if (task) {
 		if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 			/* We are done here */
-			msg_debug_task ("normally closing connection from: %s",
-					rspamd_inet_address_to_string (task->client_addr));
-			rspamd_session_destroy (task->s);
+			if (task->http_conn && task->sock != -1 &&
+					rspamd_http_connection_is_keepalive (task->http_conn) &&
+					task->worker->state == rspamd_worker_state_running) {
+				msg_debug_task ("keep connection from: %s",
+						rspamd_inet_address_to_string (task->client_addr));
+				rspamd_worker_keepalive_session (task);
+			}
+			else {
+				msg_debug_task ("normally closing connection from: %s",
+						rspamd_inet_address_to_string (task->client_addr));
+				rspamd_session_destroy (task->s);
+			}
 		}
 		else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
 			rspamd_session_pending (task->s);
@@ -320,8 +430,14 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, closing connection",
-				rspamd_inet_address_to_string_pretty (session->addr));
+		if (session->keepalive) {
+			msg_debug ("closing keep-alive connection from: %s",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
+		else {
+			msg_info ("no data received from: %s, closing connection",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
 		rspamd_inet_address_free (session->addr);
 		rspamd_http_connection_reset (session->http_conn);
 		rspamd_http_connection_unref (session->http_conn);
@@ -332,6 +448,500 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+static void rspamd_worker_v3_io (gint fd, short what, gpointer ud);
+
+static void
+rspamd_worker_v3_watch (struct rspamd_worker_v3_session *session, short what)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+
+	rspamd_ev_watcher_stop (ctx->event_loop, &session->ev);
+	rspamd_ev_watcher_init (&session->ev, session->fd, what,
+			rspamd_worker_v3_io, session);
+	rspamd_ev_watcher_start (ctx->event_loop, &session->ev, ctx->timeout);
+}
+
+static void
+rspamd_worker_v3_set_active (struct rspamd_worker_v3_session *session,
+		gboolean active)
+{
+	if (session->active != active) {
+		session->active = active;
+
+		if (active) {
+			session->worker->nconns ++;
+		}
+		else {
+			reduce_tasks_count (session->worker);
+		}
+	}
+}
+
+static void
+rspamd_worker_v3_session_free (struct rspamd_worker_v3_session *session)
+{
+	struct rspamd_task *task = session->task;
+
+	rspamd_ev_watcher_stop (session->ctx->event_loop, &session->ev);
+
+	if (task) {
+		session->task = NULL;
+		/* Session is gone, so nothing should be written anymore */
+		task->fin_callback = NULL;
+		task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+		rspamd_session_destroy (task->s);
+	}
+
+	if (session->reply) {
+		rspamd_fstring_free (session->reply);
+	}
+
+	g_free (session->data);
+	rspamd_inet_address_free (session->addr);
+	close (session->fd);
+	DL_DELETE (session->ctx->v3_sessions, session);
+	rspamd_worker_v3_set_active (session, FALSE);
+	g_free (session);
+}
+
+static gboolean
+rspamd_worker_v3_fin (struct rspamd_task *task, void *arg)
+{
+	struct rspamd_worker_v3_session *session =
+			(struct rspamd_worker_v3_session *)arg;
+	guint16 flags;
+
+	if (!(task->processed_stages & RSPAMD_TASK_STAGE_REPLIED)) {
+		flags = GUINT16_FROM_LE (session->req.flags);
+		session->reply = rspamd_protocol_v3_reply (task,
+				flags & RSPAMD_PROTOCOL_V3_REQUEST_NAMES);
+		task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+		session->state = RSPAMD_WORKER_V3_WRITE_REPLY;
+		session->pos = 0;
+		/* Task is destroyed when reply is written */
+		rspamd_worker_v3_watch (session, EV_WRITE);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_v3_process (struct rspamd_worker_v3_session *session)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+	struct rspamd_task *task;
+	guint32 fields_len;
+	guchar *data;
+
+	rspamd_ev_watcher_stop (ctx->event_loop, &session->ev);
+
+	if (session->req.cmd == RSPAMD_PROTOCOL_V3_CMD_SYMBOLS) {
+		/* No need to create a task */
+		g_free (session->data);
+		session->data = NULL;
+		session->reply = rspamd_protocol_v3_symbols_table (ctx->cfg);
+		session->state = RSPAMD_WORKER_V3_WRITE_REPLY;
+		session->pos = 0;
+		rspamd_worker_v3_watch (session, EV_WRITE);
+
+		return;
+	}
+
+	task = rspamd_worker_new_task (ctx, session->worker, FALSE);
+	session->task = task;
+	session->state = RSPAMD_WORKER_V3_PROCESS;
+	/* Task is counted in connections, so session should not be counted twice */
+	rspamd_worker_v3_set_active (session, FALSE);
+
+	msg_info_task ("accepted binary request from %s port %d, task ptr: %p",
+			rspamd_inet_address_to_string (session->addr),
+			rspamd_inet_address_get_port (session->addr),
+			task);
+
+	/* Socket and address are owned by session, as it can have more requests */
+	task->client_addr = rspamd_inet_address_copy (session->addr);
+	task->fin_callback = rspamd_worker_v3_fin;
+	task->fin_arg = session;
+
+	/* Request data is referred by the task, so it is now handled by task */
+	data = session->data;
+	session->data = NULL;
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_free,
+			data);
+	fields_len = GUINT32_FROM_LE (session->req.fields_len);
+
+	if (!rspamd_protocol_handle_v3_request (task, &session->req, data,
+			fields_len)) {
+		msg_err_task ("cannot handle request: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else {
+		if (task->cmd == CMD_PING) {
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+		else {
+			if (!rspamd_task_load_message (task, NULL, data + fields_len,
+					session->data_len - fields_len)) {
+				msg_err_task ("cannot load message: %e", task->err);
+				task->flags |= RSPAMD_TASK_FLAG_SKIP;
+			}
+		}
+	}
+
+	rspamd_worker_start_task (ctx, task);
+}
+
+static gboolean
+rspamd_worker_v3_check_header (struct rspamd_worker_v3_session *session)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+	const struct rspamd_protocol_v3_request *req = &session->req;
+	guint32 fields_len, body_len;
+	gsize max_body_len;
+
+	if (memcmp (req->magic, RSPAMD_PROTOCOL_V3_MAGIC,
+			sizeof (req->magic)) != 0 ||
+			req->version != RSPAMD_PROTOCOL_V3_VERSION) {
+		msg_info_ctx ("bad binary request from %s: invalid magic or version %d",
+				rspamd_inet_address_to_string_pretty (session->addr),
+				(gint)req->version);
+
+		return FALSE;
+	}
+
+	fields_len = GUINT32_FROM_LE (req->fields_len);
+	body_len = GUINT32_FROM_LE (req->body_len);
+	/* Body is read to memory before processing, so it is always limited */
+	max_body_len = ctx->cfg->max_message > 0 ?
+			ctx->cfg->max_message : DEFAULT_MAX_MESSAGE;
+
+	if (fields_len > RSPAMD_PROTOCOL_V3_MAX_FIELDS_LEN ||
+			body_len > max_body_len) {
+		msg_info_ctx ("bad binary request from %s: too large: "
+				"%ud fields length, %ud body length",
+				rspamd_inet_address_to_string_pretty (session->addr),
+				fields_len, body_len);
+
+		return FALSE;
+	}
+
+	session->data_len = (gsize)fields_len + body_len;
+	/*
+	 * Lengths are not trusted, so the buffer grows when data arrives;
+	 * one more byte is allocated to have a valid pointer for empty requests
+	 */
+	session->data_alloc = MIN (session->data_len, RSPAMD_WORKER_V3_CHUNK);
+	session->data = g_malloc (session->data_alloc + 1);
+	session->pos = 0;
+	session->state = RSPAMD_WORKER_V3_READ_DATA;
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_v3_read (struct rspamd_worker_v3_session *session)
+{
+	guchar *dst;
+	gsize want;
+	gssize r;
+
+	for (;;) {
+		if (session->state == RSPAMD_WORKER_V3_READ_HEADER) {
+			dst = ((guchar *)&session->req) + session->pos;
+			want = sizeof (session->req) - session->pos;
+		}
+		else {
+			if (session->pos == session->data_alloc &&
+					session->data_alloc < session->data_len) {
+				session->data_alloc = MIN (session->data_len,
+						session->data_alloc * 2);
+				session->data = g_realloc (session->data,
+						session->data_alloc + 1);
+			}
+
+			dst = session->data + session->pos;
+			want = session->data_alloc - session->pos;
+		}
+
+		if (session->state == RSPAMD_WORKER_V3_READ_HEADER &&
+				session->pos == 0 &&
+				session->worker->state != rspamd_worker_state_running) {
+			/* Do not start new requests when terminating */
+			rspamd_worker_v3_session_free (session);
+
+			return;
+		}
+
+		if (want > 0) {
+			/* We read exactly one request, so the next one is left in socket */
+			r = read (session->fd, dst, want);
+
+			if (r == -1) {
+				if (errno == EAGAIN || errno == EINTR) {
+					return;
+				}
+
+				msg_info ("cannot read binary request from %s: %s",
+						rspamd_inet_address_to_string_pretty (session->addr),
+						strerror (errno));
+				rspamd_worker_v3_session_free (session);
+
+				return;
+			}
+			else if (r == 0) {
+				if (session->state != RSPAMD_WORKER_V3_READ_HEADER ||
+						session->pos != 0) {
+					msg_info ("truncated binary request from %s",
+							rspamd_inet_address_to_string_pretty (session->addr));
+				}
+
+				rspamd_worker_v3_session_free (session);
+
+				return;
+			}
+
+			session->pos += r;
+			rspamd_worker_v3_set_active (session, TRUE);
+
+			if ((gsize)r < want) {
+				continue;
+			}
+
+			if (session->state == RSPAMD_WORKER_V3_READ_DATA &&
+					session->pos < session->data_len) {
+				/* Buffer is full, grow it and read more */
+				continue;
+			}
+		}
+
+		if (session->state == RSPAMD_WORKER_V3_READ_HEADER) {
+			if (!rspamd_worker_v3_check_header (session)) {
+				rspamd_worker_v3_session_free (session);
+
+				return;
+			}
+		}
+		else {
+			rspamd_worker_v3_process (session);
+
+			return;
+		}
+	}
+}
+
+static void
+rspamd_worker_v3_write (struct rspamd_worker_v3_session *session)
+{
+	struct rspamd_task *task;
+	gssize r;
+
+	r = write (session->fd, session->reply->str + session->pos,
+			session->reply->len - session->pos);
+
+	if (r == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return;
+		}
+
+		msg_info ("cannot write binary reply to %s: %s",
+				rspamd_inet_address_to_string_pretty (session->addr),
+				strerror (errno));
+		rspamd_worker_v3_session_free (session);
+
+		return;
+	}
+
+	session->pos += r;
+
+	if (session->pos < session->reply->len) {
+		return;
+	}
+
+	rspamd_fstring_free (session->reply);
+	session->reply = NULL;
+
+	if (session->task) {
+		task = session->task;
+		session->task = NULL;
+		rspamd_session_destroy (task->s);
+	}
+
+	rspamd_worker_v3_set_active (session, FALSE);
+
+	if (session->worker->state != rspamd_worker_state_running) {
+		rspamd_worker_v3_session_free (session);
+
+		return;
+	}
+
+	/* Wait for the next request on the same connection */
+	memset (&session->req, 0, sizeof (session->req));
+	session->state = RSPAMD_WORKER_V3_READ_HEADER;
+	session->pos = 0;
+	rspamd_worker_v3_watch (session, EV_READ);
+}
+
+static void
+rspamd_worker_v3_io (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_v3_session *session =
+			(struct rspamd_worker_v3_session *)ud;
+
+	if (what == EV_TIMER) {
+		if (session->state != RSPAMD_WORKER_V3_READ_HEADER || session->pos != 0) {
+			msg_info ("timeout on binary connection from %s",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
+
+		rspamd_worker_v3_session_free (session);
+
+		return;
+	}
+
+	switch (session->state) {
+	case RSPAMD_WORKER_V3_READ_HEADER:
+	case RSPAMD_WORKER_V3_READ_DATA:
+		rspamd_worker_v3_read (session);
+		break;
+	case RSPAMD_WORKER_V3_WRITE_REPLY:
+		rspamd_worker_v3_write (session);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+rspamd_worker_start_http (struct rspamd_worker_session *session, gint http_opts)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+
+	if (ctx->keepalive) {
+		http_opts |= RSPAMD_HTTP_SERVER_KEEP_ALIVE;
+	}
+
+	session->http_conn = rspamd_http_connection_new_server (
+			ctx->http_ctx,
+			session->fd,
+			rspamd_worker_body_handler,
+			rspamd_worker_error_handler,
+			rspamd_worker_finish_handler,
+			http_opts);
+
+	rspamd_http_connection_set_max_size (session->http_conn,
+			ctx->cfg->max_message);
+
+	if (ctx->key) {
+		rspamd_http_connection_set_key (session->http_conn, ctx->key);
+	}
+
+	rspamd_http_connection_read_message (session->http_conn,
+			session,
+			ctx->timeout);
+}
+
+static void
+rspamd_worker_start_v3 (struct rspamd_worker_session *http_session)
+{
+	struct rspamd_worker_v3_session *session;
+
+	session = g_malloc0 (sizeof (*session));
+	session->fd = http_session->fd;
+	session->addr = http_session->addr;
+	session->ctx = http_session->ctx;
+	session->worker = http_session->worker;
+	session->state = RSPAMD_WORKER_V3_READ_HEADER;
+	DL_APPEND (session->ctx->v3_sessions, session);
+	g_free (http_session);
+
+	rspamd_worker_v3_watch (session, EV_READ);
+}
+
+/*
+ * Closes binary connections waiting for the next request, as they would
+ * otherwise be kept open until timeout by clients on shutdown
+ */
+static gboolean
+rspamd_worker_v3_stop_handler (struct rspamd_worker_signal_handler *sigh,
+		void *arg)
+{
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *)arg;
+	struct rspamd_worker_v3_session *session, *tmp;
+
+	DL_FOREACH_SAFE (ctx->v3_sessions, session, tmp) {
+		if (session->state == RSPAMD_WORKER_V3_READ_HEADER &&
+				session->pos == 0 && !session->active) {
+			rspamd_worker_v3_session_free (session);
+		}
+	}
+
+	/* No more signals */
+	return FALSE;
+}
+
+/*
+ * Checks the first bytes of a connection to choose between HTTP and binary
+ * protocol. Data is peeked, so it is left for the selected protocol handler.
+ */
+static void
+rspamd_worker_sniff_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_session *session = (struct rspamd_worker_session *)ud;
+	struct rspamd_worker_ctx *ctx = session->ctx;
+	guchar magic[RSPAMD_PROTOCOL_V3_MAGIC_LEN];
+	gssize r;
+
+	if (what == EV_TIMER) {
+		msg_info ("no data received from: %s, closing connection",
+				rspamd_inet_address_to_string_pretty (session->addr));
+		goto err;
+	}
+
+	r = recv (fd, magic, sizeof (magic), MSG_PEEK);
+
+	if (r == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return;
+		}
+
+		msg_info ("cannot read from: %s: %s",
+				rspamd_inet_address_to_string_pretty (session->addr),
+				strerror (errno));
+		goto err;
+	}
+	else if (r == 0) {
+		goto err;
+	}
+
+	if ((gsize)r < sizeof (magic) &&
+			memcmp (magic, RSPAMD_PROTOCOL_V3_MAGIC, r) == 0) {
+		/*
+		 * Wait for the rest of magic, it cannot be HTTP anyway (no method
+		 * starts with "RS"), so this is practically a single byte case
+		 */
+		return;
+	}
+
+	rspamd_ev_watcher_stop (ctx->event_loop, &session->sniff_ev);
+
+	if ((gsize)r == sizeof (magic) &&
+			memcmp (magic, RSPAMD_PROTOCOL_V3_MAGIC, sizeof (magic)) == 0) {
+		rspamd_worker_start_v3 (session);
+	}
+	else {
+		rspamd_worker_start_http (session, 0);
+	}
+
+	return;
+
+err:
+	rspamd_ev_watcher_stop (ctx->event_loop, &session->sniff_ev);
+	rspamd_inet_address_free (session->addr);
+	close (session->fd);
+	g_free (session);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -375,25 +985,18 @@ accept_socket (EV_P_ ev_io *w, int revents)
 		http_opts = RSPAMD_HTTP_REQUIRE_ENCRYPTION;
 	}
 
-	session->http_conn = rspamd_http_connection_new_server (
-			ctx->http_ctx,
-			nfd,
-			rspamd_worker_body_handler,
-			rspamd_worker_error_handler,
-			rspamd_worker_finish_handler,
-			http_opts);
-
 	worker->srv->stat->connections_count++;
-	rspamd_http_connection_set_max_size (session->http_conn,
-			ctx->cfg->max_message);
 
-	if (ctx->key) {
-		rspamd_http_connection_set_key (session->http_conn, ctx->key);
+	if (ctx->binary_protocol && http_opts == 0) {
+		/* Binary protocol is not encrypted, so it is not allowed otherwise */
+		rspamd_ev_watcher_init (&session->sniff_ev, nfd, EV_READ,
+				rspamd_worker_sniff_handler, session);
+		rspamd_ev_watcher_start (ctx->event_loop, &session->sniff_ev,
+				ctx->timeout);
+	}
+	else {
+		rspamd_worker_start_http (session, http_opts);
 	}
-
-	rspamd_http_connection_read_message (session->http_conn,
-			session,
-			ctx->timeout);
 }
 
 gpointer
@@ -461,6 +1064,25 @@ init_worker (struct rspamd_config *cfg)
 			RSPAMD_CL_FLAG_INT_32,
 			"Maximum count of parallel tasks processed by a single worker process");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"binary_protocol",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, binary_protocol),
+			0,
+			"Accept binary (v3) scan protocol alongside HTTP");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive),
+			0,
+			"Allow HTTP keep-alive and pipelined requests, idle connections are "
+			"closed after `timeout`");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"keypair",
@@ -486,6 +1108,18 @@ start_worker (struct rspamd_worker *worker)
 	g_assert (rspamd_worker_check_context (worker->ctx, rspamd_worker_magic));
 	ctx->cfg = worker->srv->cfg;
 	ctx->event_loop = rspamd_prepare_worker (worker, "normal", accept_socket);
+
+	if (ctx->binary_protocol) {
+		/* Called after the default handlers that stop accepting */
+		rspamd_worker_set_signal_handler (SIGTERM, worker, ctx->event_loop,
+				rspamd_worker_v3_stop_handler, ctx);
+		rspamd_worker_set_signal_handler (SIGINT, worker, ctx->event_loop,
+				rspamd_worker_v3_stop_handler, ctx);
+		rspamd_worker_set_signal_handler (SIGHUP, worker, ctx->event_loop,
+				rspamd_worker_v3_stop_handler, ctx);
+		rspamd_worker_set_signal_handler (SIGUSR2, worker, ctx->event_loop,
+				rspamd_worker_v3_stop_handler, ctx);
+	}
 	rspamd_symcache_start_refresh (worker->srv->cfg->cache, ctx->event_loop,
 			worker);
 
@@ -30,6 +30,7 @@ extern "C" {
 static const guint64 rspamd_worker_magic = 0xb48abc69d601dc1dULL;
 
 struct rspamd_lang_detector;
+struct rspamd_worker_v3_session;
 
 struct rspamd_worker_ctx {
 	guint64 magic;
@@ -55,6 +56,12 @@ struct rspamd_worker_ctx {
 	struct rspamd_http_context *http_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Accept binary (v3) protocol alongside HTTP */
+	gboolean binary_protocol;
+	/* Allow HTTP keep-alive and pipelined requests */
+	gboolean keepalive;
+	/* Binary protocol connections, idle ones are closed on shutdown */
+	struct rspamd_worker_v3_session *v3_sessions;
 };
 
 /*
@@ -11,6 +11,7 @@ import sys
 import tempfile
 import json
 import stat
+import struct
 from robot.libraries.BuiltIn import BuiltIn
 from robot.api import logger
 
@@ -152,6 +153,87 @@ def rspamc(addr, port, filename):
     r = s.recv(2048)
     return r.decode('utf-8')
 
+def _v3_request(cmd, body=b'', version=3, body_len=None):
+    if body_len is None:
+        body_len = len(body)
+    return struct.pack('<4sBBHII', b'RSP3', version, cmd, 0, 0, body_len) + body
+
+def _v3_recv(s, size):
+    res = b''
+    while len(res) < size:
+        chunk = s.recv(size - len(res))
+        if not chunk:
+            return None
+        res += chunk
+    return res
+
+def _v3_reply(s):
+    hdr = _v3_recv(s, 40)
+    if hdr is None:
+        return None
+    (magic, version, flags, action, table_id, nsymbols, extra_len,
+        settings_id, score, required_score) = struct.unpack('<4sBBHIIIIdd', hdr)
+    if magic != b'RSP3' or version != 3:
+        raise Exception('bad v3 reply header: %r' % hdr)
+    ids = []
+    for i in range(nsymbols):
+        ids.append(struct.unpack('<If', _v3_recv(s, 8))[0])
+    names = []
+    if flags & 8:
+        for i in range(nsymbols):
+            nlen = struct.unpack('<H', _v3_recv(s, 2))[0]
+            names.append(_v3_recv(s, nlen).decode('utf-8'))
+    _v3_recv(s, extra_len)
+    return {'flags': flags, 'table_id': table_id, 'ids': ids, 'names': names}
+
+def _v3_connect(addr, port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.settimeout(10)
+    s.connect((addr, port))
+    return s
+
+def v3_ping(addr, port, count):
+    """Sends `count` pipelined binary PING requests over one connection,
+    returns the number of replies"""
+    s = _v3_connect(addr, port)
+    s.sendall(_v3_request(2) * int(count))
+    replies = 0
+    for i in range(int(count)):
+        if _v3_reply(s) is None:
+            break
+        replies += 1
+    s.close()
+    return replies
+
+def v3_bad_request(addr, port, version, body_len):
+    """Returns True if rspamd closes a binary connection without a reply"""
+    s = _v3_connect(addr, port)
+    s.sendall(_v3_request(2, version=int(version), body_len=int(body_len)))
+    try:
+        res = s.recv(64)
+    except socket.error:
+        res = b''
+    s.close()
+    return len(res) == 0
+
+def v3_scan_symbols(addr, port, filename):
+    """Fetches the binary symbols table and scans a message with the binary
+    protocol, returns names of the symbols found"""
+    s = _v3_connect(addr, port)
+    s.sendall(_v3_request(1))
+    table = _v3_reply(s)
+    if table['ids'] != list(range(len(table['ids']))):
+        raise Exception('symbols ids are not dense: %r' % table['ids'])
+    if len(set(table['names'])) != len(table['names']):
+        raise Exception('symbols names are not unique')
+    goo = open(filename, 'rb').read()
+    s.sendall(_v3_request(0, goo))
+    reply = _v3_reply(s)
+    s.close()
+    if reply['table_id'] != table['table_id']:
+        raise Exception('symbols table has changed')
+    return [table['names'][i] for i in reply['ids'] if i < len(table['names'])]
+
 def scan_file(addr, port, filename):
     return str(urlopen("http://%s:%s/symbols?file=%s" % (addr, port, filename)).read())
 
@@ -15,4 +15,230 @@ function exports.init_url_parser(file)
   ffi.C.rspamd_url_init(file)
 end
 
+-- In-memory redis emulation to run redis scripts in tests, it supports
+-- only commands that are used by our scripts
+function exports.redis_mock()
+  local mock = {
+    data = {}, -- key -> {type = 'hash'|'set'|'zset'|'string', value = {}}
+    written = false,
+  }
+
+  local function get(key, tp)
+    local elt = mock.data[key]
+
+    if elt and elt.type ~= tp then
+      error('WRONGTYPE Operation against a key holding the wrong kind of value')
+    end
+
+    return elt
+  end
+
+  local function get_or_create(key, tp)
+    local elt = get(key, tp)
+
+    if not elt then
+      elt = {type = tp, value = {}}
+      mock.data[key] = elt
+    end
+
+    mock.written = true
+
+    return elt
+  end
+
+  local function sorted_keys(t)
+    local res = {}
+    for k,_ in pairs(t) do table.insert(res, k) end
+    table.sort(res, function(a, b)
+      if type(a) == type(b) then return a < b end
+      return tostring(a) < tostring(b)
+    end)
+    return res
+  end
+
+  local function zscore_lim(lim)
+    if lim == '-inf' then return -math.huge end
+    if lim == '+inf' then return math.huge end
+    return tonumber(lim)
+  end
+
+  local commands = {}
+
+  commands.TYPE = function(k)
+    local elt = mock.data[k]
+    return {ok = elt and elt.type or 'none'}
+  end
+  commands.SCAN = function(_, _, pattern)
+    local lpat = '^' .. pattern:gsub('[%^%$%(%)%%%.%[%]%+%-%?]', '%%%0')
+        :gsub('%*', '.*') .. '$'
+    local res = {}
+    for _,k in ipairs(sorted_keys(mock.data)) do
+      if k:match(lpat) then table.insert(res, k) end
+    end
+    return {'0', res}
+  end
+  commands.SET = function(k, v, ...)
+    local args = {...}
+    for _,a in ipairs(args) do
+      if a == 'NX' and mock.data[k] then return false end
+    end
+    mock.data[k] = {type = 'string', value = tostring(v)}
+    mock.written = true
+    return {ok = 'OK'}
+  end
+  commands.DEL = function(...)
+    local n = 0
+    for _,k in ipairs({...}) do
+      if mock.data[k] then
+        mock.data[k] = nil
+        n = n + 1
+      end
+    end
+    mock.written = true
+    return n
+  end
+  commands.HMGET = function(k, ...)
+    local elt = get(k, 'hash')
+    local res = {}
+    for i,f in ipairs({...}) do
+      res[i] = elt and elt.value[f] or false
+    end
+    return res
+  end
+  commands.HGET = function(k, f)
+    return commands.HMGET(k, f)[1]
+  end
+  commands.HSET = function(k, ...)
+    local elt = get_or_create(k, 'hash')
+    local args = {...}
+    for i = 1,#args,2 do
+      elt.value[args[i]] = tostring(args[i + 1])
+    end
+    return 1
+  end
+  commands.HINCRBY = function(k, f, incr)
+    local elt = get_or_create(k, 'hash')
+    local v = (tonumber(elt.value[f]) or 0) + tonumber(incr)
+    elt.value[f] = tostring(v)
+    return v
+  end
+  commands.SADD = function(k, ...)
+    local elt = get_or_create(k, 'set')
+    local n = 0
+    for _,m in ipairs({...}) do
+      m = tostring(m)
+      if not elt.value[m] then
+        elt.value[m] = true
+        n = n + 1
+      end
+    end
+    return n
+  end
+  commands.SCARD = function(k)
+    local elt = get(k, 'set')
+    if not elt then return 0 end
+    return #sorted_keys(elt.value)
+  end
+  commands.SPOP = function(k, count)
+    local elt = get(k, 'set')
+    local res = {}
+    if not elt then return res end
+    for _,m in ipairs(sorted_keys(elt.value)) do
+      if #res >= tonumber(count) then break end
+      elt.value[m] = nil
+      table.insert(res, m)
+    end
+    mock.written = true
+    if not next(elt.value) then mock.data[k] = nil end
+    return res
+  end
+  commands.ZADD = function(k, score, m)
+    local elt = get_or_create(k, 'zset')
+    local existed = elt.value[tostring(m)] ~= nil
+    elt.value[tostring(m)] = tonumber(score)
+    return existed and 0 or 1
+  end
+  commands.ZREM = function(k, m)
+    local elt = get(k, 'zset')
+    mock.written = true
+    if elt and elt.value[tostring(m)] then
+      elt.value[tostring(m)] = nil
+      if not next(elt.value) then mock.data[k] = nil end
+      return 1
+    end
+    return 0
+  end
+  local function zrange(k, min, max)
+    local elt = get(k, 'zset')
+    local res = {}
+    if not elt then return res end
+    for _,m in ipairs(sorted_keys(elt.value)) do
+      local s = elt.value[m]
+      if s >= zscore_lim(min) and s <= zscore_lim(max) then
+        table.insert(res, {m, s})
+      end
+    end
+    table.sort(res, function(a, b) return a[2] < b[2] end)
+    return res
+  end
+  commands.ZRANGEBYSCORE = function(k, min, max, _, offset, count)
+    local res = {}
+    for i,e in ipairs(zrange(k, min, max)) do
+      if i > (tonumber(offset) or 0) and
+          (not count or #res < tonumber(count)) then
+        table.insert(res, e[1])
+      end
+    end
+    return res
+  end
+  commands.ZCOUNT = function(k, min, max)
+    return #zrange(k, min, max)
+  end
+
+  function mock.call(cmd, ...)
+    local f = commands[string.upper(cmd)]
+    if not f then
+      error('unsupported redis command: ' .. cmd)
+    end
+    return f(...)
+  end
+
+  -- Runs a script like EVAL does, `replicate_commands` fails after writes
+  -- like in Redis before 5.0
+  function mock.eval(script, keys, argv)
+    local env = {
+      KEYS = keys or {},
+      ARGV = argv or {},
+      redis = {
+        call = mock.call,
+        replicate_commands = function()
+          if mock.written then
+            error('ERR replicate_commands() must be called before any write')
+          end
+          return true
+        end,
+      },
+      tonumber = tonumber, tostring = tostring, type = type,
+      ipairs = ipairs, pairs = pairs, next = next,
+      string = string, table = table, math = math,
+    }
+    local f, err
+
+    if setfenv then
+      f, err = loadstring(script)
+      if f then setfenv(f, env) end
+    else
+      f, err = load(script, 'script', 't', env)
+    end
+
+    if not f then error(err) end
+
+    mock.written = false
+
+    return f()
+  end
+
+  return mock
+end
+
 return exports
\ No newline at end of file
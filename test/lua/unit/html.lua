@@ -128,4 +128,95 @@ context("HTML processing", function()
           c[2], t))
     end
   end)
+
+  test("Streaming mode is the same as full mode", function()
+    local ffi = require("ffi")
+
+    ffi.cdef[[
+    struct rspamd_test_html_content {
+      void *base_url;
+      void *html_tags;
+      int flags;
+      unsigned int total_tags;
+      uint32_t bgcolor;
+      int bgcolor_valid;
+      unsigned char *tags_seen;
+      unsigned int *tags_count;
+      unsigned int max_depth;
+      void *images;
+      void *blocks;
+      void *parsed;
+    };
+    struct rspamd_test_byte_array {
+      unsigned char *data;
+      unsigned int len;
+    };
+    void * rspamd_mempool_new_ (size_t sz, const char *name, int flags, const char *strloc);
+    void rspamd_mempool_delete (void *pool);
+    struct rspamd_test_byte_array *g_byte_array_new (void);
+    struct rspamd_test_byte_array *g_byte_array_append (
+      struct rspamd_test_byte_array *arr, const char *data, unsigned int len);
+    unsigned char *g_byte_array_free (struct rspamd_test_byte_array *arr, int free_segment);
+    unsigned int g_list_length (void *list);
+    struct rspamd_test_byte_array *rspamd_html_process_part_full (void *pool,
+      struct rspamd_test_html_content *hc, struct rspamd_test_byte_array *in,
+      void **exceptions, void *urls, void *emails);
+    struct rspamd_test_byte_array *rspamd_html_process_part_stream (void *pool,
+      struct rspamd_test_html_content *hc, struct rspamd_test_byte_array *in,
+      void **exceptions, void *urls, void *emails);
+    ]]
+
+    -- RSPAMD_HTML_FLAG_STREAMING
+    local streaming_flag = 256
+
+    local function process(html, func)
+      local pool = ffi.C.rspamd_mempool_new_(4096, "lua", 0, "html.lua")
+      local hc = ffi.new('struct rspamd_test_html_content')
+      local exceptions = ffi.new('void *[1]')
+      local input = ffi.C.g_byte_array_append(ffi.C.g_byte_array_new(),
+          html, #html)
+      local out = func(pool, hc, input, exceptions, nil, nil)
+      local res = {
+        text = ffi.string(out.data, out.len),
+        flags = bit.band(hc.flags, bit.bnot(streaming_flag)),
+        streaming = bit.band(hc.flags, streaming_flag) ~= 0,
+        total = hc.total_tags,
+        exceptions = ffi.C.g_list_length(exceptions[0]),
+      }
+
+      ffi.C.g_byte_array_free(out, 1)
+      ffi.C.g_byte_array_free(input, 1)
+      ffi.C.rspamd_mempool_delete(pool)
+
+      return res
+    end
+
+    local cases = {
+      -- Inline, block and unknown tags are counted the same way
+      {[[<html><body><p>a <b>b</b> <span>c</span> <foo>d</foo></p>
+<div><i>e</i><br>f</div></body></html>]], 0},
+      -- Unbalanced
+      {[[<html><body><div><p>a</div></table>b</p></body></html>]], 0},
+      -- Ignored content
+      {[[<html><head><title>t</title><style>p {}</style></head>
+<body>text</body></html>]], 0},
+      -- Nested <a>, displayed url of the first one is checked
+      {[[<html><body>Hello <a href="http://example.com/">http://example.net/]] ..
+       [[<a href="http://example.org/">text</a></body></html>]], 1},
+      -- Displayed url of a closed <a>
+      {[[<html><body>Hello <a href="http://example.com/">http://example.net/</a>]] ..
+       [[ and <a href="http://example.org/">text</a></body></html>]], 1},
+    }
+
+    for i,c in ipairs(cases) do
+      local full = process(c[1], ffi.C.rspamd_html_process_part_full)
+      local stream = process(c[1], ffi.C.rspamd_html_process_part_stream)
+
+      assert_false(full.streaming)
+      assert_true(stream.streaming)
+      full.streaming, stream.streaming = nil, nil
+      assert_rspamd_table_eq({expect = full, actual = stream})
+      assert_equal(c[2], stream.exceptions, 'case ' .. tostring(i))
+    end
+  end)
 end)
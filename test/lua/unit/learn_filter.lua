@@ -0,0 +1,115 @@
+-- Local learn filter tests
+
+context("Learn filter", function()
+  local ffi = require("ffi")
+
+  ffi.cdef[[
+  struct rspamd_learn_filter_hdr {
+    char magic[8];
+    unsigned int nbuckets;
+    int lock;
+    unsigned int flags;
+    unsigned int count;
+    uint64_t pending;
+  };
+  struct rspamd_learn_filter {
+    struct rspamd_learn_filter_hdr *hdr;
+  };
+  typedef int (*rspamd_learn_filter_seed_cb) (struct rspamd_learn_filter *flt,
+    void *ud);
+  struct rspamd_learn_filter *rspamd_learn_filter_open (const char *path,
+    size_t nelts, void **err);
+  int rspamd_learn_filter_check (struct rspamd_learn_filter *flt,
+    const unsigned char *digest);
+  void rspamd_learn_filter_add (struct rspamd_learn_filter *flt,
+    const unsigned char *digest, int is_spam);
+  int rspamd_learn_filter_seed (struct rspamd_learn_filter *flt,
+    rspamd_learn_filter_seed_cb cb, void *ud);
+  void rspamd_learn_filter_close (struct rspamd_learn_filter *flt);
+  ]]
+
+  local path = '/tmp/rspamd_unit_test_learn_filter.flt'
+
+  local function digest(i)
+    local d = ffi.new('unsigned char[64]')
+    d[0] = i % 256
+    d[1] = math.floor(i / 256) % 256
+    d[6] = (i * 7) % 256
+    d[7] = (i * 13) % 256
+    return d
+  end
+
+  local function open_seeded(learned)
+    os.remove(path)
+    local flt = ffi.C.rspamd_learn_filter_open(path, 4096, nil)
+    assert_not_nil(flt)
+    local cb = ffi.cast('rspamd_learn_filter_seed_cb', function(f)
+      for i,is_spam in pairs(learned) do
+        ffi.C.rspamd_learn_filter_add(f, digest(i), is_spam and 1 or 0)
+      end
+      return 1
+    end)
+    assert_equal(ffi.C.rspamd_learn_filter_seed(flt, cb, nil), 1)
+    cb:free()
+    return flt
+  end
+
+  test("New filter is not trusted until seeded", function()
+    os.remove(path)
+    local flt = ffi.C.rspamd_learn_filter_open(path, 4096, nil)
+    assert_not_nil(flt)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(1)), -1)
+
+    local cb = ffi.cast('rspamd_learn_filter_seed_cb', function() return 0 end)
+    assert_equal(ffi.C.rspamd_learn_filter_seed(flt, cb, nil), 0)
+    cb:free()
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(1)), -1)
+    ffi.C.rspamd_learn_filter_close(flt)
+    os.remove(path)
+  end)
+
+  test("Seeded filter knows cached learns", function()
+    local flt = open_seeded({[1] = true, [2] = false})
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(1)), 1)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(2)), 2)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(3)), 0)
+    ffi.C.rspamd_learn_filter_close(flt)
+
+    -- Seeding state is persistent
+    flt = ffi.C.rspamd_learn_filter_open(path, 0, nil)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(1)), 1)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(3)), 0)
+    ffi.C.rspamd_learn_filter_close(flt)
+    os.remove(path)
+  end)
+
+  test("Lock of a dead process is taken over", function()
+    local flt = open_seeded({[1] = true})
+    -- Larger than any pid_max
+    flt.hdr.lock = 0x7ffffff0
+    ffi.C.rspamd_learn_filter_add(flt, digest(5), 0)
+    assert_equal(flt.hdr.lock, 0)
+    assert_equal(flt.hdr.flags, 0)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(5)), 2)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(3)), 0)
+    ffi.C.rspamd_learn_filter_close(flt)
+    os.remove(path)
+  end)
+
+  test("Busy lock does not spoil the shared filter", function()
+    local flt = open_seeded({[1] = true})
+    -- init is always alive
+    flt.hdr.lock = 1
+    ffi.C.rspamd_learn_filter_add(flt, digest(5), 0)
+    flt.hdr.lock = 0
+    assert_equal(flt.hdr.flags, 0)
+    -- This process has lost a learn, so it cannot give negative answers
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(3)), -1)
+    ffi.C.rspamd_learn_filter_close(flt)
+
+    flt = ffi.C.rspamd_learn_filter_open(path, 0, nil)
+    assert_equal(ffi.C.rspamd_learn_filter_check(flt, digest(3)), 0)
+    ffi.C.rspamd_learn_filter_close(flt)
+    os.remove(path)
+  end)
+end)
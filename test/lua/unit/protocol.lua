@@ -0,0 +1,107 @@
+-- Scan reply writers
+
+context("Protocol reply", function()
+  local ffi = require "ffi"
+  local ucl = require "ucl"
+  local rspamd_task = require "rspamd_task"
+  local unpack = table.unpack or unpack
+
+  ffi.cdef[[
+  typedef struct f_str_s {
+    size_t len;
+    size_t allocated;
+    char str[];
+  } rspamd_fstring_t;
+  rspamd_fstring_t *rspamd_fstring_new (void);
+  void rspamd_fstring_free (rspamd_fstring_t *str);
+  void *rspamd_protocol_write_ucl (void *task, int flags);
+  void rspamd_protocol_write_json (void *task, int flags, rspamd_fstring_t **out);
+  void rspamd_ucl_emit_fstring_comments (const void *obj, int emit_type,
+    rspamd_fstring_t **target, const void *comments);
+  void ucl_object_unref (void *obj);
+  ]]
+
+  -- RSPAMD_PROTOCOL_DEFAULT | RSPAMD_PROTOCOL_URLS
+  local flags = 0x7f
+  -- UCL_EMIT_JSON_COMPACT
+  local emit_json_compact = 1
+
+  local function fstring_result(fstr)
+    local res = ffi.string(fstr[0].str, fstr[0].len)
+    ffi.C.rspamd_fstring_free(fstr[0])
+    return res
+  end
+
+  local function ucl_reply(task)
+    local obj = ffi.C.rspamd_protocol_write_ucl(task:topointer(), flags)
+    local fstr = ffi.new('rspamd_fstring_t *[1]', ffi.C.rspamd_fstring_new())
+    ffi.C.rspamd_ucl_emit_fstring_comments(obj, emit_json_compact, fstr, nil)
+    ffi.C.ucl_object_unref(obj)
+    return fstring_result(fstr)
+  end
+
+  local function json_reply(task)
+    local fstr = ffi.new('rspamd_fstring_t *[1]', ffi.C.rspamd_fstring_new())
+    ffi.C.rspamd_protocol_write_json(task:topointer(), flags, fstr)
+    return fstring_result(fstr)
+  end
+
+  local function parse(str)
+    local parser = ucl.parser()
+    local res, err = parser:parse_string(str)
+    assert_true(res, err)
+    return parser:get_object()
+  end
+
+  local msg = [[
+From: <sender@example.com>
+To: <nobody@example.com>
+Subject: test
+Message-ID: <"quoted"\id@example.com>
+Content-Type: text/plain
+
+Test http://example.com/path?a=1&b="2" and https://пример.рф/
+and mail user@example.net
+]]
+
+  local cases = {
+    {'no symbols', {}},
+    {'symbols', {
+      {'TEST_SYMBOL', 1.0},
+      {'TEST_SYMBOL_OPTS', 0.5, 'opt1', 'opt "2"', 'back\\slash'},
+      {'TEST_SYMBOL_CTRL', -2.25, 'tab\there', 'nl\nthere', '\1\31'},
+      {'TEST_SYMBOL_UTF', 1e-3, 'юникод', '\226\128\168'},
+      {'TEST_SYMBOL_BIG', 1e10, string.rep('x', 1000)},
+    }},
+  }
+
+  for _,c in ipairs(cases) do
+    test("JSON writer is the same as UCL: " .. c[1], function()
+      local res,task = rspamd_task.load_from_string(msg, rspamd_config)
+      assert_true(res, "failed to load message")
+      task:process_message()
+
+      for _,sym in ipairs(c[2]) do
+        task:insert_result(sym[1], sym[2], unpack(sym, 3))
+      end
+
+      local ucl_str = ucl_reply(task)
+      local json_str = json_reply(task)
+
+      -- Time is different for each reply
+      local ucl_obj, json_obj = parse(ucl_str), parse(json_str)
+      ucl_obj.time_real = nil
+      json_obj.time_real = nil
+      ucl_obj.time_virtual = nil
+      json_obj.time_virtual = nil
+      assert_rspamd_table_eq({expect = ucl_obj, actual = json_obj})
+
+      -- And apart from the time fields the strings are equal
+      local function strip_time(s)
+        return (s:gsub('"time_real":[^,}]*,?', ''):gsub('"time_virtual":[^,}]*,?', ''))
+      end
+      assert_equal(strip_time(ucl_str), strip_time(json_str))
+      task:destroy()
+    end)
+  end
+end)
@@ -102,6 +102,16 @@ context("Quoted-Printable encoding", function()
       'Mailscape External Mail Flow Outbound Test=',
       'asan found'
     },
+    {
+      '=D0=BF=d1=80=D0=B8=\r\n=D0=B2=D0=B5=D1=82',
+      'привет',
+      'consecutive escapes'
+    },
+    {
+      'test=D0=BF=D',
+      'testп',
+      'incomplete escape'
+    },
   }
 
   for _,c in ipairs(cases) do
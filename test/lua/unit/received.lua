@@ -129,6 +129,21 @@ context("Received headers parser", function()
          by_hostname = 'x.com.br',
        }
     },
+    {[[from EXCH01.corp.example.com (10.1.1.10) by EXCH02.corp.example.com (10.1.1.11) with Microsoft SMTP Server (TLS) id 15.0.1395.4; Wed, 20 Mar 2019 15:05:36 +0100]],
+       {
+         from_hostname = 'exch01.corp.example.com',
+         real_ip = '10.1.1.10',
+         by_hostname = 'exch02.corp.example.com',
+       }
+    },
+    {[[from mail-sor-f41.example.com (mail-sor-f41.example.com. [209.85.220.41]) by mx.example.com with SMTPS id u11sor1234567wmj.5.2019.03.20.07.05.36 for <user@example.com> (Google Transport Security); Wed, 20 Mar 2019 07:05:36 -0700 (PDT)]],
+       {
+         from_hostname = 'mail-sor-f41.example.com',
+         real_ip = '209.85.220.41',
+         by_hostname = 'mx.example.com',
+         for_mbox = 'user@example.com',
+       }
+    },
   }
 
   local task = ffi.C.rspamd_task_new(nil, nil)
@@ -199,6 +214,16 @@ context("Received headers parser", function()
                 string.format('%s: by_hostname: %s, expected: nil',
                     c[1], ffi_string(hdr.by_hostname)))
           end
+        elseif k == 'for_mbox' then
+          if #v > 0 then
+            assert_equal(v, ffi_string(hdr.for_mbox),
+                string.format('%s: for_mbox: %s, expected: %s',
+                    c[1], ffi_string(hdr.for_mbox), v))
+          else
+            assert_nil(hdr.for_mbox,
+                string.format('%s: for_mbox: %s, expected: nil',
+                    c[1], ffi_string(hdr.for_mbox)))
+          end
         end
       end
     end)
@@ -0,0 +1,99 @@
+-- Native expiry of redis statistics tokens
+
+context("Redis statistics native expiry", function()
+  local ffi = require "ffi"
+  local rspamd_util = require "rspamd_util"
+  local test_helper = require "rspamd_test_helper"
+
+  ffi.cdef[[
+  const char *rspamd_redis_expiry_script_source (void);
+  ]]
+
+  local script = ffi.string(ffi.C.rspamd_redis_expiry_script_source())
+  -- epochs, stats, lock
+  local keys = {'RS_expiry_BAYES_SPAM_epochs', 'RS_expiry_BAYES_SPAM_stats',
+    'RS_expiry_BAYES_SPAM_lock'}
+  -- buckets prefix, current epoch, cutoff epoch, count, interval,
+  -- significant hits
+  local argv = {'RS_expiry_BAYES_SPAM', '27010', '27008', '10', '5', '10'}
+
+  local function prepare()
+    local redis = test_helper.redis_mock()
+    -- Not significant
+    redis.call('HSET', 'RS_1', 'H', '1', 'T', '27000')
+    -- Significant
+    redis.call('HSET', 'RS_2', 'S', '20', 'H', '1', 'T', '27000')
+    -- Learned after the epoch
+    redis.call('HSET', 'RS_3', 'H', '1', 'T', '27005')
+    redis.call('SADD', 'RS_expiry_BAYES_SPAM_27000', 'RS_1', 'RS_2', 'RS_3')
+    redis.call('ZADD', 'RS_expiry_BAYES_SPAM_epochs', 27000, 27000)
+
+    return redis
+  end
+
+  test("Expiry step", function()
+    local redis = prepare()
+    local res = redis.eval(script, keys, argv)
+
+    assert_rspamd_table_eq({
+      expect = {1, 3, 1, 1, 3, 1, 1, 0, 0},
+      actual = res
+    })
+    assert_nil(redis.data['RS_1'])
+    assert_equal('27010', redis.call('HGET', 'RS_2', 'T'))
+    assert_equal('27005', redis.call('HGET', 'RS_3', 'T'))
+    assert_equal(1, redis.call('SCARD', 'RS_expiry_BAYES_SPAM_27010'))
+    assert_equal(0, redis.call('SCARD', 'RS_expiry_BAYES_SPAM_27000'))
+    assert_rspamd_table_eq({
+      expect = {'27010'},
+      actual = redis.call('ZRANGEBYSCORE', 'RS_expiry_BAYES_SPAM_epochs',
+          '-inf', '+inf')
+    })
+
+    -- Locked till the next interval, only counters are returned
+    res = redis.eval(script, keys, argv)
+    assert_rspamd_table_eq({
+      expect = {0, 0, 0, 0, 3, 1, 1, 0, 0},
+      actual = res
+    })
+  end)
+
+  test("Expiry step is bounded", function()
+    local redis = prepare()
+    local args = {'RS_expiry_BAYES_SPAM', '27010', '27008', '2', '5', '10'}
+    local res = redis.eval(script, keys, args)
+
+    assert_equal(1, res[1])
+    assert_equal(2, res[2])
+    -- One token is left in the outdated epoch
+    assert_equal(1, res[8])
+    assert_equal(1, res[9])
+
+    redis.call('DEL', 'RS_expiry_BAYES_SPAM_lock')
+    res = redis.eval(script, keys, args)
+    assert_equal(1, res[2])
+    assert_equal(3, res[5])
+    assert_equal(0, res[8])
+    assert_equal(0, res[9])
+  end)
+
+  test("Native expiry predicate", function()
+    local cases = {
+      {{native_expiry = true, new_schema = true, expiry = 8640000}, true},
+      {{native_expiry = true, new_schema = true, expire = 8640000}, true},
+      {{native_expiry = false, new_schema = true, expiry = 8640000}, false},
+      {{native_expiry = true, expiry = 8640000}, false},
+      {{native_expiry = true, new_schema = true, expiry = 0}, false},
+      {{native_expiry = true, new_schema = true}, false},
+      {{native_expiry = true, new_schema = true, expiry = 8640000,
+        shard_tokens = true}, false},
+      {{native_expiry = true, new_schema = true, expiry = 8640000,
+        sharding = true}, false},
+    }
+
+    for i,c in ipairs(cases) do
+      assert_equal(c[2], rspamd_util.stat_native_expiry(c[1]),
+          'case ' .. tostring(i))
+    end
+  end)
+end)
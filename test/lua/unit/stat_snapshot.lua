@@ -0,0 +1,38 @@
+context("Statistics snapshot", function()
+  local lua_stat = require "lua_stat"
+  local test_helper = require "rspamd_test_helper"
+
+  test("Scan tokens", function()
+    local redis = test_helper.redis_mock()
+    redis.call('HSET', 'RS', 'learns_spam', '10', 'learns_ham', '5')
+    redis.call('HSET', 'RS_100', 'S', '3', 'H', '1')
+    redis.call('HSET', 'RS_200', 'H', '5')
+    redis.call('HSET', 'RS_300', 'S', '7', 'T', '27000')
+    local res = redis.eval(lua_stat.snapshot_scan_script, {'RS', '0', '100'})
+
+    assert_equal('0', res[1])
+    assert_rspamd_table_eq({
+      expect = {'100', '3', '1', '200', '0', '5', '300', '7', '0'},
+      actual = res[2]
+    })
+  end)
+
+  test("Scan skips native expiry keys", function()
+    local redis = test_helper.redis_mock()
+    redis.call('HSET', 'RS_100', 'S', '3', 'H', '1')
+    -- Keys created by native expiry share the same prefix
+    redis.call('SADD', 'RS_expiry_27000', 'RS_100')
+    redis.call('ZADD', 'RS_expiry_epochs', 27000, 27000)
+    redis.call('HINCRBY', 'RS_expiry_stats', 'expired', 1)
+    redis.call('SET', 'RS_expiry_lock', '1')
+    -- Non hash key with a token like name
+    redis.call('SET', 'RS_400', '1')
+    local res = redis.eval(lua_stat.snapshot_scan_script, {'RS', '0', '100'})
+
+    assert_equal('0', res[1])
+    assert_rspamd_table_eq({
+      expect = {'100', '3', '1'},
+      actual = res[2]
+    })
+  end)
+end)
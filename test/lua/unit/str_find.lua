@@ -0,0 +1,154 @@
+-- Vectorised string scanning helpers
+
+context("String scanning", function()
+  local ffi = require "ffi"
+
+  ffi.cdef[[
+  size_t rspamd_str_find_newline (const char *s, size_t len);
+  size_t rspamd_str_find_line_dashes (const char *s, size_t len);
+  size_t rspamd_str_find_8bit (const unsigned char *s, size_t len);
+  ]]
+
+  local function naive_newline(s)
+    local pos = s:find('[\r\n]')
+
+    return pos and pos - 1 or #s
+  end
+
+  local function naive_8bit(s)
+    local pos = s:find('[\128-\255]')
+
+    return pos and pos - 1 or #s
+  end
+
+  local function naive_line_dashes(s)
+    for i = 2, #s - 1 do
+      local prev = s:sub(i - 1, i - 1)
+      if s:sub(i, i + 1) == '--' and (prev == '\r' or prev == '\n') then
+        return i + 1
+      end
+    end
+
+    return #s
+  end
+
+  -- Lengths around the vector size and the loads of the previous and the
+  -- next characters
+  local lengths = {}
+  for i = 0, 70 do
+    lengths[#lengths + 1] = i
+  end
+  for _,i in ipairs{127, 128, 129, 255, 256, 257, 1000} do
+    lengths[#lengths + 1] = i
+  end
+
+  local function random_string(len, alphabet)
+    local t = {}
+    for i = 1, len do
+      local c = math.random(1, #alphabet)
+      t[i] = alphabet:sub(c, c)
+    end
+
+    return table.concat(t)
+  end
+
+  math.randomseed(42)
+
+  test("Newline search is the same as naive scan", function()
+    for _,len in ipairs(lengths) do
+      for _ = 1, 50 do
+        -- Mostly plain characters to get matches at any offset
+        local s = random_string(len, string.rep('a', 60) .. '\r\n\128')
+        assert_equal(naive_newline(s), tonumber(ffi.C.rspamd_str_find_newline(s, #s)),
+            string.format('%q', s))
+      end
+
+      -- Single newline at each position
+      for pos = 1, len do
+        local s = string.rep('x', pos - 1) .. '\n' .. string.rep('x', len - pos)
+        assert_equal(pos - 1, tonumber(ffi.C.rspamd_str_find_newline(s, #s)))
+      end
+    end
+  end)
+
+  test("8bit search is the same as naive scan", function()
+    local function find_8bit(s, offset)
+      return tonumber(ffi.C.rspamd_str_find_8bit(
+          ffi.cast('const unsigned char *', s) + offset, #s - offset))
+    end
+
+    for _,len in ipairs(lengths) do
+      for _ = 1, 50 do
+        local s = random_string(len, string.rep('a', 60) .. '\127\128\255')
+        assert_equal(naive_8bit(s), find_8bit(s, 0), string.format('%q', s))
+      end
+
+      -- Single 8bit character at each position, including the last vector
+      -- and the scalar tail, with different alignments
+      for pos = 1, len do
+        for _,c in ipairs{'\128', '\255'} do
+          local s = string.rep('\127', pos - 1) .. c .. string.rep('x', len - pos)
+          assert_equal(pos - 1, find_8bit(s, 0))
+
+          for offset = 1, math.min(pos - 1, 15) do
+            assert_equal(pos - 1 - offset, find_8bit(s, offset))
+          end
+        end
+      end
+
+      -- 7bit only
+      assert_equal(len, find_8bit(string.rep('\127', len), 0))
+    end
+  end)
+
+  test("Line dashes search is the same as naive scan", function()
+    for _,len in ipairs(lengths) do
+      for _ = 1, 50 do
+        local s = random_string(len, 'aaaaaaaa--\r\n')
+        assert_equal(naive_line_dashes(s),
+            tonumber(ffi.C.rspamd_str_find_line_dashes(s, #s)),
+            string.format('%q', s))
+      end
+
+      -- Single match at each position, including vector boundaries
+      for pos = 1, len - 2 do
+        local s = string.rep('-', pos - 1) .. '\n--' .. string.rep('-', len - pos - 2)
+        assert_equal(naive_line_dashes(s),
+            tonumber(ffi.C.rspamd_str_find_line_dashes(s, #s)),
+            string.format('%q', s))
+      end
+    end
+  end)
+
+  test("All line dashes are found in order", function()
+    for _,len in ipairs(lengths) do
+      local s = random_string(len, 'aa--\r\n')
+      local expected, found = {}, {}
+      local prev = nil
+
+      -- Match at the very end is not distinguished from no match
+      for i = 2, len - 2 do
+        local c = s:sub(i - 1, i - 1)
+        if s:sub(i, i + 1) == '--' and (c == '\r' or c == '\n') then
+          expected[#expected + 1] = i + 1
+        end
+      end
+
+      -- The same loop as in the mime parser
+      local pos = 0
+      while pos + 3 <= len do
+        local off = tonumber(ffi.C.rspamd_str_find_line_dashes(
+            ffi.cast('const char *', s) + pos, len - pos))
+        if off == len - pos then
+          break
+        end
+        assert_true(prev == nil or pos + off > prev)
+        prev = pos + off
+        found[#found + 1] = pos + off
+        pos = pos + off - 1
+      end
+
+      assert_rspamd_table_eq({expect = expected, actual = found})
+    end
+  end)
+end)
@@ -5,6 +5,7 @@ context("URL check functions", function()
   local lua_urls_compose = require "lua_urls_compose"
   local url = require("rspamd_url")
   local lua_util = require("lua_util")
+  local util = require("rspamd_util")
   local logger = require("rspamd_logger")
   local test_helper = require("rspamd_test_helper")
   local ffi = require("ffi")
@@ -207,4 +208,35 @@ context("URL check functions", function()
       assert_equal(v[2], res, 'expected ' .. v[2] .. ' but got ' .. res .. ' in url ' .. v[1])
     end)
   end
+
+  cases = {
+    {'http://www.example.com/a', 'http://www.example.com/b', true, true},
+    {'http://www.example.com/', 'http://example.com/', false, true},
+    {'http://a.b.co.uk/', 'http://b.co.uk/', false, true},
+    {'http://example.com/', 'http://example.org/', false, false},
+  }
+
+  for i,c in ipairs(cases) do
+    test("URL host ids " .. i, function()
+      local u1 = url.create(pool, c[1])
+      local u2 = url.create(pool, c[2])
+      assert_not_nil(u1:get_host_id())
+      assert_equal(c[3], u1:get_host_id() == u2:get_host_id())
+      assert_equal(c[4], u1:get_tld_id() == u2:get_tld_id())
+      assert_equal(u1:get_tld_id(), url.intern_host(u1:get_tld()))
+    end)
+  end
+
+  cases = {
+    {'www.example.com', 'example.com'},
+    {'WWW.Example.COM', 'Example.COM'},
+    {'www.тест.рф', 'тест.рф'},
+    {'www.Тест.РФ', 'Тест.РФ'},
+  }
+
+  for i,c in ipairs(cases) do
+    test("Get TLD " .. i, function()
+      assert_equal(c[2], util.get_tld(c[1]))
+    end)
+  end
 end)
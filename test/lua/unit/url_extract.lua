@@ -0,0 +1,206 @@
+-- Urls extraction from text parts: candidates cache and limits
+
+context("URL extraction limits", function()
+  local rspamd_task = require "rspamd_task"
+  local test_helper = require "rspamd_test_helper"
+
+  test_helper.init_url_parser()
+
+  local function message(lines, ct)
+    return table.concat({
+      'From: <sender@example.net>',
+      'Subject: urls',
+      'Content-Type: ' .. (ct or 'text/plain'),
+      '',
+      table.concat(lines, '\n'),
+      '',
+    }, '\n')
+  end
+
+  local function process(msg)
+    local res,task = rspamd_task.load_from_string(msg, rspamd_config)
+    assert_true(res, "failed to load message")
+    task:process_message()
+
+    return task
+  end
+
+  local function nurls(task)
+    local _,n = task:has_urls()
+    return n
+  end
+
+  local function find_url(task, str)
+    for _,u in ipairs(task:get_urls()) do
+      if tostring(u) == str then
+        return u
+      end
+    end
+  end
+
+  test("Duplicate candidates are parsed once", function()
+    local lines = {}
+    for i = 1, 100 do
+      lines[i] = 'http://example.com/dup'
+    end
+    lines[#lines + 1] = 'http://example.org/a'
+    lines[#lines + 1] = 'http://example.org/b?x=1'
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    assert_rspamd_table_eq({
+      expect = {candidates = 3, duplicates = 99, failed = 0, query_checks = 1,
+                dropped = 0},
+      actual = stat
+    })
+    assert_equal(3, nurls(task))
+    assert_equal(100, find_url(task, 'http://example.com/dup'):get_count())
+    assert_false(task:has_flag('urls_truncated'))
+    assert_false(task:has_flag('urls_query_limit'))
+    task:destroy()
+  end)
+
+  test("Candidates are shared between parts", function()
+    local msg = table.concat({
+      'From: <sender@example.net>',
+      'Subject: urls',
+      'Content-Type: multipart/alternative; boundary="xxx"',
+      '',
+      '--xxx',
+      'Content-Type: text/plain',
+      '',
+      'Visit http://example.com/shared now',
+      '--xxx',
+      'Content-Type: text/html',
+      '',
+      '<html><body><p>Visit http://example.com/shared now</p></body></html>',
+      '--xxx--',
+      '',
+    }, '\n')
+
+    local task = process(msg)
+    local stat = task:get_urls_stat()
+
+    assert_equal(1, stat.candidates)
+    assert_equal(1, stat.duplicates)
+    assert_equal(1, nurls(task))
+    task:destroy()
+  end)
+
+  test("Many duplicate urls do not reach the limits", function()
+    local lines = {}
+    for i = 1, 20000 do
+      lines[i] = 'http://example.com/same'
+    end
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    assert_equal(1, stat.candidates)
+    assert_equal(19999, stat.duplicates)
+    assert_equal(1, nurls(task))
+    assert_equal(20000, find_url(task, 'http://example.com/same'):get_count())
+    assert_false(task:has_flag('urls_truncated'))
+    task:destroy()
+  end)
+
+  test("Queries are searched up to max_url_queries", function()
+    local lines = {}
+    for i = 1, 1100 do
+      lines[i] = string.format('http://example.com/r?n=%d', i)
+    end
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    -- Default max_url_queries
+    assert_equal(1024, stat.query_checks)
+    assert_equal(0, stat.dropped)
+    assert_equal(1100, nurls(task))
+    assert_true(task:has_flag('urls_query_limit'))
+    assert_false(task:has_flag('urls_truncated'))
+    task:destroy()
+  end)
+
+  test("Urls are truncated at max_urls", function()
+    local lines = {}
+    for i = 1, 10300 do
+      lines[i] = string.format('http://example.com/%d', i)
+    end
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    -- Default max_urls, extraction stops at the first url over the limit
+    assert_equal(10240, nurls(task))
+    assert_equal(10241, stat.candidates)
+    assert_equal(1, stat.dropped)
+    assert_true(task:has_flag('urls_truncated'))
+    assert_false(task:has_flag('urls_query_limit'))
+    task:destroy()
+  end)
+
+  test("Urls from queries are truncated at max_urls", function()
+    local lines = {}
+    for i = 1, 10239 do
+      lines[i] = string.format('http://example.com/%d', i)
+    end
+    -- The last url fits in the limit but the url in its query does not
+    lines[#lines + 1] = 'http://example.com/r?u=http://example.org/q'
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    assert_equal(10240, nurls(task))
+    assert_equal(1, stat.dropped)
+    assert_nil(find_url(task, 'http://example.org/q'))
+    assert_true(task:has_flag('urls_truncated'))
+    task:destroy()
+  end)
+
+  test("Failed candidates are parsed once", function()
+    local lines = {}
+    for i = 1, 10 do
+      lines[i] = 'http://foo:-80/'
+    end
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    assert_true(stat.candidates <= 1)
+    assert_true(stat.failed <= 1)
+    assert_equal(0, nurls(task))
+    task:destroy()
+  end)
+
+  test("Both limits are reached", function()
+    local lines = {}
+    for i = 1, 10300 do
+      lines[i] = string.format('http://example.com/%d?n=%d', i, i)
+    end
+
+    local task = process(message(lines))
+    local stat = task:get_urls_stat()
+
+    assert_equal(10240, nurls(task))
+    assert_equal(1024, stat.query_checks)
+    assert_equal(1, stat.dropped)
+    assert_true(task:has_flag('urls_truncated'))
+    assert_true(task:has_flag('urls_query_limit'))
+    assert_rspamd_table_eq({
+      expect = {'urls_query_limit', 'urls_truncated'},
+      actual = (function()
+        local flags = {}
+        for _,f in ipairs(task:get_flags()) do
+          if f:match('^urls_') then
+            flags[#flags + 1] = f
+          end
+        end
+        table.sort(flags)
+        return flags
+      end)()
+    })
+    task:destroy()
+  end)
+end)
@@ -222,7 +222,8 @@ rspamd_http_start_servers (pid_t *sfd, rspamd_inet_addr_t *addr,
 	guint i;
 	gint fd;
 
-	g_assert ((fd = rspamd_inet_address_listen (addr, SOCK_STREAM, TRUE)) != -1);
+	g_assert ((fd = rspamd_inet_address_listen (addr, SOCK_STREAM,
+			RSPAMD_INET_ADDRESS_LISTEN_ASYNC)) != -1);
 
 	for (i = 0; i < nservers; i ++) {
 		sfd[i] = fork ();
@@ -0,0 +1,218 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libmime/message.h"
+#include "libmime/lang_detection.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+
+/* Less than 80 words, so all words are used for detection */
+static const gchar *texts[] = {
+	"The quick brown fox jumps over the lazy dog while the farmer is "
+	"watching from the window of his house and thinking about the weather "
+	"that is going to be rather bad for the harvest this year",
+	"Der schnelle braune Fuchs springt über den faulen Hund, während der "
+	"Bauer aus dem Fenster seines Hauses schaut und über das Wetter "
+	"nachdenkt, das in diesem Jahr für die Ernte ziemlich schlecht wird",
+	"Le renard brun rapide saute par-dessus le chien paresseux pendant que "
+	"le fermier regarde par la fenêtre de sa maison et pense au temps qu'il "
+	"fera cette année pour la récolte",
+	"Быстрая коричневая лиса прыгает через ленивую собаку, пока фермер "
+	"смотрит из окна своего дома и думает о погоде, которая в этом году "
+	"будет довольно плохой для урожая",
+	/* No stop words here, so trigramms are used */
+	"Wetterbericht Donnerstag Temperaturen Niederschlagswahrscheinlichkeit "
+	"Windgeschwindigkeit Luftfeuchtigkeit Sonnenaufgang Sonnenuntergang "
+	"Hochdruckgebiet Tiefdruckgebiet Gewitterwarnung Straßenglätte",
+	"Previsioni meteorologiche giovedì temperature precipitazioni "
+	"probabilità velocità vento umidità alba tramonto anticiclone "
+	"perturbazione temporali",
+	"Meteorología jueves temperaturas precipitaciones probabilidad "
+	"velocidad viento humedad amanecer atardecer anticiclón borrasca "
+	"tormentas",
+};
+
+/* Languages detected for the texts above with the previous scoring */
+static const gchar *expected_langs[] = {
+	"en",
+	"de",
+	"fr",
+	"ru",
+	"de",
+	"it",
+	"es",
+};
+
+static GString *
+lang_detection_test_detect (struct rspamd_lang_detector *d,
+		const gchar *text, gboolean *multiple)
+{
+	struct rspamd_task *task;
+	struct rspamd_mime_text_part *part;
+	struct rspamd_lang_detector_res *lang;
+	GString *msg, *res;
+	guint i, j;
+
+	msg = g_string_new ("From: <sender@example.com>\r\n"
+			"To: <rcpt@example.com>\r\n"
+			"Subject: language test\r\n"
+			"Content-Type: text/plain; charset=utf-8\r\n\r\n");
+	g_string_append (msg, text);
+	g_string_append (msg, "\r\n");
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, d, NULL, FALSE);
+	task->msg.begin = msg->str;
+	task->msg.len = msg->len;
+
+	g_assert (rspamd_message_parse (task));
+	rspamd_message_process (task);
+
+	res = g_string_new (NULL);
+
+	PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, text_parts), i, part) {
+		/* Detect explicitly as the detection results might be cached */
+		if (part->languages) {
+			g_ptr_array_unref (part->languages);
+			part->languages = NULL;
+		}
+
+		rspamd_language_detector_detect (task, d, part);
+		g_assert (part->languages != NULL);
+
+		if (part->languages->len > 1) {
+			*multiple = TRUE;
+		}
+
+		PTR_ARRAY_FOREACH (part->languages, j, lang) {
+			rspamd_printf_gstring (res, "%s:%.8f;", lang->lang, lang->prob);
+		}
+	}
+
+	rspamd_task_free (task);
+	g_string_free (msg, TRUE);
+
+	return res;
+}
+
+static struct rspamd_lang_detector *
+lang_detection_test_init (const gchar *model_cache)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_lang_detector *d;
+	ucl_object_t *top, *section, *saved;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	section = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (section,
+			ucl_object_fromstring (RSPAMD_TEST_LANGUAGES_DIR),
+			"languages", 0, false);
+	ucl_object_insert_key (section, ucl_object_fromstring (model_cache),
+			"model_cache", 0, false);
+	ucl_object_insert_key (top, section, "lang_detection", 0, false);
+
+	saved = cfg->rcl_obj;
+	cfg->rcl_obj = top;
+	d = rspamd_language_detector_init (cfg);
+	cfg->rcl_obj = saved;
+	ucl_object_unref (top);
+
+	g_assert (d != NULL);
+
+	return d;
+}
+
+/* Breaks the hash tables at the end of the model, so it must be rebuilt */
+static void
+lang_detection_test_corrupt (const gchar *model_cache)
+{
+	guchar garbage[4096];
+	struct stat st;
+	gint fd;
+
+	memset (garbage, 0xff, sizeof (garbage));
+	fd = open (model_cache, O_WRONLY);
+	g_assert (fd != -1);
+	g_assert (fstat (fd, &st) != -1);
+	g_assert (st.st_size > (off_t)sizeof (garbage));
+	g_assert (pwrite (fd, garbage, sizeof (garbage),
+			st.st_size - sizeof (garbage)) == sizeof (garbage));
+	close (fd);
+}
+
+void
+rspamd_lang_detection_test_func (void)
+{
+	struct rspamd_lang_detector *fresh, *cached, *rebuilt;
+	GString *fresh_res, *cached_res, *rebuilt_res;
+	gchar *model_cache, expected[8];
+	struct stat st;
+	ino_t ino;
+	gboolean multiple = FALSE;
+	gint fd;
+	guint i;
+
+	G_STATIC_ASSERT (G_N_ELEMENTS (texts) == G_N_ELEMENTS (expected_langs));
+
+	model_cache = g_build_filename (g_get_tmp_dir (),
+			"rspamd_test_languages.XXXXXX", NULL);
+	fd = g_mkstemp (model_cache);
+	g_assert (fd != -1);
+	close (fd);
+	unlink (model_cache);
+
+	/* Model is built from the languages files and saved */
+	fresh = lang_detection_test_init (model_cache);
+	g_assert (stat (model_cache, &st) != -1);
+	g_assert (st.st_size > 0);
+	ino = st.st_ino;
+
+	/* Model is mapped from the saved file and it is not rewritten */
+	cached = lang_detection_test_init (model_cache);
+	g_assert (stat (model_cache, &st) != -1);
+	g_assert (st.st_ino == ino);
+
+	/* Corrupted model is rejected, rebuilt and saved again */
+	lang_detection_test_corrupt (model_cache);
+	rebuilt = lang_detection_test_init (model_cache);
+	g_assert (stat (model_cache, &st) != -1);
+	g_assert (st.st_ino != ino);
+
+	for (i = 0; i < G_N_ELEMENTS (texts); i ++) {
+		fresh_res = lang_detection_test_detect (fresh, texts[i], &multiple);
+		cached_res = lang_detection_test_detect (cached, texts[i], &multiple);
+		rebuilt_res = lang_detection_test_detect (rebuilt, texts[i], &multiple);
+
+		/* The most probable language goes first */
+		rspamd_snprintf (expected, sizeof (expected), "%s:", expected_langs[i]);
+		g_assert (g_str_has_prefix (fresh_res->str, expected));
+		g_assert_cmpstr (fresh_res->str, ==, cached_res->str);
+		g_assert_cmpstr (fresh_res->str, ==, rebuilt_res->str);
+
+		g_string_free (fresh_res, TRUE);
+		g_string_free (cached_res, TRUE);
+		g_string_free (rebuilt_res, TRUE);
+	}
+
+	/* Trigramms probabilities have been compared */
+	g_assert (multiple);
+
+	unlink (model_cache);
+	g_free (model_cache);
+}
@@ -0,0 +1,184 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libmime/message.h"
+#include "ottery.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+
+/* All parts but one are large enough to be decoded in the threads pool */
+static const gsize part_sizes[] = {
+	40 * 1024, 33 * 1024 + 1, 100 * 1024 + 7, 64 * 1024, 1024, 250 * 1024
+};
+static const gchar *boundary = "----=_decode_test_boundary";
+
+struct decoded_part {
+	GString *data;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+};
+
+static GString *
+mime_decode_test_message (void)
+{
+	GString *msg;
+	guchar *content;
+	gchar *encoded;
+	gsize i, j, len, olen;
+
+	msg = g_string_new ("From: <sender@example.com>\r\n"
+			"To: <rcpt@example.com>\r\n"
+			"Subject: decode test\r\n"
+			"MIME-Version: 1.0\r\n");
+	rspamd_printf_gstring (msg, "Content-Type: multipart/mixed; "
+			"boundary=\"%s\"\r\n\r\n", boundary);
+
+	for (i = 0; i < G_N_ELEMENTS (part_sizes); i ++) {
+		len = part_sizes[i];
+		content = g_malloc (len);
+
+		if (i % 2 == 0) {
+			/* Binary content */
+			ottery_rand_bytes (content, len);
+			encoded = rspamd_encode_base64_fold (content, len, 76, &olen,
+					RSPAMD_TASK_NEWLINES_CRLF);
+			rspamd_printf_gstring (msg, "--%s\r\n"
+					"Content-Type: application/octet-stream\r\n"
+					"Content-Disposition: attachment; filename=\"part%ud.bin\"\r\n"
+					"Content-Transfer-Encoding: base64\r\n\r\n", boundary, (guint)i);
+		}
+		else {
+			/*
+			 * Printable text with some 8bit characters, hard newlines are
+			 * not used as they are converted to CRLF by the encoder
+			 */
+			for (j = 0; j < len; j ++) {
+				content[j] = (guchar)(' ' + ottery_rand_range (200));
+			}
+
+			encoded = rspamd_encode_qp_fold (content, len, 76, &olen,
+					RSPAMD_TASK_NEWLINES_CRLF);
+			rspamd_printf_gstring (msg, "--%s\r\n"
+					"Content-Type: text/plain; charset=iso-8859-1\r\n"
+					"Content-Transfer-Encoding: quoted-printable\r\n\r\n",
+					boundary);
+		}
+
+		g_assert (encoded != NULL);
+		g_string_append_len (msg, encoded, olen);
+		g_string_append (msg, "\r\n");
+		g_free (encoded);
+		g_free (content);
+	}
+
+	rspamd_printf_gstring (msg, "--%s--\r\n", boundary);
+
+	return msg;
+}
+
+static GArray *
+mime_decode_test_parse (struct rspamd_config *cfg, GString *msg,
+		guint nthreads)
+{
+	struct rspamd_task *task;
+	struct rspamd_mime_part *part;
+	struct decoded_part dp;
+	GArray *res;
+	guint i;
+
+	cfg->parts_decode_threads = nthreads;
+	task = rspamd_task_new (NULL, cfg, NULL, NULL, NULL, FALSE);
+	task->msg.begin = msg->str;
+	task->msg.len = msg->len;
+
+	g_assert (rspamd_message_parse (task));
+
+	res = g_array_new (FALSE, FALSE, sizeof (struct decoded_part));
+
+	PTR_ARRAY_FOREACH (MESSAGE_FIELD (task, parts), i, part) {
+		dp.data = g_string_new_len (part->parsed_data.begin,
+				part->parsed_data.len);
+		memcpy (dp.digest, part->digest, sizeof (dp.digest));
+		g_array_append_val (res, dp);
+	}
+
+	rspamd_task_free (task);
+
+	return res;
+}
+
+static void
+mime_decode_test_free (GArray *parts)
+{
+	struct decoded_part *dp;
+	guint i;
+
+	for (i = 0; i < parts->len; i ++) {
+		dp = &g_array_index (parts, struct decoded_part, i);
+		g_string_free (dp->data, TRUE);
+	}
+
+	g_array_free (parts, TRUE);
+}
+
+void
+rspamd_mime_decode_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct decoded_part *serial, *threaded;
+	GArray *serial_parts, *threaded_parts;
+	GString *msg;
+	guint saved_threads = cfg->parts_decode_threads, i, iter;
+
+	for (iter = 0; iter < 10; iter ++) {
+		msg = mime_decode_test_message ();
+
+		serial_parts = mime_decode_test_parse (cfg, msg, 0);
+		threaded_parts = mime_decode_test_parse (cfg, msg, 4);
+
+		/* Multipart itself and all its children */
+		g_assert_cmpuint (serial_parts->len, ==,
+				G_N_ELEMENTS (part_sizes) + 1);
+		g_assert_cmpuint (serial_parts->len, ==, threaded_parts->len);
+
+		for (i = 0; i < serial_parts->len; i ++) {
+			serial = &g_array_index (serial_parts, struct decoded_part, i);
+			threaded = &g_array_index (threaded_parts, struct decoded_part, i);
+
+			g_assert_cmpuint (serial->data->len, ==, threaded->data->len);
+			g_assert (memcmp (serial->data->str, threaded->data->str,
+					serial->data->len) == 0);
+			g_assert (memcmp (serial->digest, threaded->digest,
+					sizeof (serial->digest)) == 0);
+		}
+
+		/* Decoded content is what has been encoded */
+		for (i = 0; i < G_N_ELEMENTS (part_sizes); i ++) {
+			threaded = &g_array_index (threaded_parts, struct decoded_part,
+					i + 1);
+			g_assert_cmpuint (threaded->data->len, ==, part_sizes[i]);
+		}
+
+		mime_decode_test_free (serial_parts);
+		mime_decode_test_free (threaded_parts);
+		g_string_free (msg, TRUE);
+	}
+
+	cfg->parts_decode_threads = saved_threads;
+}
@@ -0,0 +1,133 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libmime/mime_encoding.h"
+#include "ottery.h"
+#include "tests.h"
+#include <unicode/ucnv.h>
+#include <unicode/ustring.h>
+
+/* Single byte charsets that are converted using tables */
+static const gchar *charsets[] = {
+	"windows-1250", "windows-1251", "windows-1252", "windows-1253",
+	"windows-1254", "windows-1255", "windows-1256", "windows-1257",
+	"windows-1258", "koi8-r", "koi8-u", "iso-8859-1", "iso-8859-2",
+	"iso-8859-3", "iso-8859-4", "iso-8859-5", "iso-8859-6", "iso-8859-7",
+	"iso-8859-8", "iso-8859-9", "iso-8859-10", "iso-8859-11", "iso-8859-13",
+	"iso-8859-14", "iso-8859-15", "iso-8859-16",
+};
+
+/* Plain ICU conversion with the same substitution callback */
+static GString *
+mime_encoding_test_icu (const gchar *canon, const guchar *in, gsize len)
+{
+	UConverter *conv;
+	UErrorCode uc_err = U_ZERO_ERROR;
+	UChar *ubuf;
+	GString *res;
+	gint32 ulen, olen;
+
+	conv = ucnv_open (canon, &uc_err);
+	g_assert (U_SUCCESS (uc_err));
+	ucnv_setToUCallBack (conv, UCNV_TO_U_CALLBACK_SUBSTITUTE, NULL, NULL, NULL,
+			&uc_err);
+	g_assert (U_SUCCESS (uc_err));
+
+	ubuf = g_new (UChar, len + 1);
+	ulen = ucnv_toUChars (conv, ubuf, len + 1, (const gchar *)in, len, &uc_err);
+	g_assert (U_SUCCESS (uc_err));
+
+	res = g_string_sized_new (len * 3 + 1);
+	u_strToUTF8 (res->str, res->allocated_len, &olen, ubuf, ulen, &uc_err);
+	g_assert (U_SUCCESS (uc_err));
+	res->len = olen;
+
+	g_free (ubuf);
+	ucnv_close (conv);
+
+	return res;
+}
+
+static void
+mime_encoding_test_compare (rspamd_mempool_t *pool, const gchar *charset,
+		const gchar *canon, const guchar *in, gsize len)
+{
+	GByteArray *bin, *bout;
+	GString *expected;
+
+	bin = g_byte_array_sized_new (len);
+	g_byte_array_append (bin, in, len);
+	bout = g_byte_array_new ();
+
+	g_assert (rspamd_mime_to_utf8_byte_array (bin, bout, pool, charset));
+	expected = mime_encoding_test_icu (canon, in, len);
+
+	if (bout->len != expected->len ||
+			memcmp (bout->data, expected->str, expected->len) != 0) {
+		g_error ("%s: conversion of %d bytes differs from ICU",
+				charset, (gint)len);
+	}
+
+	g_string_free (expected, TRUE);
+	g_byte_array_free (bin, TRUE);
+	g_byte_array_free (bout, TRUE);
+}
+
+void
+rspamd_mime_encoding_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	rspamd_ftok_t tok;
+	const gchar *canon;
+	guchar all[256], buf[1024];
+	guint i, j;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "encoding", 0);
+
+	for (i = 0; i < G_N_ELEMENTS (all); i ++) {
+		all[i] = i;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (charsets); i ++) {
+		RSPAMD_FTOK_FROM_STR (&tok, charsets[i]);
+		canon = rspamd_mime_detect_charset (&tok, pool);
+		g_assert (canon != NULL);
+
+		/* Each byte including unmapped ones */
+		for (j = 0; j < G_N_ELEMENTS (all); j ++) {
+			mime_encoding_test_compare (pool, charsets[i], canon, &all[j], 1);
+		}
+
+		/* All bytes at once, so 7bit and 8bit runs cross vector boundaries */
+		mime_encoding_test_compare (pool, charsets[i], canon, all,
+				sizeof (all));
+
+		/* Mixed 7bit and 8bit runs of random lengths */
+		for (j = 0; j < sizeof (buf); j ++) {
+			buf[j] = ottery_rand_range (3) == 0 ?
+					0x80 + ottery_rand_range (127) : ottery_rand_range (127);
+		}
+
+		for (j = 0; j < 64; j ++) {
+			mime_encoding_test_compare (pool, charsets[i], canon, buf + j,
+					sizeof (buf) - j * 3);
+		}
+	}
+
+	rspamd_mempool_delete (pool);
+}
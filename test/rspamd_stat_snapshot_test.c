@@ -0,0 +1,229 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libmime/message.h"
+#include "libstat/stat_api.h"
+#include "libstat/stat_internal.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+static const gchar *spam_texts[] = {
+	"Cheap pills online, buy viagra now and get huge discount on all "
+	"pharmacy products, limited offer, click here to order today",
+	"Huge discount on pharmacy products, buy cheap pills online now, "
+	"order viagra today and get free shipping, limited offer",
+	"Limited offer: cheap viagra and other pills, huge pharmacy discount, "
+	"click here and buy online now, free shipping today",
+};
+
+static const gchar *ham_texts[] = {
+	"Hello team, the meeting about the quarterly report is moved to "
+	"Tuesday afternoon, please bring your notes and the project plan",
+	"Hi all, please review the project plan before the meeting on "
+	"Tuesday, the quarterly report draft is attached to the ticket",
+	"Dear colleagues, notes from the Tuesday meeting are attached, "
+	"the quarterly report and project plan are updated accordingly",
+};
+
+static struct rspamd_task *
+stat_snapshot_test_task (const gchar *text)
+{
+	struct rspamd_task *task;
+	GString *msg;
+
+	msg = g_string_new ("From: <sender@example.com>\r\n"
+			"To: <rcpt@example.com>\r\n"
+			"Subject: snapshot test\r\n"
+			"Content-Type: text/plain; charset=utf-8\r\n\r\n");
+	g_string_append (msg, text);
+	g_string_append (msg, "\r\n");
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, NULL, FALSE);
+	task->msg.begin = msg->str;
+	task->msg.len = msg->len;
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_gstring_free_hard, msg);
+
+	g_assert (rspamd_message_parse (task));
+	rspamd_message_process (task);
+
+	return task;
+}
+
+/* Learning is emulated by counting tokens of each class as the live backend does */
+static guint64
+stat_snapshot_test_learn (const gchar **texts, guint ntexts, GArray *tokens)
+{
+	struct rspamd_task *task;
+	struct rspamd_stat_snapshot_token st;
+	rspamd_token_t *tok;
+	guint i, j;
+
+	for (i = 0; i < ntexts; i ++) {
+		task = stat_snapshot_test_task (texts[i]);
+		rspamd_stat_classify (task, NULL, RSPAMD_TASK_STAGE_CLASSIFIERS_PRE,
+				NULL);
+		g_assert (task->tokens != NULL && task->tokens->len > 0);
+
+		PTR_ARRAY_FOREACH (task->tokens, j, tok) {
+			st.hash = tok->data;
+			st.value = 1.0;
+			g_array_append_val (tokens, st);
+		}
+
+		rspamd_task_free (task);
+	}
+
+	return ntexts;
+}
+
+static gdouble
+stat_snapshot_test_classify (const gchar *text, const gchar *expected)
+{
+	struct rspamd_task *task;
+	gdouble *pprob, prob;
+	guint stage;
+
+	task = stat_snapshot_test_task (text);
+
+	for (stage = RSPAMD_TASK_STAGE_CLASSIFIERS_PRE;
+			stage <= RSPAMD_TASK_STAGE_CLASSIFIERS_POST; stage <<= 1) {
+		rspamd_stat_classify (task, NULL, stage, NULL);
+	}
+
+	/* Both classes must be found in snapshots, otherwise nothing is classified */
+	g_assert (task->flags & RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS);
+	g_assert (task->flags & RSPAMD_TASK_FLAG_HAS_HAM_TOKENS);
+
+	pprob = rspamd_mempool_get_variable (task->task_pool, "bayes_prob");
+	g_assert (pprob != NULL);
+	prob = *pprob;
+
+	g_assert (rspamd_task_find_symbol_result (task, expected) != NULL);
+
+	rspamd_task_free (task);
+
+	return prob;
+}
+
+static struct rspamd_statfile_config *
+stat_snapshot_test_statfile (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clf,
+		const gchar *symbol, const gchar *path, gboolean is_spam)
+{
+	struct rspamd_statfile_config *stf;
+
+	stf = rspamd_config_new_statfile (cfg, NULL);
+	stf->symbol = rspamd_mempool_strdup (cfg->cfg_pool, symbol);
+	stf->is_spam = is_spam;
+	stf->clcf = clf;
+	stf->opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (stf->opts, ucl_object_fromstring (path),
+			"filename", 0, false);
+	/* Reload snapshots as soon as they are written */
+	ucl_object_insert_key (stf->opts, ucl_object_fromdouble (0.0),
+			"check_interval", 0, false);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)ucl_object_unref, stf->opts);
+	clf->statfiles = g_list_append (clf->statfiles, stf);
+
+	return stf;
+}
+
+void
+rspamd_stat_snapshot_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_classifier_config *clf;
+	struct rspamd_tokenizer_config *tkcf;
+	GList *saved_classifiers = cfg->classifiers;
+	GArray *spam_tokens, *ham_tokens;
+	GError *err = NULL;
+	gchar *spam_path, *ham_path;
+	guint64 spam_learns, ham_learns;
+	gdouble prob;
+
+	spam_path = g_build_filename (g_get_tmp_dir (),
+			"rspamd_test_spam.snapshot", NULL);
+	ham_path = g_build_filename (g_get_tmp_dir (),
+			"rspamd_test_ham.snapshot", NULL);
+	unlink (spam_path);
+	unlink (ham_path);
+
+	tkcf = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*tkcf));
+	tkcf->name = "osb";
+
+	clf = rspamd_config_new_classifier (cfg, NULL);
+	clf->classifier = "bayes";
+	clf->backend = "snapshot";
+	clf->name = "snapshot_test";
+	clf->tokenizer = tkcf;
+	clf->min_token_hits = 1;
+	/* Snapshot backend has no learn cache */
+	clf->opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (clf->opts, ucl_object_typed_new (UCL_NULL),
+			"cache", 0, false);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)ucl_object_unref, clf->opts);
+	stat_snapshot_test_statfile (cfg, clf, "BAYES_SPAM", spam_path, TRUE);
+	stat_snapshot_test_statfile (cfg, clf, "BAYES_HAM", ham_path, FALSE);
+
+	rspamd_stat_close ();
+	cfg->classifiers = g_list_prepend (NULL, clf);
+	rspamd_stat_init (cfg, event_loop);
+
+	spam_tokens = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_stat_snapshot_token));
+	ham_tokens = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_stat_snapshot_token));
+	spam_learns = stat_snapshot_test_learn (spam_texts,
+			G_N_ELEMENTS (spam_texts), spam_tokens);
+	ham_learns = stat_snapshot_test_learn (ham_texts,
+			G_N_ELEMENTS (ham_texts), ham_tokens);
+
+	g_assert (rspamd_stat_snapshot_write (spam_path, spam_tokens, spam_learns,
+			&err));
+	g_assert (rspamd_stat_snapshot_write (ham_path, ham_tokens, ham_learns,
+			&err));
+
+	prob = stat_snapshot_test_classify (
+			"Buy cheap viagra pills online now, huge pharmacy discount "
+			"and free shipping, limited offer today", "BAYES_SPAM");
+	g_assert (prob > 0.9);
+
+	prob = stat_snapshot_test_classify (
+			"Hello team, notes from the meeting and the quarterly report "
+			"are attached, please review the project plan", "BAYES_HAM");
+	g_assert (prob < 0.1);
+
+	g_array_free (spam_tokens, TRUE);
+	g_array_free (ham_tokens, TRUE);
+
+	rspamd_stat_close ();
+	g_list_free (cfg->classifiers);
+	cfg->classifiers = saved_classifiers;
+	rspamd_stat_init (cfg, event_loop);
+
+	unlink (spam_path);
+	unlink (ham_path);
+	g_free (spam_path);
+	g_free (ham_path);
+}
@@ -82,6 +82,10 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/mime_decode", rspamd_mime_decode_test_func);
+	g_test_add_func ("/rspamd/lang_detection", rspamd_lang_detection_test_func);
+	g_test_add_func ("/rspamd/mime_encoding", rspamd_mime_encoding_test_func);
+	g_test_add_func ("/rspamd/stat_snapshot", rspamd_stat_snapshot_test_func);
 	g_test_add_func ("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
 
 #if 0
@@ -160,6 +160,46 @@ rspamd_upstream_test_func (void)
 	msg_debug ("p value for hash consistency: %.6f", p);
 	g_assert (p > 0.9);
 
+	/* Test shards consistency */
+	success = 0;
+	for (i = 0; i < assumptions; i ++) {
+		guint64 shard_key = ottery_rand_uint64 ();
+
+		up = rspamd_upstream_get_shard (ls, shard_key);
+		upn = rspamd_upstream_get_shard (nls, shard_key);
+		g_assert (up == rspamd_upstream_get_shard (ls, shard_key));
+
+		if (strcmp (rspamd_upstream_name (up), rspamd_upstream_name (upn)) == 0) {
+			success ++;
+		}
+	}
+
+	p = 1.0 - fabs (3.0 / 4.0 - (gdouble)success / (gdouble)assumptions);
+	msg_debug ("p value for shards consistency: %.6f", p);
+	g_assert (p > 0.9);
+
+	rspamd_upstreams_destroy (nls);
+
+	/* Test latency rotation: slow upstream should be avoided */
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls, test_upstream_list, 443, NULL));
+	success = 0;
+
+	for (i = 0; i < 1000; i ++) {
+		up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		g_assert (up != NULL);
+
+		if (strcmp (rspamd_upstream_name (up), "kernel.org") == 0) {
+			rspamd_upstream_ok_latency (up, 1.0);
+			success ++;
+		}
+		else {
+			rspamd_upstream_ok_latency (up, 0.01);
+		}
+	}
+
+	msg_debug ("slow upstream has been selected %d times", success);
+	g_assert (success < 100);
 	rspamd_upstreams_destroy (nls);
 
 
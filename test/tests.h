@@ -42,6 +42,14 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_mime_decode_test_func (void);
+
+void rspamd_lang_detection_test_func (void);
+
+void rspamd_mime_encoding_test_func (void);
+
+void rspamd_stat_snapshot_test_func (void);
+
 void rspamd_lua_lua_pcall_vs_resume_test_func (void);
 
 #ifdef  __cplusplus
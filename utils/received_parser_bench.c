@@ -17,9 +17,11 @@
 #include "config.h"
 #include "printf.h"
 #include "message.h"
+#include "util.h"
 #include "smtp_parsers.h"
 
 static gdouble total_time = 0;
+static gdouble total_scan_time = 0;
 static gint total_parsed = 0;
 static gint total_valid = 0;
 static gint total_real_ip = 0;
@@ -29,14 +31,11 @@ static gint total_known_ts = 0;
 static gint total_known_for = 0;
 
 static void
-rspamd_process_file (const gchar *fname)
+rspamd_read_file (const gchar *fname, GPtrArray *lines)
 {
-	struct rspamd_task *task;
 	GIOChannel *f;
 	GError *err = NULL;
 	GString *buf;
-	struct received_header rh;
-	gdouble t1, t2;
 
 	f = g_io_channel_new_file (fname, "r", &err);
 
@@ -49,8 +48,6 @@ rspamd_process_file (const gchar *fname)
 
 	g_io_channel_set_encoding (f, NULL, NULL);
 	buf = g_string_sized_new (8192);
-	task = g_malloc0 (sizeof (*task));
-	task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "test");
 
 	while (g_io_channel_read_line_string (f, buf, NULL, &err)
 			== G_IO_STATUS_NORMAL) {
@@ -59,11 +56,55 @@ rspamd_process_file (const gchar *fname)
 			buf->len --;
 		}
 
+		/* Skip comments and empty lines in corpus */
+		if (buf->len == 0 || buf->str[0] == '#') {
+			continue;
+		}
+
+		g_ptr_array_add (lines, g_strndup (buf->str, buf->len));
+	}
+
+	if (err) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", fname, err);
+		g_error_free (err);
+	}
+
+	g_io_channel_unref (f);
+	g_string_free (buf, TRUE);
+}
+
+static void
+rspamd_process_lines (GPtrArray *lines, gboolean count)
+{
+	struct rspamd_task *task;
+	struct rspamd_received_header rh;
+	struct rspamd_received_spans spans;
+	const gchar *line;
+	gdouble t1, t2;
+	guint i;
+
+	task = g_malloc0 (sizeof (*task));
+	task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "test");
+
+	PTR_ARRAY_FOREACH (lines, i, line) {
+		gsize len = strlen (line);
+
+		t1 = rspamd_get_virtual_ticks ();
+		rspamd_smtp_received_scan (line, len, &spans);
+		t2 = rspamd_get_virtual_ticks ();
+		total_scan_time += t2 - t1;
+
+		memset (&rh, 0, sizeof (rh));
 		t1 = rspamd_get_virtual_ticks ();
-		rspamd_smtp_received_parse (task, buf->str, buf->len, &rh);
+		rspamd_smtp_received_parse (task, line, len, &rh);
 		t2 = rspamd_get_virtual_ticks ();
 
 		total_time += t2 - t1;
+
+		if (!count) {
+			continue;
+		}
+
 		total_parsed ++;
 
 		if (rh.addr) {
@@ -72,7 +113,7 @@ rspamd_process_file (const gchar *fname)
 		if (rh.real_hostname) {
 			total_real_host ++;
 		}
-		if (rh.type != RSPAMD_RECEIVED_UNKNOWN) {
+		if (!(rh.flags & RSPAMD_RECEIVED_UNKNOWN)) {
 			total_known_proto ++;
 		}
 
@@ -89,13 +130,6 @@ rspamd_process_file (const gchar *fname)
 		}
 	}
 
-	if (err) {
-		rspamd_fprintf (stderr, "cannot read %s: %e\n", fname, err);
-		g_error_free (err);
-	}
-
-	g_io_channel_unref (f);
-	g_string_free (buf, TRUE);
 	rspamd_mempool_delete (task->task_pool);
 	g_free (task);
 }
@@ -103,26 +137,46 @@ rspamd_process_file (const gchar *fname)
 int
 main (int argc, char **argv)
 {
-	gint i;
+	gint i, start = 1, iterations = 1;
+	GPtrArray *lines;
 
-	for (i = 1; i < argc; i ++) {
+	/* -n <iterations> repeats the whole corpus to get stable timings */
+	if (argc > 3 && strcmp (argv[1], "-n") == 0) {
+		iterations = atoi (argv[2]);
+		start = 3;
+
+		if (iterations <= 0) {
+			iterations = 1;
+		}
+	}
+
+	lines = g_ptr_array_new_full (1024, g_free);
+
+	for (i = start; i < argc; i ++) {
 		if (argv[i]) {
-			rspamd_process_file (argv[i]);
+			rspamd_read_file (argv[i], lines);
 		}
 	}
 
-	rspamd_printf ("Parsed %d received headers in %.3f seconds\n"
+	for (i = 0; i < iterations; i ++) {
+		rspamd_process_lines (lines, i == 0);
+	}
+
+	rspamd_printf ("Parsed %d received headers %d times in %.3f seconds "
+			"(%.3f seconds tokenizing)\n"
 			"Total valid (has by part): %d\n"
 			"Total real ip: %d\n"
 			"Total real host: %d\n"
 			"Total known proto: %d\n"
 			"Total known timestamp: %d\n"
 			"Total known for: %d\n",
-			total_parsed, total_time,
+			total_parsed, iterations, total_time, total_scan_time,
 			total_valid, total_real_ip,
 			total_real_host, total_known_proto,
 			total_known_ts,
 			total_known_for);
 
+	g_ptr_array_free (lines, TRUE);
+
 	return 0;
 }